@@ -609,6 +609,7 @@ int main (int argc, char *argv[])
     //FoxGrid
    bool runclient(false);
    long nbCPUs = -1;
+   long nbThread = 0;
    string IP;
    bool testLSQ=false;
    bool testMC=false;
@@ -665,6 +666,12 @@ int main (int argc, char *argv[])
          cout << "Running Fox (mostly) quietly"<<endl;
          continue;
       }
+      if(STRCMP("--xml-base64",argv[i])==0)
+      {
+         XMLCrystSetBase64Arrays(true);
+         cout << "Saving powder patterns and single crystal data as base64 in xml files"<<endl;
+         continue;
+      }
       if(STRCMP("--finalcost",argv[i])==0)
       {
          ++i;
@@ -816,6 +823,19 @@ int main (int argc, char *argv[])
          fitprofile=true;
          continue;
       }
+      if(STRCMP("--nbthread",argv[i])==0)
+      {
+         ++i;
+         #ifdef __WX__CRYST__
+         wxString(argv[i]).ToLong(&nbThread);
+         #else
+         stringstream sstr(argv[i]);
+         sstr >> nbThread;
+         #endif
+         if(nbThread<0) nbThread=0;
+         cout << "Indexing will use "<<nbThread<<" threads (0: all available)"<<endl;
+         continue;
+      }
       if(STRCMP("--index",argv[i])==0)
       {
          ++i;
@@ -839,6 +859,7 @@ int main (int argc, char *argv[])
          { pos->d2obsmin=pos->d2obs; pos->d2obsmax=pos->d2obs;}
 
          CellExplorer cx(pl,TRICLINIC,0);
+         cx.SetNbThread(nbThread);
          cx.SetAngleMinMax((float)90*DEG2RAD,(float)120*DEG2RAD);
 
          // Use at most 20 lines ?
@@ -870,6 +891,75 @@ int main (int argc, char *argv[])
          TAU_REPORT_STATISTICS();
          exit(0);
       }
+      if(STRCMP("--index-batch",argv[i])==0)
+      {
+         // Automatic peak search, indexing, Le Bail & spacegroup ranking for a list of
+         // Fox .xml files (one per line), with one JSON result per line in the output file
+         #ifdef __WX__CRYST__
+         const string listname(wxString(argv[i+1]).ToAscii());
+         const string outname(wxString(argv[i+2]).ToAscii());
+         #else
+         const string listname(argv[i+1]);
+         const string outname(argv[i+2]);
+         #endif
+         i+=2;
+         ifstream flist(listname.c_str());
+         if(!flist)
+         {
+            cout<<"Cannot find list of files to index:"<<listname<<endl;
+            exit(0);
+         }
+         vector<string> vfile;
+         string line;
+         while(getline(flist,line)) if(line.size()>0) vfile.push_back(line);
+         flist.close();
+         ofstream out(outname.c_str());
+         out.imbue(std::locale::classic());
+         // Files are processed in groups, and all objects deleted after each group
+         const unsigned int nbFileGroup=32;
+         for(unsigned int i0=0;i0<vfile.size();i0+=nbFileGroup)
+         {
+            vector<PowderPattern*> vpPattern;
+            vector<string> vPatternFile;
+            for(unsigned int j=i0;(j<vfile.size())&&(j<(i0+nbFileGroup));++j)
+            {
+               const long nb0=gPowderPatternRegistry.GetNb();
+               try
+               {
+                  XMLCrystFileLoadAllObject(vfile[j]);
+               }
+               catch(const ObjCrystException &except)
+               {
+                  AutoIndexingResult res;
+                  res.name=vfile[j];
+                  res.error="Failed loading file";
+                  res.WriteJSON(out);
+                  out<<endl;
+                  continue;
+               }
+               for(long k=nb0;k<gPowderPatternRegistry.GetNb();++k)
+               {
+                  vpPattern.push_back(&(gPowderPatternRegistry.GetObj(k)));
+                  vPatternFile.push_back(vfile[j]);
+               }
+            }
+            vector<AutoIndexingResult> vResult;
+            AutoIndexPowderPatterns(vpPattern,vResult,true,true,nbThread);
+            for(unsigned int j=0;j<vResult.size();++j)
+            {
+               vResult[j].name=vPatternFile[j]+":"+vResult[j].name;
+               vResult[j].WriteJSON(out);
+               out<<endl;
+            }
+            gOptimizationObjRegistry.DeleteAll();
+            gDiffractionDataSingleCrystalRegistry.DeleteAll();
+            gPowderPatternRegistry.DeleteAll();
+            gCrystalRegistry.DeleteAll();
+         }
+         out.close();
+         TAU_REPORT_STATISTICS();
+         exit(0);
+      }
       if(STRCMP("--index-test",argv[i])==0)
       {
          ofstream out("indexing-results.txt");
@@ -904,6 +994,7 @@ int main (int argc, char *argv[])
             pl.Print(cout);
 
             CellExplorer cx(pl,TRICLINIC,LATTICE_P);
+            cx.SetNbThread(nbThread);
             cx.SetAngleMinMax((float)90*DEG2RAD,(float)120*DEG2RAD);
 
             const float dmin=pl.GetPeakList()[nb-1].dobs;
@@ -924,7 +1015,7 @@ int main (int argc, char *argv[])
             Chronometer chrono;
             cx.DicVol(10,4,50,4);
             pl.Simulate(0,a,b,c,alpha,beta,gamma,true,20,0,0.);// Just to write the cell parameters
-            const std::list< std::pair< RecUnitCell, float > >::const_iterator pos=cx.GetSolutions().begin();
+            const std::vector< std::pair< RecUnitCell, float > >::const_iterator pos=cx.GetSolutions().begin();
             float score=0,vsol=0;
             if(pos!=cx.GetSolutions().end())
             {
@@ -1155,11 +1246,18 @@ int main (int argc, char *argv[])
            <<"         -o out.xml   : output in 'out.xml'"<<endl
            <<"         --randomize  : randomize initial configuration"<<endl
            <<"         --silent     : (almost) no text output"<<endl
+           <<"         --xml-base64 : save powder pattern and single crystal data as base64 in xml files"<<endl
+           <<"                        (smaller and faster, for output and autosave files)"<<endl
            <<"         --finalcost 0.15 : run optimization until cost < 0.15"<<endl
            <<"         --cif2pattern 1.5406 170 5000 .1 outfile:"<<endl
            <<"                               simulate pattern for input crystal, wavelength=1.5406"<<endl
            <<"                               up to 170deg with 5000 points and a peak width of 0.1 deg"<<endl
            <<"                               and save to file outfile%d.dat"<<endl
+           <<"   --index-batch list.txt results.json: for each Fox .xml file listed in list.txt (one per line),"<<endl
+           <<"                 search peaks, index, validate with a Le Bail fit and rank spacegroups"<<endl
+           <<"                 for all powder patterns, and write one JSON result per line in results.json"<<endl
+           <<"   --nbthread 4: use 4 threads for indexing with --index or --index-batch (default: 0, all available),"<<endl
+           <<"                 only if compiled with openmp=1. Must be given before --index or --index-batch"<<endl
            <<endl<<endl<<"           EXAMPLES :"<<endl<<endl
            <<"Load file 'silicon.xml' and launch GUI:"<<endl<<endl
            <<"    Fox silicon.xml"<<endl<<endl
@@ -1503,13 +1503,19 @@ CrystVector_REAL SavitzkyGolay(const CrystVector_REAL &v, const unsigned int um,
    const unsigned int n=v.numElements();
    CrystVector_REAL d(n);
    d=0;
-   const unsigned int nm=n-m;
-   REAL *pd=d.data()+m;
-   for(unsigned int i=m;i<nm;++i)
-   {
-      const REAL *c=sgcoeffs,*p=v.data()+i-m;
-      for(int j=-m;j<=m;++j) *pd += *c++ * *p++;
-      pd++;
+   if(n>2*(unsigned int)m)
+   {
+      // Accumulate one coefficient at a time over the whole pattern: the inner loop
+      // is then a contiguous axpy which the compiler can vectorize. The summation
+      // order for each point is unchanged.
+      const long nm=n-2*m;
+      REAL *const pd=d.data()+m;
+      for(int j=0;j<=2*m;++j)
+      {
+         const REAL c=sgcoeffs[j];
+         const REAL *const p=v.data()+j;
+         for(long i=0;i<nm;++i) pd[i] += c*p[i];
+      }
    }
    if(deriv!=0) delete[]sgcoeffs;
    return d;
@@ -1,5 +1,7 @@
 #include <ctype.h>
 #include <cmath>
+#include <cstdio>
+#include <cstdlib>
 #include <boost/format.hpp>
 
 #include "cctbx/sgtbx/space_group.h"
@@ -765,14 +767,16 @@ CIF::CIF(istream &is, const bool interpret,const bool verbose)
    (*fpObjCrystInformUser)("CIF: Opening CIF");
    Chronometer chrono;
    chrono.start();
-   //Copy to an iostream so that we can put back characters if necessary
-   stringstream in;
-   char c;
-   while(is.get(c))in.put(c);
+   // Read the whole stream in memory, by blocks
+   string buf;
+   {
+      char tmp[65536];
+      while(is.read(tmp,sizeof(tmp)) || (is.gcount()>0)) buf.append(tmp,is.gcount());
+   }
    const float t0read=chrono.seconds();
    s=(boost::format("CIF: Parsing CIF (reading dt=%5.3fs)")%t0read).str();
    (*fpObjCrystInformUser)(s);
-   this->Parse(in);
+   this->Parse(buf);
    const float t1parse=chrono.seconds();
    s=(boost::format("CIF: Finished Parsing, Extracting...(parsing dt=%5.3fs)") % (t1parse-t0read)).str();
    (*fpObjCrystInformUser)(s);
@@ -795,32 +799,78 @@ std::string trimString(const std::string &s)
    return s.substr(i0, i1-i0+1);
 }
 
+/** Cursor over the CIF text held in memory. This replaces the stringstream
+* peek()/get()/>>/getline calls with direct character access, and allows to look
+* ahead without seeking.
+*/
+class CIFCursor
+{
+   public:
+      CIFCursor(const char *begin,const char *end):mp(begin),mpEnd(end){}
+      bool eof()const {return mp>=mpEnd;}
+      int peek()const {return (mp<mpEnd) ? (unsigned char)*mp : EOF;}
+      bool get(char &c)
+      {
+         if(mp>=mpEnd) return false;
+         c=*mp++;
+         return true;
+      }
+      /// Skip all non-graphical characters, the last one being stored in lastc
+      void SkipSpace(char &lastc)
+      {
+         while((mp<mpEnd)&&(0==isgraph((unsigned char)*mp))) lastc=*mp++;
+      }
+      /// Read one word, delimited by white space (same as operator>>)
+      string Word()
+      {
+         while((mp<mpEnd)&&(0!=isspace((unsigned char)*mp))) ++mp;
+         const char *p0=mp;
+         while((mp<mpEnd)&&(0==isspace((unsigned char)*mp))) ++mp;
+         return string(p0,mp);
+      }
+      /// Read the rest of the line (same as getline: the end-of-line is consumed but not returned)
+      string Line()
+      {
+         const char *p0=mp;
+         while((mp<mpEnd)&&(*mp!='\n')) ++mp;
+         const string line(p0,mp);
+         if(mp<mpEnd) ++mp;
+         return line;
+      }
+      /// Does the next word begin with this (lower case) prefix, case-insensitive ?
+      /// Nothing is consumed.
+      bool NextWordBeginsWith(const char *prefix,const bool wholeWord=false)const
+      {
+         const char *p=mp;
+         for(;*prefix!=0;++prefix,++p)
+            if((p>=mpEnd)||(tolower((unsigned char)*p)!=*prefix)) return false;
+         if(wholeWord) return (p>=mpEnd)||(0!=isspace((unsigned char)*p));
+         return true;
+      }
+   private:
+      const char *mp;
+      const char *mpEnd;
+};
+
 /// Read one value, whether it is numeric, string or text
-string CIFReadValue(stringstream &in,char &lastc)
+string CIFReadValue(CIFCursor &in,char &lastc)
 {
    bool vv=false;//very verbose ?
-   string value;
-   while(!isgraph(in.peek())) in.get(lastc);
+   in.SkipSpace(lastc);
    while(in.peek()=='#')
    {//discard these comments for now
-      string tmp;
-      getline(in,tmp);
+      in.Line();
       lastc='\r';
-      while(!isgraph(in.peek())) in.get(lastc);
+      in.SkipSpace(lastc);
    }
    if(in.peek()==';')
    {//SemiColonTextField
       bool warning=!iseol(lastc);
       if(warning)
          cout<<"WARNING: Trying to read a SemiColonTextField but last char is not an end-of-line char !"<<endl;
-      value="";
+      string value="";
       in.get(lastc);
-      while(in.peek()!=';')
-      {
-         string tmp;
-         getline(in,tmp);
-         value+=tmp+" ";
-      }
+      while((in.peek()!=';')&&!in.eof()) value+=in.Line()+" ";
       in.get(lastc);
       if(vv) cout<<"SemiColonTextField:"<<value<<endl;
       if(warning && !vv) cout<<"SemiColonTextField:"<<value<<endl;
@@ -830,38 +880,41 @@ string CIFReadValue(stringstream &in,char &lastc)
    {//QuotedString
       char delim;
       in.get(delim);
-      value="";
+      string value="";
       while(!((lastc==delim)&&(!isgraph(in.peek()))) )
       {
-         in.get(lastc);
+         if(!in.get(lastc)) break;
          value+=lastc;
       }
       if(vv) cout<<"QuotedString:"<<value<<endl;
-      return trimString(value.substr(0,value.size()-1));
+      if(value.size()>0) value.erase(value.size()-1);
+      return trimString(value);
    }
    // If we got here, we have an ordinary value, numeric or unquoted string
-   in>>value;
+   const string value=in.Word();
    if(vv) cout<<"NormalValue:"<<value<<endl;
    return value;
 }
 
 void CIF::Parse(stringstream &in)
+{
+   this->Parse(in.str());
+}
+
+void CIF::Parse(const string &buf)
 {
    bool vv=false;//very verbose ?
+   CIFCursor in(buf.c_str(),buf.c_str()+buf.size());
    char lastc=' ';
    string block="";// Current block data
    while(!in.eof())
    {
-      //stringstream mess;
-      //mess<<"CIF: Parsing:"<<in.tellg();
-      //(*fpObjCrystInformUser)(mess.str());
-      while(!isgraph(in.peek()) && !in.eof()) in.get(lastc);
+      in.SkipSpace(lastc);
       if(in.eof()) break;
       if(vv) cout<<endl;
       if(in.peek()=='#')
       {//Comment
-         string tmp;
-         getline(in,tmp);
+         const string tmp=in.Line();
          if(block=="") mvComment.push_back(tmp);
          else mvData[block].mvComment.push_back(tmp);
          lastc='\r';
@@ -870,12 +923,11 @@ void CIF::Parse(stringstream &in)
       }
       if(in.peek()=='_')
       {//Tag
-         string tag,value;
-         in>>tag;
+         string tag=in.Word();
          // Convert all dots to underscores to cover much of DDL2 with this DDL1 parser.
          for (string::size_type pos = tag.find('.'); pos != string::npos; pos = tag.find('.', ++ pos))
             tag.replace(pos, 1, 1, '_');
-         value=CIFReadValue(in,lastc);
+         const string value=CIFReadValue(in,lastc);
          if(value==string("?")) continue;//useless
          mvData[block].mvItem[ci_string(tag.c_str())]=value;
          if(vv)cout<<"New Tag:"<<tag<<" ("<<value.size()<<"):"<<value<<endl;
@@ -883,9 +935,8 @@ void CIF::Parse(stringstream &in)
       }
       if((in.peek()=='d') || (in.peek()=='D'))
       {// Data
-         string tmp;
-         in>>tmp;
-         block=tmp.substr(5);
+         const string tmp=in.Word();
+         block=(tmp.size()>5) ? tmp.substr(5) : string("");
          if(vv) cout<<endl<<endl<<"NEW BLOCK DATA: !!!!!!!!!!!!!!!!!!!!!!!!!!!!!!! ->"<<block<<endl<<endl<<endl;
          mvData[block]=CIFData();
          continue;
@@ -893,15 +944,14 @@ void CIF::Parse(stringstream &in)
       if((in.peek()=='l') || (in.peek()=='L'))
       {// loop_
          vector<ci_string> tit;
-         string tmp;
-         in>>tmp; //should be loop_
+         string tmp=in.Word(); //should be loop_
          if(vv) cout<<"LOOP : "<<tmp;
          while(!in.eof())
          {//read titles
-            while(!isgraph(in.peek()) && !in.eof()) in.get(lastc);
+            in.SkipSpace(lastc);
             if(in.peek()=='#')
             {
-               getline(in,tmp);
+               tmp=in.Line();
                if(block=="") mvComment.push_back(tmp);
                else mvData[block].mvComment.push_back(tmp);
                continue;
@@ -911,7 +961,7 @@ void CIF::Parse(stringstream &in)
                if(vv) cout<<endl<<"End of loop titles:"<<(char)in.peek()<<endl;
                break;
             }
-            in>>tmp;
+            tmp=in.Word();
             // Convert all dots to underscores to cover much of DDL2 with this DDL1 parser.
             for (string::size_type pos = tmp.find('.'); pos != string::npos; pos = tmp.find('.', ++ pos))
                tmp.replace(pos, 1, 1, '_');
@@ -919,57 +969,49 @@ void CIF::Parse(stringstream &in)
             if(vv) cout<<" , "<<tmp;
          }
          if(vv) cout<<endl;
-         map<ci_string,vector<string> > lp;
-         while(true)
+         // Values are stored by column, in the order of the titles
+         vector<vector<string> > vcol(tit.size());
+         while(tit.size()>0)
          {
-            while(!isgraph(in.peek()) && !in.eof()) in.get(lastc);
+            in.SkipSpace(lastc);
             if(in.eof()) break;
             if(vv) cout<<"LOOP VALUES...: "<<(char)in.peek()<<" "<<endl;
             if(in.peek()=='_') break;
             if(in.peek()=='#')
             {// Comment (in a loop ??)
-               string tmp;
-               getline(in,tmp);
+               tmp=in.Line();
                if(block=="") mvComment.push_back(tmp);
                else mvData[block].mvComment.push_back(tmp);
                lastc='\r';
                if(vv) cout<<"Comment in a loop (?):"<<tmp<<endl;
                continue;
             };
-            const std::ios::pos_type pos=in.tellg();
-            in>>tmp;
-            if(vv) cout<<"WHATNEXT? "<<tmp;
-            if(ci_string(tmp.c_str())=="loop_")
-            {//go back and continue
-               if(vv) cout<<endl<<"END OF LOOP :"<<tmp<<endl;
-               in.seekg(pos);
+            if(in.NextWordBeginsWith("loop_",true) || in.NextWordBeginsWith("data_"))
+            {
+               if(vv) cout<<endl<<"END OF LOOP"<<endl;
                break;
             }
-            if(tmp.size()>=5)
-               if(ci_string(tmp.substr(0,5).c_str())=="data_")
-               {//go back and continue
-                  if(vv) cout<<endl<<"END OF LOOP :"<<tmp<<endl;
-                  in.seekg(pos);
-                  break;
-               }
-            // go back
-            in.seekg(pos);
             for(unsigned int i=0;i<tit.size();++i)
             {//Read all values
-               const string value=CIFReadValue(in,lastc);
-               lp[tit[i]].push_back(value);
-               if(vv) cout<<"     #"<<i<<" :  "<<value<<endl;
+               vcol[i].push_back(CIFReadValue(in,lastc));
+               if(vv) cout<<"     #"<<i<<" :  "<<vcol[i].back()<<endl;
             }
          }
+         map<ci_string,vector<string> > lp;
+         for(unsigned int i=0;i<tit.size();++i)
+         {
+            vector<string> *pcol=&(lp[tit[i]]);
+            if(pcol->size()==0) pcol->swap(vcol[i]);
+            else pcol->insert(pcol->end(),vcol[i].begin(),vcol[i].end());// Duplicate title
+         }
          // The key to the mvLoop map is the set of column titles
          set<ci_string> stit;
          for(unsigned int i=0;i<tit.size();++i) stit.insert(tit[i]);
-         mvData[block].mvLoop[stit]=lp;
+         mvData[block].mvLoop[stit].swap(lp);
          continue;
       }
       // If we get here, something went wrong ! Discard till end of line...
-      string junk;
-      getline(in,junk);
+      const string junk=in.Line();
       cout<<"WARNING: did not understand : "<<junk<<endl;
    }
 }
@@ -977,23 +1019,15 @@ void CIF::Parse(stringstream &in)
 REAL CIFNumeric2REAL(const string &s)
 {
    if((s==".") || (s=="?")) return 0.0;
-   // Use stream rather than sscanf to rely on C++ locale to read C-locale values
-   REAL v=0;
-   stringstream ss(s);
-   ss.imbue(std::locale::classic());
-   ss>>v;
-   return v;
+   // Conversion independent of the current locale. This stops at the uncertainty, e.g. "1.234(5)"
+   return string2REALC(s);
 }
 
 int CIFNumeric2Int(const string &s)
 {
    if((s==".") || (s=="?")) return 0;
-   // Use stream rather than sscanf to rely on C++ locale to read C-locale values
-   int v=0;
-   stringstream ss(s);
-   ss.imbue(std::locale::classic());
-   ss>>v;
-   return v;
+   // strtol does not depend on the locale decimal point
+   return (int)strtol(s.c_str(),0,10);
 }
 
 Crystal* CreateCrystalFromCIF(CIF &cif,bool verbose,bool checkSymAsXYZ)
@@ -177,6 +177,9 @@ class CIF
       /// Separate the file in data blocks and parse them to sort tags, loops and comments.
       /// All is stored in the original strings.
       void Parse(std::stringstream &in);
+      /// Separate the CIF text (held in memory) in data blocks and parse them to sort tags,
+      /// loops and comments. Loop values are collected directly by column.
+      void Parse(const std::string &buf);
       /// The data blocks, after parsing. The key is the name of the data block
       std::map<std::string,CIFData> mvData;
       /// Global comments, outside and data block
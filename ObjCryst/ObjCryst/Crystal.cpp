@@ -32,6 +32,7 @@
 #include "ObjCryst/ObjCryst/Crystal.h"
 #include "ObjCryst/ObjCryst/Molecule.h"
 #include "ObjCryst/ObjCryst/Atom.h"
+#include "ObjCryst/ObjCryst/ScatteringData.h"
 
 #include "ObjCryst/Quirks/VFNStreamFormat.h" //simple formatting of integers, REALs..
 #include "ObjCryst/Quirks/VFNDebug.h"
@@ -59,7 +60,8 @@ mScattererRegistry("List of Crystal Scatterers"),
 mBumpMergeCost(0.0),mBumpMergeScale(1.0),
 mDistTableMaxDistance(1.0),
 mScatteringPowerRegistry("List of Crystal ScatteringPowers"),
-mBondValenceCost(0.0),mBondValenceCostScale(1.0),mDeleteSubObjInDestructor(1)
+mBondValenceCost(0.0),mBondValenceCostScale(1.0),mDeleteSubObjInDestructor(1),
+mpGeomStructFactorStore(0)
 {
    VFN_DEBUG_MESSAGE("Crystal::Crystal()",10)
    this->InitOptions();
@@ -76,7 +78,8 @@ mScattererRegistry("List of Crystal Scatterers"),
 mBumpMergeCost(0.0),mBumpMergeScale(1.0),
 mDistTableMaxDistance(1.0),
 mScatteringPowerRegistry("List of Crystal ScatteringPowers"),
-mBondValenceCost(0.0),mBondValenceCostScale(1.0),mDeleteSubObjInDestructor(1)
+mBondValenceCost(0.0),mBondValenceCostScale(1.0),mDeleteSubObjInDestructor(1),
+mpGeomStructFactorStore(0)
 {
    VFN_DEBUG_MESSAGE("Crystal::Crystal(a,b,c,Sg)",10)
    this->Init(a,b,c,M_PI/2,M_PI/2,M_PI/2,SpaceGroupId,"");
@@ -94,7 +97,8 @@ mScattererRegistry("List of Crystal Scatterers"),
 mBumpMergeCost(0.0),mBumpMergeScale(1.0),
 mDistTableMaxDistance(1.0),
 mScatteringPowerRegistry("List of Crystal ScatteringPowers"),
-mBondValenceCost(0.0),mBondValenceCostScale(1.0),mDeleteSubObjInDestructor(1)
+mBondValenceCost(0.0),mBondValenceCostScale(1.0),mDeleteSubObjInDestructor(1),
+mpGeomStructFactorStore(0)
 {
    VFN_DEBUG_MESSAGE("Crystal::Crystal(a,b,c,alpha,beta,gamma,Sg)",10)
    this->Init(a,b,c,alpha,beta,gamma,SpaceGroupId,"");
@@ -111,7 +115,8 @@ mScattererRegistry("List of Crystal Scatterers"),
 mBumpMergeCost(0.0),mBumpMergeScale(1.0),
 mDistTableMaxDistance(1.0),
 mScatteringPowerRegistry("List of Crystal ScatteringPowers"),
-mBondValenceCost(0.0),mBondValenceCostScale(1.0),mDeleteSubObjInDestructor(1)
+mBondValenceCost(0.0),mBondValenceCostScale(1.0),mDeleteSubObjInDestructor(1),
+mpGeomStructFactorStore(0)
 {
    VFN_DEBUG_MESSAGE("Crystal::Crystal()",10)
    // Only create a default crystal, then copy old using XML
@@ -161,6 +166,7 @@ Crystal::~Crystal()
    {
        mScatteringPowerRegistry.DeRegisterAll();
    }
+   if(mpGeomStructFactorStore!=0) delete mpGeomStructFactorStore;
    gCrystalRegistry.DeRegister(*this);
    gTopRefinableObjRegistry.DeRegister(*this);
    VFN_DEBUG_EXIT("Crystal::~Crystal()",5)
@@ -281,6 +287,14 @@ const ScatteringPower& Crystal::GetScatteringPower(const string &name)const
 const RefinableObjClock& Crystal::GetMasterClockScatteringPower()const
 { return mMasterClockScatteringPower;}
 
+GeomStructFactorStore& Crystal::GetGeomStructFactorStore()const
+{
+   if(mpGeomStructFactorStore==0) mpGeomStructFactorStore=new GeomStructFactorStore(*this);
+   return *mpGeomStructFactorStore;
+}
+
+bool Crystal::HasGeomStructFactorStore()const {return mpGeomStructFactorStore!=0;}
+
 const ScatteringComponentList& Crystal::GetScatteringComponentList()const
 {
    if(mClockScattCompList>mClockMaster) return mScattCompList;
@@ -41,6 +41,7 @@
 namespace ObjCryst
 {
 class Scatterer; //forward declaration of another header's class :KLUDGE:
+class GeomStructFactorStore; //forward declaration, see ScatteringData.h
 extern const RefParType *gpRefParTypeCrystal;
 class NiftyStaticGlobalObjectsInitializer_Crystal
 {
@@ -179,6 +180,13 @@ class Crystal:public UnitCell
       /// Get the clock which reports all changes in ScatteringPowers
       const RefinableObjClock& GetMasterClockScatteringPower()const;
 
+      /** Get the geometrical structure factors store, shared by all the ScatteringData
+      * objects using this Crystal. It is created when first requested.
+      */
+      GeomStructFactorStore& GetGeomStructFactorStore()const;
+      /// Has the geometrical structure factors store been created ?
+      bool HasGeomStructFactorStore()const;
+
       /** \brief Get the list of all scattering components
       */
       virtual const ScatteringComponentList& GetScatteringComponentList()const;
@@ -542,6 +550,8 @@ class Crystal:public UnitCell
       // the destructor (default true). Modified by
       // SetDeleteSubObjInDestructor.
       bool mDeleteSubObjInDestructor;
+      /// Geometrical structure factors shared by the ScatteringData using this Crystal
+      mutable GeomStructFactorStore *mpGeomStructFactorStore;
 
    #ifdef __WX__CRYST__
    public:
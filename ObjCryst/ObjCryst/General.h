@@ -88,6 +88,8 @@ namespace ObjCryst
 /// Function to convert a substring to a floating point value, imposing a C locale (using '.' as decimal separator).
 /// This is used for input/output from data file, which are only using the C locale, contrary to the GUI.
 float string2floatC(const string &s);
+/// Same as string2floatC(), but the value is converted with the full precision of REAL.
+REAL string2REALC(const string &s);
 
 //######################################################################
 
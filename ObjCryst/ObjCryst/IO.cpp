@@ -44,7 +44,18 @@
 #include <fstream>
 #include <sstream>
 #include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <clocale>
+#include <cstdio>
+#include <list>
 #include <boost/format.hpp>
+#ifdef __WX__CRYST__
+#include "wx/thread.h"
+#elif !defined(_WIN32)
+#include <pthread.h>
+#include <unistd.h>
+#endif
 
 //#define USE_BACKGROUND_MAXLIKE_ERROR
 
@@ -56,44 +67,169 @@ namespace ObjCryst
 //
 ////////////////////////////////////////////////////////////////////////
 
-float string2floatC(const string &s)
+/// Convert a C string to a floating-point value with strtod(), independently of the locale.
+/// The string is modified if the locale does not use '.' as decimal point.
+static double CString2DoubleStrtod(char *buf)
 {
-   float v=0;
-   stringstream ss(s);
-   ss.imbue(std::locale::classic());
-   ss>>v;
-   return v;
+   // strtod() uses the decimal point of the current locale
+   const char point=*(localeconv()->decimal_point);
+   if(point!='.') for(char *p=buf;*p!=0;p++) if(*p=='.') *p=point;
+   return strtod(buf,0);
 }
 
-float InputFloat(istream &is, const char endchar)
+/** Convert a C string to a floating-point value, using '.' as decimal point whatever
+* the locale. As for strtod(), the conversion stops at the first character which cannot
+* be part of the number, e.g. "1.234(5)" gives 1.234.
+*
+* Decimal numbers with up to 15 significant digits and a decimal exponent within +/-22
+* are converted directly: the mantissa and the power of 10 are both exact doubles,
+* so the result is correctly rounded, as with strtod(). Other values (nan, inf, hexadecimal, long
+* mantissa or large exponent) use strtod().
+*/
+static double CString2DoubleC(char *buf)
 {
-   float f;
-   // Get rid of spaces, returns etc...
-   while(0==isgraph(is.peek())) is.get();
-   stringstream tmp;
-   char c;
-   while((endchar!=is.peek())&&(' '!=is.peek()))
+   static const double vpow10[23]={1e0,1e1,1e2,1e3,1e4,1e5,1e6,1e7,1e8,1e9,1e10,1e11,
+                                   1e12,1e13,1e14,1e15,1e16,1e17,1e18,1e19,1e20,1e21,1e22};
+   const char *p=buf;
+   while(0!=isspace((unsigned char)*p)) ++p;
+   bool negative=false;
+   if((*p=='-')||(*p=='+')) negative=(*p++=='-');
+   unsigned long long m=0;
+   int nbdigit=0,nbsignificant=0,e10=0;
+   for(;(*p>='0')&&(*p<='9');++p,++nbdigit)
    {
-      is.get(c) ;
-      // Explicit typecasting to char otherwise it is understood as an integer number from type charT...
-      tmp<<(char)(tolower(c)) ;
+      if((m==0)&&(*p=='0')) continue;
+      m=10*m+(*p-'0');
+      ++nbsignificant;
    }
-   if(tmp.str().find("nan")!=string::npos)
+   if(*p=='.')
+      for(++p;(*p>='0')&&(*p<='9');++p,++nbdigit)
+      {
+         --e10;
+         if((m==0)&&(*p=='0')) continue;
+         m=10*m+(*p-'0');
+         ++nbsignificant;
+      }
+   if((nbdigit==0)||(nbsignificant>15)||(*p=='x')||(*p=='X')) return CString2DoubleStrtod(buf);
+   if((*p=='e')||(*p=='E'))
    {
-      VFN_DEBUG_MESSAGE("InputFloat(..):"<<tmp.str()<<" -> NAN ! -> 1",9);
-      return 1;
+      const char *pe=p+1;
+      bool eneg=false;
+      if((*pe=='-')||(*pe=='+')) eneg=(*pe++=='-');
+      if((*pe>='0')&&(*pe<='9'))
+      {
+         int e=0;
+         for(;(*pe>='0')&&(*pe<='9');++pe) if(e<10000) e=10*e+(*pe-'0');
+         e10+= eneg ? -e : e;
+      }
    }
-   if(tmp.str().find("inf")!=string::npos)
+   double v=(double)m;
+   if(m!=0)
    {
-      VFN_DEBUG_MESSAGE("InputFloat(..):"<<tmp.str()<<" -> INF ! -> 1",9);
-      return 1;
+      if((e10<-22)||(e10>22)) return CString2DoubleStrtod(buf);
+      if(e10<0) v/=vpow10[-e10];
+      else v*=vpow10[e10];
    }
-   tmp.imbue(std::locale::classic());
-   tmp>>f;
+   return negative ? -v : v;
+}
+
+float string2floatC(const string &s)
+{
+   return (float)string2REALC(s);
+}
+
+REAL string2REALC(const string &s)
+{
+   char buf[64];
+   unsigned int n=0;
+   for(string::const_iterator pos=s.begin();(pos!=s.end())&&(n<sizeof(buf)-1);++pos)
+      buf[n++]=*pos;
+   buf[n]=0;
+   return (REAL)CString2DoubleC(buf);
+}
+
+/** Convert one value read from a file (nul-terminated and without whitespace) to a REAL.
+* NaN and infinite values (written differently by each platform) are returned as 1.
+* The string may be modified.
+*/
+static REAL CStringValue2REAL(char *buf)
+{
+   for(const char *p=buf;*p!=0;++p)
+      if((((*p>='a')&&(*p<='z'))||((*p>='A')&&(*p<='Z')))&&(*p!='e')&&(*p!='E'))
+      {
+         for(char *q=buf;*q!=0;++q) *q=(char)tolower((unsigned char)*q);
+         if(strstr(buf,"nan")!=0)
+         {
+            VFN_DEBUG_MESSAGE("InputFloat(..):"<<buf<<" -> NAN ! -> 1",9);
+            return 1;
+         }
+         if(strstr(buf,"inf")!=0)
+         {
+            VFN_DEBUG_MESSAGE("InputFloat(..):"<<buf<<" -> INF ! -> 1",9);
+            return 1;
+         }
+         break;
+      }
+   return (REAL)CString2DoubleC(buf);
+}
+
+REAL InputFloat(istream &is, const char endchar)
+{
+   // Read directly from the stream buffer, avoiding a formatted input
+   // and a temporary stringstream for each value
+   streambuf *pbuf=is.rdbuf();
+   // Get rid of spaces, returns etc...
+   int c=pbuf->sgetc();
+   while((c!=EOF)&&(0==isgraph(c))) c=pbuf->snextc();
+   char buf[64];
+   unsigned int n=0;
+   while((c!=EOF)&&(c!=endchar)&&(0!=isgraph(c)))
+   {
+      if(n<sizeof(buf)-1) buf[n++]=(char)c;
+      c=pbuf->snextc();
+   }
+   buf[n]=0;
+   if(c==EOF) is.setstate(ios::eofbit);
+   const REAL f=CStringValue2REAL(buf);
    VFN_DEBUG_MESSAGE("InputFloat(..):"<<f<<","<<is.good(),3);
    return f;
 }
 
+/** Read all the values until the next tag, and append them to v. The '<' starting
+* the next tag is left in the stream. The values are converted as with InputFloat(),
+* but the whole block of text is extracted at once, which is much faster for large
+* lists of values.
+*/
+static void XMLInputValueList(istream &is,vector<REAL> &v)
+{
+   string s;
+   getline(is,s,'<');
+   if(!is.eof()) is.unget();
+   // Values are separated by spaces, tabs or newlines: comparing the (unsigned)
+   // characters to ' ' is much faster than isgraph()
+   const unsigned char *p=(const unsigned char*)s.c_str();
+   char buf[64];
+   while(true)
+   {
+      while((*p!=0)&&(*p<=' ')) ++p;
+      if(*p==0) break;
+      unsigned int n=0;
+      for(;*p>' ';++p) if(n<sizeof(buf)-1) buf[n++]=(char)*p;
+      buf[n]=0;
+      v.push_back(CStringValue2REAL(buf));
+   }
+}
+
+/// Skip whitespace in the stream, and return the next character (or EOF), without extracting it.
+static int XMLPeekGraph(istream &is)
+{
+   streambuf *pbuf=is.rdbuf();
+   int c=pbuf->sgetc();
+   while((c!=EOF)&&(0==isgraph(c))) c=pbuf->snextc();
+   if(c==EOF) is.setstate(ios::eofbit);
+   return c;
+}
+
 bool ISNAN_OR_INF(REAL r)
 {
    #if defined(_MSC_VER) || defined(__BORLANDC__)
@@ -103,6 +239,106 @@ bool ISNAN_OR_INF(REAL r)
    #endif
 }
 
+static bool sXMLCrystBase64Arrays=false;
+
+void XMLCrystSetBase64Arrays(const bool b) {sXMLCrystBase64Arrays=b;}
+
+bool XMLCrystGetBase64Arrays() {return sXMLCrystBase64Arrays;}
+
+/// Index of the stream-specific flag used to skip large arrays, see XMLCrystSetSkipArrays()
+static const int sXMLCrystSkipArraysIndex=ios_base::xalloc();
+
+void XMLCrystSetSkipArrays(ostream &os,const bool b) {os.iword(sXMLCrystSkipArraysIndex)=b;}
+
+bool XMLCrystGetSkipArrays(ostream &os) {return os.iword(sXMLCrystSkipArraysIndex)!=0;}
+
+static const char sBase64Chars[]="ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/** Write an array of floating-point values as base64-encoded, little-endian
+* 32-bit floats, on lines of 76 characters.
+*/
+static void XMLOutputBase64(ostream &os,const CrystVector_REAL &v)
+{
+   const long nb=v.numElements();
+   string bytes(4*nb,0);
+   for(long i=0;i<nb;i++)
+   {
+      const float f=v(i);
+      unsigned int u;
+      memcpy(&u,&f,4);
+      for(int j=0;j<4;j++) bytes[4*i+j]=(char)((u>>(8*j))&0xff);
+   }
+   string out;
+   out.reserve((bytes.size()+2)/3*4+bytes.size()/57+1);
+   for(unsigned long i=0;i<bytes.size();i+=3)
+   {
+      const unsigned long n=bytes.size()-i;
+      const unsigned int b0=(unsigned char)bytes[i];
+      const unsigned int b1=(n>1)?(unsigned char)bytes[i+1]:0;
+      const unsigned int b2=(n>2)?(unsigned char)bytes[i+2]:0;
+      const unsigned int b=(b0<<16)|(b1<<8)|b2;
+      out+=sBase64Chars[(b>>18)&63];
+      out+=sBase64Chars[(b>>12)&63];
+      out+=(n>1)?sBase64Chars[(b>>6)&63]:'=';
+      out+=(n>2)?sBase64Chars[b&63]:'=';
+      if((i%57)==54) out+='\n';
+   }
+   os<<out<<endl;
+}
+
+/** Read an array of base64-encoded, little-endian 32-bit floats (as written by
+* XMLOutputBase64()), up to the next tag. Whitespace is ignored.
+*/
+static void XMLInputBase64(istream &is,CrystVector_REAL &v)
+{
+   static int decode[256];
+   static bool init=false;
+   if(!init)
+   {
+      for(int i=0;i<256;i++) decode[i]=-1;
+      for(int i=0;i<64;i++) decode[(unsigned char)sBase64Chars[i]]=i;
+      init=true;
+   }
+   string bytes;
+   streambuf *pbuf=is.rdbuf();
+   unsigned int b=0;
+   int nbits=0;
+   int c=pbuf->sgetc();
+   while((c!='<')&&(c!=EOF))
+   {
+      if(decode[c]>=0)
+      {
+         b=(b<<6)|decode[c];
+         nbits+=6;
+         if(nbits>=8)
+         {
+            nbits-=8;
+            bytes+=(char)((b>>nbits)&0xff);
+         }
+      }
+      c=pbuf->snextc();
+   }
+   if(c==EOF) is.setstate(ios::eofbit);
+   const long nb=bytes.size()/4;
+   v.resize(nb);
+   for(long i=0;i<nb;i++)
+   {
+      unsigned int u=0;
+      for(int j=0;j<4;j++) u|=((unsigned int)(unsigned char)bytes[4*i+j])<<(8*j);
+      float f;
+      memcpy(&f,&u,4);
+      v(i)=f;
+   }
+}
+
+/// Is the array following this tag base64-encoded ?
+static bool XMLIsBase64(const XMLCrystTag &tag)
+{
+   for(unsigned int i=0;i<tag.GetNbAttribute();i++)
+      if(("Encoding"==tag.GetAttributeName(i))&&("base64"==tag.GetAttributeValue(i))) return true;
+   return false;
+}
+
 void XMLCrystFileSaveGlobal(const string & filename)
 {
    VFN_DEBUG_ENTRY("XMLCrystFileSaveGlobal(filename)",5)
@@ -143,6 +379,162 @@ void XMLCrystFileSaveGlobal(ostream &out)
    VFN_DEBUG_EXIT("XMLCrystFileSaveGlobal(ostream)",5)
 }
 
+/// A file waiting to be written by the background XML save thread.
+struct XMLCrystAsyncSave
+{
+   XMLCrystAsyncSave(const string &filename,const string &xml,const bool coalesce):
+   mFileName(filename),mXML(xml),mCoalesce(coalesce){}
+   string mFileName;
+   string mXML;
+   bool mCoalesce;
+};
+/// Files waiting to be written, protected by sXMLCrystAsyncMutex
+static std::list<XMLCrystAsyncSave> svXMLCrystAsyncSave;
+/// True while the background thread is running (it exits when the queue is empty)
+static bool sXMLCrystAsyncSaveRunning=false;
+
+#ifdef __WX__CRYST__
+static wxMutex sXMLCrystAsyncMutex;
+static void XMLCrystAsyncLock()  {sXMLCrystAsyncMutex.Lock();}
+static void XMLCrystAsyncUnlock(){sXMLCrystAsyncMutex.Unlock();}
+#elif !defined(_WIN32)
+static pthread_mutex_t sXMLCrystAsyncMutex=PTHREAD_MUTEX_INITIALIZER;
+static void XMLCrystAsyncLock()  {pthread_mutex_lock(&sXMLCrystAsyncMutex);}
+static void XMLCrystAsyncUnlock(){pthread_mutex_unlock(&sXMLCrystAsyncMutex);}
+#endif
+
+/// Write the file to filename.tmp and rename it into place
+static void XMLCrystAsyncWrite(const XMLCrystAsyncSave &save)
+{
+   VFN_DEBUG_ENTRY("XMLCrystAsyncWrite():"<<save.mFileName,5)
+   const string tmpName=save.mFileName+".tmp";
+   {
+      ofstream out(tmpName.c_str(),ios::out|ios::binary);
+      out.write(save.mXML.c_str(),save.mXML.size());
+      out.close();
+      if(!out)
+      {
+         cout<<"XMLCrystFileSaveGlobalAsync(): error writing "<<tmpName<<endl;
+         remove(tmpName.c_str());
+         VFN_DEBUG_EXIT("XMLCrystAsyncWrite():"<<save.mFileName,5)
+         return;
+      }
+   }
+   if(rename(tmpName.c_str(),save.mFileName.c_str())!=0)
+   {// Windows does not allow to rename over an existing file
+      remove(save.mFileName.c_str());
+      if(rename(tmpName.c_str(),save.mFileName.c_str())!=0)
+         cout<<"XMLCrystFileSaveGlobalAsync(): error renaming "<<tmpName<<" to "<<save.mFileName<<endl;
+   }
+   VFN_DEBUG_EXIT("XMLCrystAsyncWrite():"<<save.mFileName,5)
+}
+
+#if defined(__WX__CRYST__) || !defined(_WIN32)
+/// Background thread loop: write all queued files, then exit
+static void XMLCrystAsyncSaveLoop()
+{
+   for(;;)
+   {
+      XMLCrystAsyncLock();
+      if(svXMLCrystAsyncSave.size()==0)
+      {
+         sXMLCrystAsyncSaveRunning=false;
+         XMLCrystAsyncUnlock();
+         return;
+      }
+      const XMLCrystAsyncSave save=svXMLCrystAsyncSave.front();
+      svXMLCrystAsyncSave.pop_front();
+      XMLCrystAsyncUnlock();
+      XMLCrystAsyncWrite(save);
+   }
+}
+#endif
+
+#ifdef __WX__CRYST__
+class XMLCrystAsyncSaveThread:public wxThread
+{
+   public:
+      XMLCrystAsyncSaveThread():wxThread(wxTHREAD_DETACHED){}
+      virtual void *Entry(){XMLCrystAsyncSaveLoop();return NULL;}
+};
+static bool XMLCrystAsyncStartThread()
+{
+   XMLCrystAsyncSaveThread *pThread=new XMLCrystAsyncSaveThread;
+   if((pThread->Create()!=wxTHREAD_NO_ERROR)||(pThread->Run()!=wxTHREAD_NO_ERROR))
+   {
+      delete pThread;
+      return false;
+   }
+   return true;
+}
+#elif !defined(_WIN32)
+static void *XMLCrystAsyncSaveThreadEntry(void *)
+{
+   XMLCrystAsyncSaveLoop();
+   return NULL;
+}
+static bool XMLCrystAsyncStartThread()
+{
+   pthread_t thread;
+   if(pthread_create(&thread,NULL,XMLCrystAsyncSaveThreadEntry,NULL)!=0) return false;
+   pthread_detach(thread);
+   return true;
+}
+#endif
+
+void XMLCrystFileSaveGlobalAsync(const string & filename,const bool coalesce)
+{
+   VFN_DEBUG_ENTRY("XMLCrystFileSaveGlobalAsync(filename)",5)
+   stringstream ss;
+   XMLCrystFileSaveGlobal(ss);
+   const XMLCrystAsyncSave save(filename,ss.str(),coalesce);
+   #if defined(__WX__CRYST__) || !defined(_WIN32)
+   XMLCrystAsyncLock();
+   if(coalesce)
+   {// Drop pending coalescable saves, superseded by this one
+      for(std::list<XMLCrystAsyncSave>::iterator pos=svXMLCrystAsyncSave.begin();pos!=svXMLCrystAsyncSave.end();)
+         if(pos->mCoalesce) pos=svXMLCrystAsyncSave.erase(pos);
+         else ++pos;
+   }
+   svXMLCrystAsyncSave.push_back(save);
+   bool startThread=false;
+   if(!sXMLCrystAsyncSaveRunning) startThread=sXMLCrystAsyncSaveRunning=true;
+   XMLCrystAsyncUnlock();
+   if(startThread)
+      if(!XMLCrystAsyncStartThread())
+      {// Could not create a thread - write everything now
+         XMLCrystAsyncLock();
+         sXMLCrystAsyncSaveRunning=false;
+         std::list<XMLCrystAsyncSave> v;
+         v.swap(svXMLCrystAsyncSave);
+         XMLCrystAsyncUnlock();
+         for(std::list<XMLCrystAsyncSave>::const_iterator pos=v.begin();pos!=v.end();++pos)
+            XMLCrystAsyncWrite(*pos);
+      }
+   #else
+   XMLCrystAsyncWrite(save);
+   #endif
+   VFN_DEBUG_EXIT("XMLCrystFileSaveGlobalAsync(filename)",5)
+}
+
+void XMLCrystFileSaveGlobalAsyncWait()
+{
+   #if defined(__WX__CRYST__) || !defined(_WIN32)
+   for(;;)
+   {
+      XMLCrystAsyncLock();
+      const bool running=sXMLCrystAsyncSaveRunning;
+      XMLCrystAsyncUnlock();
+      if(!running) return;
+      #ifdef __WX__CRYST__
+      wxMilliSleep(10);
+      #else
+      usleep(10000);
+      #endif
+   }
+   #endif
+}
+
 ObjRegistry<XMLCrystTag> XMLCrystFileLoadObjectList(const string & filename)
 {
    VFN_DEBUG_ENTRY("XMLCrystFileLoadObjectList(filename)",5)
@@ -1261,19 +1653,37 @@ void DiffractionDataSingleCrystal::XMLOutput(ostream &os,int indent)const
    if(mGroupOption.GetChoice()!=2)
    {
       XMLCrystTag tag3("HKLIobsSigmaWeightList");
+      if(XMLCrystGetBase64Arrays()) tag3.AddAttribute("Encoding","base64");
       for(int i=0;i<indent;i++) os << "  " ;
       os <<tag3<<endl;
 
-      for(long j=0;j<this->GetNbRefl();j++)
+      if(XMLCrystGetBase64Arrays())
       {
-         for(int i=0;i<=indent;i++) os << "  " ;
-         os << mIntH(j) <<" "
-            << mIntK(j) <<" "
-            << mIntL(j) <<" "
-            << mObsIntensity(j) <<" "
-            << mObsSigma(j) <<" "
-            << mWeight(j) <<" "
-            <<endl;
+         CrystVector_REAL v(6*this->GetNbRefl());
+         for(long j=0;j<this->GetNbRefl();j++)
+         {
+            v(6*j  )=mIntH(j);
+            v(6*j+1)=mIntK(j);
+            v(6*j+2)=mIntL(j);
+            v(6*j+3)=mObsIntensity(j);
+            v(6*j+4)=mObsSigma(j);
+            v(6*j+5)=mWeight(j);
+         }
+         XMLOutputBase64(os,v);
+      }
+      else
+      {
+         for(long j=0;j<this->GetNbRefl();j++)
+         {
+            for(int i=0;i<=indent;i++) os << "  " ;
+            os << mIntH(j) <<" "
+               << mIntK(j) <<" "
+               << mIntL(j) <<" "
+               << mObsIntensity(j) <<" "
+               << mObsSigma(j) <<" "
+               << mWeight(j) <<" "
+               <<endl;
+         }
       }
 
       tag3.SetIsEndTag(true);
@@ -1398,27 +1808,50 @@ void DiffractionDataSingleCrystal::XMLInput(istream &is,const XMLCrystTag &tagg)
          long nbrefl=0;
          CrystVector_long h(100),k(100),l(100);
          CrystVector_REAL iobs(100),sigma(100),weight(100);
-         do
+         if(XMLIsBase64(tag))
          {
-            is >>h(nbrefl)>>k(nbrefl)>>l(nbrefl);
-            iobs  (nbrefl)=InputFloat(is); if(ISNAN_OR_INF(iobs  (nbrefl))||(iobs  (nbrefl)<0)) iobs  (nbrefl)=1e-8;
-            sigma (nbrefl)=InputFloat(is); if(ISNAN_OR_INF(sigma (nbrefl))||(sigma (nbrefl)<0)) sigma (nbrefl)=1e-8;
-            weight(nbrefl)=InputFloat(is); if(ISNAN_OR_INF(weight(nbrefl))||(weight(nbrefl)<0)) weight(nbrefl)=1e-8;
-
-            nbrefl++;
-            if(nbrefl==iobs.numElements())
+            CrystVector_REAL v;
+            XMLInputBase64(is,v);
+            nbrefl=v.numElements()/6;
+            h.resize(nbrefl);
+            k.resize(nbrefl);
+            l.resize(nbrefl);
+            iobs.resize(nbrefl);
+            sigma.resize(nbrefl);
+            weight.resize(nbrefl);
+            for(long j=0;j<nbrefl;j++)
             {
-               h.resizeAndPreserve(nbrefl+100);
-               k.resizeAndPreserve(nbrefl+100);
-               l.resizeAndPreserve(nbrefl+100);
-               iobs.resizeAndPreserve(nbrefl+100);
-               sigma.resizeAndPreserve(nbrefl+100);
-               weight.resizeAndPreserve(nbrefl+100);
+               h(j)=(long)v(6*j);
+               k(j)=(long)v(6*j+1);
+               l(j)=(long)v(6*j+2);
+               iobs  (j)=v(6*j+3); if(ISNAN_OR_INF(iobs  (j))||(iobs  (j)<0)) iobs  (j)=1e-8;
+               sigma (j)=v(6*j+4); if(ISNAN_OR_INF(sigma (j))||(sigma (j)<0)) sigma (j)=1e-8;
+               weight(j)=v(6*j+5); if(ISNAN_OR_INF(weight(j))||(weight(j)<0)) weight(j)=1e-8;
             }
-            while(0==isgraph(is.peek())) is.get();
-            //cout << is.peek()<<" "<<nbrefl<<endl;
          }
-         while(is.peek()!='<');//until next tag
+         else
+         {
+            do
+            {
+               is >>h(nbrefl)>>k(nbrefl)>>l(nbrefl);
+               iobs  (nbrefl)=InputFloat(is); if(ISNAN_OR_INF(iobs  (nbrefl))||(iobs  (nbrefl)<0)) iobs  (nbrefl)=1e-8;
+               sigma (nbrefl)=InputFloat(is); if(ISNAN_OR_INF(sigma (nbrefl))||(sigma (nbrefl)<0)) sigma (nbrefl)=1e-8;
+               weight(nbrefl)=InputFloat(is); if(ISNAN_OR_INF(weight(nbrefl))||(weight(nbrefl)<0)) weight(nbrefl)=1e-8;
+
+               nbrefl++;
+               if(nbrefl==iobs.numElements())
+               {
+                  h.resizeAndPreserve(nbrefl+100);
+                  k.resizeAndPreserve(nbrefl+100);
+                  l.resizeAndPreserve(nbrefl+100);
+                  iobs.resizeAndPreserve(nbrefl+100);
+                  sigma.resizeAndPreserve(nbrefl+100);
+                  weight.resizeAndPreserve(nbrefl+100);
+               }
+               //cout << is.peek()<<" "<<nbrefl<<endl;
+            }
+            while((XMLPeekGraph(is)!='<')&&!is.eof());//until next tag
+         }
          XMLCrystTag junkEndTag(is);
 
          h.resizeAndPreserve(nbrefl);
@@ -2088,7 +2521,10 @@ void PowderPattern::XMLOutput(ostream &os,int indent)const
       for(int i=0;i<indent;i++) os << "  " ;
       os<<tagg<<endl<<endl;
    }
-   XMLCrystTag tag2("XIobsSigmaWeightList");
+   if(!XMLCrystGetSkipArrays(os))
+   {
+      XMLCrystTag tag2("XIobsSigmaWeightList");
+      if(XMLCrystGetBase64Arrays()) tag2.AddAttribute("Encoding","base64");
       for(int i=0;i<indent;i++) os << "  " ;
       os<<tag2<<endl;
 
@@ -2096,18 +2532,34 @@ void PowderPattern::XMLOutput(ostream &os,int indent)const
       if(this->GetRadiation().GetWavelengthType()!=WAVELENGTH_TOF)
          scale=RAD2DEG;
 
-      for(unsigned long j=0;j<this->GetNbPoint();j++)
+      if(XMLCrystGetBase64Arrays())
       {
-         for(int i=0;i<=indent;i++) os << "  " ;
-         os << scale*mX(j) <<" "
-            << mPowderPatternObs(j) <<" "
-            << mPowderPatternObsSigma(j) <<" "
-            << mPowderPatternWeight(j) <<" "
-            <<endl;
+         CrystVector_REAL v(4*this->GetNbPoint());
+         for(unsigned long j=0;j<this->GetNbPoint();j++)
+         {
+            v(4*j  )=scale*mX(j);
+            v(4*j+1)=mPowderPatternObs(j);
+            v(4*j+2)=mPowderPatternObsSigma(j);
+            v(4*j+3)=mPowderPatternWeight(j);
+         }
+         XMLOutputBase64(os,v);
+      }
+      else
+      {
+         for(unsigned long j=0;j<this->GetNbPoint();j++)
+         {
+            for(int i=0;i<=indent;i++) os << "  " ;
+            os << scale*mX(j) <<" "
+               << mPowderPatternObs(j) <<" "
+               << mPowderPatternObsSigma(j) <<" "
+               << mPowderPatternWeight(j) <<" "
+               <<endl;
+         }
       }
       tag2.SetIsEndTag(true);
       for(int i=0;i<indent;i++) os << "  " ;
       os<<tag2<<endl;
+   }
 
    for(int j=0;j<mExcludedRegionMinX.numElements();j++)
    {
@@ -2279,26 +2731,18 @@ void PowderPattern::XMLInput(istream &is,const XMLCrystTag &tagg)
             VFN_DEBUG_EXIT("Loading Iobs-Sigma-Weight List...",8);
             continue;
          }
-         mNbPoint=0;
-         mPowderPatternObs.resize(500);
-         mPowderPatternObsSigma.resize(500);
-         mPowderPatternWeight.resize(500);
-         do
+         vector<REAL> v;
+         XMLInputValueList(is,v);
+         mNbPoint=v.size()/3;
+         mPowderPatternObs.resize(mNbPoint);
+         mPowderPatternObsSigma.resize(mNbPoint);
+         mPowderPatternWeight.resize(mNbPoint);
+         for(unsigned long j=0;j<mNbPoint;j++)
          {
-            is >>mPowderPatternObs(mNbPoint)
-               >>mPowderPatternObsSigma(mNbPoint)
-               >>mPowderPatternWeight(mNbPoint);
-            mNbPoint++;
-            VFN_DEBUG_MESSAGE("Point #"<<mNbPoint,5);
-            if(mNbPoint==(unsigned long)mPowderPatternObs.numElements())
-            {
-               mPowderPatternObs.resizeAndPreserve(mNbPoint+500);
-               mPowderPatternObsSigma.resizeAndPreserve(mNbPoint+500);
-               mPowderPatternWeight.resizeAndPreserve(mNbPoint+500);
-            }
-            while(0==isgraph(is.peek())) is.get();
+            mPowderPatternObs(j)=v[3*j];
+            mPowderPatternObsSigma(j)=v[3*j+1];
+            mPowderPatternWeight(j)=v[3*j+2];
          }
-         while(is.peek()!='<');//until next tag
          this->SetPowderPatternPar(min,step,mNbPoint);
          mClockPowderPatternPar.Click();
 
@@ -2309,37 +2753,48 @@ void PowderPattern::XMLInput(istream &is,const XMLCrystTag &tagg)
       if("XIobsSigmaWeightList"==tag.GetName())
       {
          VFN_DEBUG_ENTRY("Loading X-Iobs-Sigma-Weight List...",8);
+         CrystVector_REAL v;
+         if(XMLIsBase64(tag)) XMLInputBase64(is,v);
          while(0==isgraph(is.peek())) is.get();
-         if(is.peek()=='<')
+         if((is.peek()=='<')&&(v.numElements()<4))
          {
             cout <<"PowderPattern::XMLInput(): no data point in the powder pattern !"<<endl;
             XMLCrystTag junk(is);
             VFN_DEBUG_EXIT("Loading Iobs-Sigma-Weight List...",8);
             continue;
          }
-         mNbPoint=0;
-         mX.resize(500);
-         mPowderPatternObs.resize(500);
-         mPowderPatternObsSigma.resize(500);
-         mPowderPatternWeight.resize(500);
-         do
+         if(XMLIsBase64(tag))
          {
-            is >>mX(mNbPoint)
-               >>mPowderPatternObs(mNbPoint)
-               >>mPowderPatternObsSigma(mNbPoint)
-               >>mPowderPatternWeight(mNbPoint);
-            mNbPoint++;
-            VFN_DEBUG_MESSAGE("Point #"<<mNbPoint,5);
-            if(mNbPoint==(unsigned long)mPowderPatternObs.numElements())
+            mNbPoint=v.numElements()/4;
+            mX.resize(mNbPoint);
+            mPowderPatternObs.resize(mNbPoint);
+            mPowderPatternObsSigma.resize(mNbPoint);
+            mPowderPatternWeight.resize(mNbPoint);
+            for(unsigned long j=0;j<mNbPoint;j++)
             {
-               mX.resizeAndPreserve(mNbPoint+500);
-               mPowderPatternObs.resizeAndPreserve(mNbPoint+500);
-               mPowderPatternObsSigma.resizeAndPreserve(mNbPoint+500);
-               mPowderPatternWeight.resizeAndPreserve(mNbPoint+500);
+               mX(j)=v(4*j);
+               mPowderPatternObs(j)=v(4*j+1);
+               mPowderPatternObsSigma(j)=v(4*j+2);
+               mPowderPatternWeight(j)=v(4*j+3);
+            }
+         }
+         else
+         {
+            vector<REAL> vx;
+            XMLInputValueList(is,vx);
+            mNbPoint=vx.size()/4;
+            mX.resize(mNbPoint);
+            mPowderPatternObs.resize(mNbPoint);
+            mPowderPatternObsSigma.resize(mNbPoint);
+            mPowderPatternWeight.resize(mNbPoint);
+            for(unsigned long j=0;j<mNbPoint;j++)
+            {
+               mX(j)=vx[4*j];
+               mPowderPatternObs(j)=vx[4*j+1];
+               mPowderPatternObsSigma(j)=vx[4*j+2];
+               mPowderPatternWeight(j)=vx[4*j+3];
             }
-            while(0==isgraph(is.peek())) is.get();
          }
-         while(is.peek()!='<');//until next tag
          mX.resizeAndPreserve(mNbPoint);
          if(this->GetRadiation().GetWavelengthType()!=WAVELENGTH_TOF)
             mX*=DEG2RAD;
@@ -49,6 +49,46 @@ void XMLCrystFileSaveGlobal(const string & filename);
 * Saving is done in well-formed xml format.
 */
 void XMLCrystFileSaveGlobal(std::ostream &out);
+/** \brief Save all Objcryst++ objects, writing the file in a background thread.
+*
+* The XML description is generated immediately in memory (so that it corresponds
+* to the current state of all objects), and the file is then written by a background
+* thread, so that the caller (e.g. an optimization) is not stalled by a slow (network)
+* filesystem. The data is first written to filename+".tmp", which is then renamed,
+* so that an incomplete file is never seen under the final name.
+*
+* \param coalesce: if true and a previous coalescable save has not been written yet,
+* it is dropped and replaced by this one (useful when saving each new best configuration).
+* If false, the file is always written (e.g. the result of each run).
+*
+* Without wxWidgets threads or POSIX threads (Windows command-line version), the
+* file is written synchronously.
+*/
+void XMLCrystFileSaveGlobalAsync(const string & filename,const bool coalesce=true);
+/// Wait until all files saved with XMLCrystFileSaveGlobalAsync() have been written.
+void XMLCrystFileSaveGlobalAsyncWait();
+/** \brief Choose how large numerical arrays are saved in XML files.
+*
+* If true, the powder pattern data points and the single crystal reflections are
+* saved as base64-encoded little-endian 32-bit floats (with an Encoding="base64"
+* attribute), which is much more compact and faster to write and read than
+* formatted text. Files using either form can always be loaded.
+*
+* The default is false (formatted text).
+*/
+void XMLCrystSetBase64Arrays(const bool b);
+/// Are large numerical arrays saved as base64 in XML files ? See XMLCrystSetBase64Arrays()
+bool XMLCrystGetBase64Arrays();
+/** \brief Skip large numerical arrays (powder pattern data points) when writing
+* XML to this stream.
+*
+* This is used by XMLConfig, which keeps the observed data separately so that it can
+* be shared between undo history entries. The flag is stored in the stream (iword),
+* so it does not affect other streams.
+*/
+void XMLCrystSetSkipArrays(std::ostream &os,const bool b);
+/// Are large numerical arrays skipped when writing XML to this stream ? See XMLCrystSetSkipArrays()
+bool XMLCrystGetSkipArrays(std::ostream &os);
 /** \brief Get the list (tags) of ObjCryst objects in a file
 *
 * This will recognize only certain tags in the file (Crystal,PowderPattern,
@@ -21,12 +21,21 @@
 */
 #include <algorithm>
 #include <iomanip>
+#include <map>
 
 #include "ObjCryst/ObjCryst/Indexing.h"
 #include "ObjCryst/Quirks/VFNDebug.h"
 #include "ObjCryst/Quirks/VFNStreamFormat.h"
 #include "ObjCryst/Quirks/Chronometer.h"
 
+#ifdef HAVE_SSE_MATHFUN
+#include "ObjCryst/Quirks/sse_mathfun.h"
+#endif
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 using namespace std;
 
 #ifndef M_PI
@@ -453,6 +462,57 @@ float RecUnitCell::hkl2d(const float h,const float k,const float l,REAL *derivpa
    return 0.0;
 }
 
+void RecUnitCell::GetQuadraticForm(float *q) const
+{
+   q[0]=par[0];
+   switch(mlattice)
+   {
+      case TRICLINIC:
+      {
+         for(unsigned int i=1;i<7;++i) q[i]=par[i];
+         break;
+      }
+      case MONOCLINIC:
+      {
+         q[1]=par[1]*par[1];q[2]=par[2]*par[2];q[3]=par[3]*par[3];
+         q[4]=0;q[5]=0;q[6]=2*par[1]*par[3]*par[4];
+         break;
+      }
+      case ORTHOROMBIC:
+      {
+         q[1]=par[1]*par[1];q[2]=par[2]*par[2];q[3]=par[3]*par[3];
+         q[4]=0;q[5]=0;q[6]=0;
+         break;
+      }
+      case HEXAGONAL:
+      {
+         q[1]=par[1]*par[1];q[2]=q[1];q[3]=par[2]*par[2];
+         q[4]=q[1];q[5]=0;q[6]=0;
+         break;
+      }
+      case RHOMBOEDRAL:
+      {
+         q[1]=par[1]*par[1];q[2]=q[1];q[3]=q[1];
+         q[4]=2*q[1]*par[2];q[5]=q[4];q[6]=q[4];
+         break;
+      }
+      case TETRAGONAL:
+      {
+         q[1]=par[1]*par[1];q[2]=q[1];q[3]=par[2]*par[2];
+         q[4]=0;q[5]=0;q[6]=0;
+         break;
+      }
+      case CUBIC:
+      {
+         q[1]=par[1]*par[1];q[2]=q[1];q[3]=q[1];
+         q[4]=0;q[5]=0;q[6]=0;
+         break;
+      }
+      // This should never happen.
+      default: throw 0;
+   }
+}
+
 void RecUnitCell::hkl2d_delta(const float h,const float k,const float l,
                               const RecUnitCell &delta, float & dmin, float &dmax) const
 {
@@ -690,6 +750,179 @@ vector<float> RecUnitCell::DirectUnitCell(const bool equiv)const
    return par;
 }
 ///////////////////////////////////////////////// PEAKLIST:HKL0 /////////////////////
+/////////////////////////////////////////////////////// PackedHKLTable ///////////////////////////////////////
+PackedHKLTable::PackedHKLTable():
+mMaxIndex(0)
+{}
+
+void PackedHKLTable::clear()
+{
+   mvH.clear();mvK.clear();mvL.clear();
+   mvHH.clear();mvKK.clear();mvLL.clear();mvHK.clear();mvKL.clear();mvHL.clear();
+   mvBlock.clear();
+   mMaxIndex=0;
+}
+
+void PackedHKLTable::reserve(const unsigned long nb)
+{
+   mvH.reserve(nb);mvK.reserve(nb);mvL.reserve(nb);
+   mvHH.reserve(nb);mvKK.reserve(nb);mvLL.reserve(nb);mvHK.reserve(nb);mvKL.reserve(nb);mvHL.reserve(nb);
+}
+
+void PackedHKLTable::push_back(const int h,const int k,const int l)
+{
+   mvH.push_back(h);
+   mvK.push_back(k);
+   mvL.push_back(l);
+   mvHH.push_back(float(h*h));
+   mvKK.push_back(float(k*k));
+   mvLL.push_back(float(l*l));
+   mvHK.push_back(float(h*k));
+   mvKL.push_back(float(k*l));
+   mvHL.push_back(float(h*l));
+}
+
+unsigned long PackedHKLTable::size()const {return mvH.size();}
+
+void PackedHKLTable::CalcD2(const RecUnitCell &ruc,float *d2)const
+{
+   float q[7];
+   ruc.GetQuadraticForm(q);
+   this->CalcD2(q,0,this->size(),d2);
+}
+
+void PackedHKLTable::CalcD2(const float *q,const unsigned long first,const unsigned long last,float *d2)const
+{
+   if(last<=first) return;
+   const unsigned long nb=last-first;
+   const float *phh=mvHH.data()+first,*pkk=mvKK.data()+first,*pll=mvLL.data()+first,
+               *phk=mvHK.data()+first,*pkl=mvKL.data()+first,*phl=mvHL.data()+first;
+   unsigned long i=0;
+   #ifdef HAVE_SSE_MATHFUN
+   const __m128 q0=_mm_set1_ps(q[0]),q1=_mm_set1_ps(q[1]),q2=_mm_set1_ps(q[2]),q3=_mm_set1_ps(q[3]),
+                q4=_mm_set1_ps(q[4]),q5=_mm_set1_ps(q[5]),q6=_mm_set1_ps(q[6]);
+   for(;(i+4)<=nb;i+=4)
+   {
+      __m128 v=_mm_add_ps(q0,_mm_mul_ps(q1,_mm_loadu_ps(phh+i)));
+      v=_mm_add_ps(v,_mm_mul_ps(q2,_mm_loadu_ps(pkk+i)));
+      v=_mm_add_ps(v,_mm_mul_ps(q3,_mm_loadu_ps(pll+i)));
+      v=_mm_add_ps(v,_mm_mul_ps(q4,_mm_loadu_ps(phk+i)));
+      v=_mm_add_ps(v,_mm_mul_ps(q5,_mm_loadu_ps(pkl+i)));
+      v=_mm_add_ps(v,_mm_mul_ps(q6,_mm_loadu_ps(phl+i)));
+      _mm_storeu_ps(d2+i,v);
+   }
+   #endif
+   for(;i<nb;++i)
+      d2[i]=q[0]+q[1]*phh[i]+q[2]*pkk[i]+q[3]*pll[i]+q[4]*phk[i]+q[5]*pkl[i]+q[6]*phl[i];
+}
+
+void PackedHKLTable::BuildEnumeration(const CrystalSystem system,const CrystalCentering centering,
+                                      const unsigned int maxIndex)
+{
+   this->BuildEnumeration(system,centering,maxIndex,maxIndex,maxIndex,0,0);
+}
+
+void PackedHKLTable::BuildEnumeration(const CrystalSystem system,const CrystalCentering centering,
+                                      const unsigned int hmax,const unsigned int kmax,const unsigned int lmax,
+                                      const float *q,const float d2max)
+{
+   this->clear();
+   bool negk,negl;// do we need <0 indices for k,l ?
+   switch(system)
+   {
+      case TRICLINIC:  negk=true ;negl=true ;break;
+      case MONOCLINIC: negk=false;negl=true ;break;
+      case ORTHOROMBIC:negk=false;negl=false;break;
+      case HEXAGONAL:  negk=true ;negl=false;break;
+      case RHOMBOEDRAL:negk=true ;negl=true ;break;
+      case TETRAGONAL: negk=false;negl=false;break;
+      case CUBIC:      negk=false;negl=false;break;
+      // This should never happen.  Avoid using unitialized values.
+      default: throw 0;
+   }
+   // The block index is only built for the complete (cubic) enumeration
+   const bool blocks=(q==0)&&(hmax==kmax)&&(hmax==lmax);
+   const int nh=(int)hmax,nk=(int)kmax,nl=(int)lmax;
+   if(blocks)
+   {
+      mMaxIndex=hmax;
+      mvBlock.resize((nh+1)*(nh+1)*(nh+2));
+   }
+   unsigned long *pblock=mvBlock.data();
+   for(int h=0;h<=nh;++h)
+      for(int k=0;k<=nk;++k)
+         for(int l=0;l<=(nl+1);++l)
+         {
+            if(blocks) *pblock++=this->size();
+            if(l>nl) break;// End of this h,|k| block
+            bool extinct;// Centering extinctions (parity does not depend on signs)
+            switch(centering)
+            {
+               case LATTICE_P:extinct=false;break;
+               case LATTICE_I:extinct=((h+k+l)%2)!=0;break;
+               case LATTICE_A:extinct=((k+l)%2)!=0;break;
+               case LATTICE_B:extinct=((h+l)%2)!=0;break;
+               case LATTICE_C:extinct=((h+k)%2)!=0;break;
+               case LATTICE_F:extinct=(((h+k)%2)!=0)||(((h+l)%2)!=0);break;
+               // This should never happen.  Avoid using unitialized values.
+               default: throw 0;
+            }
+            if(extinct) continue;
+            if((h+k+l)==0) continue;
+            for(int sk=-1;sk<=1;sk+=2)
+            {
+               if((sk<0)&&((!negk)||(h==0)||(k==0))) continue;// Do not list 0 k l or h 0 l twice
+               for(int sl=-1;sl<=1;sl+=2)
+               {
+                  if((sl<0)&&((!negl)||(l==0))) continue;
+                  if((sl<0)&&(h==0)&&((k==0)||(system==MONOCLINIC))) continue;// 0 k l and 0 k -l are equivalent
+                  if(q!=0)
+                  {
+                     const float fh=h,fk=sk*k,fl=sl*l;
+                     if((q[0]+q[1]*fh*fh+q[2]*fk*fk+q[3]*fl*fl+q[4]*fh*fk+q[5]*fk*fl+q[6]*fh*fl)>d2max) continue;
+                  }
+                  this->push_back(h,sk*k,sl*l);
+               }
+            }
+         }
+}
+
+unsigned int PackedHKLTable::GetMaxIndex()const{return mMaxIndex;}
+
+void PackedHKLTable::GetBlock(const unsigned int h,const unsigned int absk,const unsigned int lmax,
+                              unsigned long &first,unsigned long &last)const
+{
+   const unsigned long *p=mvBlock.data()+(h*(mMaxIndex+1)+absk)*(mMaxIndex+2);
+   first=p[0];
+   last=p[lmax+1];
+}
+
+const PackedHKLTable& GetHKLEnumerationTable(const CrystalSystem system,const CrystalCentering centering,
+                                             const unsigned int maxIndex)
+{
+   // Tables are indexed by crystal system, centering and maximum index
+   static map<pair<pair<int,int>,unsigned int>,PackedHKLTable*> vTable;
+   const pair<int,int> sc((int)system,(int)centering);
+   const PackedHKLTable *ptable=0;
+   #ifdef _OPENMP
+   #pragma omp critical(HKLEnumerationTable)
+   #endif
+   {
+      map<pair<pair<int,int>,unsigned int>,PackedHKLTable*>::const_iterator pos=vTable.lower_bound(make_pair(sc,maxIndex));
+      if((pos!=vTable.end())&&(pos->first.first==sc)) ptable=pos->second;
+      else
+      {// Round the maximum index to avoid building many similar tables
+         const unsigned int n=(maxIndex<8)?8:((maxIndex+7)/8)*8;
+         PackedHKLTable *pnew=new PackedHKLTable;
+         pnew->BuildEnumeration(system,centering,n);
+         vTable[make_pair(sc,n)]=pnew;
+         ptable=pnew;
+      }
+   }
+   return *ptable;
+}
+
+/////////////////////////////////////////////////////// PeakList ///////////////////////////////////////
 PeakList::hkl0::hkl0(const int h0,const int k0, const int l0):
 h(h0),k(k0),l(l0)
 {}
@@ -934,11 +1167,38 @@ const vector<PeakList::hkl> & PeakList::GetPeakList()const {return mvHKL;}
 
 /////////////////////////////////////////////////////// SCORE ///////////////////////////////////////
 
+/** Maximum absolute values of the Miller indices for reflections with d*^2<=d2max,
+* given the quadratic form q of the reciprocal unit cell (see RecUnitCell::GetQuadraticForm()).
+*
+* The direct metric tensor is the inverse of the reciprocal one, and |h|<=a*sqrt(d2max-zero), etc..
+* If the quadratic form is not positive definite (invalid cell), only its diagonal is used.
+*/
+void MaxHKLIndices(const float *q,const float d2max,int &hmax,int &kmax,int &lmax)
+{
+   const double r=d2max-q[0];
+   if(r<=0) {hmax=0;kmax=0;lmax=0;return;}
+   const double g11=q[1],g22=q[2],g33=q[3],g12=q[4]/2,g23=q[5]/2,g13=q[6]/2;
+   const double c11=g22*g33-g23*g23,c22=g11*g33-g13*g13,c33=g11*g22-g12*g12;
+   const double det=g11*c11-g12*(g12*g33-g23*g13)+g13*(g12*g23-g22*g13);
+   if((g11>0)&&(c33>0)&&(det>0))
+   {
+      hmax=(int)sqrt(r*c11/det)+1;
+      kmax=(int)sqrt(r*c22/det)+1;
+      lmax=(int)sqrt(r*c33/det)+1;
+   }
+   else
+   {
+      hmax=(int)sqrt(r/max(g11,1e-6))+1;
+      kmax=(int)sqrt(r/max(g22,1e-6))+1;
+      lmax=(int)sqrt(r/max(g33,1e-6))+1;
+   }
+}
+
 float Score(const PeakList &dhkl, const RecUnitCell &rpar, const unsigned int nbSpurious,
             const bool verbose,const bool storehkl,const bool storePredictedHKL)
 {
    const bool autozero=false;
-   vector<PeakList::hkl>::const_iterator pos,first,last;
+   vector<PeakList::hkl>::const_iterator pos;
    for(pos=dhkl.GetPeakList().begin();pos!=dhkl.GetPeakList().end();++pos)
    {
       if(storehkl) pos->isIndexed=false;
@@ -949,142 +1209,92 @@ float Score(const PeakList &dhkl, const RecUnitCell &rpar, const unsigned int nb
    if(storePredictedHKL) dhkl.mvPredictedHKL.clear();
 
    unsigned long nbCalc=0;
-   int h,k,l;
    float predict_coeff=1;
    if(storePredictedHKL)predict_coeff=2;
    const float dmax=dhkl.mvHKL[nb-1].d2obs*predict_coeff*1.05;
-   int sk0,sl0;// do we need >0 *and* <0 indices for k,l ?
-   switch(rpar.mlattice)
-   {
-      case TRICLINIC:
-         sk0=-1;sl0=-1;
-	 break;
-      case MONOCLINIC:
-         sk0=1;sl0=-1;
-         break;
-      case ORTHOROMBIC:
-         sk0=1;sl0=1;
-         break;
-      case HEXAGONAL:
-         sk0=-1;sl0=1;
-         break;
-      case RHOMBOEDRAL:
-         sk0=-1;sl0=-1;
-         break;
-      case TETRAGONAL:
-         sk0=1;sl0=1;
-         break;
-      case CUBIC:
-         sk0=1;sl0=1;
-         break;
-      // This should never happen.  Avoid using unitialized values.
-      default:
-         throw 0;
-   }
-   int stepk,stepl;// steps in k,l to use for centered lattices
-   switch(rpar.mCentering)
-   {
-      case LATTICE_P:stepk=1;stepl=1;break;
-      case LATTICE_I:stepk=1;stepl=2;break;
-      case LATTICE_A:stepk=1;stepl=2;break;
-      case LATTICE_B:stepk=1;stepl=2;break;
-      case LATTICE_C:stepk=2;stepl=1;break;
-      case LATTICE_F:stepk=2;stepl=2;break;
-      // This should never happen.  Avoid using unitialized values.
-      default: throw 0;
-   }
-   first=dhkl.GetPeakList().begin();last=dhkl.GetPeakList().end();
-   unsigned long nbCalcH,nbCalcK;// Number of calculated lines below dmax for each h,k
-   for(h=0;;++h)
+   float q[7];
+   rpar.GetQuadraticForm(q);
+   // All calculated reflections below dmax are listed first, with their d*^2, and
+   // then matched to the observed lines. Reflections are taken from the shared
+   // enumeration table, within the maximum Miller indices for this cell.
+   int hmax,kmax,lmax;
+   MaxHKLIndices(q,dmax,hmax,kmax,lmax);
+   const int maxIndex=max(hmax,max(kmax,lmax));
+   // Cells with large indices below dmax (large cells, or dmax doubled for the predicted
+   // reflections) are not worth a shared table: their reflections are enumerated directly,
+   // only within the maximum indices and below dmax.
+   PackedHKLTable largeCellTable;
+   const bool useSharedTable=(maxIndex<=64);
+   if(!useSharedTable)
+      largeCellTable.BuildEnumeration(rpar.mlattice,rpar.mCentering,hmax,kmax,lmax,q,dmax);
+   const PackedHKLTable &table= useSharedTable ?
+                                GetHKLEnumerationTable(rpar.mlattice,rpar.mCentering,maxIndex) : largeCellTable;
+   // h 0 l reflections (h>0) used to be counted twice for lattices with k<0 indices: keep
+   // the same number of calculated reflections, so that scores are unchanged.
+   const bool countH0L=(rpar.mlattice==TRICLINIC)||(rpar.mlattice==HEXAGONAL)||(rpar.mlattice==RHOMBOEDRAL);
+   vector<pair<float,unsigned long> > *const pvd2=&(dhkl.mvScoreD2);
+   vector<float> *const pvblock=&(dhkl.mvScoreBlockD2);
+   pvd2->clear();
+   // The table built for a large cell is handled as a single block
+   const int hend=useSharedTable ? hmax : 0, kend=useSharedTable ? kmax : 0;
+   for(int h=0;h<=hend;++h)
+      for(int k=0;k<=kend;++k)
+      {
+         const unsigned long nbCalc0=nbCalc;
+         unsigned long first=0,last=table.size();
+         if(useSharedTable) table.GetBlock(h,k,lmax,first,last);
+         if(last==first) continue;
+         pvblock->resize(last-first);
+         table.CalcD2(q,first,last,&((*pvblock)[0]));
+         const float *pd2=&((*pvblock)[0]);
+         for(unsigned long i=first;i<last;++i)
+         {
+            const float d2=*pd2++;
+            if(d2>dmax) continue;
+            nbCalc++;
+            if((!useSharedTable)&&countH0L&&(table.mvH[i]>0)&&(table.mvK[i]==0)) nbCalc++;
+            if(storePredictedHKL)
+               dhkl.mvPredictedHKL.push_back(PeakList::hkl(0,0,0,0,table.mvH[i],table.mvK[i],table.mvL[i],d2));
+            pvd2->push_back(make_pair(d2,i));
+         }
+         if(useSharedTable&&countH0L&&(h>0)&&(k==0)) nbCalc+=nbCalc-nbCalc0;
+      }
+   // Match each observed line with the closest calculated reflection (within +/-0.1).
+   // Reflections are sorted by d*^2 and then by their order in the table, so
+   // that among equidistant reflections the first listed is used.
+   sort(pvd2->begin(),pvd2->end());
+   const vector<pair<float,unsigned long> >::const_iterator d2begin=pvd2->begin(),d2end=pvd2->end();
+   for(pos=dhkl.GetPeakList().begin();pos!=dhkl.GetPeakList().end();++pos)
    {
-      nbCalcH=0;
-      for(int sk=sk0;sk<=1;sk+=2)
+      const float d2obs=pos->d2obs;
+      // First calculated reflection with d*^2>=d2obs
+      vector<pair<float,unsigned long> >::const_iterator p1=lower_bound(d2begin,d2end,make_pair(d2obs,(unsigned long)0));
+      vector<pair<float,unsigned long> >::const_iterator best=d2end;
+      float bestdiff=0;
+      if(p1!=d2end)
       {
-         if(h==0) sk=1;// no need to explore 0kl with both sk -1 and 1
-         if(stepk==2) k=(h%2);// For LATTICE_C,LATTICE_F: h odd => k odd
-         else k=0;
-         for(;;k+=stepk)
-         {
-            nbCalcK=0;
-            for(int sl=sl0;sl<=1;sl+=2)
-            {
-               if((h+k)==0)
-               {
-                  sl=1;// No need to list 0 0 l with l<0
-                  l=1;
-               }
-               else
-               {
-                  if(h==0)
-                  {
-                     if(rpar.mlattice==MONOCLINIC) sl=1;// 0 k l and 0 k -l are equivalent
-                     if((sk<0)||(sl<0)) l=1;// Do not list 0 k 0 with k<0
-                     else l=0;// h==k==0 already covered
-                  }
-                  else
-                  {
-                     if(sl<0) l=1;// Do not list h k 0 twice
-                     else l=0;
-                  }
-               }
-               if(stepl==2)
-               {
-                  if(rpar.mCentering==LATTICE_I) l+=(h+k+l)%2;
-                  if(rpar.mCentering==LATTICE_A) l+=(k+l)%2;// Start at hk1 if k odd
-                  if(  (rpar.mCentering==LATTICE_B)
-                     ||(rpar.mCentering==LATTICE_F)) l+=(h+l)%2;// Start at hk1 if h odd
-               }
-               for(;;l+=stepl)
-               {
-                  const float d2=rpar.hkl2d(h,sk*k,sl*l);
-                  if(d2>dmax)
-                  {
-                     //cout<<__FILE__<<":"<<__LINE__<<" hkl: "<<h<<" "<<sk*k<<" "<<sl*l<<":"<<sqrt(d2)<<" deriv="<<sl*rpar.hkl2d(h,sk*k,sl*l,NULL,3)<<"/"<<sqrt(dmax)<<endl;
-                     // Only break if d is increasing with l
-                     if((sl*rpar.hkl2d(h,sk*k,sl*l,NULL,3))>=0) break;
-                     else continue;
-                  }
-                  nbCalc++;nbCalcK++;nbCalcH++;
-                  if(storePredictedHKL)
-                  {
-                     dhkl.mvPredictedHKL.push_back(PeakList::hkl(0,0,0,0,h,sk*k,sl*l,d2));
-                     //continue;
-                  }
-                  for(pos=first;pos!=last;++pos)
-                  {
-                     const float tmp=d2-pos->d2obs;
-                     if(tmp<.1)
-                     {
-                        if(tmp<-.1) break;
-                        if(fabs(tmp)<fabs(pos->d2diff))
-                        {
-                           pos->d2diff=tmp;
-                           if(storehkl)
-                           {
-                              pos->h=h;
-                              pos->k=sk*k;
-                              pos->l=sl*l;
-                              pos->isIndexed=true;
-                              pos->d2calc=d2;
-                           }
-                        }
-                        /*
-                        if((verbose)&&(fabs(tmp)<.01))
-                           cout<<__FILE__<<":"<<__LINE__<<"      hkl: "<<h<<" "<<k<<" "<<l
-                              <<"#"<<i<<": calc="<<sqrt(d2)<<", obs="<<sqrt(*pd2)<<", min_epsilon="<<*pdq2<<", tmp="<<tmp<<endl;
-                        */
-                     }
-                  }
-               }
-            }
-            if(nbCalcK==0) //d(hk0)>dmax
-            {
-               //cout<<__FILE__<<":"<<__LINE__<<" hkl: "<<h<<" "<<sk*k<<" "<<0<<" deriv="<<sk*rpar.hkl2d(h,sk*k,0,NULL,2)<<endl;
-               if((sk*rpar.hkl2d(h,sk*k,0,NULL,2))>=0) break;
-            }
-         }
+         const float tmp=p1->first-d2obs;
+         if(tmp<.1) {best=p1;bestdiff=tmp;}
+      }
+      if(p1!=d2begin)
+      {// Last calculated reflection with d*^2<d2obs (first listed if several have the same d*^2)
+         vector<pair<float,unsigned long> >::const_iterator p0=p1-1;
+         p0=lower_bound(d2begin,p1,make_pair(p0->first,(unsigned long)0));
+         const float tmp=p0->first-d2obs;
+         if(tmp>=-.1)
+            if(  (best==d2end)||(fabs(tmp)<fabs(bestdiff))
+               ||((fabs(tmp)==fabs(bestdiff))&&(p0->second<best->second))) {best=p0;bestdiff=tmp;}
+      }
+      if(best==d2end) continue;
+      pos->d2diff=bestdiff;
+      if(storehkl)
+      {
+         pos->h=table.mvH[best->second];
+         pos->k=table.mvK[best->second];
+         pos->l=table.mvL[best->second];
+         pos->isIndexed=true;
+         pos->d2calc=best->first;
       }
-      if(nbCalcH==0) break;//h00 beyond limit
    }
    float epsilon=0.0,zero=0.0;
    if(autozero)
@@ -1145,6 +1355,47 @@ float Score(const PeakList &dhkl, const RecUnitCell &rpar, const unsigned int nb
    return score;
 }
 
+void ScoreBatch(const PeakList &dhkl, const vector<RecUnitCell> &vruc, vector<float> &vscore,
+                const unsigned int nbSpurious,const unsigned int nbThread)
+{
+   vector<PeakList> vpeaks;
+   ScoreBatch(dhkl,vruc,vscore,vpeaks,nbSpurious,nbThread);
+}
+
+void ScoreBatch(const PeakList &dhkl, const vector<RecUnitCell> &vruc, vector<float> &vscore,
+                vector<PeakList> &vpeaks,const unsigned int nbSpurious,const unsigned int nbThread)
+{
+   vscore.resize(vruc.size());
+   if(vruc.size()==0) return;
+   #ifdef _OPENMP
+   const int nbth=(nbThread>0) ? (int)nbThread : omp_get_max_threads();
+   if(nbth>1)
+   {
+      // Score() modifies the peak list (d2diff, stats, work arrays): use one copy per thread
+      if(vpeaks.size()!=(unsigned long)nbth) vpeaks.assign(nbth,dhkl);
+      #pragma omp parallel num_threads(nbth)
+      {
+         const PeakList &peaks=vpeaks[omp_get_thread_num()];
+         for(vector<PeakList::hkl>::const_iterator pos=peaks.GetPeakList().begin();pos!=peaks.GetPeakList().end();++pos)
+            pos->stats=0;
+         #pragma omp for schedule(dynamic,4)
+         for(long i=0;i<(long)vruc.size();++i)
+            vscore[i]=Score(peaks,vruc[i],nbSpurious);
+         if(nbSpurious>0)
+         {
+            #pragma omp critical(ScoreBatchStats)
+            for(unsigned long i=0;i<dhkl.GetPeakList().size();++i)
+               dhkl.GetPeakList()[i].stats+=peaks.GetPeakList()[i].stats;
+         }
+      }
+      return;
+   }
+   #endif
+   // Single thread: no copy needed, the statistics go directly to the original list
+   for(unsigned long i=0;i<vruc.size();++i)
+      vscore[i]=Score(dhkl,vruc[i],nbSpurious);
+}
+
 /////////////////////////////////////////////////////// CellExplorer ///////////////////////////////////////
 
 CellExplorer::CellExplorer(const PeakList &dhkl, const CrystalSystem lattice, const unsigned int nbSpurious):
@@ -1156,11 +1407,40 @@ mZeroShiftMin(0),mZeroShiftMax(0),
 mlattice(lattice),mCentering(LATTICE_P),mNbSpurious(nbSpurious),
 mObs(0),mCalc(0),mWeight(0),mDeriv(0),mBestScore(0.0),
 mMinScoreReport(10),mMaxDicVolDepth(6),mDicVolDepthReport(6),
-mNbLSQExcept(0)
+mNbLSQExcept(0),mNbThread(0)
 {
    this->Init();
 }
 
+/** Small random number generator (xorshift) for CellExplorer::Evolution().
+*
+* rand() is neither thread-safe nor reproducible when used from several threads, so each
+* trial of a generation uses its own stream, derived from a seed drawn with rand() and
+* the index of the trial. Results are therefore independent of the number of threads.
+*/
+class EvolutionRandom
+{
+   public:
+      EvolutionRandom(const unsigned int seed,const unsigned int stream):
+      mState(seed*2654435761u+(stream+1)*0x9E3779B9u)
+      {
+         if(mState==0) mState=0x6A09E667u;
+         for(unsigned int i=0;i<4;++i) (*this)();
+      }
+      /// Random integer in [0;2^32[
+      unsigned int operator()()
+      {
+         mState^=mState<<13;
+         mState^=mState>>17;
+         mState^=mState<<5;
+         return mState;
+      }
+      /// Random float in [0;1]
+      float Uniform(){return (*this)()*(1.0f/4294967295.0f);}
+   private:
+      unsigned int mState;
+};
+
 void CellExplorer::Evolution(unsigned int ng,const bool randomize,const float f,const float cr,unsigned int np)
 {
    this->Init();
@@ -1168,40 +1448,56 @@ void CellExplorer::Evolution(unsigned int ng,const bool randomize,const float f,
    //cout<<__FILE__<<":"<<__LINE__<<"<CellExplorer::Evolution(...): randomizing,ng="<<ng
    //    <<"random="<<randomize<<"f="<<f<<"cr="<<cr<<"np="<<np<<endl;
    vector<pair<RecUnitCell,float> > vRUC(np);
-   vector<pair<RecUnitCell,float> > vTrial(np);
+   vector<RecUnitCell> vTrial(np);
+   vector<float> vTrialScore(np);
    float bestScore=-1e20;
    vector<pair<RecUnitCell,float> >::iterator bestpos=vRUC.begin();
 
    const clock_t mTime0=clock();
+   // Per-thread copies of the peak list, re-used for all generations
+   vector<PeakList> vThreadPeaks;
 
    if(randomize)
    {
       for(unsigned int i=0;i<vRUC.size();++i)
       {
          vRUC[i].first.mlattice=mlattice;
-         vTrial[i].first.mlattice=mlattice;
+         vTrial[i].mlattice=mlattice;
          for(unsigned int k=0;k<mnpar;++k) vRUC[i].first.par[k]=mMin[k]+mAmp[k]*rand()/(float)RAND_MAX;
-         vRUC[i].second=Score(*mpPeakList,vRUC[i].first,mNbSpurious);
+         vTrial[i]=vRUC[i].first;
       }
+      ScoreBatch(*mpPeakList,vTrial,vTrialScore,vThreadPeaks,mNbSpurious,mNbThread);
+      for(unsigned int i=0;i<vRUC.size();++i) vRUC[i].second=vTrialScore[i];
    }
+   #ifdef _OPENMP
+   const int nbth=(mNbThread>0) ? (int)mNbThread : omp_get_max_threads();
+   #endif
 
    for(unsigned long i=ng;i>0;--i)
    {
-      for(unsigned j=0;j<np;j++)
+      // All trials of a generation only depend on the current population, and are
+      // generated in parallel, each with its own random stream
+      const unsigned int seed=rand();
+      #ifdef _OPENMP
+      #pragma omp parallel for num_threads(nbth)
+      #endif
+      for(long jj=0;jj<(long)np;jj++)
       {
+         const unsigned int j=jj;
+         EvolutionRandom rnd(seed,j);
          if(true)
          {// DE/rand/1/exp
             unsigned int r1=j,r2=j,r3=j;
-            while(r1==j)r1=rand()%np;
-            while((r2==j)||(r1==r2))r2=rand()%np;
-            while((r3==j)||(r3==r1)||(r3==r2))r3=rand()%np;
-            unsigned int ncr=1+(int)(cr*mnpar*rand()/(float)RAND_MAX);
-            unsigned int ncr0=rand()%mnpar;
-            RecUnitCell *t0=&(vTrial[j].first);
-            RecUnitCell *c0=&(vRUC[j].first);
-            RecUnitCell *c1=&(vRUC[r1].first);
-            RecUnitCell *c2=&(vRUC[r2].first);
-            RecUnitCell *c3=&(vRUC[r3].first);
+            while(r1==j)r1=rnd()%np;
+            while((r2==j)||(r1==r2))r2=rnd()%np;
+            while((r3==j)||(r3==r1)||(r3==r2))r3=rnd()%np;
+            unsigned int ncr=1+(int)(cr*mnpar*rnd.Uniform());
+            unsigned int ncr0=rnd()%mnpar;
+            RecUnitCell *t0=&(vTrial[j]);
+            const RecUnitCell *c0=&(vRUC[j].first);
+            const RecUnitCell *c1=&(vRUC[r1].first);
+            const RecUnitCell *c2=&(vRUC[r2].first);
+            const RecUnitCell *c3=&(vRUC[r3].first);
             for(unsigned int k=0;k<mnpar;++k)t0->par[k] = c0->par[k];
             for(unsigned int k=0;k<ncr;++k)
             {
@@ -1215,17 +1511,17 @@ void CellExplorer::Evolution(unsigned int ng,const bool randomize,const float f,
          if(false)
          {// DE/rand-to-best/1/exp
             unsigned int r1=j,r2=j,r3=j;
-            while(r1==j)r1=rand()%np;
-            while((r2==j)||(r1==r2))r2=rand()%np;
-            while((r3==j)||(r3==r1)||(r3==r2))r3=rand()%np;
-            unsigned int ncr=1+(int)(cr*(mnpar-1)*rand()/(float)RAND_MAX);
-            unsigned int ncr0=rand()%mnpar;
-            RecUnitCell *t0=&(vTrial[j].first);
-            RecUnitCell *c0=&(vRUC[j].first);
-            //RecUnitCell *c1=&(vRUC[r1].first);
-            RecUnitCell *c2=&(vRUC[r2].first);
-            RecUnitCell *c3=&(vRUC[r3].first);
-            RecUnitCell *best=&(bestpos->first);
+            while(r1==j)r1=rnd()%np;
+            while((r2==j)||(r1==r2))r2=rnd()%np;
+            while((r3==j)||(r3==r1)||(r3==r2))r3=rnd()%np;
+            unsigned int ncr=1+(int)(cr*(mnpar-1)*rnd.Uniform());
+            unsigned int ncr0=rnd()%mnpar;
+            RecUnitCell *t0=&(vTrial[j]);
+            const RecUnitCell *c0=&(vRUC[j].first);
+            //const RecUnitCell *c1=&(vRUC[r1].first);
+            const RecUnitCell *c2=&(vRUC[r2].first);
+            const RecUnitCell *c3=&(vRUC[r3].first);
+            const RecUnitCell *best=&(bestpos->first);
             for(unsigned int k=0;k<6;++k)t0->par[k] = c0->par[k];//mMin[k]+mAmp[k]*rand()/(float)RAND_MAX;
             for(unsigned int k=0;k<ncr;++k)
             {
@@ -1241,22 +1537,16 @@ void CellExplorer::Evolution(unsigned int ng,const bool randomize,const float f,
          if(false)
          {// MC
             const float amp=.05/(1+i*.01);
-            RecUnitCell *t0=&(vTrial[j].first);
+            RecUnitCell *t0=&(vTrial[j]);
             for(unsigned int k=0;k<6;++k)
             {
 
-               t0->par[k] = mMin[k]+ fmod((float)(amp*mAmp[k]*(rand()/(float)RAND_MAX-0.5)+5*mAmp[k]),(float)mAmp[k]);
+               t0->par[k] = mMin[k]+ fmod((float)(amp*mAmp[k]*(rnd.Uniform()-0.5)+5*mAmp[k]),(float)mAmp[k]);
             }
          }
-      }
-      // Compute cost for all trials and select best
-      vector<pair<RecUnitCell,float> >::iterator posTrial,pos;
-      posTrial=vTrial.begin();
-      pos=vRUC.begin();
-      for(;posTrial!=vTrial.end();)
-      {
+         RecUnitCell *t0=&(vTrial[j]);
          // If using auto-zero, fix zero parameter
-         if(autozero) posTrial->first.par[0]=0;
+         if(autozero) t0->par[0]=0;
          // Did we go beyond allowed volume ?
          switch(mlattice)
          {
@@ -1264,13 +1554,13 @@ void CellExplorer::Evolution(unsigned int ng,const bool randomize,const float f,
                break;
             case MONOCLINIC:
             {
-               float v0=posTrial->first.par[1]*posTrial->first.par[2]*posTrial->first.par[3];
+               float v0=t0->par[1]*t0->par[2]*t0->par[3];
                while(v0<1/mVolumeMax)
                {
-                  const unsigned int i=rand()%3+1;
-                  posTrial->first.par[i]*=1/(mVolumeMax*v0)+1e-4;
-                  if(posTrial->first.par[i]>(mMin[i]+mAmp[i])) posTrial->first.par[i]=mMin[i]+mAmp[i];
-                  v0=posTrial->first.par[1]*posTrial->first.par[2]*posTrial->first.par[3];
+                  const unsigned int i=rnd()%3+1;
+                  t0->par[i]*=1/(mVolumeMax*v0)+1e-4;
+                  if(t0->par[i]>(mMin[i]+mAmp[i])) t0->par[i]=mMin[i]+mAmp[i];
+                  v0=t0->par[1]*t0->par[2]*t0->par[3];
                }
                break;
             }
@@ -1285,12 +1575,19 @@ void CellExplorer::Evolution(unsigned int ng,const bool randomize,const float f,
             case CUBIC:
                break;
          }
-
-         const float score=Score(*mpPeakList,posTrial->first,mNbSpurious);
+      }
+      // Compute cost for all trials and select best
+      ScoreBatch(*mpPeakList,vTrial,vTrialScore,vThreadPeaks,mNbSpurious,mNbThread);
+      vector<RecUnitCell>::const_iterator posTrial=vTrial.begin();
+      vector<float>::const_iterator posScore=vTrialScore.begin();
+      vector<pair<RecUnitCell,float> >::iterator pos=vRUC.begin();
+      for(;posTrial!=vTrial.end();)
+      {
+         const float score=*posScore;
          if(score > pos->second)
          {
             pos->second=score;
-            const REAL *p0=posTrial->first.par;
+            const REAL *p0=posTrial->par;
             REAL *p1=pos->first.par;
             for(unsigned int k=0;k<mnpar;++k) *p1++ = *p0++;
             if(score>bestScore)
@@ -1305,13 +1602,13 @@ void CellExplorer::Evolution(unsigned int ng,const bool randomize,const float f,
             if(log(rand()/(float)RAND_MAX)>(-(score-pos->second)))
             {
                pos->second=score;
-               const float *p0=posTrial->first.par;
+               const float *p0=posTrial->par;
                float *p1=pos->first.par;
                for(unsigned int k=0;k<mnpar;++k) *p1++ = *p0++;
             }
          }
          */
-         ++pos;++posTrial;
+         ++pos;++posTrial;++posScore;
       }
       if((i%100000)==0)
       {
@@ -1409,6 +1706,8 @@ void CellExplorer::SetCrystalCentering(const CrystalCentering cent)
 
 void CellExplorer::SetD2Error(const float err){mD2Error=err;}
 
+void CellExplorer::SetNbThread(const unsigned int nb){mNbThread=nb;}
+
 const string& CellExplorer::GetClassName() const
 {
    const static string className="CellExplorer";
@@ -1429,12 +1728,9 @@ unsigned int CellExplorer::GetNbLSQFunction() const
 const CrystVector_REAL& CellExplorer::GetLSQCalc(const unsigned int) const
 {
    VFN_DEBUG_ENTRY("CellExplorer::GetLSQCalc()",2)
-   unsigned int j=0;
-   for(vector<PeakList::hkl>::const_iterator pos=mpPeakList->GetPeakList().begin();pos!=mpPeakList->GetPeakList().end();++pos)
-   {
-      if(pos->isIndexed)
-         mCalc(j++)=mRecUnitCell.hkl2d(pos->h,pos->k,pos->l);
-   }
+   mvLSQD2Calc.resize(mLSQHKL.size());
+   mLSQHKL.CalcD2(mRecUnitCell,mvLSQD2Calc.data());
+   for(unsigned long j=0;j<mvLSQD2Calc.size();++j) mCalc(j)=mvLSQD2Calc[j];
    //cout<<__FILE__<<":"<<__LINE__<<"LSQCalc : Score:"<<Score(*mpPeakList,mRecUnitCell,mNbSpurious,false,true,false)<<endl;
    VFN_DEBUG_EXIT("CellExplorer::GetLSQCalc()",2)
    return mCalc;
@@ -1489,6 +1785,7 @@ void CellExplorer::BeginOptimization(const bool allowApproximations, const bool
    mObs.resize(nb-mNbSpurious);
    mWeight.resize(nb-mNbSpurious);
    mDeriv.resize(nb-mNbSpurious);
+   mLSQHKL.clear();
    int j=0;
    float thres=0.0;
    for(vector<PeakList::hkl>::const_iterator pos=mpPeakList->GetPeakList().begin();pos!=mpPeakList->GetPeakList().end();++pos)
@@ -1501,6 +1798,7 @@ void CellExplorer::BeginOptimization(const bool allowApproximations, const bool
    {
       if(pos->isIndexed)
       {
+         mLSQHKL.push_back(pos->h,pos->k,pos->l);
          mObs(j)=pos->d2obs;
          if(mObs(j)>thres) mWeight(j)=1;
          else mWeight(j)=mObs(j)/thres;
@@ -1762,10 +2060,10 @@ bool DichoIndexed(const PeakList &dhkl, const RecUnitCell &par,const RecUnitCell
 }
 
 float CellExplorer::GetBestScore()const{return mBestScore;}
-const std::list<std::pair<RecUnitCell,float> >& CellExplorer::GetSolutions()const {return mvSolution;}
-std::list<std::pair<RecUnitCell,float> >& CellExplorer::GetSolutions() {return mvSolution;}
+const std::vector<std::pair<RecUnitCell,float> >& CellExplorer::GetSolutions()const {return mvSolution;}
+std::vector<std::pair<RecUnitCell,float> >& CellExplorer::GetSolutions() {return mvSolution;}
 
-unsigned int CellExplorer::RDicVol(RecUnitCell par0,RecUnitCell dpar, unsigned int depth,unsigned long &nbCalc,const float minV,const float maxV,vector<unsigned int> vdepth)
+unsigned int CellExplorer::RDicVol(const PeakList &peaks,RecUnitCell par0,RecUnitCell dpar, unsigned int depth,unsigned long &nbCalc,const float minV,const float maxV,const unsigned int *pvdepth)
 {
    static bool localverbose=false;
    if(mlattice==TRICLINIC)
@@ -1818,14 +2116,14 @@ unsigned int CellExplorer::RDicVol(RecUnitCell par0,RecUnitCell dpar, unsigned i
    // In the triclinic case, accept a maximum of 5 missing reflections below the 5th observed line
    if(mlattice==TRICLINIC) maxMissingBelow5=5;
 
-   bool indexed=DichoIndexed(*mpPeakList,par0,dpar,mNbSpurious,localverbose,useStoredHKL,maxMissingBelow5);
+   bool indexed=DichoIndexed(peaks,par0,dpar,mNbSpurious,localverbose,useStoredHKL,maxMissingBelow5);
 
    #if 0
    // If indexation failed but depth>=4, try adding a zero ?
    if( (!indexed) && (depth>=4))
    {//:TODO: Check if this is OK ! Vary value with depth
       dpar.par[0]=.0001;
-      indexed=DichoIndexed(*mpPeakList,par0,dpar,mNbSpurious,false,useStoredHKL,maxMissingBelow5);
+      indexed=DichoIndexed(peaks,par0,dpar,mNbSpurious,false,useStoredHKL,maxMissingBelow5);
       //if(indexed) cout<<"Added zero - SUCCESS !"<<endl;
    }
    #endif
@@ -1834,12 +2132,12 @@ unsigned int CellExplorer::RDicVol(RecUnitCell par0,RecUnitCell dpar, unsigned i
    {
       // Test if two successive lines have been indexed exclusively with the same hkl
       unsigned int nbident=0;
-      for(vector<PeakList::hkl>::const_iterator pos=mpPeakList->GetPeakList().begin();pos!=mpPeakList->GetPeakList().end();)
+      for(vector<PeakList::hkl>::const_iterator pos=peaks.GetPeakList().begin();pos!=peaks.GetPeakList().end();)
       {
          if(pos->vDicVolHKL.size()==1)
          {
             const PeakList::hkl0 h0=pos->vDicVolHKL.front();
-            if(++pos==mpPeakList->GetPeakList().end()) break;
+            if(++pos==peaks.GetPeakList().end()) break;
             if(pos->vDicVolHKL.size()==1)
             {
                const PeakList::hkl0 h1=pos->vDicVolHKL.front();
@@ -1852,13 +2150,11 @@ unsigned int CellExplorer::RDicVol(RecUnitCell par0,RecUnitCell dpar, unsigned i
    }
 
    // if we can zoom in for one parameter directly, we need per-parameter depth
-   if(vdepth.size()==0)
-   {
-      vdepth.resize(mnpar-1);
-      for(vector<unsigned int>::iterator pos=vdepth.begin();pos!=vdepth.end();) *pos++=depth;
-   }
-   else
-      for(vector<unsigned int>::iterator pos=vdepth.begin();pos!=vdepth.end();++pos) if(*pos<depth)*pos=depth;
+   // (on the stack, as this is called for every box of the dichotomy)
+   unsigned int vdepth[6];
+   for(unsigned int i=0;i<(mnpar-1);++i)
+      if((pvdepth==0)||(pvdepth[i]<depth)) vdepth[i]=depth;
+      else vdepth[i]=pvdepth[i];
    #if 1
    if(false)//((useStoredHKL==2)&&(mNbSpurious==0)&&indexed)
    {  // If high-d lines have been associated to a single reflection which is either h00, 0k0 or 00l,
@@ -1866,7 +2162,7 @@ unsigned int CellExplorer::RDicVol(RecUnitCell par0,RecUnitCell dpar, unsigned i
       vector<pair<unsigned int,float> > vq0(3);
       for(unsigned int i=0;i<3;++i) {vq0[i].first=0;vq0[i].second=0.0;}
       RecUnitCell par0orig=par0,dparorig=dpar;
-      for(vector<PeakList::hkl>::const_iterator pos=mpPeakList->GetPeakList().begin();pos!=mpPeakList->GetPeakList().end();++pos)
+      for(vector<PeakList::hkl>::const_iterator pos=peaks.GetPeakList().begin();pos!=peaks.GetPeakList().end();++pos)
       {
          if(pos->vDicVolHKL.size()==1)
          {
@@ -1908,11 +2204,11 @@ unsigned int CellExplorer::RDicVol(RecUnitCell par0,RecUnitCell dpar, unsigned i
       }
       // If all parameters are at a higher depth, jump the global depth immediately
       unsigned int newdepth=40;
-      for(vector<unsigned int>::iterator pos=vdepth.begin();pos!=vdepth.end();++pos) if(*pos<newdepth) newdepth=*pos;
+      for(unsigned int i=0;i<(mnpar-1);++i) if(vdepth[i]<newdepth) newdepth=vdepth[i];
       if(newdepth>depth) depth=newdepth;
       if((vq0[0].first>0)||(vq0[1].first>0)||(vq0[2].first>0))
       {
-         indexed=DichoIndexed(*mpPeakList,par0,dpar,mNbSpurious,false,1,maxMissingBelow5);
+         indexed=DichoIndexed(peaks,par0,dpar,mNbSpurious,false,1,maxMissingBelow5);
          if(false)
          {
             {
@@ -1962,13 +2258,13 @@ unsigned int CellExplorer::RDicVol(RecUnitCell par0,RecUnitCell dpar, unsigned i
    /*
    if((!indexed)&&(depth>=2))
    {
-      vector<float> shifts(mpPeakList->GetPeakList().size());
-      vector<PeakList::hkl>::const_iterator peakpos=mpPeakList->GetPeakList().begin();
+      vector<float> shifts(peaks.GetPeakList().size());
+      vector<PeakList::hkl>::const_iterator peakpos=peaks.GetPeakList().begin();
       for(vector<float>::iterator spos=shifts.begin();spos!=shifts.end();)
       {   *spos++ = peakpos->d2diff * (float)(peakpos->isIndexed&&(!peakpos->isSpurious));peakpos++;}
       sort(shifts.begin(),shifts.end());
-      par0.par[0]=shifts[mpPeakList->GetPeakList().size()/2];//use median value
-      indexed=DichoIndexed(*mpPeakList,par0,dpar,mNbSpurious);
+      par0.par[0]=shifts[peaks.GetPeakList().size()/2];//use median value
+      indexed=DichoIndexed(peaks,par0,dpar,mNbSpurious);
       if(indexed) cout<<"Failed Dicho ? Trying auto-zero shifting :Worked !"<<endl;
    }
    */
@@ -2008,40 +2304,40 @@ unsigned int CellExplorer::RDicVol(RecUnitCell par0,RecUnitCell dpar, unsigned i
             if(vdepth[0]==depth) {par.par[1]=par0.par[1]+i0*dpar.par[1];}
             else {i0=2;}// no need to dicho this parameter which is already at higher depth
             if(mnpar==2)
-               deeperSolutions+=RDicVol(par,dpar, depth+1,nbCalc,minV,maxV,vdepth);
+               deeperSolutions+=RDicVol(peaks,par,dpar, depth+1,nbCalc,minV,maxV,vdepth);
             else
                for(int i1=-1;i1<=1;i1+=2)
                {
                   if(vdepth[1]==depth) {par.par[2]=par0.par[2]+i1*dpar.par[2];}
                   else {i1=2;}// no need to dicho this parameter which is already at higher depth
                   if(mnpar==3)
-                     deeperSolutions+=RDicVol(par,dpar, depth+1,nbCalc,minV,maxV,vdepth);
+                     deeperSolutions+=RDicVol(peaks,par,dpar, depth+1,nbCalc,minV,maxV,vdepth);
                   else
                      for(int i2=-1;i2<=1;i2+=2)
                      {
                         if(vdepth[2]==depth) {par.par[3]=par0.par[3]+i2*dpar.par[3];}
                         else {i2=2;}// no need to dicho this parameter which is already at higher depth
                         if(mnpar==4)
-                           deeperSolutions+=RDicVol(par,dpar, depth+1,nbCalc,minV,maxV,vdepth);
+                           deeperSolutions+=RDicVol(peaks,par,dpar, depth+1,nbCalc,minV,maxV,vdepth);
                         else
                            for(int i3=-1;i3<=1;i3+=2)
                            {
                               if(vdepth[3]==depth)par.par[4]=par0.par[4]+i3*dpar.par[4];
                               else i3=2;
                               if(mnpar==5)
-                                 deeperSolutions+=RDicVol(par,dpar, depth+1,nbCalc,minV,maxV,vdepth);
+                                 deeperSolutions+=RDicVol(peaks,par,dpar, depth+1,nbCalc,minV,maxV,vdepth);
                               else
                                  for(int i4=-1;i4<=1;i4+=2)
                                  {
                                     par.par[5]=par0.par[5]+i4*dpar.par[5];
                                     //if(mnpar==7)
-                                    //   deeperSolutions+=RDicVol(par,dpar, depth+1,nbCalc,minV,maxV,vdepth);
+                                    //   deeperSolutions+=RDicVol(peaks,par,dpar, depth+1,nbCalc,minV,maxV,vdepth);
                                     //else
                                        for(int i5=-1;i5<=1;i5+=2)
                                        {
                                           par.par[6]=par0.par[6]+i5*dpar.par[6];
                                           //if(localverbose) cout<<__FILE__<<":"<<__LINE__<<":"<<par.par[3]<<" +/- "<<dpar.par[3]<<" ("<<vdepth[2]<<")"<<endl;
-                                          deeperSolutions+=RDicVol(par,dpar, depth+1,nbCalc,minV,maxV,vdepth);
+                                          deeperSolutions+=RDicVol(peaks,par,dpar, depth+1,nbCalc,minV,maxV,vdepth);
                                        }
                                  }
                            }
@@ -2051,65 +2347,72 @@ unsigned int CellExplorer::RDicVol(RecUnitCell par0,RecUnitCell dpar, unsigned i
       }
       if((deeperSolutions==0) &&(depth>=mDicVolDepthReport))
       {
-         mRecUnitCell=par0;
-         vector<float> par=mRecUnitCell.DirectUnitCell();
-         float score=Score(*mpPeakList,mRecUnitCell,mNbSpurious,false,true,false);
-         // If we already have enough reports at higher depths (depth+2), don't bother record this one
-         bool report=true;
-         if(depth<(mMaxDicVolDepth-1))
-            if(mvNbSolutionDepth[depth+2]>100)report=false;
-         if(report && (((score>(mMinScoreReport*.5))&&(depth>=mDicVolDepthReport)) || (depth>=mMaxDicVolDepth)))
-         {
-            if(false)//score>) mBestScore//((score>mMinScoreReport)||(depth>=mDicVolDepthReport))
-               cout<<__FILE__<<":"<<__LINE__<<" Depth="<<depth<<" (DIC) ! a="<<par[0]<<", b="<<par[1]<<", c="<<par[2]<<", alpha="
-                  <<par[3]*RAD2DEG<<", beta="<<par[4]*RAD2DEG<<", gamma="<<par[5]*RAD2DEG<<", V="<<par[6]
-                  <<", score="<<score<<endl;
-            this->LSQRefine(5,true,true);
-
-            // Re-score (may change to a better hkl indexing), and refine again
-            score=Score(*mpPeakList,mRecUnitCell,mNbSpurious,false,true,false);
-            this->LSQRefine(5,true,true);
-
-            par=mRecUnitCell.DirectUnitCell();
-            score=Score(*mpPeakList,mRecUnitCell,mNbSpurious,false,true,false);
-            if(  ((score>mMinScoreReport)||(depth>=mDicVolDepthReport))
-               &&((mvSolution.size()<50)||(score>(mBestScore/3)))
-               &&((mvSolution.size()<50)||(score>mMinScoreReport)))
+         // Solutions are refined & recorded one at a time, using the shared peak list
+         // and the least squares object
+         #ifdef _OPENMP
+         #pragma omp critical(CellExplorerDicVolReport)
+         #endif
+         {
+            mRecUnitCell=par0;
+            vector<float> par=mRecUnitCell.DirectUnitCell();
+            float score=Score(*mpPeakList,mRecUnitCell,mNbSpurious,false,true,false);
+            // If we already have enough reports at higher depths (depth+2), don't bother record this one
+            bool report=true;
+            if(depth<(mMaxDicVolDepth-1))
+               if(mvNbSolutionDepth[depth+2]>100)report=false;
+            if(report && (((score>(mMinScoreReport*.5))&&(depth>=mDicVolDepthReport)) || (depth>=mMaxDicVolDepth)))
             {
-               if((score>(mBestScore))||((score>(mBestScore*0.8))&&(mvSolution.size()<50)))//||(rand()%100==0))
+               if(false)//score>) mBestScore//((score>mMinScoreReport)||(depth>=mDicVolDepthReport))
+                  cout<<__FILE__<<":"<<__LINE__<<" Depth="<<depth<<" (DIC) ! a="<<par[0]<<", b="<<par[1]<<", c="<<par[2]<<", alpha="
+                     <<par[3]*RAD2DEG<<", beta="<<par[4]*RAD2DEG<<", gamma="<<par[5]*RAD2DEG<<", V="<<par[6]
+                     <<", score="<<score<<endl;
+               this->LSQRefine(5,true,true);
+
+               // Re-score (may change to a better hkl indexing), and refine again
+               score=Score(*mpPeakList,mRecUnitCell,mNbSpurious,false,true,false);
+               this->LSQRefine(5,true,true);
+
+               par=mRecUnitCell.DirectUnitCell();
+               score=Score(*mpPeakList,mRecUnitCell,mNbSpurious,false,true,false);
+               if(  ((score>mMinScoreReport)||(depth>=mDicVolDepthReport))
+                  &&((mvSolution.size()<50)||(score>(mBestScore/3)))
+                  &&((mvSolution.size()<50)||(score>mMinScoreReport)))
                {
-                  char buf[200];
+                  if((score>(mBestScore))||((score>(mBestScore*0.8))&&(mvSolution.size()<50)))//||(rand()%100==0))
                   {
-                     RecUnitCell parm=par0,parp=par0;
-                     for(unsigned int i=0;i<4;++i) {parm.par[i]-=dpar.par[i];parp.par[i]+=dpar.par[i];}
-                     for(unsigned int i=4;i<7;++i) {parm.par[i]+=dpar.par[i];parp.par[i]-=dpar.par[i];}
-                     vector<float> parmd=parm.DirectUnitCell();
-                     vector<float> parpd=parp.DirectUnitCell();
-                     sprintf(buf,"a=%5.2f-%5.2f b=%5.2f-%5.2f c=%5.2f-%5.2f alpha=%6.2f-%6.2f beta=%6.2f-%6.2f gamma=%6.2f-%6.2f V=%6.2f-%6.2f",
-                              parpd[0],parmd[0],parpd[1],parmd[1],parpd[2],parmd[2],parpd[3]*RAD2DEG,parmd[3]*RAD2DEG,
-                              parpd[4]*RAD2DEG,parmd[4]*RAD2DEG,parpd[5]*RAD2DEG,parmd[5]*RAD2DEG,parpd[6],parmd[6]);
-                     for(unsigned int i = 0; i < depth; ++i)  cout << " ";
-
-                     cout<<buf<<"level="<<depth<<", indexed="<<indexed<<"("<<mvSolution.size()<<" sol.)"<<endl;
-                     sprintf(buf,"a=%7.5f-%7.5f b=%7.5f-%7.5f c=%7.5f-%7.5f alpha=%7.5f-%7.5f beta=%7.5f-%7.5f gamma=%7.5f-%7.5f",
-                              parp.par[1],parm.par[1],parp.par[2],parm.par[2],parp.par[3],parm.par[3],parp.par[4],parm.par[4],
-                              parp.par[5],parm.par[5],parp.par[6],parm.par[6]);
-                     for(unsigned int i = 0; i < depth; ++i)  cout << " ";
-                     cout<<buf<<"level="<<depth<<", indexed="<<indexed<<"("<<mvSolution.size()<<" sol.)"<<endl;
+                     char buf[200];
+                     {
+                        RecUnitCell parm=par0,parp=par0;
+                        for(unsigned int i=0;i<4;++i) {parm.par[i]-=dpar.par[i];parp.par[i]+=dpar.par[i];}
+                        for(unsigned int i=4;i<7;++i) {parm.par[i]+=dpar.par[i];parp.par[i]-=dpar.par[i];}
+                        vector<float> parmd=parm.DirectUnitCell();
+                        vector<float> parpd=parp.DirectUnitCell();
+                        sprintf(buf,"a=%5.2f-%5.2f b=%5.2f-%5.2f c=%5.2f-%5.2f alpha=%6.2f-%6.2f beta=%6.2f-%6.2f gamma=%6.2f-%6.2f V=%6.2f-%6.2f",
+                                 parpd[0],parmd[0],parpd[1],parmd[1],parpd[2],parmd[2],parpd[3]*RAD2DEG,parmd[3]*RAD2DEG,
+                                 parpd[4]*RAD2DEG,parmd[4]*RAD2DEG,parpd[5]*RAD2DEG,parmd[5]*RAD2DEG,parpd[6],parmd[6]);
+                        for(unsigned int i = 0; i < depth; ++i)  cout << " ";
+
+                        cout<<buf<<"level="<<depth<<", indexed="<<indexed<<"("<<mvSolution.size()<<" sol.)"<<endl;
+                        sprintf(buf,"a=%7.5f-%7.5f b=%7.5f-%7.5f c=%7.5f-%7.5f alpha=%7.5f-%7.5f beta=%7.5f-%7.5f gamma=%7.5f-%7.5f",
+                                 parp.par[1],parm.par[1],parp.par[2],parm.par[2],parp.par[3],parm.par[3],parp.par[4],parm.par[4],
+                                 parp.par[5],parm.par[5],parp.par[6],parm.par[6]);
+                        for(unsigned int i = 0; i < depth; ++i)  cout << " ";
+                        cout<<buf<<"level="<<depth<<", indexed="<<indexed<<"("<<mvSolution.size()<<" sol.)"<<endl;
+                     }
+                     sprintf(buf," Solution ? a=%7.3f b=%7.3f c=%7.3f alpha=%7.3f beta=%7.3f gamma=%7.3f V=%8.2f score=%6.2f #%4lu",
+                             par[0],par[1],par[2],par[3]*RAD2DEG,par[4]*RAD2DEG,par[5]*RAD2DEG,par[6],score,mvSolution.size());
+                     cout<<buf<<endl;
+                     mBestScore=score;
+                  }
+                  mvSolution.push_back(make_pair(mRecUnitCell,score));
+                  mvSolution.back().first.mNbSpurious = mNbSpurious;
+                  mvNbSolutionDepth[depth]+=1;
+                  if((mvSolution.size()>1100)&&(rand()%1000==0))
+                  {
+                     cout<<mvSolution.size()<<" solutions ! Redparing..."<<endl;
+                     this->ReduceSolutions(true);// This will update the min report score
+                     cout<<"-> "<<mvSolution.size()<<" remaining"<<endl;
                   }
-                  sprintf(buf," Solution ? a=%7.3f b=%7.3f c=%7.3f alpha=%7.3f beta=%7.3f gamma=%7.3f V=%8.2f score=%6.2f #%4lu",
-                          par[0],par[1],par[2],par[3]*RAD2DEG,par[4]*RAD2DEG,par[5]*RAD2DEG,par[6],score,mvSolution.size());
-                  cout<<buf<<endl;
-                  mBestScore=score;
-               }
-               mvSolution.push_back(make_pair(mRecUnitCell,score));
-               mvSolution.back().first.mNbSpurious = mNbSpurious;
-               mvNbSolutionDepth[depth]+=1;
-               if((mvSolution.size()>1100)&&(rand()%1000==0))
-               {
-                  cout<<mvSolution.size()<<" solutions ! Redparing..."<<endl;
-                  this->ReduceSolutions(true);// This will update the min report score
-                  cout<<"-> "<<mvSolution.size()<<" remaining"<<endl;
                }
             }
          }
@@ -2119,6 +2422,41 @@ unsigned int CellExplorer::RDicVol(RecUnitCell par0,RecUnitCell dpar, unsigned i
    return 0;
 }
 
+void CellExplorer::DicVolBoxes(const vector<pair<RecUnitCell,RecUnitCell> > &vbox,unsigned long &nbCalc,
+                               const float minV,const float maxV)
+{
+   if(vbox.size()==0) return;
+   #ifdef _OPENMP
+   const int nbth=(mNbThread>0) ? (int)mNbThread : omp_get_max_threads();
+   #else
+   const int nbth=1;
+   #endif
+   // Each thread works on its own copy of the peak list, in which the possible
+   // Miller indices of each line are stored during the dichotomy. The copies are made
+   // before the parallel region, as solutions are refined & scored using *mpPeakList.
+   const vector<PeakList> vpeaks(nbth,*mpPeakList);
+   #ifdef _OPENMP
+   #pragma omp parallel num_threads(nbth)
+   #endif
+   {
+      #ifdef _OPENMP
+      const PeakList &peaks=vpeaks[omp_get_thread_num()];
+      #else
+      const PeakList &peaks=vpeaks[0];
+      #endif
+      unsigned long nb=0;
+      #ifdef _OPENMP
+      #pragma omp for schedule(dynamic,1)
+      #endif
+      for(long i=0;i<(long)vbox.size();++i)
+         this->RDicVol(peaks,vbox[i].first,vbox[i].second,0,nb,minV,maxV);
+      #ifdef _OPENMP
+      #pragma omp atomic
+      #endif
+      nbCalc+=nb;
+   }
+}
+
 vector<float> linspace(float min, float max,unsigned int nb)
 {
    vector<float> v(nb);
@@ -2157,7 +2495,7 @@ void CellExplorer::DicVol(const float minScore,const unsigned int minDepth,const
    unsigned long nbCalc=0;
    Chronometer chrono;
    float bestscore=0;
-   list<pair<RecUnitCell,float> >::iterator bestpos;
+   vector<pair<RecUnitCell,float> >::iterator bestpos;
    bool breakDepth=false;
    // In the triclinic case, first try assigning a* and b* from the first reflections
    if(false) //mlattice==TRICLINIC)
@@ -2226,7 +2564,7 @@ void CellExplorer::DicVol(const float minScore,const unsigned int minDepth,const
                         //cout<<endl;
                         //for(int i=0;i<=6;++i)cout<<dpar.par[i]<<",";
                         //cout<<endl;
-                        RDicVol(par0,dpar,0,nbCalc,minv,maxv,vdepth);
+                        RDicVol(*mpPeakList,par0,dpar,0,nbCalc,minv,maxv,&vdepth[0]);
                      }
                   }
                }
@@ -2251,6 +2589,8 @@ void CellExplorer::DicVol(const float minScore,const unsigned int minDepth,const
       float maxv=minv+vstep;
       if(maxv>mVolumeMax)maxv=mVolumeMax;
       cout<<"Starting: V="<<minv<<"->"<<maxv<<endl;
+      // Starting boxes for the dichotomy in this volume range, explored in parallel
+      vector<pair<RecUnitCell,RecUnitCell> > vBox;
       switch(mlattice)
       {
          case TRICLINIC:
@@ -2340,7 +2680,7 @@ void CellExplorer::DicVol(const float minScore,const unsigned int minDepth,const
                               par0.par[5]=p5;
                               par0.par[6]=p6;
 
-                              RDicVol(par0,dpar,0,nbCalc,minv,maxv);
+                              vBox.push_back(make_pair(par0,dpar));
                            }
                         }
                      }
@@ -2391,13 +2731,15 @@ void CellExplorer::DicVol(const float minScore,const unsigned int minDepth,const
                                  parsmalld[4]*RAD2DEG,parlarged[4]*RAD2DEG,parsmalld[5]*RAD2DEG,parlarged[5]*RAD2DEG,parsmalld[6],parlarged[6]);
                         cout<<buf<<"   VM="<<maxv<<", x3="<<x3<<endl;
                         */
-                        RDicVol(par0,dpar,0,nbCalc,minv,maxv);
+                        vBox.push_back(make_pair(par0,dpar));
                      }//x3
                      //if(((parsmalld[6]>maxv)&&(x3==x1))||(parlarged[1]>mLengthMax)) break;
                   }//x2
                }//x1
+               this->DicVolBoxes(vBox,nbCalc,minv,maxv);
+               vBox.clear();
                // Test if we have one solution before going to the next angle range
-               for(list<pair<RecUnitCell,float> >::iterator pos=mvSolution.begin();pos!=mvSolution.end();++pos)
+               for(vector<pair<RecUnitCell,float> >::iterator pos=mvSolution.begin();pos!=mvSolution.end();++pos)
                {
                   const float score=pos->second;//Score(*mpPeakList,pos->first,mNbSpurious);
                   if(score>bestscore) {bestscore=score;bestpos=pos;}
@@ -2425,7 +2767,7 @@ void CellExplorer::DicVol(const float minScore,const unsigned int minDepth,const
                par0.par[1]=1/a;
                par0.par[2]=1/b;
                par0.par[3]=1/c;
-               RDicVol(par0,dpar,0,nbCalc,minv,maxv);
+               vBox.push_back(make_pair(par0,dpar));
                break;
             }
             latstep=(mLengthMax-mLengthMin)/24.999;
@@ -2446,7 +2788,7 @@ void CellExplorer::DicVol(const float minScore,const unsigned int minDepth,const
 
                      const float vmin=x1*x2*x3,vmax=(x1+latstep)*(x2+latstep)*(x3+latstep);
                      if(vmin>maxv) break;
-                     if(vmax>=minv) RDicVol(par0,dpar,0,nbCalc,minv,maxv);
+                     if(vmax>=minv) vBox.push_back(make_pair(par0,dpar));
                   }
                   if((x1*x2*x2)>maxv) break;
                }
@@ -2482,7 +2824,7 @@ void CellExplorer::DicVol(const float minScore,const unsigned int minDepth,const
                   if((parsmalld[6]<maxv)&&(parlarged[6]>minv))
                   {
                      //cout<<buf<<endl;
-                     RDicVol(par0,dpar,0,nbCalc,minv,maxv);
+                     vBox.push_back(make_pair(par0,dpar));
                   }
                   //else cout<<buf<<" BREAK"<<endl;
                }
@@ -2506,7 +2848,7 @@ void CellExplorer::DicVol(const float minScore,const unsigned int minDepth,const
                   vector<float> par=par0.DirectUnitCell();
                   if((par[6]<maxv)&&(par[6]>minv))
                   {
-                     RDicVol(par0,dpar,0,nbCalc,minv,maxv);
+                     vBox.push_back(make_pair(par0,dpar));
                   }
                }
             }
@@ -2539,7 +2881,7 @@ void CellExplorer::DicVol(const float minScore,const unsigned int minDepth,const
                   */
                   if((parsmalld[6]<maxv)&&(parlarged[6]>minv))
                   {
-                     RDicVol(par0,dpar,0,nbCalc,minv,maxv);
+                     vBox.push_back(make_pair(par0,dpar));
                   }
                   if(parsmalld[6]>maxv) break;
                }
@@ -2560,15 +2902,16 @@ void CellExplorer::DicVol(const float minScore,const unsigned int minDepth,const
 
                const float vmin=x1*x1*x1,vmax=(x1+latstep)*(x1+latstep)*(x1+latstep);
                if(vmin>maxv)break;
-               if(vmax>minv) RDicVol(par0,dpar,0,nbCalc,minv,maxv);
+               if(vmax>minv) vBox.push_back(make_pair(par0,dpar));
             }
             break;
          }
       }
+      this->DicVolBoxes(vBox,nbCalc,minv,maxv);
       cout<<"Finished: V="<<minv<<"->"<<maxv<<" A^3, "<<nbCalc
           <<" unit cells tested, "<<nbCalc/chrono.seconds()<<" tests/s,   Elapsed time="
           <<chrono.seconds()<<"s"<<endl;
-      for(list<pair<RecUnitCell,float> >::iterator pos=mvSolution.begin();pos!=mvSolution.end();++pos)
+      for(vector<pair<RecUnitCell,float> >::iterator pos=mvSolution.begin();pos!=mvSolution.end();++pos)
       {
          const float score=pos->second;//Score(*mpPeakList,pos->first,mNbSpurious);
          if(score>bestscore) {bestscore=score;bestpos=pos;}
@@ -2594,7 +2937,7 @@ void CellExplorer::DicVol(const float minScore,const unsigned int minDepth,const
    */
    this->ReduceSolutions(true);
    bestscore=0;bestpos=mvSolution.end();
-   for(list<pair<RecUnitCell,float> >::iterator pos=mvSolution.begin();pos!=mvSolution.end();++pos)
+   for(vector<pair<RecUnitCell,float> >::iterator pos=mvSolution.begin();pos!=mvSolution.end();++pos)
    {
       const float score=Score(*mpPeakList,pos->first,mNbSpurious);
       if(score>bestscore) {bestpos=pos;bestscore=score;}
@@ -2614,77 +2957,174 @@ void CellExplorer::DicVol(const float minScore,const unsigned int minDepth,const
    }
 }
 
-bool SimilarRUC(const RecUnitCell &c0,const RecUnitCell &c1, const float delta=0.005)
+/** Niggli reduction of a direct unit cell (Krivy & Gruber, Acta Cryst A32 (1976) 297,
+* with the tolerance handling of Grosse-Kunstleve et al., Acta Cryst A60 (2004) 1).
+*
+* \param par: a,b,c,alpha,beta,gamma (Angstroems, radians), replaced by the reduced cell.
+* Equivalent lattices described in different settings give the same reduced cell, which
+* can then be compared parameter by parameter.
+*/
+void NiggliReduce(float *par)
+{
+   double A=par[0]*par[0],B=par[1]*par[1],C=par[2]*par[2];
+   double xi=2*par[1]*par[2]*cos(par[3]);
+   double eta=2*par[0]*par[2]*cos(par[4]);
+   double zeta=2*par[0]*par[1]*cos(par[5]);
+   const double eps=1e-5*pow(par[0]*par[1]*par[2],2/3.);
+   for(unsigned int iter=0;iter<100;++iter)
+   {
+      // A1
+      if((A>(B+eps))||((fabs(A-B)<eps)&&(fabs(xi)>(fabs(eta)+eps))))
+      {
+         swap(A,B);swap(xi,eta);
+      }
+      // A2
+      if((B>(C+eps))||((fabs(B-C)<eps)&&(fabs(eta)>(fabs(zeta)+eps))))
+      {
+         swap(B,C);swap(eta,zeta);
+         continue;
+      }
+      // A3 & A4: all angles acute or all non-acute
+      const int l=(xi<-eps)?-1:((xi>eps)?1:0);
+      const int m=(eta<-eps)?-1:((eta>eps)?1:0);
+      const int n=(zeta<-eps)?-1:((zeta>eps)?1:0);
+      if((l*m*n)==1)
+      {
+         xi=fabs(xi);eta=fabs(eta);zeta=fabs(zeta);
+      }
+      else
+      {
+         int i=1,j=1,k=1;
+         int *p=0;
+         if(l==1) i=-1; else if(l==0) p=&i;
+         if(m==1) j=-1; else if(m==0) p=&j;
+         if(n==1) k=-1; else if(n==0) p=&k;
+         if(((i*j*k)<0)&&(p!=0)) *p=-1;
+         xi*=i;eta*=j;zeta*=k;
+      }
+      // A5
+      if((fabs(xi)>(B+eps))||((fabs(xi-B)<eps)&&((2*eta)<(zeta-eps)))||((fabs(xi+B)<eps)&&(zeta<-eps)))
+      {
+         const double s=(xi>0)?1:-1;
+         C=B+C-xi*s;
+         eta=eta-zeta*s;
+         xi=xi-2*B*s;
+         continue;
+      }
+      // A6
+      if((fabs(eta)>(A+eps))||((fabs(eta-A)<eps)&&((2*xi)<(zeta-eps)))||((fabs(eta+A)<eps)&&(zeta<-eps)))
+      {
+         const double s=(eta>0)?1:-1;
+         C=A+C-eta*s;
+         xi=xi-zeta*s;
+         eta=eta-2*A*s;
+         continue;
+      }
+      // A7
+      if((fabs(zeta)>(A+eps))||((fabs(zeta-A)<eps)&&((2*xi)<(eta-eps)))||((fabs(zeta+A)<eps)&&(eta<-eps)))
+      {
+         const double s=(zeta>0)?1:-1;
+         B=A+B-zeta*s;
+         xi=xi-eta*s;
+         zeta=zeta-2*A*s;
+         continue;
+      }
+      // A8
+      const double sum=xi+eta+zeta+A+B;
+      if((sum<-eps)||((fabs(sum)<eps)&&((2*(A+eta)+zeta)>eps)))
+      {
+         C=A+B+C+xi+eta+zeta;
+         xi=2*B+xi+zeta;
+         eta=2*A+eta+zeta;
+         continue;
+      }
+      break;
+   }
+   par[0]=sqrt(A);par[1]=sqrt(B);par[2]=sqrt(C);
+   const double c[3]={xi/(2*par[1]*par[2]),eta/(2*par[0]*par[2]),zeta/(2*par[0]*par[1])};
+   for(unsigned int i=0;i<3;++i) par[3+i]=acos(c[i]>1 ? 1 : (c[i]<-1 ? -1 : c[i]));
+}
+
+/// Compare two Niggli-reduced cells: true if the average difference of the
+/// lattice parameters (Angstroems and radians) is below delta
+bool SimilarReducedCell(const float *par0,const float *par1, const float delta=0.005)
 {
-   if(c0.mNbSpurious != c1.mNbSpurious) return false;
-   vector<float> par0=c0.DirectUnitCell();
-   vector<float> par1=c1.DirectUnitCell();
    float diff=0;
-   for(unsigned int i=0;i<6;++i) diff += abs(par0[i]-par1[i]);
+   for(unsigned int i=0;i<6;++i) diff += fabs(par0[i]-par1[i]);
    return (diff/6)<delta;
 }
 
-bool compareRUCScore(std::pair<RecUnitCell,float> &p1, std::pair<RecUnitCell,float> &p2)
+bool compareRUCScore(const std::pair<RecUnitCell,float> &p1, const std::pair<RecUnitCell,float> &p2)
+{
+   return p1.second > p2.second;
+}
+
+/// Order solutions by decreasing symmetry, then decreasing score
+bool compareRUCLatticeScore(const std::pair<RecUnitCell,float> &p1, const std::pair<RecUnitCell,float> &p2)
 {
+   if(p1.first.mlattice!=p2.first.mlattice) return p1.first.mlattice > p2.first.mlattice;
    return p1.second > p2.second;
 }
 
 void CellExplorer::ReduceSolutions(const bool updateReportThreshold)
 {
    const bool verbose=false;
-   std::list<std::pair<RecUnitCell,float> > vSolution2;
    // TODO: take into account number of spurious lines for cutoff value.
    // keep only solutions above mBestScore/5
-   for(list<pair<RecUnitCell,float> >::iterator pos=mvSolution.begin();pos!=mvSolution.end();)
-   {
-      if(pos->second<(mBestScore/5)) pos=mvSolution.erase(pos);
-      else ++pos;
-   }
+   std::vector<std::pair<RecUnitCell,float> > vSolution;
+   vSolution.reserve(mvSolution.size());
+   for(vector<pair<RecUnitCell,float> >::const_iterator pos=mvSolution.begin();pos!=mvSolution.end();++pos)
+      if(pos->second>=(mBestScore/5)) vSolution.push_back(*pos);
    if(updateReportThreshold&& ((mBestScore/5)>mMinScoreReport))
    {
       cout<<"CellExplorer::ReduceSolutions(): update threshold for report from "
           <<mMinScoreReport<<" to "<<mBestScore/5<<endl;
       mMinScoreReport=mBestScore/5;
    }
-
-   while(mvSolution.size()>0)
+   // Solutions are examined by decreasing symmetry and score, so that the first solution of
+   // a group of similar ones is kept (highest symmetry, and best score for that symmetry).
+   stable_sort(vSolution.begin(),vSolution.end(),compareRUCLatticeScore);
+
+   // Kept solutions are hashed on a grid of their reduced a,b,c parameters. Two similar cells
+   // differ by less than 6*delta on each parameter, so only neighbouring grid cells are searched.
+   const float delta=0.005;
+   const float gridStep=6*delta;
+   typedef pair<long,pair<long,long> > GridKey;
+   std::map<GridKey,vector<unsigned long> > grid;
+   std::vector<float> vReduced;// 6 parameters for each kept solution
+   mvSolution.clear();
+   for(vector<pair<RecUnitCell,float> >::const_iterator pos=vSolution.begin();pos!=vSolution.end();++pos)
    {
-      vSolution2.push_back(mvSolution.front());
-      mvSolution.pop_front();
-      vector<float> par=vSolution2.back().first.DirectUnitCell();
-      if(verbose)
-         cout<<__FILE__<<":"<<__LINE__<<" SOLUTION: a="<<par[0]<<", b="<<par[1]<<", c="<<par[2]
-               <<", alpha="<<par[3]*RAD2DEG<<", beta="<<par[4]*RAD2DEG<<", gamma="<<par[5]*RAD2DEG
-               <<", V="<<par[6]<<", score="<<vSolution2.back().second<<",   SIMILAR TO:"<<endl;
-      for(list<pair<RecUnitCell,float> >::iterator pos=mvSolution.begin();pos!=mvSolution.end();)
-      {
-         if(SimilarRUC(pos->first,vSolution2.back().first))
-         {
-            par=pos->first.DirectUnitCell();
-            if(verbose)
-               cout<<__FILE__<<":"<<__LINE__<<"        1: a="<<par[0]<<", b="<<par[1]<<", c="<<par[2]
-                     <<", alpha="<<par[3]*RAD2DEG<<", beta="<<par[4]*RAD2DEG<<", gamma="<<par[5]*RAD2DEG
-                     <<", V="<<par[6]<<", score="<<pos->second<<"       ("<<mvSolution.size()<<")"<<endl;
-            if(vSolution2.back().first.mlattice==pos->first.mlattice)
+      const vector<float> par=pos->first.DirectUnitCell();
+      float red[6];
+      for(unsigned int i=0;i<6;++i) red[i]=par[i];
+      NiggliReduce(red);
+      const long ia=(long)floor(red[0]/gridStep),ib=(long)floor(red[1]/gridStep),ic=(long)floor(red[2]/gridStep);
+      bool similar=false;
+      for(long i=ia-1;(i<=ia+1)&&(!similar);++i)
+         for(long j=ib-1;(j<=ib+1)&&(!similar);++j)
+            for(long k=ic-1;(k<=ic+1)&&(!similar);++k)
             {
-               if(pos->second>vSolution2.back().second) vSolution2.back()=*pos;
+               std::map<GridKey,vector<unsigned long> >::const_iterator cell=grid.find(make_pair(i,make_pair(j,k)));
+               if(cell==grid.end()) continue;
+               for(vector<unsigned long>::const_iterator idx=cell->second.begin();idx!=cell->second.end();++idx)
+                  if(  (mvSolution[*idx].first.mNbSpurious==pos->first.mNbSpurious)
+                     &&SimilarReducedCell(&vReduced[6* *idx],red,delta))
+                  {
+                     similar=true;
+                     if(verbose)
+                        cout<<__FILE__<<":"<<__LINE__<<" SOLUTION: a="<<par[0]<<", b="<<par[1]<<", c="<<par[2]
+                            <<", alpha="<<par[3]*RAD2DEG<<", beta="<<par[4]*RAD2DEG<<", gamma="<<par[5]*RAD2DEG
+                            <<", V="<<par[6]<<", score="<<pos->second<<" similar to #"<<*idx<<endl;
+                     break;
+                  }
             }
-            else if(vSolution2.back().first.mlattice<pos->first.mlattice) vSolution2.back()=*pos;
-            pos=mvSolution.erase(pos);
-         }
-         else
-         {
-            par=pos->first.DirectUnitCell();
-            if(verbose)
-               cout<<__FILE__<<":"<<__LINE__<<"        0: a="<<par[0]<<", b="<<par[1]<<", c="<<par[2]
-                     <<", alpha="<<par[3]*RAD2DEG<<", beta="<<par[4]*RAD2DEG<<", gamma="<<par[5]*RAD2DEG
-                     <<", V="<<par[6]<<", score="<<pos->second<<"       ("<<mvSolution.size()<<")"<<endl;
-            ++pos;
-         }
-      }
+      if(similar) continue;
+      grid[make_pair(ia,make_pair(ib,ic))].push_back(mvSolution.size());
+      for(unsigned int i=0;i<6;++i) vReduced.push_back(red[i]);
+      mvSolution.push_back(*pos);
    }
-   mvSolution=vSolution2;
-   mvSolution.sort(compareRUCScore);
+   stable_sort(mvSolution.begin(),mvSolution.end(),compareRUCScore);
 
    // keep at most 100 solutions, update mDicVolDepthReport and mMinScoreReport if necessary
    if(mvSolution.size()>100)
@@ -2828,4 +3268,133 @@ void CellExplorer::Init()
    }
 }
 
+DicVolMonitor::~DicVolMonitor(){}
+
+bool DicVolMonitor::BeginSystem(const CellExplorer &cx,const CrystalSystem system,
+                                const CrystalCentering centering,const unsigned int nbSpurious,
+                                const float minv,const float maxv,const float lengthmax)
+{return true;}
+
+void DicVolMonitor::EndSystem(const CellExplorer &cx){}
+
+void CellExplorer::DicVolAllSystems(const unsigned int maxNbSpurious,const bool tryCentered,
+                                    const bool weakDiffraction,const bool continueOnSolution,
+                                    DicVolMonitor *pMonitor)
+{
+   unsigned int nb=mpPeakList->GetPeakList().size();
+   if(nb>20) nb=20;// Just use 20 - beyond that we probably have a lot of weak peaks
+   if(nb<2) throw ObjCrystException("CellExplorer::DicVolAllSystems(): not enough peaks to index");
+   // Estimate volume from number of peaks at a given dmin
+   const float dmin=mpPeakList->GetPeakList()[nb-1].dobs;
+   const float dmax=mpPeakList->GetPeakList()[0].dobs/10;//assume there are no peaks at lower resolution
+   const float weak_f=weakDiffraction ? 0.5 : 1.0;
+   const float        stopOnScore=50, reportOnScore=10;
+   const unsigned int stopOnDepth=6+int(continueOnSolution),   reportOnDepth=4;
+
+   // Crystal systems and centerings, in the order used for the search
+   const CrystalSystem vsystem[6]={CUBIC,TETRAGONAL,RHOMBOEDRAL,HEXAGONAL,ORTHOROMBIC,MONOCLINIC};
+   const unsigned int vnbcent[6]={3,2,1,1,6,4};
+   const CrystalCentering vcent[6][6]={{LATTICE_P,LATTICE_I,LATTICE_F},
+                                       {LATTICE_P,LATTICE_I},
+                                       {LATTICE_P},
+                                       {LATTICE_P},
+                                       {LATTICE_P,LATTICE_I,LATTICE_A,LATTICE_B,LATTICE_C,LATTICE_F},
+                                       {LATTICE_P,LATTICE_C,LATTICE_I,LATTICE_A}};
+   bool aborted=false;
+   for(unsigned int nbSpurious=0;(nbSpurious<=maxNbSpurious)&&(!aborted);++nbSpurious)
+   {
+      this->SetNbSpurious(nbSpurious);
+      for(unsigned int i=0;(i<6)&&(!aborted);++i)
+         for(unsigned int j=0;j<vnbcent[i];++j)
+         {
+            if((i>0)&&(mBestScore>stopOnScore)&&(!continueOnSolution)) break;
+            const float minv=EstimateCellVolume(dmin,dmax,nb,vsystem[i],vcent[i][j],1.5);
+            const float maxv=EstimateCellVolume(dmin,dmax,nb,vsystem[i],vcent[i][j],0.4*weak_f);
+            float lengthmax=pow(maxv,(float)(1/3.0))*3;
+            if(lengthmax<25)lengthmax=25;
+            if(pMonitor!=0)
+               if(!pMonitor->BeginSystem(*this,vsystem[i],vcent[i][j],nbSpurious,minv,maxv,lengthmax))
+               {
+                  aborted=true;
+                  break;
+               }
+            this->SetVolumeMinMax(minv,maxv);
+            this->SetLengthMinMax(3,lengthmax);
+            this->SetCrystalSystem(vsystem[i]);
+            this->SetCrystalCentering(vcent[i][j]);
+            this->DicVol(reportOnScore,reportOnDepth,stopOnScore,stopOnDepth);
+            if(pMonitor!=0) pMonitor->EndSystem(*this);
+            if(!tryCentered) break;
+         }
+      if(mBestScore>=stopOnScore) break;
+   }
+   // Merge similar solutions from the different crystal systems
+   this->ReduceSolutions();
+}
+
+string GetHighestSymmetrySpaceGroup(const CrystalSystem system,const CrystalCentering centering)
+{
+   switch(centering)
+   {
+      case LATTICE_P:
+      {
+         switch(system)
+         {
+            case TRICLINIC:return "P-1";
+            case MONOCLINIC:return "P2/m";
+            case ORTHOROMBIC:return "Pmmm";
+            case HEXAGONAL:return "P6/mmm";
+            case RHOMBOEDRAL:return "R-3m";
+            case TETRAGONAL:return "P4/mmm";
+            case CUBIC:return "Pm-3m";
+         }
+         break;
+      }
+      case LATTICE_I:
+      {
+         switch(system)
+         {
+            case MONOCLINIC:return "I2/m";
+            case ORTHOROMBIC:return "I222";
+            case TETRAGONAL:return "I4/mmm";
+            case CUBIC:return "Im-3m";
+            default:break;
+         }
+         break;
+      }
+      case LATTICE_A:
+      {
+         switch(system)
+         {
+            case MONOCLINIC:return "A2/m";
+            case ORTHOROMBIC:return "Amm2";
+            default:break;
+         }
+         break;
+      }
+      case LATTICE_C:
+      {
+         switch(system)
+         {
+            case MONOCLINIC:return "C2/m";
+            case ORTHOROMBIC:return "Cmmm";
+            default:break;
+         }
+         break;
+      }
+      case LATTICE_F:
+      {
+         switch(system)
+         {
+            case ORTHOROMBIC:return "Fmmm";
+            case CUBIC:return "Fm-3m";
+            default:break;
+         }
+         break;
+      }
+      default:break;
+   }
+   return "";
+}
+
 }//namespace
@@ -77,6 +77,13 @@ class RecUnitCell
       ///
       /// Used for DicVol algorithm
       void hkl2d_delta(const float h,const float k,const float l,const RecUnitCell &delta, float & dmin, float &dmax) const;
+      /** Coefficients of the quadratic form giving d*^2 for any crystal system:
+      * d*_hkl^2 = q[0] + q[1] h^2 + q[2] k^2 + q[3] l^2 + q[4] hk + q[5] kl + q[6] hl
+      *
+      * This avoids the switch over crystal systems in hkl2d() when computing
+      * d*^2 for many reflections.
+      */
+      void GetQuadraticForm(float *q) const;
       /** Compute real space unit cell from reciprocal one
       *
       *\param equiv: if true, return real unit cell \e equivalent to the one computed from the reciprocal one,
@@ -109,6 +116,73 @@ class RecUnitCell
       unsigned int mNbSpurious;
 };
 
+/** Packed list of Miller indices, to compute d*^2 for many reflections at once.
+*
+* The products h^2, k^2, l^2, hk, kl and hl are stored in separate arrays, so that
+* d*^2 for all reflections is the product of this (N x 6) matrix with the quadratic
+* form of the reciprocal unit cell (see RecUnitCell::GetQuadraticForm()).
+*
+* The table can also hold the enumeration of all unique reflections for a given
+* crystal system and centering (see BuildEnumeration() and GetHKLEnumerationTable()).
+*/
+class PackedHKLTable
+{
+   public:
+      PackedHKLTable();
+      void clear();
+      void reserve(const unsigned long nb);
+      void push_back(const int h,const int k,const int l);
+      unsigned long size()const;
+      /// Compute d*^2 for all reflections, stored in d2 (which must have size() elements)
+      void CalcD2(const RecUnitCell &ruc,float *d2)const;
+      /** Compute d*^2 for reflections [first;last[, from the quadratic form q
+      * (see RecUnitCell::GetQuadraticForm()). d2 must have (last-first) elements.
+      */
+      void CalcD2(const float *q,const unsigned long first,const unsigned long last,float *d2)const;
+      /** Fill the table with all unique reflections allowed for this crystal system and
+      * centering, with |h|,|k|,|l|<=maxIndex, using the same conventions as the
+      * enumeration in Score() (h>=0, and k,l>=0 unless negative values are needed).
+      *
+      * Reflections are sorted by h, then |k|, then |l|, so that all reflections within
+      * smaller maximum indices are found in contiguous blocks, see GetBlock().
+      */
+      void BuildEnumeration(const CrystalSystem system,const CrystalCentering centering,
+                            const unsigned int maxIndex);
+      /** Same as the above, but only with |h|<=hmax, |k|<=kmax, |l|<=lmax, and if q is not null,
+      * only the reflections with d*^2<=d2max for the quadratic form q (in the same order).
+      * GetBlock() can only be used if q is null and hmax=kmax=lmax.
+      */
+      void BuildEnumeration(const CrystalSystem system,const CrystalCentering centering,
+                            const unsigned int hmax,const unsigned int kmax,const unsigned int lmax,
+                            const float *q,const float d2max);
+      /// Maximum absolute value of the Miller indices, after BuildEnumeration()
+      unsigned int GetMaxIndex()const;
+      /** Get the range [first;last[ of reflections with this value of h, this absolute value
+      * of k, and |l|<=lmax. Only valid after BuildEnumeration(), with h,absk,lmax<=GetMaxIndex().
+      */
+      void GetBlock(const unsigned int h,const unsigned int absk,const unsigned int lmax,
+                    unsigned long &first,unsigned long &last)const;
+      /// Miller indices
+      std::vector<int> mvH,mvK,mvL;
+      /// Products of Miller indices
+      std::vector<float> mvHH,mvKK,mvLL,mvHK,mvKL,mvHL;
+   private:
+      /// Maximum absolute value of the Miller indices in the enumeration
+      unsigned int mMaxIndex;
+      /// Index of the first reflection for each h, |k| and |l| in the enumeration
+      std::vector<unsigned long> mvBlock;
+};
+
+/** Get the (shared) table of all unique reflections for a crystal system and centering,
+* with |h|,|k|,|l|<=maxIndex (see PackedHKLTable::BuildEnumeration()).
+*
+* Tables are built on the first request and kept until the end of the program. The maximum
+* index of the returned table can be larger than requested. This function is thread-safe,
+* and the returned table must not be modified.
+*/
+const PackedHKLTable& GetHKLEnumerationTable(const CrystalSystem system,const CrystalCentering centering,
+                                             const unsigned int maxIndex);
+
 /** Class to store positions of observed reflections.
 *
 *
@@ -201,13 +275,61 @@ class PeakList
       /// Full list of calculated HKL positions for a given solution, up to a given resolution
       /// After finding a candidate solution, use score with pPredictedHKL=&mvPredictedHKL
       mutable list<hkl> mvPredictedHKL;
+      /// Work array for Score(): calculated d*^2 for all reflections, with their index in the HKL enumeration table
+      mutable std::vector<std::pair<float,unsigned long> > mvScoreD2;
+      /// Work array for Score(): calculated d*^2 for one block of the HKL enumeration table
+      mutable std::vector<float> mvScoreBlockD2;
 };
 
-/// Compute score for a candidate RecUnitCell and a PeakList
+/** Compute score for a candidate RecUnitCell and a PeakList
+*
+* Calculated reflections are taken from the shared tables (GetHKLEnumerationTable()),
+* or enumerated directly for cells requiring Miller indices larger than 64.
+*/
 float Score(const PeakList &dhkl, const RecUnitCell &ruc, const unsigned int nbSpurious=0,
             const bool verbose=false,const bool storehkl=false,
             const bool storePredictedHKL=false);
 
+/** Compute the score for a batch of candidate RecUnitCell, using the same PeakList.
+*
+* Each cell is scored independently (the Miller indices are not stored). When compiled
+* with OpenMP, the cells are distributed between threads, each using its own copy of
+* the PeakList (with a single thread, the original PeakList is used directly).
+* The spurious-line statistics are accumulated in the original PeakList.
+* \param vscore: the computed scores, resized to the number of cells.
+* \param nbThread: number of threads to use, or 0 to use the OpenMP default.
+*/
+void ScoreBatch(const PeakList &dhkl, const std::vector<RecUnitCell> &vruc, std::vector<float> &vscore,
+                const unsigned int nbSpurious=0,const unsigned int nbThread=0);
+
+/** Same as the above, but the per-thread copies of the PeakList are kept in \b vpeaks
+* so that they can be re-used by successive calls with the same PeakList (e.g. for
+* each generation of CellExplorer::Evolution()). \b vpeaks should be empty on the
+* first call, and cleared if the PeakList changes.
+*/
+void ScoreBatch(const PeakList &dhkl, const std::vector<RecUnitCell> &vruc, std::vector<float> &vscore,
+                std::vector<PeakList> &vpeaks,const unsigned int nbSpurious=0,const unsigned int nbThread=0);
+
+class CellExplorer;
+
+/** Monitor the progress of CellExplorer::DicVolAllSystems(), e.g. to report it from
+* the graphical interface. The default implementation does nothing.
+*/
+class DicVolMonitor
+{
+   public:
+      virtual ~DicVolMonitor();
+      /** Called before the search in each crystal system and centering, with the estimated
+      * volume range and maximum cell length.
+      * \return false to stop the search.
+      */
+      virtual bool BeginSystem(const CellExplorer &cx,const CrystalSystem system,
+                               const CrystalCentering centering,const unsigned int nbSpurious,
+                               const float minv,const float maxv,const float lengthmax);
+      /// Called after the search in each crystal system and centering
+      virtual void EndSystem(const CellExplorer &cx);
+};
+
 /** Algorithm class to find the correct indexing from observed peak positions.
 *
 */
@@ -225,6 +347,9 @@ class CellExplorer:public RefinableObj
       void SetMinMaxZeroShift(const float min,const float max);
       void SetCrystalSystem(const CrystalSystem system);
       void SetCrystalCentering(const CrystalCentering cent);
+      /// Number of threads used for the DicVol and Evolution searches, when compiled
+      /// with OpenMP (0: use the OpenMP default)
+      void SetNbThread(const unsigned int nb);
       virtual const string& GetClassName() const;
       virtual const string& GetName() const;
       virtual void Print() const;
@@ -247,14 +372,42 @@ class CellExplorer:public RefinableObj
       * the threshold above which solutions are reported will be updated to get less solutions.
       */
       void ReduceSolutions(const bool updateReportThreshold=false);
+      /** Run the DicVol algorithm for all crystal systems, from cubic to monoclinic,
+      * using the "quick" strategy of the graphical interface: the volume and length
+      * ranges are estimated from the peak list (at most the first 20 peaks), and the
+      * search stops as soon as one solution has a score above 50.
+      *
+      * \param maxNbSpurious: if no solution is found, try again allowing for up to
+      * this number of spurious lines.
+      * \param tryCentered: if true, also try the centered lattices.
+      * \param weakDiffraction: if true, allow for larger volumes (weakly diffracting sample).
+      * \param continueOnSolution: if true, explore all crystal systems even after finding a solution.
+      * \param pMonitor: if not null, notified before and after the search in each crystal system.
+      */
+      void DicVolAllSystems(const unsigned int maxNbSpurious=0,const bool tryCentered=true,
+                            const bool weakDiffraction=false,const bool continueOnSolution=false,
+                            DicVolMonitor *pMonitor=0);
       float GetBestScore()const;
-      const std::list<std::pair<RecUnitCell,float> >& GetSolutions()const;
-      std::list<std::pair<RecUnitCell,float> >& GetSolutions();
+      const std::vector<std::pair<RecUnitCell,float> >& GetSolutions()const;
+      std::vector<std::pair<RecUnitCell,float> >& GetSolutions();
    private:
-      unsigned int RDicVol(RecUnitCell uc0, RecUnitCell uc1, unsigned int depth,unsigned long &nbCalc,const float minV,const float maxV,vector<unsigned int> vdepth=vector<unsigned int>());
+      /** Recursive dichotomy search for the DicVol algorithm.
+      *
+      * \param peaks: the peak list used to store the possible Miller indices during the
+      * search. Each thread must use its own copy.
+      * \param pvdepth: the depth reached for each parameter (mnpar-1 values), if some
+      * have been determined at a higher depth. If null, all are at the current depth.
+      */
+      unsigned int RDicVol(const PeakList &peaks,RecUnitCell uc0, RecUnitCell uc1, unsigned int depth,unsigned long &nbCalc,const float minV,const float maxV,const unsigned int *pvdepth=0);
+      /** Run RDicVol() for a list of starting boxes (center,half-width of the reciprocal
+      * unit cell parameters). If compiled with OpenMP, the boxes are explored in parallel,
+      * with a dynamic scheduling. Solutions are recorded one at a time.
+      */
+      void DicVolBoxes(const std::vector<std::pair<RecUnitCell,RecUnitCell> > &vbox,unsigned long &nbCalc,
+                       const float minV,const float maxV);
       void Init();
       /// Max number of obs reflections to use
-      std::list<std::pair<RecUnitCell,float> > mvSolution;
+      std::vector<std::pair<RecUnitCell,float> > mvSolution;
       unsigned int mnpar;
       const PeakList *mpPeakList;
       float mLengthMin,mLengthMax;
@@ -279,6 +432,10 @@ class CellExplorer:public RefinableObj
       mutable CrystVector_REAL mDeriv;
       /// Reciprocal unit cell used for least squares refinement
       RecUnitCell mRecUnitCell;
+      /// Miller indices of the indexed lines used for least squares refinement
+      PackedHKLTable mLSQHKL;
+      /// Calculated d*^2 of the indexed lines, for least squares refinement
+      mutable std::vector<float> mvLSQD2Calc;
       /// Current best score
       float mBestScore;
       /// Number of solutions found during dicvol search, at each depth.
@@ -290,8 +447,15 @@ class CellExplorer:public RefinableObj
       mutable float mCosAngMax;
       /// Number of exceptions caught during LSQ, in a given search - above 20 LSQ is disabled
       unsigned int mNbLSQExcept;
+      /// Number of threads to use (0: OpenMP default)
+      unsigned int mNbThread;
 };
 
 
+/// Hermann-Mauguin symbol of the highest symmetry spacegroup for a given crystal system
+/// and lattice centering (e.g. "Pm-3m" for CUBIC and LATTICE_P), or an empty string if
+/// the combination is not handled.
+std::string GetHighestSymmetrySpaceGroup(const CrystalSystem system,const CrystalCentering centering);
+
 }//namespace
 #endif
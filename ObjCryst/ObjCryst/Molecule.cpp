@@ -44,7 +44,9 @@
    #include "ObjCryst/wxCryst/wxMolecule.h"
 #endif
 
-//#include <xmmintrin.h>
+#ifdef HAVE_SSE_MATHFUN
+#include "ObjCryst/Quirks/sse_mathfun.h"
+#endif
 
 // Try new approach for rigid bodies ?
 #define RIGID_BODY_STRICT_EXPERIMENTAL
@@ -151,6 +153,187 @@ REAL GetDihedralAngle(const MolAtom &at1,const MolAtom &at2,const MolAtom &at3,c
 }
 
 
+/** Bond length between two atoms, using the Molecule coordinate arrays (indexed
+* by MolAtom::GetIndex()). If d is not null, the derivatives of the length
+* relative to the coordinates of each atom are stored in d[0] and d[1].
+*/
+REAL CalcBondLength(const REAL *px,const REAL *py,const REAL *pz,
+                    const unsigned long i1,const unsigned long i2,XYZ *d)
+{
+   const REAL x=px[i2]-px[i1];
+   const REAL y=py[i2]-py[i1];
+   const REAL z=pz[i2]-pz[i1];
+   const REAL length=sqrt(abs(x*x+y*y+z*z));
+   if(d!=0)
+   {
+      const REAL tmp2=1/(length+1e-10);
+      d[0].x=-x*tmp2;
+      d[0].y=-y*tmp2;
+      d[0].z=-z*tmp2;
+
+      d[1].x=-d[0].x;
+      d[1].y=-d[0].y;
+      d[1].z=-d[0].z;
+   }
+   return length;
+}
+
+/** Bond angle (at2 being the central atom), using the Molecule coordinate arrays.
+* If d is not null, the derivatives of the angle relative to the coordinates
+* of each atom are stored in d[0..2].
+*/
+REAL CalcBondAngle(const REAL *px,const REAL *py,const REAL *pz,
+                   const unsigned long i1,const unsigned long i2,const unsigned long i3,XYZ *d)
+{
+   const REAL x21=px[i1]-px[i2];
+   const REAL y21=py[i1]-py[i2];
+   const REAL z21=pz[i1]-pz[i2];
+   const REAL x23=px[i3]-px[i2];
+   const REAL y23=py[i3]-py[i2];
+   const REAL z23=pz[i3]-pz[i2];
+
+   const REAL n1=sqrt(abs(x21*x21+y21*y21+z21*z21));
+   const REAL n3=sqrt(abs(x23*x23+y23*y23+z23*z23));
+   const REAL p=x21*x23+y21*y23+z21*z23;
+
+   const REAL a0=p/(n1*n3+1e-10);
+   REAL angle;
+   if(a0>=1)  angle=0;
+   else
+   {
+      if(a0<=-1) angle=M_PI;
+      else angle=acos(a0);
+   }
+
+   if(d!=0)
+   {
+      const REAL s=1/(sqrt(1-a0*a0+1e-6));
+      const REAL s0=-s/(n1*n3+1e-10);
+      const REAL s1= s*p/(n3*n1*n1*n1+1e-10);
+      const REAL s3= s*p/(n1*n3*n3*n3+1e-10);
+      d[0].x=s0*x23+s1*x21;
+      d[0].y=s0*y23+s1*y21;
+      d[0].z=s0*z23+s1*z21;
+
+      d[2].x=s0*x21+s3*x23;
+      d[2].y=s0*y21+s3*y23;
+      d[2].z=s0*z21+s3*z23;
+
+      d[1].x=-(d[0].x+d[2].x);
+      d[1].y=-(d[0].y+d[2].y);
+      d[1].z=-(d[0].z+d[2].z);
+   }
+   return angle;
+}
+
+/** Dihedral angle, using the Molecule coordinate arrays. If d is not null, the
+* derivatives of the angle relative to the coordinates of each atom are stored
+* in d[0..3].
+*/
+REAL CalcDihedralAngle(const REAL *px,const REAL *py,const REAL *pz,
+                       const unsigned long i1,const unsigned long i2,
+                       const unsigned long i3,const unsigned long i4,XYZ *d)
+{
+   const REAL x21=px[i1]-px[i2];
+   const REAL y21=py[i1]-py[i2];
+   const REAL z21=pz[i1]-pz[i2];
+
+   const REAL x34=px[i4]-px[i3];
+   const REAL y34=py[i4]-py[i3];
+   const REAL z34=pz[i4]-pz[i3];
+
+   const REAL x23=px[i3]-px[i2];
+   const REAL y23=py[i3]-py[i2];
+   const REAL z23=pz[i3]-pz[i2];
+
+   // v21 x v23
+   const REAL x123= y21*z23-z21*y23;
+   const REAL y123= z21*x23-x21*z23;
+   const REAL z123= x21*y23-y21*x23;
+
+   // v32 x v34 (= -v23 x v34)
+   const REAL x234= -(y23*z34-z23*y34);
+   const REAL y234= -(z23*x34-x23*z34);
+   const REAL z234= -(x23*y34-y23*x34);
+
+   const REAL n123= sqrt(x123*x123+y123*y123+z123*z123+1e-7);
+   const REAL n234= sqrt(x234*x234+y234*y234+z234*z234+1e-6);
+
+   const REAL p=x123*x234+y123*y234+z123*z234;
+   const REAL a0=p/(n123*n234+1e-10);
+   REAL angle;
+   if(a0>= 1) angle=0;
+   else
+   {
+      if(a0<=-1) angle=M_PI;
+      else angle=acos(a0);
+   }
+   REAL sgn=1.0;
+   if((x21*x34 + y21*y34 + z21*z34)<0) {angle=-angle;sgn=-1;}
+
+   if(d!=0)
+   {
+      const REAL s=sgn/(sqrt(1-a0*a0+1e-6));
+      const REAL s0=-s/(n123*n234+1e-10);
+      const REAL s1= s*p/(n234*n123*n123*n123+1e-10);
+      const REAL s3= s*p/(n123*n234*n234*n234+1e-10);
+      d[0].x=s0*(-z23*y234+y23*z234)+s1*(-z23*y123+y23*z123);
+      d[0].y=s0*(-x23*z234+z23*x234)+s1*(-x23*z123+z23*x123);
+      d[0].z=s0*(-y23*x234+x23*y234)+s1*(-y23*x123+x23*y123);
+
+      d[3].x=s0*(-z23*y123+y23*z123)+s3*(-z23*y234+y23*z234);
+      d[3].y=s0*(-x23*z123+z23*x123)+s3*(-x23*z234+z23*x234);
+      d[3].z=s0*(-y23*x123+x23*y123)+s3*(-y23*x234+x23*y234);
+
+      d[1].x=s0*((z23-z21)*y234-y123*z34+(y21-y23)*z234+z123*y34)+s1*(y123*(z23-z21)+z123*(y21-y23))+s3*(-y234*z34+z234*y34);
+      d[1].y=s0*((x23-x21)*z234-z123*x34+(z21-z23)*x234+x123*z34)+s1*(z123*(x23-x21)+x123*(z21-z23))+s3*(-z234*x34+x234*z34);
+      d[1].z=s0*((y23-y21)*x234-x123*y34+(x21-x23)*y234+y123*x34)+s1*(x123*(y23-y21)+y123*(x21-x23))+s3*(-x234*y34+y234*x34);
+
+      d[2].x=-(d[0].x+d[1].x+d[3].x);
+      d[2].y=-(d[0].y+d[1].y+d[3].y);
+      d[2].z=-(d[0].z+d[1].z+d[3].z);
+   }
+   return angle;
+}
+
+/** Log(likelihood) of a restraint with value v, for an ideal value v0, with
+* a flat bottom of half-width delta and a width sigma outside of it.
+* The derivative of the log(likelihood) relative to v is stored in coeff.
+* If periodic is true (dihedral angles), the distance to the ideal value
+* is brought back into [-pi;pi].
+*/
+REAL CalcRestraintLogLikelihood(const REAL v,const REAL v0,const REAL delta,const REAL sigma,
+                                REAL &coeff,const bool periodic=false)
+{
+   coeff=0;
+   if(sigma<1e-6) return 0;
+   REAL llk=v-(v0+delta);
+   if(periodic)
+   {
+      if(llk<(-M_PI)) llk += 2*M_PI;
+      if(llk>  M_PI ) llk -= 2*M_PI;
+   }
+   if(llk<=0)
+   {
+      llk=v-(v0-delta);
+      if(periodic)
+      {
+         if(llk<(-M_PI)) llk += 2*M_PI;
+         if(llk>  M_PI ) llk -= 2*M_PI;
+      }
+      if(llk>=0) return 0;
+   }
+   llk/=sigma;
+   #ifdef RESTRAINT_X2_X4_X6
+   const REAL llk2=llk*llk;
+   coeff=(2*llk+4*llk2)/sigma;
+   return llk2*(1+llk2);
+   #else
+   coeff=2*llk/sigma;
+   return llk*llk;
+   #endif
+}
+
 void ExpandAtomGroupRecursive(MolAtom* atom,
                               const map<MolAtom*,set<MolAtom*> > &connect,
                               set<MolAtom*> &atomlist,const MolAtom* finalAtom)
@@ -190,12 +373,17 @@ void ExpandAtomGroupRecursive(MolAtom* atom,
 
 MolAtom::MolAtom(const REAL x, const REAL y, const REAL z,
                  const ScatteringPower *pPow, const string &name, Molecule &parent):
-mName(name),mX(x),mY(y),mZ(z),mOccupancy(1.),mpScattPow(pPow),mpMol(&parent),mIsInRing(false),mIsNonFlipAtom(false)
+mName(name),mIndex(parent.mvAtomX.size()),mpMol(&parent),mIsInRing(false),mIsNonFlipAtom(false)
 #ifdef __WX__CRYST__
 ,mpWXCrystObj(0)
 #endif
 {
    VFN_DEBUG_MESSAGE("MolAtom::MolAtom()",4)
+   parent.mvAtomX.push_back(x);
+   parent.mvAtomY.push_back(y);
+   parent.mvAtomZ.push_back(z);
+   parent.mvAtomOccupancy.push_back(1.);
+   parent.mvpAtomScattPow.push_back(pPow);
 }
 
 MolAtom::~MolAtom()
@@ -214,9 +402,9 @@ void MolAtom::SetName(const string &name)
    {
       try
       {
-         mpMol->GetPar(&mX).SetName(mpMol->GetName()+"_"+mName+"_x");
-         mpMol->GetPar(&mY).SetName(mpMol->GetName()+"_"+mName+"_y");
-         mpMol->GetPar(&mZ).SetName(mpMol->GetName()+"_"+mName+"_z");
+         mpMol->GetPar(&(this->X())).SetName(mpMol->GetName()+"_"+mName+"_x");
+         mpMol->GetPar(&(this->Y())).SetName(mpMol->GetName()+"_"+mName+"_y");
+         mpMol->GetPar(&(this->Z())).SetName(mpMol->GetName()+"_"+mName+"_z");
       }
       catch(const ObjCrystException &except)
       {
@@ -231,32 +419,32 @@ const string& MolAtom::GetName()const{return mName;}
 const Molecule& MolAtom::GetMolecule()const{return *mpMol;}
       Molecule& MolAtom::GetMolecule()     {return *mpMol;}
 
-const REAL& MolAtom::X()const{return mX;}
-const REAL& MolAtom::Y()const{return mY;}
-const REAL& MolAtom::Z()const{return mZ;}
+const REAL& MolAtom::X()const{return mpMol->mvAtomX[mIndex];}
+const REAL& MolAtom::Y()const{return mpMol->mvAtomY[mIndex];}
+const REAL& MolAtom::Z()const{return mpMol->mvAtomZ[mIndex];}
 
-REAL& MolAtom::X(){return mX;}
-REAL& MolAtom::Y(){return mY;}
-REAL& MolAtom::Z(){return mZ;}
+REAL& MolAtom::X(){return mpMol->mvAtomX[mIndex];}
+REAL& MolAtom::Y(){return mpMol->mvAtomY[mIndex];}
+REAL& MolAtom::Z(){return mpMol->mvAtomZ[mIndex];}
 
-REAL MolAtom::GetX()const{return mX;}
-REAL MolAtom::GetY()const{return mY;}
-REAL MolAtom::GetZ()const{return mZ;}
-REAL MolAtom::GetOccupancy()const{return mOccupancy;}
+REAL MolAtom::GetX()const{return mpMol->mvAtomX[mIndex];}
+REAL MolAtom::GetY()const{return mpMol->mvAtomY[mIndex];}
+REAL MolAtom::GetZ()const{return mpMol->mvAtomZ[mIndex];}
+REAL MolAtom::GetOccupancy()const{return mpMol->mvAtomOccupancy[mIndex];}
 
-void MolAtom::SetX(const REAL a)const{ mX=a;mpMol->GetAtomPositionClock().Click();}
-void MolAtom::SetY(const REAL a)const{ mY=a;mpMol->GetAtomPositionClock().Click();}
-void MolAtom::SetZ(const REAL a)const{ mZ=a;mpMol->GetAtomPositionClock().Click();}
-void MolAtom::SetOccupancy(const REAL a){ mOccupancy=a;}
+void MolAtom::SetX(const REAL a)const{ mpMol->mvAtomX[mIndex]=a;mpMol->GetAtomPositionClock().Click();}
+void MolAtom::SetY(const REAL a)const{ mpMol->mvAtomY[mIndex]=a;mpMol->GetAtomPositionClock().Click();}
+void MolAtom::SetZ(const REAL a)const{ mpMol->mvAtomZ[mIndex]=a;mpMol->GetAtomPositionClock().Click();}
+void MolAtom::SetOccupancy(const REAL a){ mpMol->mvAtomOccupancy[mIndex]=a;}
 
-bool MolAtom::IsDummy()const{return mpScattPow==0;}
-const ScatteringPower& MolAtom::GetScatteringPower()const{return *mpScattPow;}
+bool MolAtom::IsDummy()const{return mpMol->mvpAtomScattPow[mIndex]==0;}
+const ScatteringPower& MolAtom::GetScatteringPower()const{return *(mpMol->mvpAtomScattPow[mIndex]);}
 
 void MolAtom::SetScatteringPower(const ScatteringPower& pow)
 {
-   if(mpScattPow!=&pow)
+   if(mpMol->mvpAtomScattPow[mIndex]!=&pow)
    {
-      mpScattPow=&pow;
+      mpMol->mvpAtomScattPow[mIndex]=&pow;
       this->GetMolecule().GetAtomScattPowClock().Click();
    }
 }
@@ -271,25 +459,25 @@ void MolAtom::XMLOutput(ostream &os,int indent)const
    {
       stringstream ss;
       ss.precision(os.precision());
-      ss <<mX;
+      ss <<this->GetX();
       tag.AddAttribute("x",ss.str());
    }
    {
       stringstream ss;
       ss.precision(os.precision());
-      ss <<mY;
+      ss <<this->GetY();
       tag.AddAttribute("y",ss.str());
    }
    {
       stringstream ss;
       ss.precision(os.precision());
-      ss <<mZ;
+      ss <<this->GetZ();
       tag.AddAttribute("z",ss.str());
    }
    {
       stringstream ss;
       ss.precision(os.precision());
-      ss <<mOccupancy;
+      ss <<this->GetOccupancy();
       tag.AddAttribute("Occup",ss.str());
    }
    if(mIsNonFlipAtom) tag.AddAttribute("NonFlip","1");
@@ -309,27 +497,27 @@ void MolAtom::XMLInput(istream &is,const XMLCrystTag &tag)
       }
       if("ScattPow"==tag.GetAttributeName(i))
       {
-         mpScattPow=&(mpMol->GetCrystal().GetScatteringPower(tag.GetAttributeValue(i)));
+         mpMol->mvpAtomScattPow[mIndex]=&(mpMol->GetCrystal().GetScatteringPower(tag.GetAttributeValue(i)));
       }
       if("x"==tag.GetAttributeName(i))
       {
          stringstream ss(tag.GetAttributeValue(i));
-         ss >>mX;
+         ss >>mpMol->mvAtomX[mIndex];
       }
       if("y"==tag.GetAttributeName(i))
       {
          stringstream ss(tag.GetAttributeValue(i));
-         ss >>mY;
+         ss >>mpMol->mvAtomY[mIndex];
       }
       if("z"==tag.GetAttributeName(i))
       {
          stringstream ss(tag.GetAttributeValue(i));
-         ss >>mZ;
+         ss >>mpMol->mvAtomZ[mIndex];
       }
       if("Occup"==tag.GetAttributeName(i))
       {
          stringstream ss(tag.GetAttributeValue(i));
-         ss >>mOccupancy;
+         ss >>mpMol->mvAtomOccupancy[mIndex];
       }
       if("NonFlip"==tag.GetAttributeName(i))
       {
@@ -358,6 +546,8 @@ bool MolAtom::IsNonFlipAtom() const
 
 size_t MolAtom::int_ptr() const {return (size_t)this;}
 
+unsigned long MolAtom::GetIndex()const{return mIndex;}
+
 #ifdef __WX__CRYST__
 WXCrystObjBasic* MolAtom::WXCreate(wxWindow* parent)
 {
@@ -489,71 +679,23 @@ REAL MolBond::GetLogLikelihood(const bool calcDeriv, const bool recalc)const
    if(!recalc) return mLLK;
    VFN_DEBUG_ENTRY("MolBond::GetLogLikelihood():",2)
    //TAU_PROFILE("MolBond::GetLogLikelihood()","REAL (bool,bool)",TAU_DEFAULT);
-   //const REAL length=this->GetLength();
-   const REAL x=this->GetAtom2().GetX()-this->GetAtom1().GetX();
-   const REAL y=this->GetAtom2().GetY()-this->GetAtom1().GetY();
-   const REAL z=this->GetAtom2().GetZ()-this->GetAtom1().GetZ();
-   const REAL length=sqrt(abs(x*x+y*y+z*z));
-
+   const REAL *px=mpMol->mvAtomX.data(),*py=mpMol->mvAtomY.data(),*pz=mpMol->mvAtomZ.data();
+   XYZ d[2];
+   const REAL length=CalcBondLength(px,py,pz,mAtomPair.first->GetIndex(),mAtomPair.second->GetIndex(),
+                                    calcDeriv ? d : 0);
+   REAL coeff;
+   mLLK=CalcRestraintLogLikelihood(length,mLength0,mDelta,mSigma,coeff);
    if(calcDeriv)
    {
-      const REAL tmp2=1/(length+1e-10);
-      mDerivAtom1.x=-x*tmp2;
-      mDerivAtom1.y=-y*tmp2;
-      mDerivAtom1.z=-z*tmp2;
-
-      mDerivAtom2.x=-mDerivAtom1.x;
-      mDerivAtom2.y=-mDerivAtom1.y;
-      mDerivAtom2.z=-mDerivAtom1.z;
-   }
-
-   if(mSigma<1e-6)
-   {
-      if(calcDeriv) mDerivLLKCoeff=0;
-      mLLK=0;
-      return 0;
+      mDerivAtom1=d[0];
+      mDerivAtom2=d[1];
+      mDerivLLKCoeff=coeff;
    }
-   mLLK=length-(mLength0+mDelta);
-   if(mLLK>0)
-   {
-      mLLK /= mSigma;
-      if(calcDeriv) mDerivLLKCoeff=2*mLLK/mSigma;
-      #ifdef RESTRAINT_X2_X4_X6
-      const float mLLK2=mLLK*mLLK;
-      //if(calcDeriv) mDerivLLKCoeff=(2*mLLK+4*mLLK2+6*mLLK2*mLLK2)/mSigma;
-      //mLLK=mLLK2*(1+mLLK2+mLLK2*mLLK2);
-      if(calcDeriv) mDerivLLKCoeff=(2*mLLK+4*mLLK2)/mSigma;
-      mLLK=mLLK2*(1+mLLK2);
-      #else
-      if(calcDeriv) mDerivLLKCoeff=2*mLLK/mSigma;
-      mLLK *= mLLK;
-      #endif
-      VFN_DEBUG_EXIT("MolBond::GetLogLikelihood():",2)
-      return mLLK;
-   }
-   mLLK=length-(mLength0-mDelta);
-   if(mLLK<0)
-   {
-      mLLK /= mSigma;
-      #ifdef RESTRAINT_X2_X4_X6
-      const float mLLK2=mLLK*mLLK;
-      //if(calcDeriv) mDerivLLKCoeff=(2*mLLK+4*mLLK2+6*mLLK2*mLLK2)/mSigma;
-      //mLLK=mLLK2*(1+mLLK2+mLLK2*mLLK2);
-      if(calcDeriv) mDerivLLKCoeff=(2*mLLK+4*mLLK2)/mSigma;
-      mLLK=mLLK2*(1+mLLK2);
-      #else
-      if(calcDeriv) mDerivLLKCoeff=2*mLLK/mSigma;
-      mLLK *= mLLK;
-      #endif
-      VFN_DEBUG_EXIT("MolBond::GetLogLikelihood():",2)
-      return mLLK;
-   }
-   if(calcDeriv) mDerivLLKCoeff=0;
-   mLLK=0;
    VFN_DEBUG_EXIT("MolBond::GetLogLikelihood():",2)
    return mLLK;
 }
 
+
 REAL MolBond::GetDeriv(const map<const MolAtom*,XYZ> &m, const bool llk)const
 {
    //TAU_PROFILE("MolBond::GetDeriv()","REAL (mak,bool)",TAU_DEFAULT);
@@ -604,12 +746,24 @@ void MolBond::CalcGradient(std::map<MolAtom*,XYZ> &m)const
    #endif
 }
 
+void MolBond::CalcGradient(REAL *gx,REAL *gy,REAL *gz)const
+{
+   this->GetLogLikelihood(true,true);
+   const unsigned long i1=mAtomPair.first->GetIndex(),i2=mAtomPair.second->GetIndex();
+   gx[i1]+=mDerivLLKCoeff*mDerivAtom1.x;
+   gy[i1]+=mDerivLLKCoeff*mDerivAtom1.y;
+   gz[i1]+=mDerivLLKCoeff*mDerivAtom1.z;
+   gx[i2]+=mDerivLLKCoeff*mDerivAtom2.x;
+   gy[i2]+=mDerivLLKCoeff*mDerivAtom2.y;
+   gz[i2]+=mDerivLLKCoeff*mDerivAtom2.z;
+}
+
 const MolAtom& MolBond::GetAtom1()const{return *(mAtomPair.first);}
 const MolAtom& MolBond::GetAtom2()const{return *(mAtomPair.second);}
 MolAtom& MolBond::GetAtom1(){return *(mAtomPair.first);}
 MolAtom& MolBond::GetAtom2(){return *(mAtomPair.second);}
-void MolBond::SetAtom1(MolAtom &at){mAtomPair.first =&at;}
-void MolBond::SetAtom2(MolAtom &at){mAtomPair.second=&at;}
+void MolBond::SetAtom1(MolAtom &at){mAtomPair.first =&at;mpMol->GetBondListClock().Click();}
+void MolBond::SetAtom2(MolAtom &at){mAtomPair.second=&at;mpMol->GetBondListClock().Click();}
 REAL MolBond::GetLength()const
 {
    return GetBondLength(GetAtom1(),this->GetAtom2());
@@ -625,9 +779,9 @@ REAL& MolBond::LengthDelta(){return mDelta;}
 REAL& MolBond::LengthSigma(){return mSigma;}
 REAL& MolBond::BondOrder(){return mBondOrder;}
 
-void MolBond::SetLength0(const REAL a){mLength0=a;}
-void MolBond::SetLengthDelta(const REAL a){mDelta=a;}
-void MolBond::SetLengthSigma(const REAL a){mSigma=a;}
+void MolBond::SetLength0(const REAL a){mLength0=a;mpMol->GetRestraintValueClock().Click();}
+void MolBond::SetLengthDelta(const REAL a){mDelta=a;mpMol->GetRestraintValueClock().Click();}
+void MolBond::SetLengthSigma(const REAL a){mSigma=a;mpMol->GetRestraintValueClock().Click();}
 void MolBond::SetBondOrder(const REAL a){mBondOrder=a;}
 
 bool MolBond::IsFreeTorsion()const{return mIsFreeTorsion;}
@@ -767,9 +921,9 @@ REAL MolBondAngle::GetAngle0()const{return mAngle0;}
 REAL MolBondAngle::GetAngleDelta()const{return mDelta;}
 REAL MolBondAngle::GetAngleSigma()const{return mSigma;}
 
-void MolBondAngle::SetAngle0(const REAL angle){mAngle0=angle;}
-void MolBondAngle::SetAngleDelta(const REAL delta){mDelta=delta;}
-void MolBondAngle::SetAngleSigma(const REAL sigma){mSigma=sigma;}
+void MolBondAngle::SetAngle0(const REAL angle){mAngle0=angle;mpMol->GetRestraintValueClock().Click();}
+void MolBondAngle::SetAngleDelta(const REAL delta){mDelta=delta;mpMol->GetRestraintValueClock().Click();}
+void MolBondAngle::SetAngleSigma(const REAL sigma){mSigma=sigma;mpMol->GetRestraintValueClock().Click();}
 
 REAL MolBondAngle::GetAngle()const
 {
@@ -783,93 +937,24 @@ REAL MolBondAngle::GetLogLikelihood(const bool calcDeriv, const bool recalc)cons
    if(!recalc) return mLLK;
    VFN_DEBUG_ENTRY("MolBondAngle::GetLogLikelihood():",2)
    //TAU_PROFILE("MolBondAngle::GetLogLikelihood()","REAL (bool,bool)",TAU_DEFAULT);
-   //const REAL angle=this->GetAngle();
-   const REAL x21=this->GetAtom1().GetX()-this->GetAtom2().GetX();
-   const REAL y21=this->GetAtom1().GetY()-this->GetAtom2().GetY();
-   const REAL z21=this->GetAtom1().GetZ()-this->GetAtom2().GetZ();
-   const REAL x23=this->GetAtom3().GetX()-this->GetAtom2().GetX();
-   const REAL y23=this->GetAtom3().GetY()-this->GetAtom2().GetY();
-   const REAL z23=this->GetAtom3().GetZ()-this->GetAtom2().GetZ();
-
-   const REAL n1=sqrt(abs(x21*x21+y21*y21+z21*z21));
-   const REAL n3=sqrt(abs(x23*x23+y23*y23+z23*z23));
-   const REAL p=x21*x23+y21*y23+z21*z23;
-
-   const REAL a0=p/(n1*n3+1e-10);
-   REAL angle;
-   if(a0>=1)  angle=0;
-   else
-   {
-      if(a0<=-1) angle=M_PI;
-      else angle=acos(a0);
-   }
-
+   const REAL *px=mpMol->mvAtomX.data(),*py=mpMol->mvAtomY.data(),*pz=mpMol->mvAtomZ.data();
+   XYZ d[3];
+   const REAL angle=CalcBondAngle(px,py,pz,mvpAtom[0]->GetIndex(),mvpAtom[1]->GetIndex(),
+                                  mvpAtom[2]->GetIndex(),calcDeriv ? d : 0);
+   REAL coeff;
+   mLLK=CalcRestraintLogLikelihood(angle,mAngle0,mDelta,mSigma,coeff);
    if(calcDeriv)
    {
-      const REAL s=1/(sqrt(1-a0*a0+1e-6));
-      const REAL s0=-s/(n1*n3+1e-10);
-      const REAL s1= s*p/(n3*n1*n1*n1+1e-10);
-      const REAL s3= s*p/(n1*n3*n3*n3+1e-10);
-      mDerivAtom1.x=s0*x23+s1*x21;
-      mDerivAtom1.y=s0*y23+s1*y21;
-      mDerivAtom1.z=s0*z23+s1*z21;
-
-      mDerivAtom3.x=s0*x21+s3*x23;
-      mDerivAtom3.y=s0*y21+s3*y23;
-      mDerivAtom3.z=s0*z21+s3*z23;
-
-      mDerivAtom2.x=-(mDerivAtom1.x+mDerivAtom3.x);
-      mDerivAtom2.y=-(mDerivAtom1.y+mDerivAtom3.y);
-      mDerivAtom2.z=-(mDerivAtom1.z+mDerivAtom3.z);
-   }
-
-   if(mSigma<1e-6)
-   {
-      if(calcDeriv) mDerivLLKCoeff=0;
-      mLLK=0;
-      return 0;
-   }
-
-   mLLK=angle-(mAngle0+mDelta);
-   if(mLLK>0)
-   {
-      mLLK/=mSigma;
-      #ifdef RESTRAINT_X2_X4_X6
-      const float mLLK2=mLLK*mLLK;
-      //if(calcDeriv) mDerivLLKCoeff=(2*mLLK+4*mLLK2+6*mLLK2*mLLK2)/mSigma;
-      //mLLK=mLLK2*(1+mLLK2+mLLK2*mLLK2);
-      if(calcDeriv) mDerivLLKCoeff=(2*mLLK+4*mLLK2)/mSigma;
-      mLLK=mLLK2*(1+mLLK2);
-      #else
-      if(calcDeriv) mDerivLLKCoeff=2*mLLK/mSigma;
-      mLLK *= mLLK;
-      #endif
-      VFN_DEBUG_EXIT("MolBondAngle::GetLogLikelihood():",2)
-      return mLLK;
-   }
-   mLLK=angle-(mAngle0-mDelta);
-   if(mLLK<0)
-   {
-      mLLK/=mSigma;
-      #ifdef RESTRAINT_X2_X4_X6
-      const float mLLK2=mLLK*mLLK;
-      //if(calcDeriv) mDerivLLKCoeff=(2*mLLK+4*mLLK2+6*mLLK2*mLLK2)/mSigma;
-      //mLLK=mLLK2*(1+mLLK2+mLLK2*mLLK2);
-      if(calcDeriv) mDerivLLKCoeff=(2*mLLK+4*mLLK2)/mSigma;
-      mLLK=mLLK2*(1+mLLK2);
-      #else
-      if(calcDeriv) mDerivLLKCoeff=2*mLLK/mSigma;
-      mLLK *= mLLK;
-      #endif
-      VFN_DEBUG_EXIT("MolBondAngle::GetLogLikelihood():",2)
-      return mLLK;
+      mDerivAtom1=d[0];
+      mDerivAtom2=d[1];
+      mDerivAtom3=d[2];
+      mDerivLLKCoeff=coeff;
    }
    VFN_DEBUG_EXIT("MolBondAngle::GetLogLikelihood():",2)
-   if(calcDeriv) mDerivLLKCoeff=0;
-   mLLK=0;
    return mLLK;
 }
 
+
 REAL MolBondAngle::GetDeriv(const std::map<const MolAtom*,XYZ> &m,const bool llk)const
 {
    //TAU_PROFILE("MolBondAngle::GetDeriv()","REAL (mak,bool)",TAU_DEFAULT);
@@ -932,15 +1017,30 @@ void MolBondAngle::CalcGradient(std::map<MolAtom*,XYZ> &m)const
    #endif
 }
 
+void MolBondAngle::CalcGradient(REAL *gx,REAL *gy,REAL *gz)const
+{
+   this->GetLogLikelihood(true,true);
+   const unsigned long i1=mvpAtom[0]->GetIndex(),i2=mvpAtom[1]->GetIndex(),i3=mvpAtom[2]->GetIndex();
+   gx[i1]+=mDerivLLKCoeff*mDerivAtom1.x;
+   gy[i1]+=mDerivLLKCoeff*mDerivAtom1.y;
+   gz[i1]+=mDerivLLKCoeff*mDerivAtom1.z;
+   gx[i2]+=mDerivLLKCoeff*mDerivAtom2.x;
+   gy[i2]+=mDerivLLKCoeff*mDerivAtom2.y;
+   gz[i2]+=mDerivLLKCoeff*mDerivAtom2.z;
+   gx[i3]+=mDerivLLKCoeff*mDerivAtom3.x;
+   gy[i3]+=mDerivLLKCoeff*mDerivAtom3.y;
+   gz[i3]+=mDerivLLKCoeff*mDerivAtom3.z;
+}
+
 const MolAtom& MolBondAngle::GetAtom1()const{return *(mvpAtom[0]);}
 const MolAtom& MolBondAngle::GetAtom2()const{return *(mvpAtom[1]);}
 const MolAtom& MolBondAngle::GetAtom3()const{return *(mvpAtom[2]);}
 MolAtom& MolBondAngle::GetAtom1(){return *(mvpAtom[0]);}
 MolAtom& MolBondAngle::GetAtom2(){return *(mvpAtom[1]);}
 MolAtom& MolBondAngle::GetAtom3(){return *(mvpAtom[2]);}
-void MolBondAngle::SetAtom1(MolAtom& at){mvpAtom[0]=&at;}
-void MolBondAngle::SetAtom2(MolAtom& at){mvpAtom[1]=&at;}
-void MolBondAngle::SetAtom3(MolAtom& at){mvpAtom[2]=&at;}
+void MolBondAngle::SetAtom1(MolAtom& at){mvpAtom[0]=&at;mpMol->GetBondAngleListClock().Click();}
+void MolBondAngle::SetAtom2(MolAtom& at){mvpAtom[1]=&at;mpMol->GetBondAngleListClock().Click();}
+void MolBondAngle::SetAtom3(MolAtom& at){mvpAtom[2]=&at;mpMol->GetBondAngleListClock().Click();}
 //MolAtom& MolBondAngle::GetAtom1(){return *(mvpAtom[0]);}
 //MolAtom& MolBondAngle::GetAtom2(){return *(mvpAtom[1]);}
 //MolAtom& MolBondAngle::GetAtom3(){return *(mvpAtom[2]);}
@@ -1099,9 +1199,9 @@ REAL MolDihedralAngle::GetAngle0()const{return mAngle0;}
 REAL MolDihedralAngle::GetAngleDelta()const{return mDelta;}
 REAL MolDihedralAngle::GetAngleSigma()const{return mSigma;}
 
-void MolDihedralAngle::SetAngle0(const REAL angle){mAngle0=angle;}
-void MolDihedralAngle::SetAngleDelta(const REAL delta){mDelta=delta;}
-void MolDihedralAngle::SetAngleSigma(const REAL sigma){mSigma=sigma;}
+void MolDihedralAngle::SetAngle0(const REAL angle){mAngle0=angle;mpMol->GetRestraintValueClock().Click();}
+void MolDihedralAngle::SetAngleDelta(const REAL delta){mDelta=delta;mpMol->GetRestraintValueClock().Click();}
+void MolDihedralAngle::SetAngleSigma(const REAL sigma){mSigma=sigma;mpMol->GetRestraintValueClock().Click();}
 
 REAL MolDihedralAngle::GetLogLikelihood()const{return this->GetLogLikelihood(false,true);}
 
@@ -1110,117 +1210,25 @@ REAL MolDihedralAngle::GetLogLikelihood(const bool calcDeriv, const bool recalc)
    if(!recalc) return mLLK;
    VFN_DEBUG_ENTRY("MolDihedralAngle::GetLogLikelihood():",2)
    //TAU_PROFILE("MolDihedralAngle::GetLogLikelihood()","REAL (bool,bool)",TAU_DEFAULT);
-   const REAL x21=this->GetAtom1().GetX()-this->GetAtom2().GetX();
-   const REAL y21=this->GetAtom1().GetY()-this->GetAtom2().GetY();
-   const REAL z21=this->GetAtom1().GetZ()-this->GetAtom2().GetZ();
-
-   const REAL x34=this->GetAtom4().GetX()-this->GetAtom3().GetX();
-   const REAL y34=this->GetAtom4().GetY()-this->GetAtom3().GetY();
-   const REAL z34=this->GetAtom4().GetZ()-this->GetAtom3().GetZ();
-
-   const REAL x23=this->GetAtom3().GetX()-this->GetAtom2().GetX();
-   const REAL y23=this->GetAtom3().GetY()-this->GetAtom2().GetY();
-   const REAL z23=this->GetAtom3().GetZ()-this->GetAtom2().GetZ();
-
-   // v21 x v23
-   const REAL x123= y21*z23-z21*y23;
-   const REAL y123= z21*x23-x21*z23;
-   const REAL z123= x21*y23-y21*x23;
-
-   // v32 x v34 (= -v23 x v34)
-   const REAL x234= -(y23*z34-z23*y34);
-   const REAL y234= -(z23*x34-x23*z34);
-   const REAL z234= -(x23*y34-y23*x34);
-
-   const REAL n123= sqrt(x123*x123+y123*y123+z123*z123+1e-7);
-   const REAL n234= sqrt(x234*x234+y234*y234+z234*z234+1e-6);
-
-   const REAL p=x123*x234+y123*y234+z123*z234;
-   const REAL a0=p/(n123*n234+1e-10);
-   REAL angle;
-   if(a0>= 1) angle=0;
-   else
-   {
-      if(a0<=-1) angle=M_PI;
-      else angle=acos(a0);
-   }
-   REAL sgn=1.0;
-   if((x21*x34 + y21*y34 + z21*z34)<0) {angle=-angle;sgn=-1;}
-
-
+   const REAL *px=mpMol->mvAtomX.data(),*py=mpMol->mvAtomY.data(),*pz=mpMol->mvAtomZ.data();
+   XYZ d[4];
+   const REAL angle=CalcDihedralAngle(px,py,pz,mvpAtom[0]->GetIndex(),mvpAtom[1]->GetIndex(),
+                                      mvpAtom[2]->GetIndex(),mvpAtom[3]->GetIndex(),calcDeriv ? d : 0);
+   REAL coeff;
+   mLLK=CalcRestraintLogLikelihood(angle,mAngle0,mDelta,mSigma,coeff,true);
    if(calcDeriv)
    {
-      const REAL s=sgn/(sqrt(1-a0*a0+1e-6));
-      const REAL s0=-s/(n123*n234+1e-10);
-      const REAL s1= s*p/(n234*n123*n123*n123+1e-10);
-      const REAL s3= s*p/(n123*n234*n234*n234+1e-10);
-      mDerivAtom1.x=s0*(-z23*y234+y23*z234)+s1*(-z23*y123+y23*z123);
-      mDerivAtom1.y=s0*(-x23*z234+z23*x234)+s1*(-x23*z123+z23*x123);
-      mDerivAtom1.z=s0*(-y23*x234+x23*y234)+s1*(-y23*x123+x23*y123);
-
-      mDerivAtom4.x=s0*(-z23*y123+y23*z123)+s3*(-z23*y234+y23*z234);
-      mDerivAtom4.y=s0*(-x23*z123+z23*x123)+s3*(-x23*z234+z23*x234);
-      mDerivAtom4.z=s0*(-y23*x123+x23*y123)+s3*(-y23*x234+x23*y234);
-
-      mDerivAtom2.x=s0*((z23-z21)*y234-y123*z34+(y21-y23)*z234+z123*y34)+s1*(y123*(z23-z21)+z123*(y21-y23))+s3*(-y234*z34+z234*y34);
-      mDerivAtom2.y=s0*((x23-x21)*z234-z123*x34+(z21-z23)*x234+x123*z34)+s1*(z123*(x23-x21)+x123*(z21-z23))+s3*(-z234*x34+x234*z34);
-      mDerivAtom2.z=s0*((y23-y21)*x234-x123*y34+(x21-x23)*y234+y123*x34)+s1*(x123*(y23-y21)+y123*(x21-x23))+s3*(-x234*y34+y234*x34);
-
-      mDerivAtom3.x=-(mDerivAtom1.x+mDerivAtom2.x+mDerivAtom4.x);
-      mDerivAtom3.y=-(mDerivAtom1.y+mDerivAtom2.y+mDerivAtom4.y);
-      mDerivAtom3.z=-(mDerivAtom1.z+mDerivAtom2.z+mDerivAtom4.z);
-   }
-
-   if(mSigma<1e-6)
-   {
-      if(calcDeriv) mDerivLLKCoeff=0;
-      mLLK=0;
-      return mLLK;
-   }
-   mLLK=angle-(mAngle0+mDelta);
-   if(mLLK<(-M_PI)) mLLK += 2*M_PI;
-   if(mLLK>  M_PI ) mLLK -= 2*M_PI;
-   if(mLLK>0)
-   {
-      mLLK/=mSigma;
-      #ifdef RESTRAINT_X2_X4_X6
-      const float mLLK2=mLLK*mLLK;
-      //if(calcDeriv) mDerivLLKCoeff=(2*mLLK+4*mLLK2+6*mLLK2*mLLK2)/mSigma;
-      //mLLK=mLLK2*(1+mLLK2+mLLK2*mLLK2);
-      if(calcDeriv) mDerivLLKCoeff=(2*mLLK+4*mLLK2)/mSigma;
-      mLLK=mLLK2*(1+mLLK2);
-      #else
-      if(calcDeriv) mDerivLLKCoeff=2*mLLK/mSigma;
-      mLLK *= mLLK;
-      #endif
-      VFN_DEBUG_EXIT("MolDihedralAngle::GetLogLikelihood():",2)
-      return mLLK;
-   }
-   mLLK=angle-(mAngle0-mDelta);
-   if(mLLK<(-M_PI)) mLLK += 2*M_PI;
-   if(mLLK>  M_PI ) mLLK -= 2*M_PI;
-   if(mLLK<0)
-   {
-      mLLK/=mSigma;
-      #ifdef RESTRAINT_X2_X4_X6
-      const float mLLK2=mLLK*mLLK;
-      //if(calcDeriv) mDerivLLKCoeff=(2*mLLK+4*mLLK2+6*mLLK2*mLLK2)/mSigma;
-      //mLLK=mLLK2*(1+mLLK2+mLLK2*mLLK2);
-      if(calcDeriv) mDerivLLKCoeff=(2*mLLK+4*mLLK2)/mSigma;
-      mLLK=mLLK2*(1+mLLK2);
-      #else
-      if(calcDeriv) mDerivLLKCoeff=2*mLLK/mSigma;
-      mLLK *= mLLK;
-      #endif
-      VFN_DEBUG_EXIT("MolDihedralAngle::GetLogLikelihood():",2)
-      return mLLK;
+      mDerivAtom1=d[0];
+      mDerivAtom2=d[1];
+      mDerivAtom3=d[2];
+      mDerivAtom4=d[3];
+      mDerivLLKCoeff=coeff;
    }
    VFN_DEBUG_EXIT("MolDihedralAngle::GetLogLikelihood():",2)
-   if(calcDeriv) mDerivLLKCoeff=0;
-   mLLK=0;
-   return 0;
+   return mLLK;
 }
 
+
 REAL MolDihedralAngle::GetDeriv(const std::map<const MolAtom*,XYZ> &m,const bool llk)const
 {
    //TAU_PROFILE("MolDihedralAngle::GetDeriv()","REAL (mak,bool)",TAU_DEFAULT);
@@ -1295,14 +1303,33 @@ void MolDihedralAngle::CalcGradient(std::map<MolAtom*,XYZ> &m)const
    #endif
 }
 
+void MolDihedralAngle::CalcGradient(REAL *gx,REAL *gy,REAL *gz)const
+{
+   this->GetLogLikelihood(true,true);
+   const unsigned long i1=mvpAtom[0]->GetIndex(),i2=mvpAtom[1]->GetIndex(),
+                       i3=mvpAtom[2]->GetIndex(),i4=mvpAtom[3]->GetIndex();
+   gx[i1]+=mDerivLLKCoeff*mDerivAtom1.x;
+   gy[i1]+=mDerivLLKCoeff*mDerivAtom1.y;
+   gz[i1]+=mDerivLLKCoeff*mDerivAtom1.z;
+   gx[i2]+=mDerivLLKCoeff*mDerivAtom2.x;
+   gy[i2]+=mDerivLLKCoeff*mDerivAtom2.y;
+   gz[i2]+=mDerivLLKCoeff*mDerivAtom2.z;
+   gx[i3]+=mDerivLLKCoeff*mDerivAtom3.x;
+   gy[i3]+=mDerivLLKCoeff*mDerivAtom3.y;
+   gz[i3]+=mDerivLLKCoeff*mDerivAtom3.z;
+   gx[i4]+=mDerivLLKCoeff*mDerivAtom4.x;
+   gy[i4]+=mDerivLLKCoeff*mDerivAtom4.y;
+   gz[i4]+=mDerivLLKCoeff*mDerivAtom4.z;
+}
+
 const MolAtom& MolDihedralAngle::GetAtom1()const{return *(mvpAtom[0]);}
 const MolAtom& MolDihedralAngle::GetAtom2()const{return *(mvpAtom[1]);}
 const MolAtom& MolDihedralAngle::GetAtom3()const{return *(mvpAtom[2]);}
 const MolAtom& MolDihedralAngle::GetAtom4()const{return *(mvpAtom[3]);}
-void MolDihedralAngle::SetAtom1(MolAtom& at){mvpAtom[0]=&at;}
-void MolDihedralAngle::SetAtom2(MolAtom& at){mvpAtom[1]=&at;}
-void MolDihedralAngle::SetAtom3(MolAtom& at){mvpAtom[2]=&at;}
-void MolDihedralAngle::SetAtom4(MolAtom& at){mvpAtom[3]=&at;}
+void MolDihedralAngle::SetAtom1(MolAtom& at){mvpAtom[0]=&at;mpMol->GetDihedralAngleListClock().Click();}
+void MolDihedralAngle::SetAtom2(MolAtom& at){mvpAtom[1]=&at;mpMol->GetDihedralAngleListClock().Click();}
+void MolDihedralAngle::SetAtom3(MolAtom& at){mvpAtom[2]=&at;mpMol->GetDihedralAngleListClock().Click();}
+void MolDihedralAngle::SetAtom4(MolAtom& at){mvpAtom[3]=&at;mpMol->GetDihedralAngleListClock().Click();}
 MolAtom& MolDihedralAngle::GetAtom1(){return *(mvpAtom[0]);}
 MolAtom& MolDihedralAngle::GetAtom2(){return *(mvpAtom[1]);}
 MolAtom& MolDihedralAngle::GetAtom3(){return *(mvpAtom[2]);}
@@ -1325,6 +1352,205 @@ WXCrystObjBasic* MolDihedralAngle::WXGet(){return mpWXCrystObj;}
 void MolDihedralAngle::WXDelete(){if(0!=mpWXCrystObj) delete mpWXCrystObj;mpWXCrystObj=0;}
 void MolDihedralAngle::WXNotifyDelete(){mpWXCrystObj=0;}
 #endif
+//######################################################################
+//
+//      MolRestraintPack
+//
+//######################################################################
+void MolRestraintPack::Init(const vector<MolBond*> &vb,const vector<MolBondAngle*> &va,
+                            const vector<MolDihedralAngle*> &vd)
+{
+   mvpBond.assign(vb.begin(),vb.end());
+   mvpBondAngle.assign(va.begin(),va.end());
+   mvpDihedralAngle.assign(vd.begin(),vd.end());
+   mvBondIdx.resize(2*vb.size());
+   for(unsigned long i=0;i<vb.size();++i)
+   {
+      mvBondIdx[2*i  ]=vb[i]->GetAtom1().GetIndex();
+      mvBondIdx[2*i+1]=vb[i]->GetAtom2().GetIndex();
+   }
+   mvAngleIdx.resize(3*va.size());
+   for(unsigned long i=0;i<va.size();++i)
+   {
+      mvAngleIdx[3*i  ]=va[i]->GetAtom1().GetIndex();
+      mvAngleIdx[3*i+1]=va[i]->GetAtom2().GetIndex();
+      mvAngleIdx[3*i+2]=va[i]->GetAtom3().GetIndex();
+   }
+   mvDihedralIdx.resize(4*vd.size());
+   for(unsigned long i=0;i<vd.size();++i)
+   {
+      mvDihedralIdx[4*i  ]=vd[i]->GetAtom1().GetIndex();
+      mvDihedralIdx[4*i+1]=vd[i]->GetAtom2().GetIndex();
+      mvDihedralIdx[4*i+2]=vd[i]->GetAtom3().GetIndex();
+      mvDihedralIdx[4*i+3]=vd[i]->GetAtom4().GetIndex();
+   }
+   this->UpdateValues();
+}
+
+void MolRestraintPack::UpdateValues()
+{
+   const unsigned long nbBond=mvpBond.size();
+   mvBond0.resize(nbBond);
+   mvBondDelta.resize(nbBond);
+   mvBondSigma.resize(nbBond);
+   mvBondLow.resize(nbBond);
+   mvBondHigh.resize(nbBond);
+   mvBondInvSigma.resize(nbBond);
+   for(unsigned long i=0;i<nbBond;++i)
+   {
+      mvBond0[i]=mvpBond[i]->GetLength0();
+      mvBondDelta[i]=mvpBond[i]->GetLengthDelta();
+      mvBondSigma[i]=mvpBond[i]->GetLengthSigma();
+      mvBondLow[i] =mvBond0[i]-mvBondDelta[i];
+      mvBondHigh[i]=mvBond0[i]+mvBondDelta[i];
+      mvBondInvSigma[i]=(mvBondSigma[i]<1e-6) ? 0 : 1/mvBondSigma[i];
+   }
+   const unsigned long nbAngle=mvpBondAngle.size();
+   mvAngle0.resize(nbAngle);
+   mvAngleDelta.resize(nbAngle);
+   mvAngleSigma.resize(nbAngle);
+   for(unsigned long i=0;i<nbAngle;++i)
+   {
+      mvAngle0[i]=mvpBondAngle[i]->GetAngle0();
+      mvAngleDelta[i]=mvpBondAngle[i]->GetAngleDelta();
+      mvAngleSigma[i]=mvpBondAngle[i]->GetAngleSigma();
+   }
+   const unsigned long nbDihedral=mvpDihedralAngle.size();
+   mvDihedral0.resize(nbDihedral);
+   mvDihedralDelta.resize(nbDihedral);
+   mvDihedralSigma.resize(nbDihedral);
+   for(unsigned long i=0;i<nbDihedral;++i)
+   {
+      mvDihedral0[i]=mvpDihedralAngle[i]->GetAngle0();
+      mvDihedralDelta[i]=mvpDihedralAngle[i]->GetAngleDelta();
+      mvDihedralSigma[i]=mvpDihedralAngle[i]->GetAngleSigma();
+   }
+}
+
+unsigned long MolRestraintPack::size()const
+{
+   return mvpBond.size()+mvpBondAngle.size()+mvpDihedralAngle.size();
+}
+
+REAL MolRestraintPack::GetLogLikelihood(const REAL *px,const REAL *py,const REAL *pz,
+                                        REAL *gx,REAL *gy,REAL *gz,REAL *vllk)const
+{
+   REAL llk=0,coeff;
+   XYZ d[4];
+   XYZ *pd=(gx==0) ? 0 : d;
+   // Bonds
+   const unsigned long nbBond=mvpBond.size();
+   unsigned long i=0;
+   #ifdef HAVE_SSE_MATHFUN
+   // Four bonds at a time: the flat-bottom restraint is computed without branches as
+   // max(l-(l0+delta),0)+min(l-(l0-delta),0), scaled by 1/sigma (0 if sigma<1e-6)
+   {
+      const __m128 zero=_mm_setzero_ps();
+      __m128 vsum=zero;
+      float cx[4],cy[4],cz[4];
+      for(;(i+4)<=nbBond;i+=4)
+      {
+         const unsigned int *pi=&mvBondIdx[2*i];
+         const __m128 dx=_mm_set_ps(px[pi[7]]-px[pi[6]],px[pi[5]]-px[pi[4]],px[pi[3]]-px[pi[2]],px[pi[1]]-px[pi[0]]);
+         const __m128 dy=_mm_set_ps(py[pi[7]]-py[pi[6]],py[pi[5]]-py[pi[4]],py[pi[3]]-py[pi[2]],py[pi[1]]-py[pi[0]]);
+         const __m128 dz=_mm_set_ps(pz[pi[7]]-pz[pi[6]],pz[pi[5]]-pz[pi[4]],pz[pi[3]]-pz[pi[2]],pz[pi[1]]-pz[pi[0]]);
+         const __m128 len=_mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx,dx),_mm_mul_ps(dy,dy)),_mm_mul_ps(dz,dz)));
+         const __m128 invs=_mm_loadu_ps(&mvBondInvSigma[i]);
+         const __m128 e=_mm_mul_ps(_mm_add_ps(_mm_max_ps(_mm_sub_ps(len,_mm_loadu_ps(&mvBondHigh[i])),zero),
+                                              _mm_min_ps(_mm_sub_ps(len,_mm_loadu_ps(&mvBondLow[i])),zero)),invs);
+         const __m128 e2=_mm_mul_ps(e,e);
+         #ifdef RESTRAINT_X2_X4_X6
+         const __m128 vllk4=_mm_mul_ps(e2,_mm_add_ps(_mm_set1_ps(1.0f),e2));
+         const __m128 vcoeff=_mm_mul_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(2.0f),e),_mm_mul_ps(_mm_set1_ps(4.0f),e2)),invs);
+         #else
+         const __m128 vllk4=e2;
+         const __m128 vcoeff=_mm_mul_ps(_mm_mul_ps(_mm_set1_ps(2.0f),e),invs);
+         #endif
+         vsum=_mm_add_ps(vsum,vllk4);
+         if(vllk!=0) _mm_storeu_ps(vllk+i,vllk4);
+         if(gx==0) continue;
+         const __m128 c=_mm_div_ps(vcoeff,_mm_add_ps(len,_mm_set1_ps(1e-10f)));
+         _mm_storeu_ps(cx,_mm_mul_ps(c,dx));
+         _mm_storeu_ps(cy,_mm_mul_ps(c,dy));
+         _mm_storeu_ps(cz,_mm_mul_ps(c,dz));
+         for(unsigned int j=0;j<4;++j)
+         {
+            gx[pi[2*j]]-=cx[j];gx[pi[2*j+1]]+=cx[j];
+            gy[pi[2*j]]-=cy[j];gy[pi[2*j+1]]+=cy[j];
+            gz[pi[2*j]]-=cz[j];gz[pi[2*j+1]]+=cz[j];
+         }
+      }
+      float s[4];
+      _mm_storeu_ps(s,vsum);
+      llk+=s[0]+s[1]+s[2]+s[3];
+   }
+   #endif
+   for(;i<nbBond;++i)
+   {
+      const unsigned int *pi=&mvBondIdx[2*i];
+      const REAL l=CalcRestraintLogLikelihood(CalcBondLength(px,py,pz,pi[0],pi[1],pd),
+                                              mvBond0[i],mvBondDelta[i],mvBondSigma[i],coeff);
+      llk+=l;
+      if(vllk!=0) vllk[i]=l;
+      if((pd==0)||(coeff==0)) continue;
+      for(unsigned int j=0;j<2;++j)
+      {
+         gx[pi[j]]+=coeff*d[j].x;
+         gy[pi[j]]+=coeff*d[j].y;
+         gz[pi[j]]+=coeff*d[j].z;
+      }
+   }
+   if(vllk!=0) vllk+=nbBond;
+   // Bond angles
+   const unsigned long nbAngle=mvpBondAngle.size();
+   for(i=0;i<nbAngle;++i)
+   {
+      const unsigned int *pi=&mvAngleIdx[3*i];
+      const REAL l=CalcRestraintLogLikelihood(CalcBondAngle(px,py,pz,pi[0],pi[1],pi[2],pd),
+                                              mvAngle0[i],mvAngleDelta[i],mvAngleSigma[i],coeff);
+      llk+=l;
+      if(vllk!=0) vllk[i]=l;
+      if((pd==0)||(coeff==0)) continue;
+      for(unsigned int j=0;j<3;++j)
+      {
+         gx[pi[j]]+=coeff*d[j].x;
+         gy[pi[j]]+=coeff*d[j].y;
+         gz[pi[j]]+=coeff*d[j].z;
+      }
+   }
+   if(vllk!=0) vllk+=nbAngle;
+   // Dihedral angles
+   const unsigned long nbDihedral=mvpDihedralAngle.size();
+   for(i=0;i<nbDihedral;++i)
+   {
+      const unsigned int *pi=&mvDihedralIdx[4*i];
+      const REAL l=CalcRestraintLogLikelihood(CalcDihedralAngle(px,py,pz,pi[0],pi[1],pi[2],pi[3],pd),
+                                              mvDihedral0[i],mvDihedralDelta[i],mvDihedralSigma[i],
+                                              coeff,true);
+      llk+=l;
+      if(vllk!=0) vllk[i]=l;
+      if((pd==0)||(coeff==0)) continue;
+      for(unsigned int j=0;j<4;++j)
+      {
+         gx[pi[j]]+=coeff*d[j].x;
+         gy[pi[j]]+=coeff*d[j].y;
+         gz[pi[j]]+=coeff*d[j].z;
+      }
+   }
+   return llk;
+}
+
+void MolRestraintPack::GetValues(const REAL *px,const REAL *py,const REAL *pz,REAL *v)const
+{
+   for(unsigned long i=0;i<mvpBond.size();++i)
+      *v++=CalcBondLength(px,py,pz,mvBondIdx[2*i],mvBondIdx[2*i+1],0);
+   for(unsigned long i=0;i<mvpBondAngle.size();++i)
+      *v++=CalcBondAngle(px,py,pz,mvAngleIdx[3*i],mvAngleIdx[3*i+1],mvAngleIdx[3*i+2],0);
+   for(unsigned long i=0;i<mvpDihedralAngle.size();++i)
+      *v++=CalcDihedralAngle(px,py,pz,mvDihedralIdx[4*i],mvDihedralIdx[4*i+1],
+                             mvDihedralIdx[4*i+2],mvDihedralIdx[4*i+3],0);
+}
+
 //######################################################################
 //
 //      RigidGroup
@@ -1546,6 +1772,123 @@ REAL& Quaternion::Q0(){return mQ0;}
 REAL& Quaternion::Q1(){return mQ1;}
 REAL& Quaternion::Q2(){return mQ2;}
 REAL& Quaternion::Q3(){return mQ3;}
+void Quaternion::GetRotationMatrix(REAL *m)const
+{
+   // Rotate the base vectors, so that the matrix is strictly equivalent to RotateVector()
+   REAL x=1,y=0,z=0;
+   this->RotateVector(x,y,z);
+   m[0]=x;m[3]=y;m[6]=z;
+   x=0;y=1;z=0;
+   this->RotateVector(x,y,z);
+   m[1]=x;m[4]=y;m[7]=z;
+   x=0;y=0;z=1;
+   this->RotateVector(x,y,z);
+   m[2]=x;m[5]=y;m[8]=z;
+}
+
+void BuildAtomIndexList(const std::set<MolAtom*> &atoms,std::vector<unsigned int> &vidx)
+{
+   vidx.resize(atoms.size());
+   vector<unsigned int>::iterator p=vidx.begin();
+   for(set<MolAtom*>::const_iterator pos=atoms.begin();pos!=atoms.end();++pos) *p++=(*pos)->GetIndex();
+   sort(vidx.begin(),vidx.end());
+}
+
+/// Build the mask (indexed by MolAtom::GetIndex()) of a set of atoms
+void BuildAtomMask(const std::set<MolAtom*> &atoms,const unsigned long nb,std::vector<bool> &mask)
+{
+   mask.assign(nb,false);
+   for(set<MolAtom*>::const_iterator pos=atoms.begin();pos!=atoms.end();++pos) mask[(*pos)->GetIndex()]=true;
+}
+
+void RotateAtomIndexList(REAL *px,REAL *py,REAL *pz,const std::vector<unsigned int> &vidx,
+                         const REAL *m,const REAL x0,const REAL y0,const REAL z0,
+                         REAL &dx,REAL &dy,REAL &dz)
+{
+   const unsigned long nb=vidx.size();
+   const unsigned int *pi=vidx.data();
+   REAL sx=0,sy=0,sz=0;
+   unsigned long i=0;
+   #ifdef HAVE_SSE_MATHFUN
+   if(nb>=4)
+   {
+      const __m128 m00=_mm_set1_ps(m[0]),m01=_mm_set1_ps(m[1]),m02=_mm_set1_ps(m[2]),
+                   m10=_mm_set1_ps(m[3]),m11=_mm_set1_ps(m[4]),m12=_mm_set1_ps(m[5]),
+                   m20=_mm_set1_ps(m[6]),m21=_mm_set1_ps(m[7]),m22=_mm_set1_ps(m[8]);
+      const __m128 cx=_mm_set1_ps(x0),cy=_mm_set1_ps(y0),cz=_mm_set1_ps(z0);
+      __m128 vsx=_mm_setzero_ps(),vsy=_mm_setzero_ps(),vsz=_mm_setzero_ps();
+      float bx[4],by[4],bz[4];
+      for(;(i+4)<=nb;i+=4)
+      {
+         const unsigned int i0=pi[i],i1=pi[i+1],i2=pi[i+2],i3=pi[i+3];
+         // Indices are sorted & unique, so this is a contiguous block
+         const bool contiguous=(i3-i0)==3;
+         __m128 x,y,z;
+         if(contiguous)
+         {
+            x=_mm_loadu_ps(px+i0);
+            y=_mm_loadu_ps(py+i0);
+            z=_mm_loadu_ps(pz+i0);
+         }
+         else
+         {
+            x=_mm_set_ps(px[i3],px[i2],px[i1],px[i0]);
+            y=_mm_set_ps(py[i3],py[i2],py[i1],py[i0]);
+            z=_mm_set_ps(pz[i3],pz[i2],pz[i1],pz[i0]);
+         }
+         const __m128 x1=_mm_sub_ps(x,cx),y1=_mm_sub_ps(y,cy),z1=_mm_sub_ps(z,cz);
+         const __m128 xr=_mm_add_ps(_mm_add_ps(_mm_mul_ps(m00,x1),_mm_mul_ps(m01,y1)),
+                                    _mm_add_ps(_mm_mul_ps(m02,z1),cx));
+         const __m128 yr=_mm_add_ps(_mm_add_ps(_mm_mul_ps(m10,x1),_mm_mul_ps(m11,y1)),
+                                    _mm_add_ps(_mm_mul_ps(m12,z1),cy));
+         const __m128 zr=_mm_add_ps(_mm_add_ps(_mm_mul_ps(m20,x1),_mm_mul_ps(m21,y1)),
+                                    _mm_add_ps(_mm_mul_ps(m22,z1),cz));
+         vsx=_mm_add_ps(vsx,_mm_sub_ps(xr,x));
+         vsy=_mm_add_ps(vsy,_mm_sub_ps(yr,y));
+         vsz=_mm_add_ps(vsz,_mm_sub_ps(zr,z));
+         if(contiguous)
+         {
+            _mm_storeu_ps(px+i0,xr);
+            _mm_storeu_ps(py+i0,yr);
+            _mm_storeu_ps(pz+i0,zr);
+         }
+         else
+         {
+            _mm_storeu_ps(bx,xr);
+            _mm_storeu_ps(by,yr);
+            _mm_storeu_ps(bz,zr);
+            px[i0]=bx[0];px[i1]=bx[1];px[i2]=bx[2];px[i3]=bx[3];
+            py[i0]=by[0];py[i1]=by[1];py[i2]=by[2];py[i3]=by[3];
+            pz[i0]=bz[0];pz[i1]=bz[1];pz[i2]=bz[2];pz[i3]=bz[3];
+         }
+      }
+      _mm_storeu_ps(bx,vsx);
+      _mm_storeu_ps(by,vsy);
+      _mm_storeu_ps(bz,vsz);
+      sx=bx[0]+bx[1]+bx[2]+bx[3];
+      sy=by[0]+by[1]+by[2]+by[3];
+      sz=bz[0]+bz[1]+bz[2]+bz[3];
+   }
+   #endif
+   for(;i<nb;++i)
+   {
+      const unsigned int j=pi[i];
+      const REAL x=px[j]-x0,y=py[j]-y0,z=pz[j]-z0;
+      const REAL xr=m[0]*x+m[1]*y+m[2]*z+x0;
+      const REAL yr=m[3]*x+m[4]*y+m[5]*z+y0;
+      const REAL zr=m[6]*x+m[7]*y+m[8]*z+z0;
+      sx+=xr-px[j];
+      sy+=yr-py[j];
+      sz+=zr-pz[j];
+      px[j]=xr;
+      py[j]=yr;
+      pz[j]=zr;
+   }
+   dx=sx;
+   dy=sy;
+   dz=sz;
+}
+
 //######################################################################
 //
 //      Molecule Stretch Modes
@@ -1553,6 +1896,19 @@ REAL& Quaternion::Q3(){return mQ3;}
 //######################################################################
 StretchMode::~StretchMode(){}
 
+const std::vector<unsigned int>& StretchMode::GetAtomIndexList(const std::set<MolAtom*> &atoms)const
+{
+   if(  (mClockMovedAtomIdx<mpMol->mClockAtomList)
+      ||(mvMovedAtom.size()!=atoms.size())
+      ||!equal(atoms.begin(),atoms.end(),mvMovedAtom.begin()))
+   {
+      mvMovedAtom.assign(atoms.begin(),atoms.end());
+      BuildAtomIndexList(atoms,mvMovedAtomIdx);
+      mClockMovedAtomIdx.Click();
+   }
+   return mvMovedAtomIdx;
+}
+
 StretchModeBondLength::StretchModeBondLength(MolAtom &at0,MolAtom &at1,
                                              const MolBond *pBond):
 mpAtom0(&at0),mpAtom1(&at1),mpBond(pBond)
@@ -1623,7 +1979,7 @@ void StretchModeBondLength::Stretch(const REAL amplitude,
    dx*=change;
    dy*=change;
    dz*=change;
-   mpMol->TranslateAtomGroup(mvTranslatedAtomList,dx,dy,dz,keepCenter);
+   mpMol->TranslateAtomGroup(this->GetAtomIndexList(mvTranslatedAtomList),dx,dy,dz,keepCenter);
 }
 
 void StretchModeBondLength::RandomStretch(const REAL amplitude,
@@ -1723,7 +2079,7 @@ void StretchModeBondAngle::Stretch(const REAL amplitude,
    const REAL vx=dy10*dz12-dz10*dy12;
    const REAL vy=dz10*dx12-dx10*dz12;
    const REAL vz=dx10*dy12-dy10*dx12;
-   mpMol->RotateAtomGroup(*mpAtom1,vx,vy,vz,mvRotatedAtomList,amplitude,keepCenter);
+   mpMol->RotateAtomGroup(*mpAtom1,vx,vy,vz,this->GetAtomIndexList(mvRotatedAtomList),amplitude,keepCenter);
 }
 
 void StretchModeBondAngle::RandomStretch(const REAL amplitude,
@@ -1800,7 +2156,7 @@ void StretchModeTorsion::Print(ostream &os,bool full)const
 
 void StretchModeTorsion::Stretch(const REAL amplitude, const bool keepCenter)
 {
-   mpMol->RotateAtomGroup(*mpAtom1,*mpAtom2,mvRotatedAtomList,amplitude,keepCenter);
+   mpMol->RotateAtomGroup(*mpAtom1,*mpAtom2,this->GetAtomIndexList(mvRotatedAtomList),amplitude,keepCenter);
 }
 
 void StretchModeTorsion::RandomStretch(const REAL amplitude,
@@ -1881,7 +2237,7 @@ void StretchModeTwist::Print(ostream &os,bool full)const
 
 void StretchModeTwist::Stretch(const REAL amplitude, const bool keepCenter)
 {
-   mpMol->RotateAtomGroup(*mpAtom1,*mpAtom2,mvRotatedAtomList,amplitude,keepCenter);
+   mpMol->RotateAtomGroup(*mpAtom1,*mpAtom2,this->GetAtomIndexList(mvRotatedAtomList),amplitude,keepCenter);
 }
 
 void StretchModeTwist::RandomStretch(const REAL amplitude,
@@ -1892,7 +2248,7 @@ void StretchModeTwist::RandomStretch(const REAL amplitude,
    const REAL dz=mpAtom2->GetZ()-mpAtom1->GetZ();
    if((abs(dx)+abs(dy)+abs(dz))<1e-6) return;// :KLUDGE:
    const REAL change=(REAL)(2.*rand()-RAND_MAX)/(REAL)RAND_MAX*mBaseAmplitude*amplitude;
-   mpMol->RotateAtomGroup(*mpAtom1,*mpAtom2,mvRotatedAtomList,change,keepCenter);
+   mpMol->RotateAtomGroup(*mpAtom1,*mpAtom2,this->GetAtomIndexList(mvRotatedAtomList),change,keepCenter);
 }
 
 //######################################################################
@@ -1945,7 +2301,8 @@ void MDAtomGroup::Print(ostream &os,bool full)const
 //######################################################################
 Molecule::Molecule(Crystal &cryst, const string &name):
 mDeleteSubObjInDestructor(1), mBaseRotationAmplitude(M_PI*0.02), mIsSelfOptimizing(false),
-mpCenterAtom(0), mMDMoveFreq(0.0), mMDMoveEnergy(40.), mLogLikelihoodScale(1.0)
+mpCenterAtom(0), mMDMoveFreq(0.0), mMDMoveEnergy(40.), mAsZMatrixKeepOrder(false),
+mLogLikelihoodScale(1.0), mNbLogLikelihoodIncrement(0)
 {
    VFN_DEBUG_MESSAGE("Molecule::Molecule()",5)
    mpCryst=&cryst;
@@ -2032,7 +2389,8 @@ mpCenterAtom(0), mMDMoveFreq(0.0), mMDMoveEnergy(40.), mLogLikelihoodScale(1.0)
 }
 
 Molecule::Molecule(const Molecule &old):
-mDeleteSubObjInDestructor(old.mDeleteSubObjInDestructor), mIsSelfOptimizing(false), mpCenterAtom(0)
+mDeleteSubObjInDestructor(old.mDeleteSubObjInDestructor), mIsSelfOptimizing(false), mpCenterAtom(0),
+mAsZMatrixKeepOrder(false), mNbLogLikelihoodIncrement(0)
 {
    VFN_DEBUG_ENTRY("Molecule::Molecule(old&)",5)
    // a hack, but const-correct
@@ -2557,13 +2915,8 @@ void Molecule::BeginOptimization(const bool allowApproximations,const bool enabl
          this->GetPar(&((*at)->X())).SetIsFixed(true);
          this->GetPar(&((*at)->Y())).SetIsFixed(true);
          this->GetPar(&((*at)->Z())).SetIsFixed(true);
-         for(int i = 0; i < this->GetNbComponent(); ++i)
-            if(&(this->GetAtom(i))==*at)
-            {
-              (*pos)->mvIdx.insert(i);
-              break;
-            }
       }
+      BuildAtomIndexList(**pos,(*pos)->mvIdx);
    }
    #endif
 
@@ -3028,6 +3381,9 @@ void Molecule::GlobalOptRandomMove(const REAL mutationAmplitude,
                for(vector<MolDihedralAngle*>::const_iterator pos=mvpDihedralAngle.begin();pos!=mvpDihedralAngle.end();++pos)
                   mLogLikelihood+=(*pos)->GetLogLikelihood(true,true);
                TAU_PROFILE_STOP(timer3);
+               // mLogLikelihood has been summed directly: force a full
+               // summation for the next incremental update
+               mNbLogLikelihoodIncrement=200;
 
                TAU_PROFILE_START(timer4);
                for(list<StretchMode*>::const_iterator mode=mvpStretchModeNotFree.begin();
@@ -3122,16 +3478,306 @@ void Molecule::GlobalOptRandomMove(const REAL mutationAmplitude,
    VFN_DEBUG_EXIT("Molecule::GlobalOptRandomMove()",4)
 }
 
+void Molecule::GlobalOptRandomMoveBatch(const unsigned int nbCandidate,const REAL mutationAmplitude,
+                                        std::vector<REAL> &x,std::vector<REAL> &y,std::vector<REAL> &z,
+                                        std::vector<REAL> *llk)
+{
+   TAU_PROFILE("Molecule::GlobalOptRandomMoveBatch()","void (...)",TAU_DEFAULT);
+   VFN_DEBUG_ENTRY("Molecule::GlobalOptRandomMoveBatch()",4)
+   const unsigned long nbAtom=mvpAtom.size();
+   x.resize(nbCandidate*nbAtom);
+   y.resize(nbCandidate*nbAtom);
+   z.resize(nbCandidate*nbAtom);
+   for(unsigned int k=0;k<nbCandidate;++k)
+   {
+      std::copy(mvAtomX.begin(),mvAtomX.end(),x.begin()+k*nbAtom);
+      std::copy(mvAtomY.begin(),mvAtomY.end(),y.begin()+k*nbAtom);
+      std::copy(mvAtomZ.begin(),mvAtomZ.end(),z.begin()+k*nbAtom);
+   }
+   // Stretch modes are otherwise only built in BeginOptimization(), so make sure
+   // they are up-to-date. A rigid body has no stretch mode.
+   unsigned long nbMode=0;
+   if(mFlexModel.GetChoice()!=1)
+   {
+      this->BuildStretchModeBondLength();
+      this->BuildStretchModeBondAngle();
+      this->BuildStretchModeTorsion();
+      if(  (mClockStretchModeGroups<mClockStretchModeBondLength)
+         ||(mClockStretchModeGroups<mClockStretchModeBondAngle)
+         ||(mClockStretchModeGroups<mClockStretchModeTorsion)
+         ||(mClockStretchModeGroups<mClockStretchModeTwist)) this->BuildStretchModeGroups();
+      this->BuildStretchModeFreeBatch();
+      nbMode=mvpStretchModeFreeBatch.size();
+   }
+
+   // Draw all random changes at once. As in GlobalOptRandomMove(), each mode is
+   // moved with a 50% probability.
+   vector<REAL> vchange(nbMode*nbCandidate);
+   for(unsigned long i=0;i<vchange.size();++i)
+   {
+      if((rand()%2)==0) vchange[i]=(2.*(REAL)rand()-(REAL)RAND_MAX)/(REAL)RAND_MAX*mutationAmplitude;
+      else vchange[i]=0;
+   }
+
+   REAL m[9];
+   for(unsigned long i=0;i<nbMode;++i)
+   {
+      const StretchMode *pMode=mvpStretchModeFreeBatch[i];
+      const unsigned int *def=&mvStretchModeFreeBatchDef[8*i];
+      const unsigned int a0=def[1],a1=def[2],a2=def[3];
+      // Limits of the change for the associated restraint, if any
+      const Restraint *pRestraint=0;
+      REAL v0=0,vmax=0;
+      switch(def[0])
+      {
+         case 0:
+         {
+            const MolBond *p=static_cast<const StretchModeBondLength*>(pMode)->mpBond;
+            if(p!=0)
+            {
+               v0=p->GetLength0();
+               vmax=p->GetLengthSigma()<1e-6 ? p->GetLengthDelta() : p->GetLengthDelta()+5*p->GetLengthSigma();
+               pRestraint=p;
+            }
+            break;
+         }
+         case 1:
+         {
+            const MolBondAngle *p=static_cast<const StretchModeBondAngle*>(pMode)->mpBondAngle;
+            if(p!=0)
+            {
+               v0=p->GetAngle0();
+               vmax=p->GetAngleSigma()<1e-6 ? p->GetAngleDelta() : p->GetAngleDelta()+5*p->GetAngleSigma();
+               pRestraint=p;
+            }
+            break;
+         }
+         case 2:
+         {
+            const MolDihedralAngle *p=static_cast<const StretchModeTorsion*>(pMode)->mpDihedralAngle;
+            if(p!=0)
+            {
+               v0=p->GetAngle0();
+               vmax=p->GetAngleSigma()<1e-6 ? p->GetAngleDelta() : p->GetAngleDelta()+5*p->GetAngleSigma();
+               pRestraint=p;
+            }
+            break;
+         }
+         default: break;
+      }
+      const REAL amp=pMode->mBaseAmplitude;
+      const vector<unsigned int> *pvidx;
+      if(def[0]==0)
+         pvidx=&(pMode->GetAtomIndexList(static_cast<const StretchModeBondLength*>(pMode)->mvTranslatedAtomList));
+      else if(def[0]==1)
+         pvidx=&(pMode->GetAtomIndexList(static_cast<const StretchModeBondAngle*>(pMode)->mvRotatedAtomList));
+      else if(def[0]==2)
+         pvidx=&(pMode->GetAtomIndexList(static_cast<const StretchModeTorsion*>(pMode)->mvRotatedAtomList));
+      else
+         pvidx=&(pMode->GetAtomIndexList(static_cast<const StretchModeTwist*>(pMode)->mvRotatedAtomList));
+      if(pvidx->size()==0) continue;
+
+      for(unsigned int k=0;k<nbCandidate;++k)
+      {
+         REAL change=vchange[k*nbMode+i];
+         if(change==0) continue;
+         change*=amp;
+         REAL *px=&x[k*nbAtom],*py=&y[k*nbAtom],*pz=&z[k*nbAtom];
+         if(def[0]==0)
+         {
+            REAL dx=px[a1]-px[a0];
+            REAL dy=py[a1]-py[a0];
+            REAL dz=pz[a1]-pz[a0];
+            const REAL l=sqrt(dx*dx+dy*dy+dz*dz+1e-7);
+            if(l<1e-6) continue;// :KLUDGE:
+            if(pRestraint!=0)
+            {
+               const REAL d0=l-v0;
+               if((d0+change)>vmax) change=vmax-d0;
+               else if((d0+change)<(-vmax)) change=-vmax-d0;
+            }
+            dx*=change/l;
+            dy*=change/l;
+            dz*=change/l;
+            for(vector<unsigned int>::const_iterator pos=pvidx->begin();pos!=pvidx->end();++pos)
+            {
+               px[*pos] += dx;
+               py[*pos] += dy;
+               pz[*pos] += dz;
+            }
+            continue;
+         }
+         REAL vx,vy,vz;
+         if(def[0]==1)
+         {
+            const REAL dx10=px[a0]-px[a1],dy10=py[a0]-py[a1],dz10=pz[a0]-pz[a1];
+            const REAL dx12=px[a2]-px[a1],dy12=py[a2]-py[a1],dz12=pz[a2]-pz[a1];
+            vx=dy10*dz12-dz10*dy12;
+            vy=dz10*dx12-dx10*dz12;
+            vz=dx10*dy12-dy10*dx12;
+            if((fabs(vx)+fabs(vy)+fabs(vz))<1e-6) continue;// :KLUDGE:
+            if(pRestraint!=0)
+            {
+               const REAL d0=CalcBondAngle(px,py,pz,a0,a1,a2,0)-v0;
+               if((d0+change)>vmax) change=vmax-d0;
+               else if((d0+change)<(-vmax)) change=-vmax-d0;
+            }
+         }
+         else
+         {
+            vx=px[a1]-px[a0];
+            vy=py[a1]-py[a0];
+            vz=pz[a1]-pz[a0];
+            if((fabs(vx)+fabs(vy)+fabs(vz))<1e-6) continue;// :KLUDGE:
+            if(pRestraint!=0)
+            {
+               REAL d0=CalcDihedralAngle(px,py,pz,def[4],def[5],def[6],def[7],0)-v0;
+               if(d0>M_PI) d0-=2*M_PI;
+               else if(d0<-M_PI) d0+=2*M_PI;
+               if((d0+change)>vmax) change=vmax-d0;
+               else if((d0+change)<(-vmax)) change=-vmax-d0;
+            }
+         }
+         Quaternion::RotationQuaternion(change,vx,vy,vz).GetRotationMatrix(m);
+         REAL dx,dy,dz;
+         // Center of rotation: central atom for a bond angle, first atom otherwise
+         const unsigned int c=(def[0]==1) ? a1 : a0;
+         RotateAtomIndexList(px,py,pz,*pvidx,m,px[c],py[c],pz[c],dx,dy,dz);
+      }
+   }
+   if(llk!=0)
+   {
+      this->BuildRestraintPack();
+      llk->resize(nbCandidate);
+      for(unsigned int k=0;k<nbCandidate;++k)
+         (*llk)[k]=mRestraintPack.GetLogLikelihood(&x[k*nbAtom],&y[k*nbAtom],&z[k*nbAtom]);
+   }
+   VFN_DEBUG_EXIT("Molecule::GlobalOptRandomMoveBatch()",4)
+}
+
+void Molecule::SetConformationFromBatch(const unsigned int k,const std::vector<REAL> &x,
+                                        const std::vector<REAL> &y,const std::vector<REAL> &z)
+{
+   VFN_DEBUG_MESSAGE("Molecule::SetConformationFromBatch("<<k<<")",4)
+   const unsigned long nbAtom=mvpAtom.size();
+   if(x.size()<(k+1)*nbAtom)
+      throw ObjCrystException("Molecule::SetConformationFromBatch(): candidate does not exist");
+   // Average displacement of atoms, to keep the center of the Molecule fixed
+   REAL dx=0,dy=0,dz=0;
+   for(unsigned long i=0;i<nbAtom;++i)
+   {
+      dx += x[k*nbAtom+i]-mvAtomX[i];
+      dy += y[k*nbAtom+i]-mvAtomY[i];
+      dz += z[k*nbAtom+i]-mvAtomZ[i];
+   }
+   std::copy(x.begin()+k*nbAtom,x.begin()+(k+1)*nbAtom,mvAtomX.begin());
+   std::copy(y.begin()+k*nbAtom,y.begin()+(k+1)*nbAtom,mvAtomY.begin());
+   std::copy(z.begin()+k*nbAtom,z.begin()+(k+1)*nbAtom,mvAtomZ.begin());
+   if(  (nbAtom>0)
+      &&(!this->GetPar(mXYZ.data()  ).IsFixed())
+      &&(!this->GetPar(mXYZ.data()+1).IsFixed())
+      &&(!this->GetPar(mXYZ.data()+2).IsFixed()))
+   {
+      dx /= (REAL)(this->GetNbComponent());
+      dy /= (REAL)(this->GetNbComponent());
+      dz /= (REAL)(this->GetNbComponent());
+      mQuat.RotateVector(dx,dy,dz);
+      this->GetCrystal().OrthonormalToFractionalCoords(dx,dy,dz);
+      mXYZ(0) += dx;
+      mXYZ(1) += dy;
+      mXYZ(2) += dz;
+   }
+   mClockAtomPosition.Click();
+   mClockScatterer.Click();
+}
+
 REAL Molecule::GetLogLikelihood()const
 {
    if(  (mClockLogLikelihood>mClockAtomList)
       &&(mClockLogLikelihood>mClockBondList)
       &&(mClockLogLikelihood>mClockBondAngleList)
       &&(mClockLogLikelihood>mClockDihedralAngleList)
+      &&(mClockLogLikelihood>mClockRestraintValue)
       &&(mClockLogLikelihood>mClockAtomPosition)
       &&(mClockLogLikelihood>mClockScatterer)) return mLogLikelihood*mLogLikelihoodScale;
    TAU_PROFILE("Molecule::GetLogLikelihood()","REAL ()",TAU_DEFAULT);
-   mLogLikelihood=this->RefinableObj::GetLogLikelihood();
+   this->BuildRestraintAtomIndex();
+   const unsigned long nbAtom=mvpAtom.size();
+   const unsigned long nbRestraint=mvpRestraint.size();
+   // Only the restraints involving atoms which moved since the last computation
+   // are re-evaluated. A full summation is made regularly to avoid any drift from
+   // rounding errors, and whenever the restraints' ideal values have changed.
+   bool full=  (mvRestraintLLK.size()!=nbRestraint)
+             ||(mvRestraintLLKXYZ.size()!=3*nbAtom)
+             ||(mNbLogLikelihoodIncrement>=200)
+             ||(mClockRestraintValue>mClockLogLikelihood);
+   if(!full)
+   {
+      vector<unsigned int> vUpdated;
+      REAL *p=mvRestraintLLKXYZ.data();
+      for(unsigned long i=0;i<=nbAtom;++i)
+      {
+         if(i<nbAtom)
+         {
+            if((p[0]==mvAtomX[i])&&(p[1]==mvAtomY[i])&&(p[2]==mvAtomZ[i]))
+            {
+               p+=3;
+               continue;
+            }
+            *p++=mvAtomX[i];
+            *p++=mvAtomY[i];
+            *p++=mvAtomZ[i];
+         }
+         const vector<unsigned int> *pIdx=&mvAtomRestraintIndex[i];
+         for(vector<unsigned int>::const_iterator pos=pIdx->begin();pos!=pIdx->end();++pos)
+         {
+            if(mvRestraintLLKUpdated[*pos]) continue;
+            mvRestraintLLKUpdated[*pos]=true;
+            vUpdated.push_back(*pos);
+         }
+      }
+      for(vector<unsigned int>::const_iterator pos=vUpdated.begin();pos!=vUpdated.end();++pos)
+         mvRestraintLLKUpdated[*pos]=false;
+      // If a large part of the restraints changed, a full summation using the
+      // compiled restraints is faster
+      if((4*vUpdated.size())>nbRestraint) full=true;
+      else
+      {
+         for(vector<unsigned int>::const_iterator pos=vUpdated.begin();pos!=vUpdated.end();++pos)
+         {
+            const REAL llk=mvpRestraint[*pos]->GetLogLikelihood();
+            mLogLikelihood+=llk-mvRestraintLLK[*pos];
+            mvRestraintLLK[*pos]=llk;
+         }
+         ++mNbLogLikelihoodIncrement;
+      }
+   }
+   if(full)
+   {
+      mvRestraintLLK.assign(nbRestraint,0);
+      mvRestraintLLKUpdated.assign(nbRestraint,false);
+      // Bonds, bond angles and dihedral angles, using the compiled restraints
+      this->BuildRestraintPack();
+      mRestraintPack.GetLogLikelihood(mvAtomX.data(),mvAtomY.data(),mvAtomZ.data(),
+                                      0,0,0,mvRestraintPackLLK.data());
+      for(unsigned long i=0;i<mvRestraintPackLLK.size();++i)
+         if(mvRestraintPackIndex[i]<nbRestraint) mvRestraintLLK[mvRestraintPackIndex[i]]=mvRestraintPackLLK[i];
+      // Other restraints
+      const vector<unsigned int> *pIdx=&mvAtomRestraintIndex[nbAtom];
+      for(vector<unsigned int>::const_iterator pos=pIdx->begin();pos!=pIdx->end();++pos)
+         mvRestraintLLK[*pos]=mvpRestraint[*pos]->GetLogLikelihood();
+      mLogLikelihood=0;
+      for(unsigned long i=0;i<nbRestraint;++i) mLogLikelihood+=mvRestraintLLK[i];
+      mvRestraintLLKXYZ.resize(3*nbAtom);
+      REAL *p=mvRestraintLLKXYZ.data();
+      for(unsigned long i=0;i<nbAtom;++i)
+      {
+         *p++=mvAtomX[i];
+         *p++=mvAtomY[i];
+         *p++=mvAtomZ[i];
+      }
+      mNbLogLikelihoodIncrement=0;
+   }
    mClockLogLikelihood.Click();
    return mLogLikelihood*mLogLikelihoodScale;
 }
@@ -3143,41 +3789,34 @@ unsigned int Molecule::GetNbLSQFunction()const
 
 const CrystVector_REAL& Molecule::GetLSQCalc(const unsigned int) const
 {
+   this->BuildRestraintPack();
    mLSQCalc.resize(mvpRestraint.size());
-   REAL *p=mLSQCalc.data();
-   for(vector<MolBond*>::const_iterator pos=this->GetBondList().begin();pos!=this->GetBondList().end();++pos)
-      *p++=(*pos)->GetLength();
-   for(vector<MolBondAngle*>::const_iterator pos=this->GetBondAngleList().begin();pos!=this->GetBondAngleList().end();++pos)
-      *p++=(*pos)->GetAngle();
-   for(vector<MolDihedralAngle*>::const_iterator pos=this->GetDihedralAngleList().begin();pos!=this->GetDihedralAngleList().end();++pos)
-      *p++=(*pos)->GetAngle();
+   mRestraintPack.GetValues(mvAtomX.data(),mvAtomY.data(),mvAtomZ.data(),mLSQCalc.data());
    return mLSQCalc;
 }
 
 const CrystVector_REAL& Molecule::GetLSQObs(const unsigned int) const
 {
+   this->BuildRestraintPack();
    mLSQObs.resize(mvpRestraint.size());
    REAL *p=mLSQObs.data();
-   for(vector<MolBond*>::const_iterator pos=this->GetBondList().begin();pos!=this->GetBondList().end();++pos)
-      *p++=(*pos)->GetLength0();
-   for(vector<MolBondAngle*>::const_iterator pos=this->GetBondAngleList().begin();pos!=this->GetBondAngleList().end();++pos)
-      *p++=(*pos)->GetAngle0();
-   for(vector<MolDihedralAngle*>::const_iterator pos=this->GetDihedralAngleList().begin();pos!=this->GetDihedralAngleList().end();++pos)
-      *p++=(*pos)->GetAngle0();
+   p=std::copy(mRestraintPack.mvBond0.begin(),mRestraintPack.mvBond0.end(),p);
+   p=std::copy(mRestraintPack.mvAngle0.begin(),mRestraintPack.mvAngle0.end(),p);
+   std::copy(mRestraintPack.mvDihedral0.begin(),mRestraintPack.mvDihedral0.end(),p);
    return mLSQObs;
 }
 
 const CrystVector_REAL& Molecule::GetLSQWeight(const unsigned int) const
 {
-   //:TODO: USe a clock to avoid re-computation
+   this->BuildRestraintPack();
    mLSQWeight.resize(mvpRestraint.size());
    REAL *p=mLSQWeight.data();
-   for(vector<MolBond*>::const_iterator pos=this->GetBondList().begin();pos!=this->GetBondList().end();++pos)
-      *p++=1/((*pos)->GetLengthSigma()* (*pos)->GetLengthSigma()+1e-6);
-   for(vector<MolBondAngle*>::const_iterator pos=this->GetBondAngleList().begin();pos!=this->GetBondAngleList().end();++pos)
-      *p++=1/((*pos)->GetAngleSigma()* (*pos)->GetAngleSigma()+1e-6);
-   for(vector<MolDihedralAngle*>::const_iterator pos=this->GetDihedralAngleList().begin();pos!=this->GetDihedralAngleList().end();++pos)
-      *p++=1/((*pos)->GetAngleSigma()* (*pos)->GetAngleSigma()+1e-6);
+   for(vector<REAL>::const_iterator pos=mRestraintPack.mvBondSigma.begin();pos!=mRestraintPack.mvBondSigma.end();++pos)
+      *p++=1/((*pos)*(*pos)+1e-6);
+   for(vector<REAL>::const_iterator pos=mRestraintPack.mvAngleSigma.begin();pos!=mRestraintPack.mvAngleSigma.end();++pos)
+      *p++=1/((*pos)*(*pos)+1e-6);
+   for(vector<REAL>::const_iterator pos=mRestraintPack.mvDihedralSigma.begin();pos!=mRestraintPack.mvDihedralSigma.end();++pos)
+      *p++=1/((*pos)*(*pos)+1e-6);
    mLSQWeight*=mLogLikelihoodScale;
    return mLSQWeight;
 }
@@ -3888,7 +4527,14 @@ void Molecule::AddAtom(const REAL x, const REAL y, const REAL z,
       else sprintf(buf,"%s_X_%lu",this->GetName().c_str(),mvpAtom.size()+1);
       thename=buf;
    }
-   mvpAtom.push_back(new MolAtom(x,y,z,pPow,thename,*this));
+   {
+      const REAL *px=mvAtomX.data(),*py=mvAtomY.data(),*pz=mvAtomZ.data();
+      const unsigned long nb=mvAtomX.size();
+      mvpAtom.push_back(new MolAtom(x,y,z,pPow,thename,*this));
+      // The coordinate arrays may have been re-allocated
+      if((px!=mvAtomX.data())||(py!=mvAtomY.data())||(pz!=mvAtomZ.data()))
+         this->UpdateAtomParPointers(px,py,pz,nb);
+   }
    mClockAtomPosition.Click();
    mClockAtomScattPow.Click();
    ++mScattCompList;
@@ -3973,6 +4619,18 @@ vector<MolAtom*>::iterator Molecule::RemoveAtom(MolAtom &atom, const bool del)
    mClockScatterer.Click();
 
    if(mpCenterAtom==*pos) mpCenterAtom=0;
+   {// Remove the atom from the coordinate arrays, and shift the following atoms
+      const unsigned long idx=atom.GetIndex();
+      const unsigned long nb=mvAtomX.size();
+      const REAL *px=mvAtomX.data(),*py=mvAtomY.data(),*pz=mvAtomZ.data();
+      mvAtomX.erase(mvAtomX.begin()+idx);
+      mvAtomY.erase(mvAtomY.begin()+idx);
+      mvAtomZ.erase(mvAtomZ.begin()+idx);
+      mvAtomOccupancy.erase(mvAtomOccupancy.begin()+idx);
+      mvpAtomScattPow.erase(mvpAtomScattPow.begin()+idx);
+      for(vector<MolAtom*>::iterator at=pos+1;at!=mvpAtom.end();++at) --((*at)->mIndex);
+      this->UpdateAtomParPointers(px,py,pz,nb,idx);
+   }
    if(del) delete *pos;
    pos=mvpAtom.erase(pos);
    --mScattCompList;
@@ -4246,9 +4904,164 @@ MolAtom &Molecule::GetAtom(const string &name){return **(this->FindAtom(name));}
 
 const MolAtom &Molecule::GetAtom(const string &name)const{return **(this->FindAtom(name));}
 
+/** Replace the gradient of all atoms in each rigid group by its average over the
+* group, so that following the gradient only translates rigid groups.
+*
+*:TODO: Handle case when one atom belongs to several rigid groups...
+*/
+void AverageRigidGroupGradient(const vector<vector<unsigned int> > &vGroup,REAL *gx,REAL *gy,REAL *gz)
+{
+   for(vector<vector<unsigned int> >::const_iterator pos=vGroup.begin();pos!=vGroup.end();++pos)
+   {
+      if(pos->size()==0) continue;
+      REAL dx=0,dy=0,dz=0;
+      for(vector<unsigned int>::const_iterator i=pos->begin();i!=pos->end();++i)
+      {
+         dx+=gx[*i];
+         dy+=gy[*i];
+         dz+=gz[*i];
+      }
+      dx/=pos->size();
+      dy/=pos->size();
+      dz/=pos->size();
+      for(vector<unsigned int>::const_iterator i=pos->begin();i!=pos->end();++i)
+      {
+         gx[*i]=dx;
+         gy[*i]=dy;
+         gz[*i]=dz;
+      }
+   }
+}
+
+/** Compute the log(likelihood) and its gradient g for the coordinates x, with
+* x and g both stored as [x0..xn-1,y0..yn-1,z0..zn-1]. The gradient of rigid groups
+* is averaged, see AverageRigidGroupGradient().
+*/
+REAL MolRestraintPackGradient(const MolRestraintPack &pack,const vector<vector<unsigned int> > &vGroup,
+                              const unsigned long nbAtom,const REAL *x,REAL *g)
+{
+   for(unsigned long i=0;i<3*nbAtom;++i) g[i]=0;
+   const REAL llk=pack.GetLogLikelihood(x,x+nbAtom,x+2*nbAtom,g,g+nbAtom,g+2*nbAtom);
+   AverageRigidGroupGradient(vGroup,g,g+nbAtom,g+2*nbAtom);
+   return llk;
+}
+
+/** Minimize the log(likelihood) of a set of restraints using the limited-memory
+* BFGS algorithm, with a backtracking line search.
+*
+* \param x: the coordinates [x0..xn-1,y0..yn-1,z0..zn-1], updated on return.
+* \param nbIter: maximum number of iterations.
+* \return the final log(likelihood)
+*/
+REAL MolRestraintPackLBFGS(const MolRestraintPack &pack,const vector<vector<unsigned int> > &vGroup,
+                           const unsigned long nbAtom,REAL *x,const unsigned int nbIter)
+{
+   // Number of corrections kept
+   const unsigned int nbMem=7;
+   // Maximum displacement along any coordinate for a single step, in Angstroems
+   const REAL maxStep=0.5;
+   const unsigned long n=3*nbAtom;
+   vector<REAL> g(n),d(n),x1(n),g1(n),s(nbMem*n),y(nbMem*n),rho(nbMem),alpha(nbMem);
+   REAL llk=MolRestraintPackGradient(pack,vGroup,nbAtom,x,g.data());
+   unsigned int k=0;// Number of corrections stored
+   unsigned int k0=0;// Index of the oldest correction
+   for(unsigned int iter=0;iter<nbIter;++iter)
+   {
+      if(llk<1e-6) break;
+      // Search direction from the two-loop recursion
+      for(unsigned long i=0;i<n;++i) d[i]=-g[i];
+      for(unsigned int l=k;l>0;--l)
+      {
+         const unsigned int j=(k0+l-1)%nbMem;
+         const REAL *sj=&s[j*n],*yj=&y[j*n];
+         REAL a=0;
+         for(unsigned long i=0;i<n;++i) a+=sj[i]*d[i];
+         alpha[j]=a*rho[j];
+         for(unsigned long i=0;i<n;++i) d[i]-=alpha[j]*yj[i];
+      }
+      if(k>0)
+      {
+         const unsigned int j=(k0+k-1)%nbMem;
+         const REAL *yj=&y[j*n];
+         REAL yy=0;
+         for(unsigned long i=0;i<n;++i) yy+=yj[i]*yj[i];
+         const REAL gamma=1/(rho[j]*yy);
+         for(unsigned long i=0;i<n;++i) d[i]*=gamma;
+      }
+      for(unsigned int l=0;l<k;++l)
+      {
+         const unsigned int j=(k0+l)%nbMem;
+         const REAL *sj=&s[j*n],*yj=&y[j*n];
+         REAL b=0;
+         for(unsigned long i=0;i<n;++i) b+=yj[i]*d[i];
+         b*=rho[j];
+         for(unsigned long i=0;i<n;++i) d[i]+=(alpha[j]-b)*sj[i];
+      }
+      REAL dg=0;
+      for(unsigned long i=0;i<n;++i) dg+=d[i]*g[i];
+      if(dg>=0)
+      {// Not a descent direction - restart from the gradient
+         k=0;
+         dg=0;
+         for(unsigned long i=0;i<n;++i) {d[i]=-g[i];dg-=g[i]*g[i];}
+      }
+      if(dg>-1e-10) break;
+      REAL dmax=0;
+      for(unsigned long i=0;i<n;++i) if(abs(d[i])>dmax) dmax=abs(d[i]);
+      REAL step=1;
+      if(dmax*step>maxStep) step=maxStep/dmax;
+      // Backtracking line search with Armijo condition
+      REAL llk1=llk;
+      bool ok=false;
+      for(unsigned int ls=0;ls<30;++ls)
+      {
+         for(unsigned long i=0;i<n;++i) x1[i]=x[i]+step*d[i];
+         llk1=MolRestraintPackGradient(pack,vGroup,nbAtom,x1.data(),g1.data());
+         if(llk1<=llk+1e-4*step*dg) {ok=true;break;}
+         step*=0.5;
+      }
+      if(!ok)
+      {
+         if(k==0) break;
+         k=0;// Drop the curvature information and try again along the gradient
+         continue;
+      }
+      // Store the new correction
+      const unsigned int j=(k<nbMem) ? (k0+k)%nbMem : k0;
+      REAL *sj=&s[j*n],*yj=&y[j*n];
+      REAL sy=0;
+      for(unsigned long i=0;i<n;++i)
+      {
+         sj[i]=x1[i]-x[i];
+         yj[i]=g1[i]-g[i];
+         sy+=sj[i]*yj[i];
+      }
+      if(sy>1e-10)
+      {
+         rho[j]=1/sy;
+         if(k<nbMem) ++k;
+         else k0=(k0+1)%nbMem;
+      }
+      const REAL dllk=llk-llk1;
+      std::copy(x1.begin(),x1.end(),x);
+      g.swap(g1);
+      llk=llk1;
+      if(dllk<1e-6*(1+llk)) break;
+   }
+   return llk;
+}
+
 void Molecule::OptimizeConformation(const long nbTrial,const REAL stopCost)
 {
    VFN_DEBUG_ENTRY("Molecule::OptimizeConformation()",5)
+   // Fast gradient minimization first, which is enough unless the starting
+   // conformation is very far from the restraints
+   this->OptimizeConformationLBFGS(500,8);
+   if(this->GetLogLikelihood()<=stopCost)
+   {
+      VFN_DEBUG_EXIT("Molecule::OptimizeConformation():L-BFGS only",5)
+      return;
+   }
    MonteCarloObj globalOptObj(true);
    globalOptObj.AddRefinableObj(*this);
    globalOptObj.SetAlgorithmParallTempering(ANNEALING_EXPONENTIAL,10000.,1.,
@@ -4261,83 +5074,195 @@ void Molecule::OptimizeConformation(const long nbTrial,const REAL stopCost)
    // Must rebuild Flip & Rotor group, in case they were tested with an absurd conformation
    mClockFlipGroup.Reset();
    mClockRotorGroup.Reset();
+   this->OptimizeConformationLBFGS(500,1);
    VFN_DEBUG_EXIT("Molecule::OptimizeConformation()",5)
 }
 
 void Molecule::OptimizeConformationSteepestDescent(const REAL maxStep,const unsigned nbStep)
 {
-   //cout<<"LLK="<<this->GetLogLikelihood()<<endl;
+   TAU_PROFILE("Molecule::OptimizeConformationSteepestDescent()","void (REAL,unsigned)",TAU_DEFAULT);
+   const unsigned long nbAtom=mvpAtom.size();
+   if((nbAtom==0)||(nbStep==0)) return;
+   this->BuildRestraintPack();
+   const MolRestraintPack &pack=mRestraintPack;
+   vector<vector<unsigned int> > vGroup(mvRigidGroup.size());
+   for(unsigned long i=0;i<mvRigidGroup.size();++i) BuildAtomIndexList(*mvRigidGroup[i],vGroup[i]);
+   vector<REAL> x(3*nbAtom),g(3*nbAtom);
+   std::copy(mvAtomX.begin(),mvAtomX.end(),x.begin());
+   std::copy(mvAtomY.begin(),mvAtomY.end(),x.begin()+nbAtom);
+   std::copy(mvAtomZ.begin(),mvAtomZ.end(),x.begin()+2*nbAtom);
    for(unsigned i = 0; i < nbStep; ++i)
    {
-      // Calc full gradient
-      //Calculate & display gradient
-      map<MolAtom*,XYZ> grad;
-      for(vector<MolAtom*>::iterator pos=this->GetAtomList().begin();
-         pos!=this->GetAtomList().end();++pos) grad[*pos]=XYZ(0,0,0);
-
-      // :TODO: remove atoms that are in rigid groups ?
-      for(vector<MolBond*>::iterator pos=this->GetBondList().begin();
-         pos!=this->GetBondList().end();++pos)          (*pos)->CalcGradient(grad);
-
-      for(vector<MolBondAngle*>::iterator pos=this->GetBondAngleList().begin();
-         pos!=this->GetBondAngleList().end();++pos)     (*pos)->CalcGradient(grad);
-
-      for(vector<MolDihedralAngle*>::iterator pos=this->GetDihedralAngleList().begin();
-         pos!=this->GetDihedralAngleList().end();++pos) (*pos)->CalcGradient(grad);
-
-      #if 0
-      // Display gradient - for tests
-      for(map<MolAtom*,XYZ>::const_iterator pos=grad.begin();pos!=grad.end();++pos)
-      {
-         char buf[100];
-         sprintf(buf,"%10s Grad LLK= (%8.3f %8.3f %8.3f)",
-               pos->first->GetName().c_str(),pos->second.x,pos->second.y,pos->second.z);
-         cout<<buf<<endl;
-      }
-      #endif
+      MolRestraintPackGradient(pack,vGroup,nbAtom,x.data(),g.data());
       // Find maximum absolute value of gradient
       REAL f=0;
-      for(map<MolAtom*,XYZ>::const_iterator pos=grad.begin();pos!=grad.end();++pos)
-      {
-         if(abs(pos->second.x)>f) f=abs(pos->second.x);
-         if(abs(pos->second.y)>f) f=abs(pos->second.y);
-         if(abs(pos->second.z)>f) f=abs(pos->second.z);
-      }
+      for(unsigned long j=0;j<3*nbAtom;++j) if(abs(g[j])>f) f=abs(g[j]);
       if(f>1e-6) f=maxStep/f;
       else break;//nothing to optimize ?
-      // Average derivatives inside rigid groups
-      //:TODO: still allow rotations of rigid groups ?
-      //:TODO: Handle case when one atom belongs to several rigid groups...
-      for(vector<RigidGroup *>::const_iterator pos=this->GetRigidGroupList().begin();pos!=this->GetRigidGroupList().end();++pos)
-      {
-         if((*pos)->size()==0) continue; // Just in case...
-         REAL dx=0,dy=0,dz=0;
-         for(set<MolAtom *>::const_iterator at=(*pos)->begin();at!=(*pos)->end();++at)
-         {
-            dx+=(*at)->GetX();
-            dy+=(*at)->GetY();
-            dz+=(*at)->GetZ();
-         }
-         dx/=(*pos)->size();
-         dy/=(*pos)->size();
-         dz/=(*pos)->size();
-         for(set<MolAtom *>::const_iterator at=(*pos)->begin();at!=(*pos)->end();++at)
+      // Move according to max step to minimize LLK
+      for(unsigned long j=0;j<3*nbAtom;++j) x[j]-=g[j]*f;
+   }
+   std::copy(x.begin(),x.begin()+nbAtom,mvAtomX.begin());
+   std::copy(x.begin()+nbAtom,x.begin()+2*nbAtom,mvAtomY.begin());
+   std::copy(x.begin()+2*nbAtom,x.end(),mvAtomZ.begin());
+   mClockAtomPosition.Click();
+}
+
+void Molecule::OptimizeConformationLBFGS(const unsigned int nbIter,const unsigned int nbStart,
+                                         const REAL amplitude)
+{
+   VFN_DEBUG_ENTRY("Molecule::OptimizeConformationLBFGS()",5)
+   TAU_PROFILE("Molecule::OptimizeConformationLBFGS()","void (unsigned,unsigned,REAL)",TAU_DEFAULT);
+   const unsigned long nbAtom=mvpAtom.size();
+   if((nbAtom==0)||(nbStart==0)||(mvpRestraint.size()==0))
+   {
+      VFN_DEBUG_EXIT("Molecule::OptimizeConformationLBFGS():nothing to do",5)
+      return;
+   }
+   this->BuildRestraintPack();
+   const MolRestraintPack &pack=mRestraintPack;
+   vector<vector<unsigned int> > vGroup(mvRigidGroup.size());
+   for(unsigned long i=0;i<mvRigidGroup.size();++i) BuildAtomIndexList(*mvRigidGroup[i],vGroup[i]);
+   // Starting conformations: the current one, and random displacements around it.
+   // These are generated before the (parallel) minimizations, so that the result
+   // does not depend on the number of threads.
+   const unsigned long n=3*nbAtom;
+   vector<REAL> vx(n*nbStart);
+   for(unsigned int s=0;s<nbStart;++s)
+   {
+      REAL *x=&vx[s*n];
+      std::copy(mvAtomX.begin(),mvAtomX.end(),x);
+      std::copy(mvAtomY.begin(),mvAtomY.end(),x+nbAtom);
+      std::copy(mvAtomZ.begin(),mvAtomZ.end(),x+2*nbAtom);
+      if(s==0) continue;
+      for(unsigned long i=0;i<n;++i) x[i]+=amplitude*(2*(REAL)rand()/(REAL)RAND_MAX-1);
+      // Rigid groups are only translated
+      for(vector<vector<unsigned int> >::const_iterator pos=vGroup.begin();pos!=vGroup.end();++pos)
+      {
+         if(pos->size()==0) continue;
+         const unsigned int i0=pos->front();
+         const REAL dx=x[i0]-mvAtomX[i0],dy=x[nbAtom+i0]-mvAtomY[i0],dz=x[2*nbAtom+i0]-mvAtomZ[i0];
+         for(vector<unsigned int>::const_iterator i=pos->begin();i!=pos->end();++i)
          {
-            grad[*at].x=dx;
-            grad[*at].y=dy;
-            grad[*at].z=dz;
+            x[*i]=mvAtomX[*i]+dx;
+            x[nbAtom+*i]=mvAtomY[*i]+dy;
+            x[2*nbAtom+*i]=mvAtomZ[*i]+dz;
          }
       }
-      // Move according to max step to minimize LLK
-      for(map<MolAtom*,XYZ>::const_iterator pos=grad.begin();pos!=grad.end();++pos)
+   }
+   vector<REAL> vllk(nbStart);
+   #ifdef _OPENMP
+   #pragma omp parallel for schedule(dynamic)
+   #endif
+   for(long s=0;s<(long)nbStart;++s)
+      vllk[s]=MolRestraintPackLBFGS(pack,vGroup,nbAtom,&vx[s*n],nbIter);
+   const unsigned int best=std::min_element(vllk.begin(),vllk.end())-vllk.begin();
+   VFN_DEBUG_MESSAGE("Molecule::OptimizeConformationLBFGS(): best start #"<<best<<", llk="<<vllk[best],5)
+   const REAL *x=&vx[best*n];
+   std::copy(x,x+nbAtom,mvAtomX.begin());
+   std::copy(x+nbAtom,x+2*nbAtom,mvAtomY.begin());
+   std::copy(x+2*nbAtom,x+n,mvAtomZ.begin());
+   mClockAtomPosition.Click();
+   VFN_DEBUG_EXIT("Molecule::OptimizeConformationLBFGS()",5)
+}
+
+/** Compute the force (-gradient) and torque applied on a group of atoms,
+* as well as its center.
+*/
+void MDRigidGroupForce(const vector<unsigned int> &vidx,const REAL *px,const REAL *py,const REAL *pz,
+                       const REAL *gx,const REAL *gy,const REAL *gz,
+                       REAL &x0,REAL &y0,REAL &z0,XYZ &f,XYZ &t)
+{
+   x0=0;y0=0;z0=0;
+   for(vector<unsigned int>::const_iterator pos=vidx.begin();pos!=vidx.end();++pos)
+   {
+      x0+=px[*pos];
+      y0+=py[*pos];
+      z0+=pz[*pos];
+   }
+   x0/=vidx.size();
+   y0/=vidx.size();
+   z0/=vidx.size();
+   f=XYZ(0,0,0);
+   t=XYZ(0,0,0);
+   for(vector<unsigned int>::const_iterator pos=vidx.begin();pos!=vidx.end();++pos)
+   {
+      const REAL x=px[*pos]-x0,y=py[*pos]-y0,z=pz[*pos]-z0;
+      f.x-=gx[*pos];
+      f.y-=gy[*pos];
+      f.z-=gz[*pos];
+      t.x-=y*gz[*pos]-z*gy[*pos];
+      t.y-=z*gx[*pos]-x*gz[*pos];
+      t.z-=x*gy[*pos]-y*gx[*pos];
+   }
+}
+
+void Molecule::BuildMDRestraintPack(const vector<MolBond*> &vb,const vector<MolBondAngle*> &va,
+                                    const vector<MolDihedralAngle*> &vd)const
+{
+   if(  (mClockMDRestraintPack>mClockAtomList)
+      &&(mClockMDRestraintPack>mClockBondList)
+      &&(mClockMDRestraintPack>mClockBondAngleList)
+      &&(mClockMDRestraintPack>mClockDihedralAngleList)
+      &&(mMDRestraintPack.mvpBond.size()==vb.size())
+      &&(mMDRestraintPack.mvpBondAngle.size()==va.size())
+      &&(mMDRestraintPack.mvpDihedralAngle.size()==vd.size())
+      &&equal(vb.begin(),vb.end(),mMDRestraintPack.mvpBond.begin())
+      &&equal(va.begin(),va.end(),mMDRestraintPack.mvpBondAngle.begin())
+      &&equal(vd.begin(),vd.end(),mMDRestraintPack.mvpDihedralAngle.begin()))
+   {
+      if(mClockMDRestraintPack<mClockRestraintValue)
+      {
+         mMDRestraintPack.UpdateValues();
+         mClockMDRestraintPack.Click();
+      }
+      return;
+   }
+   VFN_DEBUG_MESSAGE("Molecule::BuildMDRestraintPack()",4)
+   mMDRestraintPack.Init(vb,va,vd);
+   mClockMDRestraintPack.Click();
+}
+
+void Molecule::BuildMDRigidGroup(const map<RigidGroup*,std::pair<XYZ,XYZ> > &vr)const
+{
+   const unsigned long nbAtom=mvpAtom.size();
+   bool same=(mClockMDRigidGroup>mClockRigidGroup)&&(mClockMDRigidGroup>mClockAtomList)
+             &&(mvMDRigidGroup.size()==vr.size())&&(mvMDIsRigid.size()==nbAtom);
+   if(same)
+   {
+      vector<const RigidGroup*>::const_iterator prg=mvMDRigidGroup.begin();
+      for(map<RigidGroup*,std::pair<XYZ,XYZ> >::const_iterator pos=vr.begin();pos!=vr.end();++pos,++prg)
+         if(pos->first!=*prg) {same=false;break;}
+   }
+   if(same) return;
+   VFN_DEBUG_MESSAGE("Molecule::BuildMDRigidGroup()",4)
+   const REAL m=500;// mass, same as in MolecularDynamicsEvolve()
+   const REAL *px=mvAtomX.data(),*py=mvAtomY.data(),*pz=mvAtomZ.data();
+   mvMDIsRigid.assign(nbAtom,false);
+   mvMDRigidGroup.resize(vr.size());
+   mvMDRigidGroupIdx.resize(vr.size());
+   mvMDRigidGroupMass.resize(vr.size());
+   mvMDRigidGroupInertia.resize(vr.size());
+   unsigned long j=0;
+   for(map<RigidGroup*,std::pair<XYZ,XYZ> >::const_iterator pos=vr.begin();pos!=vr.end();++pos,++j)
+   {
+      mvMDRigidGroup[j]=pos->first;
+      vector<unsigned int> *pidx=&mvMDRigidGroupIdx[j];
+      BuildAtomIndexList(*(pos->first),*pidx);
+      REAL x0,y0,z0;
+      XYZ f,t;
+      // Only used to get the center of the group
+      MDRigidGroupForce(*pidx,px,py,pz,px,py,pz,x0,y0,z0,f,t);
+      REAL r2=0;
+      for(vector<unsigned int>::const_iterator at=pidx->begin();at!=pidx->end();++at)
       {
-         pos->first->SetX(pos->first->GetX()-pos->second.x*f);
-         pos->first->SetY(pos->first->GetY()-pos->second.y*f);
-         pos->first->SetZ(pos->first->GetZ()-pos->second.z*f);
+         mvMDIsRigid[*at]=true;
+         r2+=(px[*at]-x0)*(px[*at]-x0)+(py[*at]-y0)*(py[*at]-y0)+(pz[*at]-z0)*(pz[*at]-z0);
       }
-      //this->RestraintStatus(cout);
-      //cout<<"LLK="<<this->GetLogLikelihood()<<endl;
+      mvMDRigidGroupMass[j]=m*pidx->size();
+      mvMDRigidGroupInertia[j]=m*r2+1e-6;
    }
+   mClockMDRigidGroup.Click();
 }
 
 void Molecule::MolecularDynamicsEvolve(map<MolAtom*,XYZ> &v0,const unsigned nbStep,const REAL dt,
@@ -4345,6 +5270,7 @@ void Molecule::MolecularDynamicsEvolve(map<MolAtom*,XYZ> &v0,const unsigned nbSt
                                        const vector<MolDihedralAngle*> &vd,
                                        map<RigidGroup*,std::pair<XYZ,XYZ> > &vr, REAL nrj0)
 {
+   TAU_PROFILE("Molecule::MolecularDynamicsEvolve()","void (...)",TAU_DEFAULT);
    const vector<MolBond*> *pvb=&vb;
    const vector<MolBondAngle*> *pva=&va;
    const vector<MolDihedralAngle*> *pvd=&vd;
@@ -4355,43 +5281,70 @@ void Molecule::MolecularDynamicsEvolve(map<MolAtom*,XYZ> &v0,const unsigned nbSt
       pva=&(this->GetBondAngleList());
       pvd=&(this->GetDihedralAngleList());
       for(vector<RigidGroup *>::iterator pos=this->GetRigidGroupList().begin();pos!=this->GetRigidGroupList().end();++pos)
-         (*pvr)[*pos]=make_pair(XYZ(0,0,0),XYZ(0,0,0));
+         if(pvr->count(*pos)==0) (*pvr)[*pos]=make_pair(XYZ(0,0,0),XYZ(0,0,0));
    }
    const REAL m=500;// mass
    const REAL im=1./m;
-
-   // Try to keep total energy constant
-   REAL e_v,e_k,v_r=1.0;
+   const unsigned long nbAtom=mvpAtom.size();
+   REAL *px=mvAtomX.data(),*py=mvAtomY.data(),*pz=mvAtomZ.data();
+
+   // Rigid groups: atom indices, total mass & moment of inertia (isotropic approximation)
+   this->BuildMDRigidGroup(*pvr);
+   const vector<vector<unsigned int> > &vrgidx=mvMDRigidGroupIdx;
+   const REAL *vrgmass=mvMDRigidGroupMass.data(),*vrginertia=mvMDRigidGroupInertia.data();
+   const unsigned long nbRigid=vrgidx.size();
+   mvMDRigidGroupState.resize(5*nbRigid);
+   XYZ *vrgv=mvMDRigidGroupState.data(),*vrgw=vrgv+nbRigid,*vrga=vrgw+nbRigid,
+       *vrgalpha=vrga+nbRigid,*vrgc=vrgalpha+nbRigid;
+   {
+      unsigned long j=0;
+      for(map<RigidGroup*,std::pair<XYZ,XYZ> >::const_iterator pos=pvr->begin();pos!=pvr->end();++pos,++j)
+      {
+         vrgv[j]=pos->second.first;
+         vrgw[j]=pos->second.second;
+      }
+   }
+
+   // Free atoms: indices & velocities in packed arrays
+   mvMDAtomIdx.clear();
+   mvMDVelocity.clear();
+   for(map<MolAtom*,XYZ>::const_iterator pos=v0.begin();pos!=v0.end();++pos)
+   {
+      if(mvMDIsRigid[pos->first->GetIndex()]) continue;
+      mvMDAtomIdx.push_back(pos->first->GetIndex());
+      mvMDVelocity.push_back(pos->second.x);
+      mvMDVelocity.push_back(pos->second.y);
+      mvMDVelocity.push_back(pos->second.z);
+   }
+   const unsigned long nbFree=mvMDAtomIdx.size();
+   const unsigned int *pidx=mvMDAtomIdx.data();
+   REAL *pv=mvMDVelocity.data();
+   mvMDGrad.resize(3*nbAtom);
+   REAL *gx=mvMDGrad.data(),*gy=gx+nbAtom,*gz=gy+nbAtom;
+   this->BuildMDRestraintPack(*pvb,*pva,*pvd);
+
+   // Initial gradient
+   fill(mvMDGrad.begin(),mvMDGrad.end(),(REAL)0);
+   REAL e_v=mMDRestraintPack.GetLogLikelihood(px,py,pz,gx,gy,gz);
+   for(unsigned long j=0;j<nbRigid;++j)
+   {
+      XYZ f,t;
+      MDRigidGroupForce(vrgidx[j],px,py,pz,gx,gy,gz,vrgc[j].x,vrgc[j].y,vrgc[j].z,f,t);
+      vrga[j]=XYZ(f.x/vrgmass[j],f.y/vrgmass[j],f.z/vrgmass[j]);
+      vrgalpha[j]=XYZ(t.x/vrginertia[j],t.y/vrginertia[j],t.z/vrginertia[j]);
+   }
+
+   // Velocity Verlet integration, trying to keep total energy constant
+   REAL e_k,v_r=1.0;
+   const REAL hdt=0.5*dt;
    for(unsigned i = 0; i < nbStep; ++i)
    {
-      // Calc full gradient
-      map<MolAtom*,XYZ> grad;
-      for(map<MolAtom*,XYZ>::iterator pos=v0.begin();pos!=v0.end();++pos) grad[pos->first]=XYZ(0,0,0);
-
-      // :TODO: handle rigid groups ?
-      e_v=0;
-      for(vector<MolBond*>::const_iterator pos=pvb->begin();pos!=pvb->end();++pos)
-      {
-         (*pos)->CalcGradient(grad);
-         e_v+=(*pos)->GetLogLikelihood(false,false);
-      }
-
-      for(vector<MolBondAngle*>::const_iterator pos=pva->begin();pos!=pva->end();++pos)
-      {
-         (*pos)->CalcGradient(grad);
-         e_v+=(*pos)->GetLogLikelihood(false,false);
-      }
-
-      for(vector<MolDihedralAngle*>::const_iterator pos=pvd->begin();pos!=pvd->end();++pos)
-      {
-         (*pos)->CalcGradient(grad);
-         e_v+=(*pos)->GetLogLikelihood(false,false);
-      }
-
       //kinetic energy
       e_k=0;
-      for(map<MolAtom*,XYZ>::const_iterator pos=v0.begin();pos!=v0.end();++pos)
-         e_k += 0.5*m*(pos->second.x*pos->second.x + pos->second.y*pos->second.y + pos->second.z*pos->second.z);
+      for(unsigned long j=0;j<3*nbFree;++j) e_k += 0.5*m*pv[j]*pv[j];
+      for(unsigned long j=0;j<nbRigid;++j)
+         e_k += 0.5*vrgmass[j]*(vrgv[j].x*vrgv[j].x+vrgv[j].y*vrgv[j].y+vrgv[j].z*vrgv[j].z)
+               +0.5*vrginertia[j]*(vrgw[j].x*vrgw[j].x+vrgw[j].y*vrgw[j].y+vrgw[j].z*vrgw[j].z);
 
       if(nrj0==0) nrj0=e_k+e_v;
       else
@@ -4401,39 +5354,96 @@ void Molecule::MolecularDynamicsEvolve(map<MolAtom*,XYZ> &v0,const unsigned nbSt
          if(de<e_k) v_r=sqrt((e_k-de)/e_k);
          else v_r=0.0;
       }
-
       #if 0
       char buf[100];
       sprintf(buf,"(i) LLK + Ek = %10.3f + %10.3f =%10.3f (nrj0=%10.3f)",e_v,e_k,e_v+e_k,nrj0);
       cout<<buf<<endl;
-
-      // Display gradient & speed - for tests
-      for(map<MolAtom*,XYZ>::iterator pos=v0.begin();pos!=v0.end();++pos)
+      #endif
+      // Half-step speed with the current gradient, then move atoms
+      for(unsigned long j=0;j<nbFree;++j)
+      {
+         const unsigned int k=pidx[j];
+         REAL *v=pv+3*j;
+         v[0]=v_r*v[0]-gx[k]*hdt*im;
+         v[1]=v_r*v[1]-gy[k]*hdt*im;
+         v[2]=v_r*v[2]-gz[k]*hdt*im;
+         px[k]+=v[0]*dt;
+         py[k]+=v[1]*dt;
+         pz[k]+=v[2]*dt;
+      }
+      for(unsigned long j=0;j<nbRigid;++j)
+      {
+         XYZ *v=&vrgv[j],*w=&vrgw[j];
+         v->x=v_r*v->x+vrga[j].x*hdt;
+         v->y=v_r*v->y+vrga[j].y*hdt;
+         v->z=v_r*v->z+vrga[j].z*hdt;
+         w->x=v_r*w->x+vrgalpha[j].x*hdt;
+         w->y=v_r*w->y+vrgalpha[j].y*hdt;
+         w->z=v_r*w->z+vrgalpha[j].z*hdt;
+         const REAL ang=sqrt(w->x*w->x+w->y*w->y+w->z*w->z)*dt;
+         if(ang>1e-8)
+         {
+            REAL mat[9],dx,dy,dz;
+            Quaternion::RotationQuaternion(ang,w->x,w->y,w->z).GetRotationMatrix(mat);
+            RotateAtomIndexList(px,py,pz,vrgidx[j],mat,vrgc[j].x,vrgc[j].y,vrgc[j].z,dx,dy,dz);
+         }
+         for(vector<unsigned int>::const_iterator at=vrgidx[j].begin();at!=vrgidx[j].end();++at)
+         {
+            px[*at]+=v->x*dt;
+            py[*at]+=v->y*dt;
+            pz[*at]+=v->z*dt;
+         }
+      }
+      mClockAtomPosition.Click();
+      // New gradient
+      fill(mvMDGrad.begin(),mvMDGrad.end(),(REAL)0);
+      e_v=mMDRestraintPack.GetLogLikelihood(px,py,pz,gx,gy,gz);
+      // Second half-step speed with the new gradient
+      for(unsigned long j=0;j<nbFree;++j)
       {
-         sprintf(buf,"%10s xyz= (%8.3f %8.3f %8.3f) v= (%8.3f %8.3f %8.3f) m*a= (%8.3f %8.3f %8.3f)",
-               pos->first->GetName().c_str(),
-               pos->first->GetX(),pos->first->GetY(),pos->first->GetZ(),
-                v0[*pos].x    ,v0[*pos].y     ,v0[*pos].z,
-               -grad[*pos].x*im,-grad[*pos].y*im,-grad[*pos].z*im);
-         //cout<<buf<<endl;
+         const unsigned int k=pidx[j];
+         REAL *v=pv+3*j;
+         v[0]-=gx[k]*hdt*im;
+         v[1]-=gy[k]*hdt*im;
+         v[2]-=gz[k]*hdt*im;
       }
-      //cout<<endl<<endl;
-      #endif
-      // Move according to max step to minimize LLK
-      for(map<MolAtom*,XYZ>::const_iterator pos=v0.begin();pos!=v0.end();++pos)
+      for(unsigned long j=0;j<nbRigid;++j)
       {
-         const XYZ *pa=&(grad[pos->first]);
-         pos->first->SetX(pos->first->GetX()+pos->second.x*dt*v_r-0.5*im*dt*dt*pa->x);
-         pos->first->SetY(pos->first->GetY()+pos->second.y*dt*v_r-0.5*im*dt*dt*pa->y);
-         pos->first->SetZ(pos->first->GetZ()+pos->second.z*dt*v_r-0.5*im*dt*dt*pa->z);
+         XYZ f,t;
+         MDRigidGroupForce(vrgidx[j],px,py,pz,gx,gy,gz,vrgc[j].x,vrgc[j].y,vrgc[j].z,f,t);
+         vrga[j]=XYZ(f.x/vrgmass[j],f.y/vrgmass[j],f.z/vrgmass[j]);
+         vrgalpha[j]=XYZ(t.x/vrginertia[j],t.y/vrginertia[j],t.z/vrginertia[j]);
+         vrgv[j].x+=vrga[j].x*hdt;
+         vrgv[j].y+=vrga[j].y*hdt;
+         vrgv[j].z+=vrga[j].z*hdt;
+         vrgw[j].x+=vrgalpha[j].x*hdt;
+         vrgw[j].y+=vrgalpha[j].y*hdt;
+         vrgw[j].z+=vrgalpha[j].z*hdt;
       }
-      // Compute new speed
-      for(map<MolAtom*,XYZ>::iterator pos=v0.begin();pos!=v0.end();++pos)
+   }
+   // Copy back the new speeds
+   for(unsigned long j=0;j<nbFree;++j)
+   {
+      XYZ *v=&(v0[mvpAtom[pidx[j]]]);
+      v->x=pv[3*j];
+      v->y=pv[3*j+1];
+      v->z=pv[3*j+2];
+   }
+   {
+      unsigned long j=0;
+      for(map<RigidGroup*,std::pair<XYZ,XYZ> >::iterator pos=pvr->begin();pos!=pvr->end();++pos,++j)
       {
-         const XYZ *pa=&(grad[pos->first]);
-         pos->second.x = v_r*pos->second.x - pa->x*dt*im;
-         pos->second.y = v_r*pos->second.y - pa->y*dt*im;
-         pos->second.z = v_r*pos->second.z - pa->z*dt*im;
+         pos->second.first=vrgv[j];
+         pos->second.second=vrgw[j];
+         for(vector<unsigned int>::const_iterator at=vrgidx[j].begin();at!=vrgidx[j].end();++at)
+         {
+            map<MolAtom*,XYZ>::iterator v=v0.find(mvpAtom[*at]);
+            if(v==v0.end()) continue;
+            const REAL x=px[*at]-vrgc[j].x,y=py[*at]-vrgc[j].y,z=pz[*at]-vrgc[j].z;
+            v->second.x=vrgv[j].x+vrgw[j].y*z-vrgw[j].z*y;
+            v->second.y=vrgv[j].y+vrgw[j].z*x-vrgw[j].x*z;
+            v->second.z=vrgv[j].z+vrgw[j].x*y-vrgw[j].y*x;
+         }
       }
    }
 }
@@ -4471,6 +5481,24 @@ void Molecule::RotateAtomGroup(const MolAtom &at1,const MolAtom &at2,
 void Molecule::RotateAtomGroup(const MolAtom &at,const REAL vx,const REAL vy,const REAL vz,
                                const set<MolAtom *> &atoms, const REAL angle,
                                const bool keepCenter)
+{
+   if(atoms.size()==0) return;
+   vector<unsigned int> vidx;
+   BuildAtomIndexList(atoms,vidx);
+   this->RotateAtomGroup(at,vx,vy,vz,vidx,angle,keepCenter);
+}
+void Molecule::RotateAtomGroup(const MolAtom &at1,const MolAtom &at2,
+                               const std::vector<unsigned int> &atoms, const REAL angle,
+                               const bool keepCenter)
+{
+   const REAL vx=at2.X()-at1.X();
+   const REAL vy=at2.Y()-at1.Y();
+   const REAL vz=at2.Z()-at1.Z();
+   this->RotateAtomGroup(at1,vx,vy,vz,atoms,angle,keepCenter);
+}
+void Molecule::RotateAtomGroup(const MolAtom &at,const REAL vx,const REAL vy,const REAL vz,
+                               const std::vector<unsigned int> &atoms, const REAL angle,
+                               const bool keepCenter)
 {
    TAU_PROFILE("Molecule::RotateAtomGroup(MolAtom&,vx,vy,vz,...)","void (...)",TAU_DEFAULT);
    if(atoms.size()==0) return;
@@ -4479,73 +5507,15 @@ void Molecule::RotateAtomGroup(const MolAtom &at,const REAL vx,const REAL vy,con
    const REAL z0=at.Z();
    // :KLUDGE: ? Refuse to do anything if vector is not well defined
    if((fabs(vx)+fabs(vy)+fabs(vz))<1e-6) return;
-   REAL dx=0.,dy=0.,dz=0.;
    bool keepc=keepCenter;
    if(keepc)
       if(  (this->GetPar(mXYZ.data()  ).IsFixed())
          ||(this->GetPar(mXYZ.data()+1).IsFixed())
          ||(this->GetPar(mXYZ.data()+2).IsFixed())) keepc=false;
-   #if 0
-   const REAL ca=cos(angle),sa=sin(angle);
-   const REAL ca1=1-ca;
-   const REAL vnorm=1/sqrt(vx*vx+vy*vy+vz*vz);
-   const REAL ux=vx*vnorm,uy=vy*vnorm,uz=vz*vnorm;
-   const REAL m00=ca+ux*ux*ca1;// See http://en.wikipedia.org/wiki/Rotation_matrix
-   const REAL m01=ux*uy*ca1-uz*sa;
-   const REAL m02=ux*uz*ca1+uy*sa;
-   const REAL m10=uy*ux*ca1+uz*sa; // :TODO: Check formulas !
-   const REAL m11=ca+uy*uy*ca1;
-   const REAL m12=uy*uz*ca1-ux*sa;
-   const REAL m20=uz*ux*ca1-uy*sa;
-   const REAL m21=uz*uy*ca1+ux*sa;
-   const REAL m22=ca+uz*uz*ca1;
-   for(set<MolAtom *>::const_iterator pos=atoms.begin();pos!=atoms.end();++pos)
-   {
-      if(keepc)
-      {
-         dx -= (*pos)->X();
-         dy -= (*pos)->Y();
-         dz -= (*pos)->Z();
-      }
-      const REAL x=(*pos)->X() - x0;
-      const REAL y=(*pos)->Y() - y0;
-      const REAL z=(*pos)->Z() - z0;
-
-      (*pos)->X() = m00*x+m01*y+m02*z+x0;
-      (*pos)->Y() = m10*x+m11*y+m12*z+y0;
-      (*pos)->Z() = m20*x+m21*y+m22*z+z0;
-      if(keepc)
-      {
-         dx += (*pos)->X();
-         dy += (*pos)->Y();
-         dz += (*pos)->Z();
-      }
-   }
-   #else
-   const Quaternion quat=Quaternion::RotationQuaternion(angle,vx,vy,vz);
-   for(set<MolAtom *>::const_iterator pos=atoms.begin();pos!=atoms.end();++pos)
-   {
-      if(keepc)
-      {
-         dx -= (*pos)->X();
-         dy -= (*pos)->Y();
-         dz -= (*pos)->Z();
-      }
-      (*pos)->X() -= x0;
-      (*pos)->Y() -= y0;
-      (*pos)->Z() -= z0;
-      quat.RotateVector((*pos)->X(),(*pos)->Y(),(*pos)->Z());
-      (*pos)->X() += x0;
-      (*pos)->Y() += y0;
-      (*pos)->Z() += z0;
-      if(keepc)
-      {
-         dx += (*pos)->X();
-         dy += (*pos)->Y();
-         dz += (*pos)->Z();
-      }
-   }
-   #endif
+   REAL m[9];
+   Quaternion::RotationQuaternion(angle,vx,vy,vz).GetRotationMatrix(m);
+   REAL dx,dy,dz;
+   RotateAtomIndexList(mvAtomX.data(),mvAtomY.data(),mvAtomZ.data(),atoms,m,x0,y0,z0,dx,dy,dz);
    // (dx,dy,dz) = vector of the translation of the center of the molecule due to the rotation
    if(keepc)
    {
@@ -4565,11 +5535,20 @@ void Molecule::TranslateAtomGroup(const set<MolAtom *> &atoms,
                                   const REAL dx,const REAL dy,const REAL dz,
                                   const bool keepCenter)
 {
-   for(set<MolAtom *>::const_iterator pos=atoms.begin();pos!=atoms.end();++pos)
+   vector<unsigned int> vidx;
+   BuildAtomIndexList(atoms,vidx);
+   this->TranslateAtomGroup(vidx,dx,dy,dz,keepCenter);
+}
+void Molecule::TranslateAtomGroup(const std::vector<unsigned int> &atoms,
+                                  const REAL dx,const REAL dy,const REAL dz,
+                                  const bool keepCenter)
+{
+   REAL *px=mvAtomX.data(),*py=mvAtomY.data(),*pz=mvAtomZ.data();
+   for(vector<unsigned int>::const_iterator pos=atoms.begin();pos!=atoms.end();++pos)
    {
-      (*pos)->X() += dx;
-      (*pos)->Y() += dy;
-      (*pos)->Z() += dz;
+      px[*pos] += dx;
+      py[*pos] += dy;
+      pz[*pos] += dz;
    }
    bool keepc=keepCenter;
    if(keepc)
@@ -4645,6 +5624,12 @@ const map<MolAtom *,set<MolAtom *> > &Molecule::GetConnectivityTable()
 RefinableObjClock& Molecule::GetBondListClock(){return mClockBondList;}
 const RefinableObjClock& Molecule::GetBondListClock()const{return mClockBondList;}
 
+RefinableObjClock& Molecule::GetBondAngleListClock(){return mClockBondAngleList;}
+const RefinableObjClock& Molecule::GetBondAngleListClock()const{return mClockBondAngleList;}
+
+RefinableObjClock& Molecule::GetDihedralAngleListClock(){return mClockDihedralAngleList;}
+const RefinableObjClock& Molecule::GetDihedralAngleListClock()const{return mClockDihedralAngleList;}
+
 RefinableObjClock& Molecule::GetAtomPositionClock(){return mClockAtomPosition;}
 const RefinableObjClock& Molecule::GetAtomPositionClock()const{return mClockAtomPosition;}
 
@@ -4654,6 +5639,9 @@ const RefinableObjClock& Molecule::GetAtomScattPowClock()const { return mClockAt
       RefinableObjClock& Molecule::GetRigidGroupClock(){return mClockRigidGroup;}
 const RefinableObjClock& Molecule::GetRigidGroupClock()const{return mClockRigidGroup;}
 
+      RefinableObjClock& Molecule::GetRestraintValueClock(){return mClockRestraintValue;}
+const RefinableObjClock& Molecule::GetRestraintValueClock()const{return mClockRestraintValue;}
+
 void Molecule::RigidifyWithDihedralAngles()
 {
    this->BuildConnectivityTable();
@@ -4991,7 +5979,7 @@ REAL Molecule::BondLengthRandomChange(const StretchModeBondLength& mode, const R
    dx*=change/l;
    dy*=change/l;
    dz*=change/l;
-   this->TranslateAtomGroup(mode.mvTranslatedAtomList,dx,dy,dz,true);
+   this->TranslateAtomGroup(mode.GetAtomIndexList(mode.mvTranslatedAtomList),dx,dy,dz,true);
    return change;
 }
 
@@ -5049,7 +6037,7 @@ REAL Molecule::BondAngleRandomChange(const StretchModeBondAngle& mode, const REA
       #endif
    }
    else change=(2.*(REAL)rand()-(REAL)RAND_MAX)/(REAL)RAND_MAX*mode.mBaseAmplitude*amplitude;
-   this->RotateAtomGroup(*(mode.mpAtom1),vx,vy,vz,mode.mvRotatedAtomList,change,true);
+   this->RotateAtomGroup(*(mode.mpAtom1),vx,vy,vz,mode.GetAtomIndexList(mode.mvRotatedAtomList),change,true);
    return change;
 }
 REAL Molecule::DihedralAngleRandomChange(const StretchModeTorsion& mode, const REAL amplitude,
@@ -5089,7 +6077,7 @@ REAL Molecule::DihedralAngleRandomChange(const StretchModeTorsion& mode, const R
       #endif
    }
    else change=(REAL)(2.*rand()-RAND_MAX)/(REAL)RAND_MAX*mode.mBaseAmplitude*amplitude;
-   this->RotateAtomGroup(*(mode.mpAtom1),*(mode.mpAtom2),mode.mvRotatedAtomList,change,true);
+   this->RotateAtomGroup(*(mode.mpAtom1),*(mode.mpAtom2),mode.GetAtomIndexList(mode.mvRotatedAtomList),change,true);
    return change;
 }
 
@@ -5184,6 +6172,20 @@ const vector<MolZAtom>& Molecule::AsZMatrix(const bool keeporder)const
 {
    this->BuildConnectivityTable();
    const long n=mvpAtom.size();
+   if(  (mClockAsZMatrixOrder>mClockConnectivityTable)
+      &&(mClockAsZMatrixOrder>mClockAtomList)
+      &&(keeporder==mAsZMatrixKeepOrder)
+      &&((long)mAsZMatrix.size()==n))
+   {// Same atom ordering, only update what changed
+      if(mClockAsZMatrix<mClockAtomScattPow)
+         for(long z=0;z<n;++z)
+            if(mvAsZMatrixIndex[4*z]>=0) mAsZMatrix[z].mpPow=mvpAtomScattPow[mvAsZMatrixIndex[4*z]];
+      if(mClockAsZMatrix<mClockAtomPosition) this->UpdateZMatrixInternalCoords();
+      mClockAsZMatrix.Click();
+      return mAsZMatrix;
+   }
+   VFN_DEBUG_ENTRY("Molecule::AsZMatrix()",4)
+   TAU_PROFILE("Molecule::AsZMatrix()","void (bool)",TAU_DEFAULT);
    // index of the atoms in the list
    map<const MolAtom*,long> vIndex;
    {
@@ -5268,10 +6270,80 @@ const vector<MolZAtom>& Molecule::AsZMatrix(const bool keeporder)const
       }
       long z=0;
       BuildZMatrixRecursive(z,0,mvpAtom,mConnectivityTable,mAsZMatrix,vIndex,vZIndex,vrZIndex);
+      // Store the atom indices involved in each line of the z-matrix
+      mvAsZMatrixIndex.assign(4*n,-1);
+      for(long i=0;i<n;++i)
+      {
+         long *p=&mvAsZMatrixIndex[4*i];
+         p[0]=vrZIndex[i];
+         if(i>0) p[1]=vrZIndex[mAsZMatrix[i].mBondAtom];
+         if(i>1) p[2]=vrZIndex[mAsZMatrix[i].mBondAngleAtom];
+         if(i>2) p[3]=vrZIndex[mAsZMatrix[i].mDihedralAtom];
+      }
+   }
+   if(keeporder)
+   {
+      mvAsZMatrixIndex.assign(4*n,-1);
+      for(long i=0;i<n;++i)
+      {
+         long *p=&mvAsZMatrixIndex[4*i];
+         p[0]=i;
+         if(i>0) p[1]=mAsZMatrix[i].mBondAtom;
+         if(i>1) p[2]=mAsZMatrix[i].mBondAngleAtom;
+         if(i>2) p[3]=mAsZMatrix[i].mDihedralAtom;
+      }
+   }
+   mAsZMatrixKeepOrder=keeporder;
+   mvAsZMatrixXYZ.resize(3*n);
+   REAL *p=mvAsZMatrixXYZ.data();
+   for(long i=0;i<n;++i)
+   {
+      *p++=mvAtomX[i];
+      *p++=mvAtomY[i];
+      *p++=mvAtomZ[i];
    }
+   mClockAsZMatrixOrder.Click();
+   mClockAsZMatrix.Click();
+   VFN_DEBUG_EXIT("Molecule::AsZMatrix()",4)
    return mAsZMatrix;
 }
 
+void Molecule::UpdateZMatrixInternalCoords()const
+{
+   TAU_PROFILE("Molecule::UpdateZMatrixInternalCoords()","void ()",TAU_DEFAULT);
+   const long n=mvpAtom.size();
+   // Find the atoms which moved since the last update
+   vector<bool> moved(n,false);
+   bool any=false;
+   REAL *p=mvAsZMatrixXYZ.data();
+   for(long i=0;i<n;++i,p+=3)
+   {
+      if((p[0]==mvAtomX[i])&&(p[1]==mvAtomY[i])&&(p[2]==mvAtomZ[i])) continue;
+      p[0]=mvAtomX[i];
+      p[1]=mvAtomY[i];
+      p[2]=mvAtomZ[i];
+      moved[i]=true;
+      any=true;
+   }
+   if(!any) return;
+   for(long z=1;z<n;++z)
+   {
+      const long *pi=&mvAsZMatrixIndex[4*z];
+      if(pi[0]<0) continue;// Atom not reached when building the z-matrix (unconnected ?)
+      const unsigned int nb=(z>2) ? 4 : z+1;
+      bool m=false;
+      for(unsigned int j=0;j<nb;++j) m = m || moved[pi[j]];
+      if(!m) continue;
+      mAsZMatrix[z].mBondLength=GetBondLength(*mvpAtom[pi[1]],*mvpAtom[pi[0]]);
+      if(z>1)
+         mAsZMatrix[z].mBondAngle=GetBondAngle(*mvpAtom[pi[2]],*mvpAtom[pi[1]],*mvpAtom[pi[0]]);
+      if(z>2)
+         mAsZMatrix[z].mDihedralAngle=fmod(GetDihedralAngle(*mvpAtom[pi[3]],*mvpAtom[pi[2]],
+                                                            *mvpAtom[pi[1]],*mvpAtom[pi[0]])+2*M_PI,
+                                           2*M_PI);
+   }
+}
+
 void Molecule::InitRefParList()
 {
 }
@@ -5331,15 +6403,25 @@ void Molecule::BuildRingList()
    this->BuildConnectivityTable();
    if(mClockRingList>mClockConnectivityTable) return;
    VFN_DEBUG_ENTRY("Molecule::BuildRingList()",7)
-   for(vector<MolAtom*>::const_iterator pos=mvpAtom.begin();pos!=mvpAtom.end();++pos)
-      (*pos)->SetIsInRing(false);
+   mvRing.clear();
+   // Only bonds inside biconnected components can be part of a ring, so restrict
+   // the search to these, and skip all the acyclic parts of the molecule.
+   map<MolAtom *,set<MolAtom *> > ringConnect;
+   for(unsigned long i=0;i<mvpAtom.size();i++)
+   {
+      mvpAtom[i]->SetIsInRing(false);
+      for(vector<unsigned int>::const_iterator pos=mvConnectivityIndex[i].begin();
+          pos!=mvConnectivityIndex[i].end();++pos)
+         if(this->IsBondInRing(*mvpAtom[i],*mvpAtom[*pos]))
+            ringConnect[mvpAtom[i]].insert(mvpAtom[*pos]);
+   }
    list<MolAtom *> atomlist;
    // Use a map with a set for key to eliminate duplicate rings
    map<set<MolAtom *>,list<MolAtom *> > ringlist;
-   for(unsigned long i=0;i<mvpAtom.size();i++)
+   for(map<MolAtom *,set<MolAtom *> >::const_iterator pos=ringConnect.begin();pos!=ringConnect.end();++pos)
    {
       atomlist.clear();
-      BuildRingRecursive(mvpAtom[i],mvpAtom[i],mConnectivityTable,atomlist,ringlist);
+      BuildRingRecursive(pos->first,pos->first,ringConnect,atomlist,ringlist);
    }
    for(map<set<MolAtom *>,list<MolAtom *> >::const_iterator pos0=ringlist.begin();pos0!=ringlist.end();pos0++)
    {
@@ -5378,6 +6460,85 @@ void Molecule::BuildConnectivityTable()const
       mConnectivityTable[&(mvpBond[i]->GetAtom1())].insert(&(mvpBond[i]->GetAtom2()));
       mConnectivityTable[&(mvpBond[i]->GetAtom2())].insert(&(mvpBond[i]->GetAtom1()));
    }
+   // Index-based graph
+   const unsigned long nb=mvpAtom.size();
+   mvConnectivityIndex.assign(nb,vector<unsigned int>());
+   for(unsigned long i=0;i<mvpBond.size();++i)
+   {
+      const unsigned int i1=mvpBond[i]->GetAtom1().GetIndex(),i2=mvpBond[i]->GetAtom2().GetIndex();
+      if(find(mvConnectivityIndex[i1].begin(),mvConnectivityIndex[i1].end(),i2)!=mvConnectivityIndex[i1].end())
+         continue;// Duplicate bond
+      mvConnectivityIndex[i1].push_back(i2);
+      mvConnectivityIndex[i2].push_back(i1);
+   }
+   // Depth-first search (non-recursive, Tarjan) to get the bridges & biconnected components
+   mvConnectivityBCC.resize(nb);
+   for(unsigned long i=0;i<nb;++i) mvConnectivityBCC[i].assign(mvConnectivityIndex[i].size(),0);
+   mvDFSPre.assign(nb,-1);
+   mvDFSLow.assign(nb,-1);
+   mvDFSSize.assign(nb,1);
+   mvDFSParent.assign(nb,-1);
+   mvDFSRoot.assign(nb,-1);
+   mvDFSOrder.clear();
+   mvDFSOrder.reserve(nb);
+   // Stacks of (atom, index of the bond in mvConnectivityIndex[atom])
+   vector<pair<unsigned int,unsigned int> > vStack,vBondStack;
+   unsigned int nbBCC=0;
+   for(unsigned int r=0;r<nb;++r)
+   {
+      if(mvDFSPre[r]>=0) continue;
+      mvDFSPre[r]=mvDFSOrder.size();
+      mvDFSLow[r]=mvDFSPre[r];
+      mvDFSRoot[r]=r;
+      mvDFSOrder.push_back(r);
+      vStack.push_back(make_pair(r,0));
+      while(vStack.size()>0)
+      {
+         const unsigned int u=vStack.back().first;
+         if(vStack.back().second<mvConnectivityIndex[u].size())
+         {
+            const unsigned int k=vStack.back().second++;
+            const unsigned int v=mvConnectivityIndex[u][k];
+            if(mvDFSPre[v]<0)
+            {// Tree edge
+               mvDFSPre[v]=mvDFSOrder.size();
+               mvDFSLow[v]=mvDFSPre[v];
+               mvDFSParent[v]=u;
+               mvDFSRoot[v]=r;
+               mvDFSOrder.push_back(v);
+               vBondStack.push_back(make_pair(u,k));
+               vStack.push_back(make_pair(v,0));
+            }
+            else if(((long)v!=mvDFSParent[u])&&(mvDFSPre[v]<mvDFSPre[u]))
+            {// Back edge
+               if(mvDFSPre[v]<mvDFSLow[u]) mvDFSLow[u]=mvDFSPre[v];
+               vBondStack.push_back(make_pair(u,k));
+            }
+         }
+         else
+         {
+            vStack.pop_back();
+            if(mvDFSParent[u]<0) continue;
+            const unsigned int p=mvDFSParent[u];
+            mvDFSSize[p]+=mvDFSSize[u];
+            if(mvDFSLow[u]<mvDFSLow[p]) mvDFSLow[p]=mvDFSLow[u];
+            if(mvDFSLow[u]>=mvDFSPre[p])
+            {// All bonds down to p-u form a biconnected component
+               for(;;)
+               {
+                  const pair<unsigned int,unsigned int> b=vBondStack.back();
+                  vBondStack.pop_back();
+                  const unsigned int a1=b.first,a2=mvConnectivityIndex[a1][b.second];
+                  mvConnectivityBCC[a1][b.second]=nbBCC;
+                  mvConnectivityBCC[a2][find(mvConnectivityIndex[a2].begin(),mvConnectivityIndex[a2].end(),a1)
+                                        -mvConnectivityIndex[a2].begin()]=nbBCC;
+                  if((a1==p)&&(a2==u)) break;
+               }
+               ++nbBCC;
+            }
+         }
+      }
+   }
 
    #ifdef __DEBUG__
    {
@@ -5400,10 +6561,173 @@ void Molecule::BuildConnectivityTable()const
    VFN_DEBUG_EXIT("Molecule::BuildConnectivityTable()",5)
 }
 
+bool Molecule::IsBondInRing(const MolAtom &at1,const MolAtom &at2)const
+{
+   this->BuildConnectivityTable();
+   const long i=at1.GetIndex(),j=at2.GetIndex();
+   // A tree bond is a bridge unless the sub-tree below is linked above it by a back edge
+   if(mvDFSParent[j]==i) return mvDFSLow[j]<=mvDFSPre[i];
+   if(mvDFSParent[i]==j) return mvDFSLow[i]<=mvDFSPre[j];
+   return true;// Back edge
+}
+
+unsigned int Molecule::GetBondBiconnectedComponent(const MolAtom &at1,const MolAtom &at2)const
+{
+   this->BuildConnectivityTable();
+   const unsigned int i=at1.GetIndex();
+   const vector<unsigned int>::const_iterator pos=find(mvConnectivityIndex[i].begin(),
+                                                       mvConnectivityIndex[i].end(),at2.GetIndex());
+   return mvConnectivityBCC[i][pos-mvConnectivityIndex[i].begin()];
+}
+
+long Molecule::GetBondSideNbAtom(const MolAtom &at1,const MolAtom &at2)const
+{
+   if(this->IsBondInRing(at1,at2)) return -1;
+   const long i=at1.GetIndex(),j=at2.GetIndex();
+   if(mvDFSParent[i]==j) return mvDFSSize[i];
+   return mvDFSSize[mvDFSRoot[i]]-mvDFSSize[j];
+}
+
+void Molecule::GetBondSideAtomList(const MolAtom &at1,const MolAtom &at2,std::set<MolAtom*> &atoms)const
+{
+   this->BuildConnectivityTable();
+   const long i=at1.GetIndex(),j=at2.GetIndex();
+   // Sub-trees are contiguous in the DFS order
+   if(mvDFSParent[i]==j)
+   {
+      for(long k=mvDFSPre[i];k<(mvDFSPre[i]+mvDFSSize[i]);++k) atoms.insert(mvpAtom[mvDFSOrder[k]]);
+      return;
+   }
+   const long r=mvDFSRoot[i];
+   for(long k=mvDFSPre[r];k<mvDFSPre[j];++k) atoms.insert(mvpAtom[mvDFSOrder[k]]);
+   for(long k=mvDFSPre[j]+mvDFSSize[j];k<(mvDFSPre[r]+mvDFSSize[r]);++k) atoms.insert(mvpAtom[mvDFSOrder[k]]);
+}
+
+void Molecule::BuildRestraintAtomIndex()const
+{
+   if(  (mClockRestraintAtomIndex>mClockAtomList)
+      &&(mClockRestraintAtomIndex>mClockBondList)
+      &&(mClockRestraintAtomIndex>mClockBondAngleList)
+      &&(mClockRestraintAtomIndex>mClockDihedralAngleList)) return;
+   VFN_DEBUG_ENTRY("Molecule::BuildRestraintAtomIndex()",5)
+   TAU_PROFILE("Molecule::BuildRestraintAtomIndex()","void ()",TAU_DEFAULT);
+   const unsigned long nbAtom=mvpAtom.size();
+   map<const MolAtom*,unsigned int> vAtomIdx;
+   for(unsigned long i=0;i<nbAtom;++i) vAtomIdx[mvpAtom[i]]=i;
+   mvAtomRestraintIndex.clear();
+   mvAtomRestraintIndex.resize(nbAtom+1);
+   for(unsigned long i=0;i<mvpRestraint.size();++i)
+   {
+      vector<const MolAtom*> vpAt;
+      if(const MolBond *pBond=dynamic_cast<const MolBond*>(mvpRestraint[i]))
+      {
+         vpAt.push_back(&(pBond->GetAtom1()));
+         vpAt.push_back(&(pBond->GetAtom2()));
+      }
+      else if(const MolBondAngle *pAngle=dynamic_cast<const MolBondAngle*>(mvpRestraint[i]))
+         vpAt.assign(pAngle->begin(),pAngle->end());
+      else if(const MolDihedralAngle *pDihed=dynamic_cast<const MolDihedralAngle*>(mvpRestraint[i]))
+         vpAt.assign(pDihed->begin(),pDihed->end());
+      bool other=vpAt.size()==0;
+      for(vector<const MolAtom*>::const_iterator pos=vpAt.begin();pos!=vpAt.end();++pos)
+      {
+         map<const MolAtom*,unsigned int>::const_iterator idx=vAtomIdx.find(*pos);
+         if(idx==vAtomIdx.end()) other=true;
+         else mvAtomRestraintIndex[idx->second].push_back(i);
+      }
+      // Restraints of unknown type (or with atoms outside this Molecule) are always re-computed
+      if(other) mvAtomRestraintIndex[nbAtom].push_back(i);
+   }
+   // Force a full re-computation of the log(likelihood)
+   mvRestraintLLK.clear();
+   mClockRestraintAtomIndex.Click();
+   VFN_DEBUG_EXIT("Molecule::BuildRestraintAtomIndex()",5)
+}
+
+void Molecule::BuildRestraintPack()const
+{
+   if(  (mClockRestraintPack>mClockAtomList)
+      &&(mClockRestraintPack>mClockBondList)
+      &&(mClockRestraintPack>mClockBondAngleList)
+      &&(mClockRestraintPack>mClockDihedralAngleList))
+   {
+      mRestraintPack.UpdateValues();
+      return;
+   }
+   VFN_DEBUG_ENTRY("Molecule::BuildRestraintPack()",5)
+   TAU_PROFILE("Molecule::BuildRestraintPack()","void ()",TAU_DEFAULT);
+   mRestraintPack.Init(mvpBond,mvpBondAngle,mvpDihedralAngle);
+   map<const Restraint*,unsigned int> vRestraintIdx;
+   for(unsigned long i=0;i<mvpRestraint.size();++i) vRestraintIdx[mvpRestraint[i]]=i;
+   // Restraints which are not in RefinableObj::mvpRestraint get an out-of-range index
+   mvRestraintPackIndex.assign(mRestraintPack.size(),mvpRestraint.size());
+   vector<unsigned int>::iterator p=mvRestraintPackIndex.begin();
+   map<const Restraint*,unsigned int>::const_iterator idx;
+   for(vector<MolBond*>::const_iterator pos=mvpBond.begin();pos!=mvpBond.end();++pos,++p)
+      if((idx=vRestraintIdx.find(*pos))!=vRestraintIdx.end()) *p=idx->second;
+   for(vector<MolBondAngle*>::const_iterator pos=mvpBondAngle.begin();pos!=mvpBondAngle.end();++pos,++p)
+      if((idx=vRestraintIdx.find(*pos))!=vRestraintIdx.end()) *p=idx->second;
+   for(vector<MolDihedralAngle*>::const_iterator pos=mvpDihedralAngle.begin();pos!=mvpDihedralAngle.end();++pos,++p)
+      if((idx=vRestraintIdx.find(*pos))!=vRestraintIdx.end()) *p=idx->second;
+   mvRestraintPackLLK.resize(mRestraintPack.size());
+   mClockRestraintPack.Click();
+   VFN_DEBUG_EXIT("Molecule::BuildRestraintPack()",5)
+}
+
 Molecule::RotorGroup::RotorGroup(const MolAtom &at1,const MolAtom &at2):
 mpAtom1(&at1),mpAtom2(&at2),mBaseRotationAmplitude(M_PI*0.04)
 {}
 
+void Molecule::BuildStretchModeFreeBatch()const
+{
+   if(  (mvpStretchModeFreeBatch.size()==mvpStretchModeFree.size())
+      &&(mClockStretchModeFreeBatch>mClockStretchModeGroups)
+      &&(mClockStretchModeFreeBatch>mClockAtomList)) return;
+   VFN_DEBUG_MESSAGE("Molecule::BuildStretchModeFreeBatch()",4)
+   mvpStretchModeFreeBatch.clear();
+   mvStretchModeFreeBatchDef.clear();
+   for(list<StretchMode*>::const_iterator pos=mvpStretchModeFree.begin();pos!=mvpStretchModeFree.end();++pos)
+   {
+      unsigned int def[8]={0,0,0,0,0,0,0,0};
+      if(const StretchModeBondLength *p=dynamic_cast<const StretchModeBondLength*>(*pos))
+      {
+         def[0]=0;
+         def[1]=p->mpAtom0->GetIndex();
+         def[2]=p->mpAtom1->GetIndex();
+      }
+      else if(const StretchModeBondAngle *p=dynamic_cast<const StretchModeBondAngle*>(*pos))
+      {
+         def[0]=1;
+         def[1]=p->mpAtom0->GetIndex();
+         def[2]=p->mpAtom1->GetIndex();
+         def[3]=p->mpAtom2->GetIndex();
+      }
+      else if(const StretchModeTorsion *p=dynamic_cast<const StretchModeTorsion*>(*pos))
+      {
+         def[0]=2;
+         def[1]=p->mpAtom1->GetIndex();
+         def[2]=p->mpAtom2->GetIndex();
+         if(p->mpDihedralAngle!=0)
+         {
+            def[4]=p->mpDihedralAngle->GetAtom1().GetIndex();
+            def[5]=p->mpDihedralAngle->GetAtom2().GetIndex();
+            def[6]=p->mpDihedralAngle->GetAtom3().GetIndex();
+            def[7]=p->mpDihedralAngle->GetAtom4().GetIndex();
+         }
+      }
+      else if(const StretchModeTwist *p=dynamic_cast<const StretchModeTwist*>(*pos))
+      {
+         def[0]=3;
+         def[1]=p->mpAtom1->GetIndex();
+         def[2]=p->mpAtom2->GetIndex();
+      }
+      else continue;
+      mvpStretchModeFreeBatch.push_back(*pos);
+      mvStretchModeFreeBatchDef.insert(mvStretchModeFreeBatchDef.end(),def,def+8);
+   }
+   mClockStretchModeFreeBatch.Click();
+}
+
 void Molecule::BuildRotorGroup()
 {
    if(  (mClockRotorGroup>mClockBondList)
@@ -5641,13 +6965,17 @@ void Molecule::BuildRotorGroup()
 
 void Molecule::BuildStretchModeBondLength()
 {
-   #if 0
-   if(  (mClockStretchModeBondLength>mClockBondList)
-      &&(mClockStretchModeBondLength>mClockAtomList)
+   // Stretch modes only depend on the molecule topology, restraints, rigid groups
+   // and flexibility model, so they are kept across optimizations
+   if(  (mClockStretchModeBondLength>mClockAtomList)
+      &&(mClockStretchModeBondLength>mClockBondList)
       &&(mClockStretchModeBondLength>mClockBondAngleList)
-      &&(mClockStretchModeBondLength>mClockDihedralAngleList)) return;
-   #endif
+      &&(mClockStretchModeBondLength>mClockDihedralAngleList)
+      &&(mClockStretchModeBondLength>mClockRigidGroup)
+      &&(mClockStretchModeBondLength>mFlexModel.GetClock())) return;
    VFN_DEBUG_ENTRY("Molecule::BuildStretchModeBondLength()",7)
+   // Mask of the atoms moved by a mode, indexed by MolAtom::GetIndex()
+   vector<bool> mask;
    this->BuildConnectivityTable();
    TAU_PROFILE("Molecule::BuildStretchModeBondLength()","void ()",TAU_DEFAULT);
    TAU_PROFILE_TIMER(timer1,"Molecule::BuildStretchModeBondLength 1","", TAU_FIELD);
@@ -5659,54 +6987,32 @@ void Molecule::BuildStretchModeBondLength()
    // Build list of atoms moved when stretching a bond length. Only keep the group
    // of atoms on the smaller side.
    TAU_PROFILE_START(timer1);
+   const long nbHalf=(mvpAtom.size()+1)/2;
    for(unsigned long i=0;i<mvpBond.size();++i)
    {
       //if((mFlexModel.GetChoice()!=0)&&(false==mvpBond[i]->IsFreeTorsion())) continue;
       MolAtom* const atom1=&(mvpBond[i]->GetAtom1());
       MolAtom* const atom2=&(mvpBond[i]->GetAtom2());
+      // We have found a ring. No use looking at either side.
+      // :TODO: handle this properly..
+      if(this->IsBondInRing(*atom1,*atom2)) continue;
       for(unsigned int j=1;j<=2;++j)
       {
-         const set<MolAtom*> *pConn;
-         if(j==1) pConn=&(mConnectivityTable[atom1]);
-         else pConn=&(mConnectivityTable[atom2]);
-
+         // Number of atoms translated, known before building the list
+         const long nbTrans= (j==1) ? this->GetBondSideNbAtom(*atom1,*atom2)
+                                    : this->GetBondSideNbAtom(*atom2,*atom1);
+         if((nbTrans>nbHalf)||(nbTrans==0)) continue;
          if(j==1)
-            mvStretchModeBondLength.push_back(StretchModeBondLength(mvpBond[i]->GetAtom2(),
-                                                                    mvpBond[i]->GetAtom1(),
-                                                                    mvpBond[i]));
-         else
-            mvStretchModeBondLength.push_back(StretchModeBondLength(mvpBond[i]->GetAtom1(),
-                                                                    mvpBond[i]->GetAtom2(),
-                                                                    mvpBond[i]));
-         if(j==1) mvStretchModeBondLength.back().mvTranslatedAtomList.insert(atom1);
-         if(j==2) mvStretchModeBondLength.back().mvTranslatedAtomList.insert(atom2);
-
-         for(set<MolAtom*>::const_iterator pos=pConn->begin();pos!=pConn->end();++pos)
-         {
-            if((j==1)&&(*pos==atom2)) continue;
-            if((j==2)&&(*pos==atom1)) continue;
-            ExpandAtomGroupRecursive(*pos,mConnectivityTable,
-                                     mvStretchModeBondLength.back().mvTranslatedAtomList);
-         }
-         const unsigned long ct1=mvStretchModeBondLength.back().mvTranslatedAtomList.count(atom1),
-                             ct2=mvStretchModeBondLength.back().mvTranslatedAtomList.count(atom2);
-         if( ((j==1)&&(ct2>0)) || ((j==2)&&(ct1>0)) )
          {
-            // We have found a ring. No use looking at the other side.
-            // :TODO: handle this properly..
-            mvStretchModeBondLength.pop_back();
-            break;
+            mvStretchModeBondLength.push_back(StretchModeBondLength(*atom2,*atom1,mvpBond[i]));
+            this->GetBondSideAtomList(*atom1,*atom2,mvStretchModeBondLength.back().mvTranslatedAtomList);
          }
-         if(  (mvStretchModeBondLength.back().mvTranslatedAtomList.size()>((mvpAtom.size()+1)/2))
-            ||(mvStretchModeBondLength.back().mvTranslatedAtomList.size()==0))
+         else
          {
-            #ifdef __DEBUG__
-            cout<<"Rejecting StretchModeBondLength ";mvStretchModeBondLength.back().Print(cout);cout<<endl;
-            #endif
-            mvStretchModeBondLength.pop_back();
+            mvStretchModeBondLength.push_back(StretchModeBondLength(*atom1,*atom2,mvpBond[i]));
+            this->GetBondSideAtomList(*atom2,*atom1,mvStretchModeBondLength.back().mvTranslatedAtomList);
          }
-         else if(mvStretchModeBondLength.back().mvTranslatedAtomList.size()==((mvpAtom.size()+1)/2))
-                  break;//we translate exactly half of the atoms, so skip the other half
+         if(nbTrans==nbHalf) break;//we translate exactly half of the atoms, so skip the other half
       }
    }
    TAU_PROFILE_STOP(timer1);
@@ -5717,12 +7023,13 @@ void Molecule::BuildStretchModeBondLength()
    {
       TAU_PROFILE_START(timer5);
       bool keep=true;
+      BuildAtomMask(pos->mvTranslatedAtomList,mvpAtom.size(),mask);
       for(vector<RigidGroup*>::const_iterator group=mvRigidGroup.begin();
           group!=mvRigidGroup.end();++group)
       {
          unsigned long ct=0;
          for(set<MolAtom *>::const_iterator at=(*group)->begin();at!=(*group)->end();++at)
-            ct += pos->mvTranslatedAtomList.count(*at);
+            ct += mask[(*at)->GetIndex()];
          if((ct>0)&&(ct!=(*group)->size()))
          {
             keep=false;
@@ -5759,15 +7066,10 @@ void Molecule::BuildStretchModeBondLength()
       TAU_PROFILE_START(timer2);
       bool keep=true;
       pos->mvpBrokenBond.clear();
+      BuildAtomMask(pos->mvTranslatedAtomList,mvpAtom.size(),mask);
       for(vector<MolBond*>::const_iterator r=mvpBond.begin();r!=mvpBond.end();++r)
       {
-         unsigned int ct=0;
-         for(set<MolAtom *>::const_iterator at=pos->mvTranslatedAtomList.begin();
-             at!=pos->mvTranslatedAtomList.end();++at)
-         {
-            if(*at==&((*r)->GetAtom1())) ct++;
-            if(*at==&((*r)->GetAtom2())) ct++;
-         }
+         const unsigned int ct=mask[(*r)->GetAtom1().GetIndex()]+mask[(*r)->GetAtom2().GetIndex()];
          // If we moved either both or non of the bond atom, the bond length is unchanged.
          if((ct!=0)&&(ct !=2)) pos->mvpBrokenBond.insert(make_pair(*r,0));
       }
@@ -5788,16 +7090,10 @@ void Molecule::BuildStretchModeBondLength()
       TAU_PROFILE_START(timer3);
       bool keep=true;
       pos->mvpBrokenBondAngle.clear();
+      BuildAtomMask(pos->mvTranslatedAtomList,mvpAtom.size(),mask);
       for(vector<MolBondAngle*>::const_iterator r=mvpBondAngle.begin();r!=mvpBondAngle.end();++r)
       {
-         unsigned int ct=0;
-         for(set<MolAtom *>::const_iterator at=pos->mvTranslatedAtomList.begin();
-             at!=pos->mvTranslatedAtomList.end();++at)
-         {
-            if(*at==&((*r)->GetAtom1())) ct++;
-            if(*at==&((*r)->GetAtom2())) ct++;
-            if(*at==&((*r)->GetAtom3())) ct++;
-         }
+         const unsigned int ct=mask[(*r)->GetAtom1().GetIndex()]+mask[(*r)->GetAtom2().GetIndex()]+mask[(*r)->GetAtom3().GetIndex()];
          bool broken=true;
          if((ct==0)||(ct==3)) broken=false;
          if(broken)
@@ -5830,17 +7126,10 @@ void Molecule::BuildStretchModeBondLength()
       TAU_PROFILE_START(timer4);
       bool keep=true;
       pos->mvpBrokenDihedralAngle.clear();
+      BuildAtomMask(pos->mvTranslatedAtomList,mvpAtom.size(),mask);
       for(vector<MolDihedralAngle*>::const_iterator r=mvpDihedralAngle.begin();r!=mvpDihedralAngle.end();++r)
       {
-         unsigned int ct=0;
-         for(set<MolAtom *>::const_iterator at=pos->mvTranslatedAtomList.begin();
-             at!=pos->mvTranslatedAtomList.end();++at)
-         {
-            if(*at==&((*r)->GetAtom1())) ct++;
-            if(*at==&((*r)->GetAtom2())) ct++;
-            if(*at==&((*r)->GetAtom3())) ct++;
-            if(*at==&((*r)->GetAtom4())) ct++;
-         }
+         const unsigned int ct=mask[(*r)->GetAtom1().GetIndex()]+mask[(*r)->GetAtom2().GetIndex()]+mask[(*r)->GetAtom3().GetIndex()]+mask[(*r)->GetAtom4().GetIndex()];
          bool broken=true;
          if((ct==0)||(ct==4)) broken=false;
          if(broken)
@@ -5913,13 +7202,17 @@ void Molecule::BuildStretchModeBondLength()
 
 void Molecule::BuildStretchModeBondAngle()
 {
-   #if 0
-   if(  (mClockStretchModeBondAngle>mClockBondList)
-      &&(mClockStretchModeBondAngle>mClockAtomList)
+   // Stretch modes only depend on the molecule topology, restraints, rigid groups
+   // and flexibility model, so they are kept across optimizations
+   if(  (mClockStretchModeBondAngle>mClockAtomList)
+      &&(mClockStretchModeBondAngle>mClockBondList)
       &&(mClockStretchModeBondAngle>mClockBondAngleList)
-      &&(mClockStretchModeBondAngle>mClockDihedralAngleList)) return;
-   #endif
+      &&(mClockStretchModeBondAngle>mClockDihedralAngleList)
+      &&(mClockStretchModeBondAngle>mClockRigidGroup)
+      &&(mClockStretchModeBondAngle>mFlexModel.GetClock())) return;
    VFN_DEBUG_ENTRY("Molecule::BuildStretchModeBondAngle()",10)
+   // Mask of the atoms moved by a mode, indexed by MolAtom::GetIndex()
+   vector<bool> mask;
    this->BuildConnectivityTable();
    TAU_PROFILE("Molecule::BuildStretchModeBondAngle()","void ()",TAU_DEFAULT);
    TAU_PROFILE_TIMER(timer1,"Molecule::BuildStretchModeBondAngle 1","", TAU_FIELD);
@@ -5943,6 +7236,9 @@ void Molecule::BuildStretchModeBondAngle()
          for(;pos2!=pConn0->end();++pos2)
          {
             VFN_DEBUG_MESSAGE("Molecule::BuildStretchModeBondAngle():"<<i<<","<<*pos1<<","<<*pos2,10)
+            // Both bonds are in the same ring system: changing the angle would break the ring
+            if(  this->GetBondBiconnectedComponent(*mvpAtom[i],**pos1)
+               ==this->GetBondBiconnectedComponent(*mvpAtom[i],**pos2)) continue;
             //Do we have a bond angle restraint corresponding to these atoms ?
             MolBondAngle *pMolBondAngle=0;
             for(vector<MolBondAngle*>::const_iterator pos=mvpBondAngle.begin();pos!=mvpBondAngle.end();++pos)
@@ -5980,12 +7276,16 @@ void Molecule::BuildStretchModeBondAngle()
                }
                mvStretchModeBondAngle.back().mvRotatedAtomList.insert(mvpAtom[i]);
 
-               for(set<MolAtom*>::const_iterator pos=pConn->begin();pos!=pConn->end();++pos)
-               {
-                  if(*pos==mvpAtom[i]) continue;
-                  ExpandAtomGroupRecursive(*pos,mConnectivityTable,
-                                           mvStretchModeBondAngle.back().mvRotatedAtomList);
-               }
+               MolAtom *const pAtomRot= (j==1) ? *pos1 : *pos2;
+               if(!this->IsBondInRing(*pAtomRot,*mvpAtom[i]))
+                  this->GetBondSideAtomList(*pAtomRot,*mvpAtom[i],mvStretchModeBondAngle.back().mvRotatedAtomList);
+               else
+                  for(set<MolAtom*>::const_iterator pos=pConn->begin();pos!=pConn->end();++pos)
+                  {
+                     if(*pos==mvpAtom[i]) continue;
+                     ExpandAtomGroupRecursive(*pos,mConnectivityTable,
+                                              mvStretchModeBondAngle.back().mvRotatedAtomList);
+                  }
                //if(j==1)mvStretchModeBondAngle.back().mvRotatedAtomList.erase(*pos2);
                //if(j==2)mvStretchModeBondAngle.back().mvRotatedAtomList.erase(*pos1);
                mvStretchModeBondAngle.back().mvRotatedAtomList.erase(mvpAtom[i]);
@@ -6029,12 +7329,13 @@ void Molecule::BuildStretchModeBondAngle()
    {
       TAU_PROFILE_START(timer5);
       bool keep=true;
+      BuildAtomMask(pos->mvRotatedAtomList,mvpAtom.size(),mask);
       for(vector<RigidGroup*>::const_iterator group=mvRigidGroup.begin();
           group!=mvRigidGroup.end();++group)
       {
          unsigned long ct=0;
          for(set<MolAtom *>::const_iterator at=(*group)->begin();at!=(*group)->end();++at)
-            ct += pos->mvRotatedAtomList.count(*at);
+            ct += mask[(*at)->GetIndex()];
          if(ct>0)
          {
             // Add the origin atom, which does not move relatively to the rotated atoms
@@ -6077,15 +7378,10 @@ void Molecule::BuildStretchModeBondAngle()
       TAU_PROFILE_START(timer2);
       bool keep=true;
       pos->mvpBrokenBond.clear();
+      BuildAtomMask(pos->mvRotatedAtomList,mvpAtom.size(),mask);
       for(vector<MolBond*>::const_iterator r=mvpBond.begin();r!=mvpBond.end();++r)
       {
-         unsigned int ct=0;
-         for(set<MolAtom *>::const_iterator at=pos->mvRotatedAtomList.begin();
-             at!=pos->mvRotatedAtomList.end();++at)
-         {
-            if(*at==&((*r)->GetAtom1())) ct++;
-            if(*at==&((*r)->GetAtom2())) ct++;
-         }
+         const unsigned int ct=mask[(*r)->GetAtom1().GetIndex()]+mask[(*r)->GetAtom2().GetIndex()];
          bool broken=true;
          // If we moved either both or non of the bond atom, the bond length is unchanged.
          if((ct==0)||(ct==2)) broken=false;
@@ -6119,16 +7415,10 @@ void Molecule::BuildStretchModeBondAngle()
       TAU_PROFILE_START(timer3);
       bool keep=true;
       pos->mvpBrokenBondAngle.clear();
+      BuildAtomMask(pos->mvRotatedAtomList,mvpAtom.size(),mask);
       for(vector<MolBondAngle*>::const_iterator r=mvpBondAngle.begin();r!=mvpBondAngle.end();++r)
       {
-         unsigned int ct=0;
-         for(set<MolAtom *>::const_iterator at=pos->mvRotatedAtomList.begin();
-             at!=pos->mvRotatedAtomList.end();++at)
-         {
-            if(*at==&((*r)->GetAtom1())) ct++;
-            if(*at==&((*r)->GetAtom2())) ct++;
-            if(*at==&((*r)->GetAtom3())) ct++;
-         }
+         const unsigned int ct=mask[(*r)->GetAtom1().GetIndex()]+mask[(*r)->GetAtom2().GetIndex()]+mask[(*r)->GetAtom3().GetIndex()];
          bool broken=true;
          if(ct==0) broken=false;
          if(ct==3) broken=false;
@@ -6164,17 +7454,10 @@ void Molecule::BuildStretchModeBondAngle()
       TAU_PROFILE_START(timer4);
       bool keep=true;
       pos->mvpBrokenDihedralAngle.clear();
+      BuildAtomMask(pos->mvRotatedAtomList,mvpAtom.size(),mask);
       for(vector<MolDihedralAngle*>::const_iterator r=mvpDihedralAngle.begin();r!=mvpDihedralAngle.end();++r)
       {
-         unsigned int ct=0;
-         for(set<MolAtom *>::const_iterator at=pos->mvRotatedAtomList.begin();
-             at!=pos->mvRotatedAtomList.end();++at)
-         {
-            if(*at==&((*r)->GetAtom1())) ct++;
-            if(*at==&((*r)->GetAtom2())) ct++;
-            if(*at==&((*r)->GetAtom3())) ct++;
-            if(*at==&((*r)->GetAtom4())) ct++;
-         }
+         const unsigned int ct=mask[(*r)->GetAtom1().GetIndex()]+mask[(*r)->GetAtom2().GetIndex()]+mask[(*r)->GetAtom3().GetIndex()]+mask[(*r)->GetAtom4().GetIndex()];
          bool broken=true;
          if(ct==0) broken=false;
          if(ct==4) broken=false;
@@ -6250,13 +7533,17 @@ void Molecule::BuildStretchModeBondAngle()
 
 void Molecule::BuildStretchModeTorsion()
 {
-   #if 0
-   if(  (mClockStretchModeTorsion>mClockBondList)
-      &&(mClockStretchModeTorsion>mClockAtomList)
+   // Stretch modes only depend on the molecule topology, restraints, rigid groups
+   // and flexibility model, so they are kept across optimizations
+   if(  (mClockStretchModeTorsion>mClockAtomList)
+      &&(mClockStretchModeTorsion>mClockBondList)
       &&(mClockStretchModeTorsion>mClockBondAngleList)
-      &&(mClockStretchModeTorsion>mClockDihedralAngleList)) return;
-   #endif
+      &&(mClockStretchModeTorsion>mClockDihedralAngleList)
+      &&(mClockStretchModeTorsion>mClockRigidGroup)
+      &&(mClockStretchModeTorsion>mFlexModel.GetClock())) return;
    VFN_DEBUG_ENTRY("Molecule::BuildStretchModeTorsion()",7)
+   // Mask of the atoms moved by a mode, indexed by MolAtom::GetIndex()
+   vector<bool> mask;
    TAU_PROFILE("Molecule::BuildStretchModeTorsion()","void ()",TAU_DEFAULT);
    TAU_PROFILE_TIMER(timer1,"Molecule::BuildStretchModeTorsion 1","", TAU_FIELD);
    TAU_PROFILE_TIMER(timer2,"Molecule::BuildStretchModeTorsion 2","", TAU_FIELD);
@@ -6281,12 +7568,18 @@ void Molecule::BuildStretchModeTorsion()
          mvStretchModeTorsion.back().mvRotatedAtomList.insert(atom1);
          mvStretchModeTorsion.back().mvRotatedAtomList.insert(atom2);
 
-         for(set<MolAtom*>::const_iterator pos=pConn->begin();pos!=pConn->end();++pos)
+         if(!this->IsBondInRing(*atom1,*atom2))
          {
-            if((*pos==atom2)||(*pos==atom1)) continue;
-            ExpandAtomGroupRecursive(*pos,mConnectivityTable,
-                                     mvStretchModeTorsion.back().mvRotatedAtomList);
+            if(j==1) this->GetBondSideAtomList(*atom1,*atom2,mvStretchModeTorsion.back().mvRotatedAtomList);
+            else     this->GetBondSideAtomList(*atom2,*atom1,mvStretchModeTorsion.back().mvRotatedAtomList);
          }
+         else
+            for(set<MolAtom*>::const_iterator pos=pConn->begin();pos!=pConn->end();++pos)
+            {
+               if((*pos==atom2)||(*pos==atom1)) continue;
+               ExpandAtomGroupRecursive(*pos,mConnectivityTable,
+                                        mvStretchModeTorsion.back().mvRotatedAtomList);
+            }
          mvStretchModeTorsion.back().mvRotatedAtomList.erase(atom1);
          mvStretchModeTorsion.back().mvRotatedAtomList.erase(atom2);
 
@@ -6440,12 +7733,13 @@ void Molecule::BuildStretchModeTorsion()
    {
       TAU_PROFILE_START(timer5);
       bool keep=true;
+      BuildAtomMask(pos->mvRotatedAtomList,mvpAtom.size(),mask);
       for(vector<RigidGroup*>::const_iterator group=mvRigidGroup.begin();
           group!=mvRigidGroup.end();++group)
       {
          unsigned long ct=0;
          for(set<MolAtom *>::const_iterator at=(*group)->begin();at!=(*group)->end();++at)
-            ct += pos->mvRotatedAtomList.count(*at);
+            ct += mask[(*at)->GetIndex()];
          if(ct>0)
          {
             // Add the axis atoms, which do not move relatively to the rotated atoms
@@ -6489,15 +7783,10 @@ void Molecule::BuildStretchModeTorsion()
       TAU_PROFILE_START(timer2);
       bool keep=true;
       pos->mvpBrokenBond.clear();
+      BuildAtomMask(pos->mvRotatedAtomList,mvpAtom.size(),mask);
       for(vector<MolBond*>::const_iterator r=mvpBond.begin();r!=mvpBond.end();++r)
       {
-         unsigned int ct=0;
-         for(set<MolAtom *>::const_iterator at=pos->mvRotatedAtomList.begin();
-             at!=pos->mvRotatedAtomList.end();++at)
-         {
-            if(*at==&((*r)->GetAtom1())) ct++;
-            if(*at==&((*r)->GetAtom2())) ct++;
-         }
+         const unsigned int ct=mask[(*r)->GetAtom1().GetIndex()]+mask[(*r)->GetAtom2().GetIndex()];
          bool broken=true;
          // If we moved either both or non of the bond atom, the bond length is unchanged.
          if((ct==0)||(ct==2)) broken=false;
@@ -6531,16 +7820,10 @@ void Molecule::BuildStretchModeTorsion()
       TAU_PROFILE_START(timer3);
       bool keep=true;
       pos->mvpBrokenBondAngle.clear();
+      BuildAtomMask(pos->mvRotatedAtomList,mvpAtom.size(),mask);
       for(vector<MolBondAngle*>::const_iterator r=mvpBondAngle.begin();r!=mvpBondAngle.end();++r)
       {
-         unsigned int ct=0;
-         for(set<MolAtom *>::const_iterator at=pos->mvRotatedAtomList.begin();
-             at!=pos->mvRotatedAtomList.end();++at)
-         {
-            if(*at==&((*r)->GetAtom1())) ct++;
-            if(*at==&((*r)->GetAtom2())) ct++;
-            if(*at==&((*r)->GetAtom3())) ct++;
-         }
+         const unsigned int ct=mask[(*r)->GetAtom1().GetIndex()]+mask[(*r)->GetAtom2().GetIndex()]+mask[(*r)->GetAtom3().GetIndex()];
          bool broken=true;
          if((ct==0)||(ct==3)) broken=false;
          if(broken)
@@ -6573,17 +7856,10 @@ void Molecule::BuildStretchModeTorsion()
       TAU_PROFILE_START(timer4);
       bool keep=true;
       pos->mvpBrokenDihedralAngle.clear();
+      BuildAtomMask(pos->mvRotatedAtomList,mvpAtom.size(),mask);
       for(vector<MolDihedralAngle*>::const_iterator r=mvpDihedralAngle.begin();r!=mvpDihedralAngle.end();++r)
       {
-         unsigned int ct=0;
-         for(set<MolAtom *>::const_iterator at=pos->mvRotatedAtomList.begin();
-             at!=pos->mvRotatedAtomList.end();++at)
-         {
-            if(*at==&((*r)->GetAtom1())) ct++;
-            if(*at==&((*r)->GetAtom2())) ct++;
-            if(*at==&((*r)->GetAtom3())) ct++;
-            if(*at==&((*r)->GetAtom4())) ct++;
-         }
+         const unsigned int ct=mask[(*r)->GetAtom1().GetIndex()]+mask[(*r)->GetAtom2().GetIndex()]+mask[(*r)->GetAtom3().GetIndex()]+mask[(*r)->GetAtom4().GetIndex()];
          bool broken=true;
          if((ct==0)||(ct==4)) broken=false;
          if(broken)
@@ -6664,13 +7940,17 @@ void Molecule::BuildStretchModeTorsion()
 
 void Molecule::BuildStretchModeTwist()
 {
-   #if 0
-   if(  (mClockStretchModeTwist>mClockBondList)
-      &&(mClockStretchModeTwist>mClockAtomList)
+   // Stretch modes only depend on the molecule topology, restraints, rigid groups
+   // and flexibility model, so they are kept across optimizations
+   if(  (mClockStretchModeTwist>mClockAtomList)
+      &&(mClockStretchModeTwist>mClockBondList)
       &&(mClockStretchModeTwist>mClockBondAngleList)
-      &&(mClockStretchModeTwist>mClockDihedralAngleList)) return;
-   #endif
+      &&(mClockStretchModeTwist>mClockDihedralAngleList)
+      &&(mClockStretchModeTwist>mClockRigidGroup)
+      &&(mClockStretchModeTwist>mFlexModel.GetClock())) return;
    VFN_DEBUG_ENTRY("Molecule::BuildStretchModeTwist()",7)
+   // Mask of the atoms moved by a mode, indexed by MolAtom::GetIndex()
+   vector<bool> mask;
    this->BuildConnectivityTable();
    mvStretchModeTwist.clear();
 
@@ -6851,12 +8131,13 @@ void Molecule::BuildStretchModeTwist()
       }
       //Get rid of stretch modes that break rigid groups
       bool keep=true;
+      BuildAtomMask(pos->mvRotatedAtomList,mvpAtom.size(),mask);
       for(vector<RigidGroup*>::const_iterator group=mvRigidGroup.begin();
           group!=mvRigidGroup.end();++group)
       {
          unsigned long ct=0;
          for(set<MolAtom *>::const_iterator at=(*group)->begin();at!=(*group)->end();++at)
-            ct += pos->mvRotatedAtomList.count(*at);
+            ct += mask[(*at)->GetIndex()];
          if(ct>0)
          {
             // Add atom1 and atom2 to the count only if they are in the group
@@ -7439,6 +8720,7 @@ void Molecule::BuildStretchModeGroups()
          mvpStretchModeFree.push_back(&(*mode));
       else mvpStretchModeNotFree.push_back(&(*mode));
    #endif
+   mClockStretchModeGroups.Click();
 }
 
 void Molecule::BuildMDAtomGroups()
@@ -7610,15 +8892,15 @@ void Molecule::UpdateScattCompList()const
    VFN_DEBUG_ENTRY("Molecule::UpdateScattCompList()",5)
    TAU_PROFILE("Molecule::UpdateScattCompList()","void ()",TAU_DEFAULT);
    const long nb=this->GetNbComponent();
+   const REAL *px=mvAtomX.data(),*py=mvAtomY.data(),*pz=mvAtomZ.data();
    // Get internal coords
    for(long i=0;i<nb;++i)
    {
-      if(mvpAtom[i]->IsDummy()) mScattCompList(i).mpScattPow=0;
-      else mScattCompList(i).mpScattPow=&(mvpAtom[i]->GetScatteringPower());
-      mScattCompList(i).mX=mvpAtom[i]->GetX();
-      mScattCompList(i).mY=mvpAtom[i]->GetY();
-      mScattCompList(i).mZ=mvpAtom[i]->GetZ();
-      mScattCompList(i).mOccupancy=mvpAtom[i]->GetOccupancy()*mOccupancy;
+      mScattCompList(i).mpScattPow=mvpAtomScattPow[i];
+      mScattCompList(i).mX=px[i];
+      mScattCompList(i).mY=py[i];
+      mScattCompList(i).mZ=pz[i];
+      mScattCompList(i).mOccupancy=mvAtomOccupancy[i]*mOccupancy;
    }
 
   #ifdef RIGID_BODY_STRICT_EXPERIMENTAL
@@ -7630,24 +8912,26 @@ void Molecule::UpdateScattCompList()const
         (*pos)->mQuat.Normalize();
         // Center of the atom group
         REAL x0=0,y0=0,z0=0;
-        for(set<unsigned int>::iterator at=(*pos)->mvIdx.begin();at!=(*pos)->mvIdx.end();++at)
+        for(vector<unsigned int>::const_iterator at=(*pos)->mvIdx.begin();at!=(*pos)->mvIdx.end();++at)
         {
-          x0+=mvpAtom[*at]->GetX();
-          y0+=mvpAtom[*at]->GetY();
-          z0+=mvpAtom[*at]->GetZ();
+          x0+=px[*at];
+          y0+=py[*at];
+          z0+=pz[*at];
         }
         x0/=(*pos)->size();
         y0/=(*pos)->size();
         z0/=(*pos)->size();
 
         // Apply rotation & translation to all atoms
-        for(set<unsigned int>::iterator at=(*pos)->mvIdx.begin();at!=(*pos)->mvIdx.end();++at)
+        REAL m[9];
+        (*pos)->mQuat.GetRotationMatrix(m);
+        const REAL tx=x0+(*pos)->mX, ty=y0+(*pos)->mY, tz=z0+(*pos)->mZ;
+        for(vector<unsigned int>::const_iterator at=(*pos)->mvIdx.begin();at!=(*pos)->mvIdx.end();++at)
         {
-          REAL x=mvpAtom[*at]->GetX()-x0, y=mvpAtom[*at]->GetY()-y0, z=mvpAtom[*at]->GetZ()-z0;
-          (*pos)->mQuat.RotateVector(x,y,z);
-          mScattCompList(*at).mX=x+x0+(*pos)->mX;
-          mScattCompList(*at).mY=y+y0+(*pos)->mY;
-          mScattCompList(*at).mZ=z+z0+(*pos)->mZ;
+          const REAL x=px[*at]-x0, y=py[*at]-y0, z=pz[*at]-z0;
+          mScattCompList(*at).mX=m[0]*x+m[1]*y+m[2]*z+tx;
+          mScattCompList(*at).mY=m[3]*x+m[4]*y+m[5]*z+ty;
+          mScattCompList(*at).mZ=m[6]*x+m[7]*y+m[8]*z+tz;
         }
     }
   }
@@ -7703,6 +8987,28 @@ void Molecule::UpdateScattCompList()const
    mClockScattCompList.Click();
    VFN_DEBUG_EXIT("Molecule::UpdateScattCompList()",5)
 }
+void Molecule::UpdateAtomParPointers(const REAL *px,const REAL *py,const REAL *pz,
+                                     const unsigned long nb,const long removed)
+{
+   VFN_DEBUG_ENTRY("Molecule::UpdateAtomParPointers()",4)
+   const REAL *pOld[3]={px,py,pz};
+   REAL *pNew[3]={mvAtomX.data(),mvAtomY.data(),mvAtomZ.data()};
+   for(long i=0;i<this->GetNbPar();++i)
+   {
+      RefinablePar *par=&(this->GetPar(i));
+      const REAL *p=par->GetPointer();
+      for(unsigned int j=0;j<3;++j)
+      {
+         if((p<pOld[j])||(p>=(pOld[j]+nb))) continue;
+         long idx=p-pOld[j];
+         if((removed>=0)&&(idx>removed)) --idx;
+         par->SetPointer(pNew[j]+idx);
+         break;
+      }
+   }
+   VFN_DEBUG_EXIT("Molecule::UpdateAtomParPointers()",4)
+}
+
 vector<MolAtom*>::reverse_iterator Molecule::FindAtom(const string &name)
 {
    VFN_DEBUG_ENTRY("Molecule::FindAtom():"<<name,4)
@@ -48,9 +48,10 @@ struct XYZ
 
 /** MolAtom : atom inside a Molecule
 *
-* This keeps coordinates, recorded in a cartesian frame (in Angstroem),
-* the associated scattering power
-* and it also keeps in a list of all bonds in which this atom is involved.
+* This gives access to the coordinates, recorded in a cartesian frame (in Angstroem),
+* the occupancy and the associated scattering power. These are stored in contiguous
+* arrays in the parent Molecule (see Molecule::mvAtomX), the MolAtom being only
+* a view on these arrays.
 *
 * \note maybe it's not a great idea to keep a reference of bonds for this
 * atom in here
@@ -60,6 +61,9 @@ class MolAtom
    public:
       /** Constructor for a MolAtom
       *
+      * The coordinates, occupancy and scattering power are appended to the arrays
+      * of the parent Molecule, so a MolAtom should only be created
+      * by Molecule::AddAtom().
       */
       MolAtom(const REAL x, const REAL y, const REAL z,
               const ScatteringPower *pPow, const string &name,
@@ -119,22 +123,22 @@ class MolAtom
       bool IsNonFlipAtom() const;
       /// Access to the integer address of this object, for unique identification from python
       size_t int_ptr() const;
+      /// Index of this atom in the parent Molecule's list of atoms and coordinate arrays.
+      unsigned long GetIndex()const;
    private:
+      friend class Molecule;
       /// Name for this atom
       string mName;
       /* Get the atom at the other end of bond #i
       MolAtom & GetBondedAtom(unsigned int i);
       */
-      /** Cartesian oordinates in the Molecule reference frame.
+      /** Index of the atom in the parent Molecule's arrays (Molecule::mvAtomX,...)
+      * holding the cartesian coordinates in the Molecule reference frame,
+      * the occupancy and the scattering power.
       *
-      * mutable because they may need to be changed when in a rigid group,
-      * even though the end position of the atom remains the same.
+      * This is updated by Molecule::RemoveAtom().
       */
-      mutable REAL mX,mY,mZ;
-      /// Occupancy
-      REAL mOccupancy;
-      /// ScatteringPower
-      const ScatteringPower* mpScattPow;
+      unsigned long mIndex;
       /// Parent Molecule
       Molecule *mpMol;
       /// Is the atom in a ring ?
@@ -210,6 +214,13 @@ class MolBond:public Restraint
       * to each coordinate of the corresponding atoms.
       */
       void CalcGradient(std::map<MolAtom*,XYZ> &m)const;
+      /** Calc log(likelihood) gradient - versus all atomic coordinates
+      *
+      * \param gx,gy,gz: arrays of the gradient, using the index of the atoms in the
+      * Molecule (see MolAtom::GetIndex()). The derivative of the log(likelihood)
+      * will be \b added to each coordinate of the atoms involved.
+      */
+      void CalcGradient(REAL *gx,REAL *gy,REAL *gz)const;
       const MolAtom& GetAtom1()const;
       const MolAtom& GetAtom2()const;
       MolAtom& GetAtom1();
@@ -299,6 +310,13 @@ class MolBondAngle:public Restraint
       * to each coordinate of the corresponding atoms.
       */
       void CalcGradient(std::map<MolAtom*,XYZ> &m)const;
+      /** Calc log(likelihood) gradient - versus all atomic coordinates
+      *
+      * \param gx,gy,gz: arrays of the gradient, using the index of the atoms in the
+      * Molecule (see MolAtom::GetIndex()). The derivative of the log(likelihood)
+      * will be \b added to each coordinate of the atoms involved.
+      */
+      void CalcGradient(REAL *gx,REAL *gy,REAL *gz)const;
       REAL GetAngle()const;
       REAL& Angle0();
       REAL& AngleDelta();
@@ -395,6 +413,13 @@ class MolDihedralAngle:public Restraint
       * to each coordinate of the corresponding atoms.
       */
       void CalcGradient(std::map<MolAtom*,XYZ> &m)const;
+      /** Calc log(likelihood) gradient - versus all atomic coordinates
+      *
+      * \param gx,gy,gz: arrays of the gradient, using the index of the atoms in the
+      * Molecule (see MolAtom::GetIndex()). The derivative of the log(likelihood)
+      * will be \b added to each coordinate of the atoms involved.
+      */
+      void CalcGradient(REAL *gx,REAL *gy,REAL *gz)const;
       REAL GetAngle()const;
       REAL& Angle0();
       REAL& AngleDelta();
@@ -490,6 +515,11 @@ class Quaternion
       void XMLInput(istream &is,const XMLCrystTag &tag);
       /// Rotate vector v=(v1,v2,v3). The rotated components are directly written
       void RotateVector(REAL &v1,REAL &v2, REAL &v3)const;
+      /** Get the 3x3 matrix (row-major, m[3*i+j]) equivalent to Quaternion::RotateVector(),
+      * so that a large number of vectors can be rotated without re-computing
+      * the quaternion products for each vector.
+      */
+      void GetRotationMatrix(REAL *m)const;
       /// Re-normalize the quaternion to unity. This should not be useful, except
       /// on individual component input, or after long calculations. And even
       /// if wrong, the rotation is independent of the norm of the quaternion.
@@ -535,9 +565,9 @@ class RigidGroup:public std::set<MolAtom *>
       /// The translation of all the atoms as a group
       /// The values will be resetted whenever entering or leaving an optimization.
       mutable REAL mX,mY,mZ;
-      /// Temporary list of the atoms indices in the molecule, used during optimization
+      /// Temporary sorted list of the atoms indices in the molecule, used during optimization
       /// This is created in Molecule::BeginOptimization()
-      mutable std::set<unsigned int> mvIdx;
+      mutable std::vector<unsigned int> mvIdx;
       /// Access to the integer address of this object, for unique identification from python
       size_t int_ptr() const;
 };
@@ -586,6 +616,18 @@ struct StretchMode
    * This can be superseeded to respect any restraint.
    */
    REAL mBaseAmplitude;
+   /** Get the sorted list of indices (see MolAtom::GetIndex()) of a set of atoms moved
+   * by this mode, so that they can be moved as a batch. The list is only re-built
+   * if the set of atoms (compared atom by atom) or the Molecule's list of atoms
+   * have changed.
+   */
+   const std::vector<unsigned int>& GetAtomIndexList(const std::set<MolAtom*> &atoms)const;
+   /// The set of atoms for which StretchMode::mvMovedAtomIdx was built (in the set order)
+   mutable std::vector<MolAtom*> mvMovedAtom;
+   /// Sorted list of indices of the atoms moved, see StretchMode::GetAtomIndexList()
+   mutable std::vector<unsigned int> mvMovedAtomIdx;
+   /// Clock recording when StretchMode::mvMovedAtomIdx was built
+   mutable RefinableObjClock mClockMovedAtomIdx;
 };
 
 /** Group of atoms for random moves changing a bond length.
@@ -730,6 +772,49 @@ struct MDAtomGroup
    std::vector<MolDihedralAngle*> mvpDihedralAngle;
 };
 
+/** Compiled representation of a list of bond length, bond angle and dihedral angle
+* restraints: for each type of restraint, the atom indices (see MolAtom::GetIndex()),
+* ideal values, delta and sigma are packed in arrays, so that all restraints of one type
+* are evaluated by a single kernel, without virtual calls and without modifying the
+* restraint objects. The bond length kernel is vectorized when using SSE.
+*
+* Restraints are ordered by type (bonds, bond angles then dihedral angles), in the
+* order of the lists given to Init().
+*/
+class MolRestraintPack
+{
+   public:
+      /// Pack a list of restraints, which must all belong to the same Molecule.
+      void Init(const std::vector<MolBond*> &vb,const std::vector<MolBondAngle*> &va,
+                const std::vector<MolDihedralAngle*> &vd);
+      /// Update the ideal values, delta and sigma from the restraint objects
+      void UpdateValues();
+      /// Total number of restraints
+      unsigned long size()const;
+      /** Log(likelihood) of the restraints for the coordinates (px,py,pz), indexed
+      * by MolAtom::GetIndex().
+      *
+      * \param gx,gy,gz: if not null, the gradient of the log(likelihood) is added to these.
+      * \param vllk: if not null, the log(likelihood) of each restraint is stored in it.
+      */
+      REAL GetLogLikelihood(const REAL *px,const REAL *py,const REAL *pz,
+                            REAL *gx=0,REAL *gy=0,REAL *gz=0,REAL *vllk=0)const;
+      /// Compute the current value (length or angle) of all restraints
+      void GetValues(const REAL *px,const REAL *py,const REAL *pz,REAL *v)const;
+      /// The restraint objects
+      std::vector<const MolBond*> mvpBond;
+      std::vector<const MolBondAngle*> mvpBondAngle;
+      std::vector<const MolDihedralAngle*> mvpDihedralAngle;
+      /// Atom indices: 2 per bond, 3 per bond angle and 4 per dihedral angle
+      std::vector<unsigned int> mvBondIdx,mvAngleIdx,mvDihedralIdx;
+      /// Ideal value, delta and sigma of each restraint
+      std::vector<REAL> mvBond0,mvBondDelta,mvBondSigma;
+      std::vector<REAL> mvAngle0,mvAngleDelta,mvAngleSigma;
+      std::vector<REAL> mvDihedral0,mvDihedralDelta,mvDihedralSigma;
+      /// Bond limits of the flat-bottom interval, and inverse sigma (0 if sigma<1e-6)
+      std::vector<REAL> mvBondLow,mvBondHigh,mvBondInvSigma;
+};
+
 /** Light-weight representation of an atom in the molecule, as a part of a Z-matrix.
 * This is used to export the Molecule structure to a z-matrix.
 *
@@ -925,6 +1010,55 @@ class Molecule: public Scatterer
       *\param nbStep: number of steps - the gradient is re-calculated after each step.
       */
       void OptimizeConformationSteepestDescent(const REAL maxStep=0.1,const unsigned nbStep=1);
+      /** Optimize the conformation from internal restraints (bond lengths, angles
+      * and dihedral angles), using a limited-memory BFGS minimization with analytical
+      * gradients. Rigid groups are only translated.
+      *
+      * Several minimizations can be made, starting from the current conformation and
+      * from random displacements of all atoms around it - the best result is kept.
+      * If compiled with OpenMP, these are run in parallel.
+      *
+      *\param nbIter: maximum number of iterations for each minimization.
+      *\param nbStart: number of starting conformations.
+      *\param amplitude: maximum displacement (in Angstroems) along each coordinate
+      * for the random starting conformations.
+      */
+      void OptimizeConformationLBFGS(const unsigned int nbIter=200,const unsigned int nbStart=1,
+                                     const REAL amplitude=0.3);
+      /** Generate a batch of random conformations from the current one, by moving
+      * the free stretch modes (those not breaking any restraint beyond the one they
+      * are associated to), as done in GlobalOptRandomMove().
+      *
+      * All random changes are drawn at once, and each stretch mode is then applied
+      * to all candidates, on packed coordinate arrays and without virtual calls.
+      * If a stretch mode is associated to a restraint, the change is limited so that
+      * the restraint stays within delta+5*sigma of its ideal value.
+      *
+      * The stretch modes are (re)built if needed, so this can also be used outside
+      * an optimization. Their amplitudes are however only tuned in BeginOptimization().
+      * A rigid body (see FlexModel) has no stretch mode, so all candidates are
+      * then identical to the current conformation.
+      *
+      * The atomic coordinates of the Molecule are not modified - use
+      * SetConformationFromBatch() to keep one of the candidates.
+      *
+      *\param nbCandidate: number of conformations to generate.
+      *\param mutationAmplitude: amplitude of the moves, as for GlobalOptRandomMove().
+      *\param x,y,z: on return, the cartesian coordinates of all candidates, in the
+      * Molecule's reference frame (i.e. before rotation and translation). The
+      * coordinates of atom i for candidate k are stored in x[k*nbAtom+i], etc...
+      *\param llk: if not null, the log(likelihood) of the bond, bond angle and dihedral
+      * angle restraints of each candidate is stored in it.
+      */
+      void GlobalOptRandomMoveBatch(const unsigned int nbCandidate,const REAL mutationAmplitude,
+                                    std::vector<REAL> &x,std::vector<REAL> &y,std::vector<REAL> &z,
+                                    std::vector<REAL> *llk=0);
+      /** Set the conformation of the Molecule from one of the candidates generated
+      * by GlobalOptRandomMoveBatch(). The position of the Molecule is shifted to keep
+      * the center of the atoms fixed, unless the translation parameters are fixed.
+      */
+      void SetConformationFromBatch(const unsigned int k,const std::vector<REAL> &x,
+                                    const std::vector<REAL> &y,const std::vector<REAL> &z);
       /** Change the conformation of the molecule using molecular dynamics principles.
       * Optionnally, move only a subgroup of atoms and only take into account some restraints.
       *
@@ -941,9 +1075,11 @@ class Molecule: public Scatterer
       * are taken into account, including rigid groups. If they are not empty, then
       * it is assumed that no atom moved belongs to a rigid group.
       * \param vr: initial speed for the angular and translation parameters of rigid groups
-      * included in the evolution. For each entry of the map the first XYZ coordinates are the speed
-      * for RigidGroup::mX,mY,mZ, and the second are the speed for the angular coordinates
-      * of the quaternion Q1,Q2,Q3
+      * included in the evolution. For each entry of the map the first XYZ coordinates are the
+      * translation speed of the group, and the second are its angular velocity (the rotation
+      * vector per unit time, around the center of the group). Atoms belonging to these rigid
+      * groups are moved as a rigid body, even if they are also listed in v0.
+      * On return, includes the new speed coordinates.
       * \param nrj0: the total energy the system should try to maintain. If equal to 0,
       * the initial energy will be used. The speed will be de/increased to compensate
       * any energy change.
@@ -992,6 +1128,29 @@ class Molecule: public Scatterer
       void RotateAtomGroup(const MolAtom &at,const REAL vx,const REAL vy,const REAL vz,
                            const set<MolAtom *> &atoms, const REAL angle,
                            const bool keepCenter=true);
+      /** Rotate a group of atoms around an axis defined by two atoms
+      *
+      * \param atoms: sorted list of the indices (see MolAtom::GetIndex()) of the
+      * atoms to rotate.
+      * \param keepCenter: if true, the coordinates of the molecule are modified
+      * so that only the rotated atoms are moved.
+      */
+      void RotateAtomGroup(const MolAtom &at1,const MolAtom &at2,
+                           const std::vector<unsigned int> &atoms, const REAL angle,
+                           const bool keepCenter=true);
+      /** Rotate a group of atoms around an axis defined by one atom and a vector
+      *
+      * The rotation is converted to a matrix once and applied to all atoms
+      * in a batch, see RotateAtomIndexList().
+      *
+      * \param atoms: sorted list of the indices (see MolAtom::GetIndex()) of the
+      * atoms to rotate.
+      * \param keepCenter: if true, the coordinates of the molecule are modified
+      * so that only the rotated atoms are moved.
+      */
+      void RotateAtomGroup(const MolAtom &at,const REAL vx,const REAL vy,const REAL vz,
+                           const std::vector<unsigned int> &atoms, const REAL angle,
+                           const bool keepCenter=true);
       /** Translate a group of atoms in a given direction
       *
       * \param keepCenter: if true, the coordinates of the molecule are modified
@@ -1000,6 +1159,16 @@ class Molecule: public Scatterer
       void TranslateAtomGroup(const set<MolAtom *> &atoms,
                               const REAL dx,const REAL dy,const REAL dz,
                               const bool keepCenter=true);
+      /** Translate a group of atoms in a given direction
+      *
+      * \param atoms: sorted list of the indices (see MolAtom::GetIndex()) of the
+      * atoms to translate.
+      * \param keepCenter: if true, the coordinates of the molecule are modified
+      * so that only the translated atoms are moved.
+      */
+      void TranslateAtomGroup(const std::vector<unsigned int> &atoms,
+                              const REAL dx,const REAL dy,const REAL dz,
+                              const bool keepCenter=true);
       /// Print the status of all restraints (bond length, angles...)
       void RestraintStatus(ostream &os)const;
       /// Print the restraints (bond length, angles...) as whole labels and number in column text format which accessible to other programs
@@ -1010,6 +1179,14 @@ class Molecule: public Scatterer
       RefinableObjClock& GetBondListClock();
       /// get the clock associated to the list of bonds
       const RefinableObjClock& GetBondListClock()const;
+      /// get the clock associated to the list of bond angles
+      RefinableObjClock& GetBondAngleListClock();
+      /// get the clock associated to the list of bond angles
+      const RefinableObjClock& GetBondAngleListClock()const;
+      /// get the clock associated to the list of dihedral angles
+      RefinableObjClock& GetDihedralAngleListClock();
+      /// get the clock associated to the list of dihedral angles
+      const RefinableObjClock& GetDihedralAngleListClock()const;
       /// Get the clock associated to the atomic positions
       RefinableObjClock& GetAtomPositionClock();
       /// Get the clock associated to the atomic positions
@@ -1024,6 +1201,12 @@ class Molecule: public Scatterer
       /// Get the clock associated to the list of rigid groups
       ///(clicked also whenever a rigid group is modified)
       const RefinableObjClock& GetRigidGroupClock()const;
+      /// Get the clock recording changes of the ideal values, delta or sigma of the
+      /// bond lengths, bond angles and dihedral angles.
+      RefinableObjClock& GetRestraintValueClock();
+      /// Get the clock recording changes of the ideal values, delta or sigma of the
+      /// bond lengths, bond angles and dihedral angles.
+      const RefinableObjClock& GetRestraintValueClock()const;
       /** Add dihedral angles so as to rigidify the Molecule.
       *
       * In practice, for every sequence of atoms A-B-C-D, add the dihedral angle
@@ -1066,6 +1249,10 @@ class Molecule: public Scatterer
       *
       * \param keeporder: if true, the order of the atoms is exactly the same as in
       * the Molecule.
+      *
+      * The Z-matrix is cached: the atom ordering is only rebuilt if the connectivity
+      * or keeporder change, and only the internal coordinates involving atoms
+      * which moved are re-computed.
       */
       const std::vector<MolZAtom>& AsZMatrix(const bool keeporder)const;
       /** Set whether to delete the MolAtoms, MolBonds, MolBondAngles and
@@ -1087,8 +1274,67 @@ class Molecule: public Scatterer
       void BuildRingList();
       /** Build the Connectivity table
       *
+      * This also builds the index-based connectivity graph (Molecule::mvConnectivityIndex)
+      * with a depth-first search tree, which gives the bonds which are not part of
+      * a ring (bridges) and the biconnected components of the molecule.
       */
       void BuildConnectivityTable()const;
+      /** Is the bond between two atoms part of a ring ? This uses the biconnected
+      * components computed in Molecule::BuildConnectivityTable(). The atoms
+      * must be bonded.
+      */
+      bool IsBondInRing(const MolAtom &at1,const MolAtom &at2)const;
+      /** Index of the biconnected component the bond between two atoms belongs to.
+      * Two bonds with the same biconnected component are part of the same ring system.
+      * The atoms must be bonded.
+      */
+      unsigned int GetBondBiconnectedComponent(const MolAtom &at1,const MolAtom &at2)const;
+      /** Number of atoms on the side of at1 for the bond at1-at2, i.e. the number of
+      * atoms (including at1) which are still connected to at1 if the bond is broken.
+      *
+      * \return the number of atoms, or -1 if the bond is part of a ring.
+      */
+      long GetBondSideNbAtom(const MolAtom &at1,const MolAtom &at2)const;
+      /** Add to a list all the atoms on the side of at1 for the bond at1-at2 (including at1).
+      * This is equivalent (but much faster) to ExpandAtomGroupRecursive() from at1, with at2
+      * already in the list. The bond must not be part of a ring.
+      */
+      void GetBondSideAtomList(const MolAtom &at1,const MolAtom &at2,std::set<MolAtom*> &atoms)const;
+      /** Build the index of restraints involving each atom, used to update
+      * the log(likelihood) incrementally in Molecule::GetLogLikelihood().
+      *
+      * The index is \e only rebuilt if the list of atoms or restraints has changed.
+      */
+      void BuildRestraintAtomIndex()const;
+      /** Build the compiled representation of all bond, bond angle and dihedral angle
+      * restraints (Molecule::mRestraintPack).
+      *
+      * The packed atom indices are \e only rebuilt if the list of atoms or restraints
+      * has changed. The ideal values, delta and sigma are always updated.
+      */
+      void BuildRestraintPack()const;
+      /** Build the table of free stretch modes used by GlobalOptRandomMoveBatch()
+      * (Molecule::mvpStretchModeFreeBatch and Molecule::mvStretchModeFreeBatchDef).
+      */
+      void BuildStretchModeFreeBatch()const;
+      /** Prepare Molecule::mMDRestraintPack for MolecularDynamicsEvolve(), for the
+      * given list of restraints.
+      *
+      * The pack is only rebuilt if the restraint lists differ from the last call, or
+      * if the list of atoms or restraints of the Molecule has changed. The ideal values,
+      * delta and sigma are updated if they have been modified since.
+      */
+      void BuildMDRestraintPack(const std::vector<MolBond*> &vb,const std::vector<MolBondAngle*> &va,
+                                const std::vector<MolDihedralAngle*> &vd)const;
+      /** Prepare the atom indices, mass and moment of inertia of the rigid groups moved
+      * by MolecularDynamicsEvolve(), as well as the mask of atoms belonging to a rigid group.
+      *
+      * These are only re-computed if the rigid groups differ from the last call, or if
+      * the list of atoms or rigid groups of the Molecule has changed.
+      */
+      void BuildMDRigidGroup(const std::map<RigidGroup*,std::pair<XYZ,XYZ> > &vr)const;
+      /// Update the internal coordinates of mAsZMatrix involving atoms which moved
+      void UpdateZMatrixInternalCoords()const;
       /** Build the groups of atoms that will be rotated during global optimization.
       *
       * This is not const because we temporarily modify the molecule conformation
@@ -1159,6 +1405,33 @@ class Molecule: public Scatterer
       *
       */
       vector<MolAtom*> mvpAtom;
+      /** Cartesian coordinates of all atoms in the Molecule reference frame, in the
+      * same order as Molecule::mvpAtom. MolAtom::X(), Y() and Z() are views on these
+      * arrays, which are contiguous so that loops on atoms (rotations of atom groups,
+      * restraints...) can be streamed linearly.
+      *
+      * mutable because they may need to be changed when in a rigid group,
+      * even though the end position of the atom remains the same.
+      *
+      * \warning the RefinablePar for the atomic coordinates point to these arrays. When
+      * they are re-allocated, the pointers must be updated using
+      * Molecule::UpdateAtomParPointers().
+      */
+      mutable std::vector<REAL> mvAtomX,mvAtomY,mvAtomZ;
+      /// Occupancy of all atoms, in the same order as Molecule::mvpAtom
+      std::vector<REAL> mvAtomOccupancy;
+      /// Scattering power of all atoms (0 for dummy atoms), in the same order as Molecule::mvpAtom
+      std::vector<const ScatteringPower*> mvpAtomScattPow;
+      /** Update the pointers of the RefinablePar for the atomic coordinates,
+      * after Molecule::mvAtomX,mvAtomY,mvAtomZ have been re-allocated or shifted.
+      *
+      * \param px,py,pz: the previous location of the coordinate arrays
+      * \param nb: the previous number of atoms
+      * \param removed: if >=0, the index of the atom which has just been removed
+      * from the arrays. Its parameters must already have been removed.
+      */
+      void UpdateAtomParPointers(const REAL *px,const REAL *py,const REAL *pz,
+                                 const unsigned long nb,const long removed=-1);
       /** The list of bonds
       *
       */
@@ -1210,6 +1483,9 @@ class Molecule: public Scatterer
          /// mClockDihedralAngleList and mClockRigidGroup. It can be used to determine if
          /// either the list of atoms or restraints have changed.
          RefinableObjClock mClockRestraint;
+         /// Clicked whenever the ideal value, delta or sigma of a bond length,
+         /// bond angle or dihedral angle is changed.
+         RefinableObjClock mClockRestraintValue;
          RefinableObjClock mClockAtomPosition;
          RefinableObjClock mClockAtomScattPow;
          RefinableObjClock mClockOrientation;
@@ -1222,6 +1498,8 @@ class Molecule: public Scatterer
          mutable RefinableObjClock mClockStretchModeBondAngle;
          mutable RefinableObjClock mClockStretchModeTorsion;
          mutable RefinableObjClock mClockStretchModeTwist;
+         /// Last time mvpStretchModeFree and mvpStretchModeNotFree were built
+         mutable RefinableObjClock mClockStretchModeGroups;
          mutable RefinableObjClock mClockMDAtomGroup;
 
       // For local minimization (EXPERIMENTAL)
@@ -1264,6 +1542,21 @@ class Molecule: public Scatterer
       /// Connectivity table: for each atom, keep the list of atoms
       /// bonded to it. All atoms are referenced from their index.
       mutable map<MolAtom *,set<MolAtom *> > mConnectivityTable;
+      /// Index-based connectivity table: for each atom (same order as mvpAtom), the
+      /// indices of the atoms bonded to it.
+      mutable std::vector<std::vector<unsigned int> > mvConnectivityIndex;
+      /// For each bond in mvConnectivityIndex, the index of the biconnected component
+      /// to which it belongs. Two bonds are part of the same ring system if they
+      /// have the same biconnected component.
+      mutable std::vector<std::vector<unsigned int> > mvConnectivityBCC;
+      /** Depth-first search tree of the connectivity graph: for each atom, the preorder
+      * index, the lowest preorder index reachable through a back edge, the size of the
+      * sub-tree, the parent (-1 for a root) and the root. The atoms of a sub-tree are
+      * contiguous in mvDFSOrder (atom indices sorted by preorder).
+      */
+      mutable std::vector<long> mvDFSPre,mvDFSLow,mvDFSSize,mvDFSParent,mvDFSRoot;
+      /// Atom indices, sorted by preorder in the depth-first search tree
+      mutable std::vector<unsigned int> mvDFSOrder;
       /** Defines a group of atoms which can be rotated around an axis defined
       * by two other atoms.
       */
@@ -1387,9 +1680,28 @@ class Molecule: public Scatterer
    /// Relative energy of molecule during molecular dynamics move
    /// Default: 40, 10 (slow conformation change), 200 (large changes)
    REAL mMDMoveEnergy;
+   /// Gradient of the restraints used by MolecularDynamicsEvolve(), with the same order
+   /// as mvAtomX (all x, then y, then z). Kept to avoid allocations at each MD move.
+   mutable std::vector<REAL> mvMDGrad;
+   /// Indices of the atoms moved by MolecularDynamicsEvolve() (excluding rigid groups)
+   mutable std::vector<unsigned int> mvMDAtomIdx;
+   /// Velocities (vx,vy,vz for each atom in mvMDAtomIdx) used by MolecularDynamicsEvolve()
+   mutable std::vector<REAL> mvMDVelocity;
 
    /// The Molecule, as a lightweight ZMatrix, for export purposes.
    mutable std::vector<MolZAtom> mAsZMatrix;
+   /** For each line of mAsZMatrix, the index (in mvpAtom) of the atom, and of its
+   * bond, bond angle and dihedral angle atoms (-1 if unused).
+   */
+   mutable std::vector<long> mvAsZMatrixIndex;
+   /// Atomic coordinates (x,y,z for each atom) for which mAsZMatrix was last computed
+   mutable std::vector<REAL> mvAsZMatrixXYZ;
+   /// The keeporder option used for the last AsZMatrix() ordering
+   mutable bool mAsZMatrixKeepOrder;
+   /// Clock for the atom ordering in mAsZMatrix
+   mutable RefinableObjClock mClockAsZMatrixOrder;
+   /// Clock for the internal coordinates in mAsZMatrix
+   mutable RefinableObjClock mClockAsZMatrix;
 
    /// The current log(likelihood)
    mutable REAL mLogLikelihood;
@@ -1406,6 +1718,58 @@ class Molecule: public Scatterer
    mutable CrystVector_REAL mLSQObs;
    /// Current LSQ Calc - one value for each restraint(bond distance, angle or dihedral angle sigmas)
    mutable CrystVector_REAL mLSQWeight;
+   /** For each atom (same order as Molecule::mvpAtom), the index of the restraints
+   * (in RefinableObj::mvpRestraint) in which it is involved. An extra last entry
+   * lists the restraints which are not a MolBond, MolBondAngle or MolDihedralAngle,
+   * and which are always re-computed.
+   */
+   mutable std::vector<std::vector<unsigned int> > mvAtomRestraintIndex;
+   /// Last computed log(likelihood) of each restraint (same order as RefinableObj::mvpRestraint)
+   mutable std::vector<REAL> mvRestraintLLK;
+   /// Atomic coordinates (x,y,z for each atom) for which mvRestraintLLK was last computed
+   mutable std::vector<REAL> mvRestraintLLKXYZ;
+   /// Flag for the restraints already re-computed during an incremental update
+   mutable std::vector<bool> mvRestraintLLKUpdated;
+   /// Number of incremental updates of mLogLikelihood since the last full summation
+   mutable unsigned long mNbLogLikelihoodIncrement;
+   /// Clock for the index of restraints per atom
+   mutable RefinableObjClock mClockRestraintAtomIndex;
+   /// Compiled bond, bond angle and dihedral angle restraints, see BuildRestraintPack()
+   mutable MolRestraintPack mRestraintPack;
+   /// Index in RefinableObj::mvpRestraint of each restraint in mRestraintPack
+   mutable std::vector<unsigned int> mvRestraintPackIndex;
+   /// Log(likelihood) of each restraint of mRestraintPack, for a full summation
+   mutable std::vector<REAL> mvRestraintPackLLK;
+   /// Clock for mRestraintPack
+   mutable RefinableObjClock mClockRestraintPack;
+   /// Compiled restraints used for molecular dynamics moves
+   mutable MolRestraintPack mMDRestraintPack;
+   /// Clock for mMDRestraintPack
+   mutable RefinableObjClock mClockMDRestraintPack;
+   /// Rigid groups used by MolecularDynamicsEvolve(), see BuildMDRigidGroup()
+   mutable std::vector<const RigidGroup*> mvMDRigidGroup;
+   /// Sorted atom indices of each rigid group in mvMDRigidGroup
+   mutable std::vector<std::vector<unsigned int> > mvMDRigidGroupIdx;
+   /// Total mass and (isotropic) moment of inertia of each rigid group in mvMDRigidGroup
+   mutable std::vector<REAL> mvMDRigidGroupMass,mvMDRigidGroupInertia;
+   /** Rigid group dynamics in MolecularDynamicsEvolve(): for each group, the speed,
+   * angular velocity, acceleration, angular acceleration and center.
+   */
+   mutable std::vector<XYZ> mvMDRigidGroupState;
+   /// For each atom (see MolAtom::GetIndex()), true if it belongs to one of mvMDRigidGroup
+   mutable std::vector<bool> mvMDIsRigid;
+   /// Clock for mvMDRigidGroup and the associated arrays
+   mutable RefinableObjClock mClockMDRigidGroup;
+   /// Free stretch modes, as used by GlobalOptRandomMoveBatch()
+   mutable std::vector<const StretchMode*> mvpStretchModeFreeBatch;
+   /** For each mode of mvpStretchModeFreeBatch, 8 values: the type of mode (0:bond length,
+   * 1:bond angle, 2:torsion, 3:twist), the index of the 3 atoms defining the mode
+   * (the last one is unused for torsion and twist) and the index of the atoms of the
+   * associated restraint (unused values are 0).
+   */
+   mutable std::vector<unsigned int> mvStretchModeFreeBatchDef;
+   /// Clock for mvpStretchModeFreeBatch
+   mutable RefinableObjClock mClockStretchModeFreeBatch;
 
    #ifdef __WX__CRYST__
    public:
@@ -1443,6 +1807,24 @@ void ExpandAtomGroupRecursive(MolAtom* atom,
                               const map<MolAtom*,set<MolAtom*> > &connect,
                               map<MolAtom*,unsigned long> &atomlist,const unsigned long maxdepth, unsigned long depth=0);
 
+/** Rotate a list of atoms given a rotation matrix and a center of rotation.
+*
+* This is the batch kernel used by Molecule::RotateAtomGroup(). When using SSE, atoms
+* are rotated four at a time, with direct loads for contiguous indices.
+*
+* \param px,py,pz: the arrays of cartesian coordinates (see Molecule::mvAtomX)
+* \param vidx: sorted list of the indices of the atoms to rotate
+* \param m: the 3x3 rotation matrix, row-major (see Quaternion::GetRotationMatrix())
+* \param x0,y0,z0: the center of rotation
+* \param dx,dy,dz: on return, the sum of the displacements of all rotated atoms
+*/
+void RotateAtomIndexList(REAL *px,REAL *py,REAL *pz,const std::vector<unsigned int> &vidx,
+                         const REAL *m,const REAL x0,const REAL y0,const REAL z0,
+                         REAL &dx,REAL &dy,REAL &dz);
+
+/// Build the sorted list of indices (see MolAtom::GetIndex()) for a set of atoms
+void BuildAtomIndexList(const std::set<MolAtom*> &atoms,std::vector<unsigned int> &vidx);
+
 // Forward declaration
 class ZScatterer;
 
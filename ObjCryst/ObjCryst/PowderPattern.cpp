@@ -373,6 +373,30 @@ number of points differ or less than 2 points !");
    VFN_DEBUG_EXIT("PowderPatternBackground::SetInterpPoints()",5)
 }
 
+void PowderPatternBackground::InitInterpPointsFromObs(const long nbPointSpline)
+{
+   const long nbInterp=(nbPointSpline<2) ? 2 : nbPointSpline;
+   CrystVector_REAL x(nbInterp),backgd(nbInterp);
+   const CrystVector_REAL *pObs=&(this->GetParentPowderPattern().GetPowderPatternObs());
+   const unsigned long nbPoint=this->GetParentPowderPattern().GetNbPoint();
+   const float xmin=this->GetParentPowderPattern().GetPowderPatternX()(0),
+               xmax=this->GetParentPowderPattern().GetPowderPatternX()(nbPoint-1);
+   for(int i=0;i<nbInterp;i++)
+   {// xmax is not necessarily > xmin, but in the right order (TOF)
+      x(i)=xmin+(xmax-xmin)/(REAL)(nbInterp-1)*REAL(i);
+      REAL x1=xmin+(xmax-xmin)/(REAL)(nbInterp-1)*REAL(i-.2);
+      REAL x2=xmin+(xmax-xmin)/(REAL)(nbInterp-1)*REAL(i+.2);
+      long n1=(long)(this->GetParentPowderPattern().X2Pixel(x1));
+      long n2=(long)(this->GetParentPowderPattern().X2Pixel(x2));
+      if(n1<0) n1=0;
+      if(n2>(long)nbPoint)n2=nbPoint;
+      backgd(i)=(*pObs)(n1);
+      for(long j=n1;j<n2;j++)
+         if((*pObs)(j)<backgd(i))backgd(i)=(*pObs)(j);
+   }
+   this->SetInterpPoints(x,backgd);
+}
+
 const pair<const CrystVector_REAL*,const CrystVector_REAL*> PowderPatternBackground::GetInterpPoints()const
 {
    return make_pair(&mBackgroundInterpPointX,&mBackgroundInterpPointIntensity);
@@ -3862,6 +3886,21 @@ supplied vector of observed intensities does not have the expected number of poi
       (*fpObjCrystInformUser)((string)buf);
    }
 }
+void PowderPattern::SetPowderPatternObs(const CrystVector_REAL &x,const CrystVector_REAL &obs,
+                                        const CrystVector_REAL &sigma,const CrystVector_REAL &weight)
+{
+   VFN_DEBUG_MESSAGE("PowderPattern::SetPowderPatternObs(x,obs,sigma,weight)",5)
+   if(  (obs.numElements()!=x.numElements())
+      ||(sigma.numElements()!=x.numElements())
+      ||(weight.numElements()!=x.numElements()))
+      throw(ObjCrystException("PowderPattern::SetPowderPatternObs(x,obs,sigma,weight): \
+the supplied vectors do not have the same number of points!"));
+   this->SetPowderPatternX(x);
+   mPowderPatternObs=obs;
+   mPowderPatternObsSigma=sigma;
+   mPowderPatternWeight=weight;
+   mClockIntegratedFactorsPrep.Reset();
+}
 void PowderPattern::SavePowderPattern(const string &filename) const
 {
    VFN_DEBUG_MESSAGE("PowderPattern::SavePowderPattern",5)
@@ -5608,47 +5647,75 @@ PeakList PowderPattern::FindPeaks(const float dmin,const float maxratio,const un
       min_iobs=5*(tmp(tmp.numElements()/2)-tmp(tmp.numElements()/4));
       //cout<<__FILE__<<":"<<__LINE__<<" MIN_IOBS (automatic)="<<min_iobs<<endl;
    }else min_iobs=-1;// This will be set after highest peak is found
+   // Single pass: list all local maxima of the (sign-inverted) second derivative,
+   // and process them by decreasing height. This replaces repeated scans of the full
+   // pattern, and a shoulder is kept as long as it yields a separate maximum.
+   long nbcandidate=0;
+   const long nbcandidatemax=(finish>start)?(finish-start+1):1;
+   CrystVector_long vcandidate(nbcandidatemax);
+   CrystVector_REAL vcandidateheight(nbcandidatemax);
+   for(long i=(start>1?start:1);i<finish;++i)
+   {
+      if(i>=(nb-1)) break;
+      const REAL y=obsd2(i);
+      if(y<=0) continue;
+      if((y>obsd2(i-1))&&(y>=obsd2(i+1)))
+      {
+         vcandidate(nbcandidate)=i;
+         vcandidateheight(nbcandidate++)=y;
+      }
+   }
+   CrystVector_long candidatesubs;
+   if(nbcandidate>0)
+   {
+      vcandidateheight.resizeAndPreserve(nbcandidate);
+      candidatesubs=SortSubs(vcandidateheight);
+   }
    PeakList pl;
    int nbav_min=0;//minimum numerb of points over which the peak is integrated
-   while(true)
+   for(long k=nbcandidate-1;k>=0;--k)
    {// Start from max
-      const long imax=obsd2.imax(start,finish);
-      REAL iobs=obsd2(imax);
-      if(iobs<=0) break;
-      REAL xmax=mX(imax)*iobs;
+      const long imax=vcandidate(candidatesubs(k));
+      const REAL iobs_max=obsd2(imax);
+      REAL iobs=iobs_max;
       long nbav=1;
+      // Integrate the peak by descending on both sides, until the derivative
+      // rises again or crosses zero
       long i=imax;
-      REAL lastiobs=obsd2(i);
-      const REAL iobs_max=lastiobs;
-      //cout<<i<<":"<<lastiobs<<":"<<mX(i)*RAD2DEG<<endl;
+      REAL lastiobs=iobs_max;
       while(true)
       {
          if(i<=1) break;
          if(obsd2(--i)>=lastiobs) break;
          lastiobs=obsd2(i);
-         obsd2(i)=0;
-         iobs+=lastiobs;
-         xmax+=mX(i)*lastiobs;nbav++;
+         iobs+=lastiobs;nbav++;
          if(lastiobs<=0) break;
-         //cout<<i<<":"<<lastiobs<<":"<<mX(i)*RAD2DEG<<endl;
       }
       float dleft=mX(i+1);
       i=imax;
-      lastiobs=obsd2(i);
+      lastiobs=iobs_max;
       while(true)
       {
          if(i>=(nb-2)) break;
          if(obsd2(++i)>=lastiobs) break;
          lastiobs=obsd2(i);
-         obsd2(i)=0;
-         iobs+=lastiobs;
-         xmax+=mX(i)*lastiobs;nbav++;
+         iobs+=lastiobs;nbav++;
          if(lastiobs<=0) break;
-         //cout<<i<<":"<<lastiobs<<":"<<mX(i)*RAD2DEG<<endl;
       }
       float dright=mX(i-1);
-      xmax/=iobs;
-      obsd2(imax)=0;
+      // Sub-pixel position from the vertex of the parabola through the maximum and its neighbours
+      REAL xmax=mX(imax);
+      {
+         const REAL y0=obsd2(imax-1),y2=obsd2(imax+1);
+         const REAL den=y0-2*iobs_max+y2;
+         if(den<0)
+         {
+            REAL delta=0.5*(y0-y2)/den;
+            if(delta>0.5) delta=0.5;
+            if(delta<-0.5) delta=-0.5;
+            xmax+=delta*(mX(imax+1)-mX(imax-1))/2;
+         }
+      }
       REAL dmax=this->X2STOL(xmax)*2;
       dright=this->X2STOL(dright)*2;
       dleft =this->X2STOL(dleft)*2;
@@ -7200,4 +7267,232 @@ REAL SpaceGroupExplorer::GetP1IntegratedGoF()
    return chi2 / nbpoint;
 }
    
+/////////////////////////////////////////////////////// AutoIndexingResult ///////////////////////////////////////
+AutoIndexingResult::AutoIndexingResult():
+nbPeak(0),nbSolution(0),score(0),centering('P'),nbSpurious(0),rwLeBail(-1),gofLeBail(-1)
+{}
+
+/// Write a string with JSON escapes
+void WriteJSONString(std::ostream &os,const string &s)
+{
+   os<<'"';
+   for(string::const_iterator pos=s.begin();pos!=s.end();++pos)
+   {
+      switch(*pos)
+      {
+         case '"': os<<"\\\"";break;
+         case '\\':os<<"\\\\";break;
+         case '\n':os<<"\\n";break;
+         case '\t':os<<"\\t";break;
+         default:
+            if((unsigned char)(*pos)<0x20) os<<' ';
+            else os<<*pos;
+      }
+   }
+   os<<'"';
+}
+
+void AutoIndexingResult::WriteJSON(std::ostream &os)const
+{
+   os<<"{\"name\":";
+   WriteJSONString(os,name);
+   os<<",\"error\":";
+   WriteJSONString(os,error);
+   os<<",\"nb_peak\":"<<nbPeak<<",\"nb_solution\":"<<nbSolution;
+   if(cell.size()==7)
+   {
+      os<<",\"score\":"<<score
+        <<",\"system\":\""<<crystalSystem<<"\",\"centering\":\""<<centering
+        <<"\",\"nb_spurious\":"<<nbSpurious
+        <<",\"cell\":["<<cell[0]<<","<<cell[1]<<","<<cell[2]<<","<<cell[3]*RAD2DEG<<","
+        <<cell[4]*RAD2DEG<<","<<cell[5]*RAD2DEG<<","<<cell[6]<<"]";
+   }
+   if(rwLeBail>=0) os<<",\"rw_lebail\":"<<rwLeBail<<",\"gof_lebail\":"<<gofLeBail;
+   if(vSPG.size()>0)
+   {
+      os<<",\"spacegroups\":[";
+      for(vector<SPGScore>::const_iterator pos=vSPG.begin();pos!=vSPG.end();++pos)
+      {
+         if(pos!=vSPG.begin()) os<<",";
+         os<<"{\"hm\":";
+         WriteJSONString(os,pos->hm);
+         os<<",\"rw\":"<<pos->rw<<",\"gof\":"<<pos->gof<<",\"ngof\":"<<pos->ngof
+           <<",\"nb_extinct\":"<<pos->nbextinct446<<",\"nb_refl\":"<<pos->nbreflused<<"}";
+      }
+      os<<"]";
+   }
+   os<<"}";
+}
+
+PowderPatternBackground* AddBayesianBackground(PowderPattern &pattern,const long nbPointSpline)
+{
+   PowderPatternBackground *pBckgd= new PowderPatternBackground;
+   pattern.AddPowderPatternComponent(*pBckgd);
+   pBckgd->InitInterpPointsFromObs(nbPointSpline);
+   pattern.Prepare();
+   pBckgd->UnFixAllPar();
+   pBckgd->GetOption(0).SetChoice(0);//linear
+   pBckgd->OptimizeBayesianBackground();
+   pBckgd->GetOption(0).SetChoice(1);//spline
+   pBckgd->OptimizeBayesianBackground();
+   pBckgd->FixAllPar();
+   return pBckgd;
+}
+
+void AutoIndexPowderPatterns(const std::vector<PowderPattern*> &vpPattern,
+                             std::vector<AutoIndexingResult> &vResult,
+                             const bool leBail,const bool spacegroup,
+                             const unsigned int nbThread)
+{
+   const long nbPattern=vpPattern.size();
+   vResult.assign(nbPattern,AutoIndexingResult());
+   // Patterns are processed one at a time: the CellExplorer and the PowderPattern
+   // are RefinableObj (registries, clocks), which are not thread-safe. The DicVol
+   // search within each pattern is parallel.
+   for(long i=0;i<nbPattern;++i)
+   {
+      AutoIndexingResult *const pResult=&(vResult[i]);
+      pResult->name=vpPattern[i]->GetName();
+      CellExplorer *pCellExplorer=0;
+      try
+      {
+         PeakList peaklist;
+         float dmin=1.5;
+         while(true)
+         {
+            peaklist=vpPattern[i]->FindPeaks(dmin,-1,1000);
+            dmin*=0.75;
+            if((peaklist.GetPeakList().size()>30)||(dmin<0.3)) break;
+         }
+         pResult->nbPeak=peaklist.GetPeakList().size();
+         if(pResult->nbPeak<5) throw ObjCrystException("not enough peaks found");
+         // Use at most 20 reflections for indexing
+         if(peaklist.GetPeakList().size()>20) peaklist.GetPeakList().resize(20);
+         pCellExplorer=new CellExplorer(peaklist,CUBIC,0);
+         pCellExplorer->SetAngleMinMax(90*DEG2RAD,140*DEG2RAD);
+         pCellExplorer->SetD2Error(0);
+         pCellExplorer->SetNbThread(nbThread);
+         pCellExplorer->DicVolAllSystems();
+         pResult->nbSolution=pCellExplorer->GetSolutions().size();
+         if(pResult->nbSolution>0)
+         {
+            const char *vsystem[7]={"TRICLINIC","MONOCLINIC","ORTHOROMBIC","HEXAGONAL","RHOMBOEDRAL","TETRAGONAL","CUBIC"};
+            const char vcent[6]={'P','I','A','B','C','F'};
+            const RecUnitCell *pCell=&(pCellExplorer->GetSolutions().front().first);
+            pResult->cell=pCell->DirectUnitCell();
+            pResult->crystalSystem=vsystem[pCell->mlattice];
+            pResult->centering=vcent[pCell->mCentering];
+            pResult->nbSpurious=pCell->mNbSpurious;
+            pResult->score=pCellExplorer->GetSolutions().front().second;
+         }
+      }
+      catch(const ObjCrystException &except)
+      {
+         pResult->error=except.message;
+      }
+      if(pCellExplorer!=0) delete pCellExplorer;
+   }
+   if(!leBail) return;
+   // Le Bail and spacegroup exploration
+   for(long i=0;i<nbPattern;++i)
+   {
+      AutoIndexingResult *const pResult=&(vResult[i]);
+      if((pResult->error!="")||(pResult->nbSolution==0)) continue;
+      try
+      {
+         PowderPattern *pPattern=vpPattern[i];
+         bool hasBackground=false;
+         for(unsigned int j=0;j<pPattern->GetNbPowderPatternComponent();j++)
+            if(pPattern->GetPowderPatternComponent(j).GetClassName()=="PowderPatternBackground")
+            {
+               hasBackground=true;
+               break;
+            }
+         if(!hasBackground) AddBayesianBackground(*pPattern);
+         const vector<float> *uc=&(pResult->cell);
+         Crystal *pCrystal=new Crystal((*uc)[0],(*uc)[1],(*uc)[2],(*uc)[3],(*uc)[4],(*uc)[5],"P1");
+         pCrystal->SetName(pPattern->GetName()+" - indexing result");
+         PowderPatternDiffraction *pDiff=new PowderPatternDiffraction;
+         pDiff->SetCrystal(*pCrystal);
+         pPattern->AddPowderPatternComponent(*pDiff);
+         pPattern->Prepare();
+         SpaceGroupExplorer spgExplorer(pDiff);
+         // Profile fitting in P1 validates the cell
+         const SPGScore scoreP1=spgExplorer.Run("P1",true,false,false,false);
+         pResult->rwLeBail=scoreP1.rw;
+         pResult->gofLeBail=scoreP1.gof;
+         if(spacegroup)
+         {
+            spgExplorer.RunAll(false,false,false,false,false);
+            pResult->vSPG.assign(spgExplorer.GetScores().begin(),spgExplorer.GetScores().end());
+         }
+      }
+      catch(const ObjCrystException &except)
+      {
+         pResult->error=except.message;
+      }
+   }
+}
+
+PowderPatternDiffraction* ValidateIndexingCandidates(PowderPattern &pattern,
+                                                     const std::vector<RecUnitCell> &vCell,
+                                                     std::vector<SPGScore> &vScore,
+                                                     const bool fitprofile,const bool verbose)
+{
+   vScore.clear();
+   if(vCell.size()==0) return 0;
+   // Common setup for all candidates: background and diffraction component
+   bool hasBackground=false;
+   for(unsigned int j=0;j<pattern.GetNbPowderPatternComponent();j++)
+      if(pattern.GetPowderPatternComponent(j).GetClassName()=="PowderPatternBackground")
+      {
+         hasBackground=true;
+         break;
+      }
+   if(!hasBackground) AddBayesianBackground(pattern);
+   vector<float> uc=vCell.front().DirectUnitCell();
+   const string name=pattern.GetName()+" - indexing result";
+   Crystal *pCrystal=new Crystal(uc[0],uc[1],uc[2],uc[3],uc[4],uc[5],"P1");
+   pCrystal->SetName(name);
+   PowderPatternDiffraction *pDiff=new PowderPatternDiffraction;
+   pDiff->SetCrystal(*pCrystal);
+   pattern.AddPowderPatternComponent(*pDiff);
+   pattern.Prepare();
+   // All candidates start from the same profile, background, scale and zero parameters
+   LSQNumObj lsq;
+   lsq.SetRefinedObj(pattern,0,true,true);
+   lsq.PrepareRefParList(true);
+   const unsigned int initial_par=lsq.GetCompiledRefinedObj().CreateParamSet("Indexing candidates initial parameters");
+   lsq.GetCompiledRefinedObj().SaveParamSet(initial_par);
+   unsigned int best=0;
+   for(unsigned int i=0;i<vCell.size();++i)
+   {
+      lsq.GetCompiledRefinedObj().RestoreParamSet(initial_par);
+      uc=vCell[i].DirectUnitCell();
+      pCrystal->Init(uc[0],uc[1],uc[2],uc[3],uc[4],uc[5],"P1",name);
+      SpaceGroupExplorer spgExplorer(pDiff);
+      try
+      {
+         vScore.push_back(spgExplorer.Run("P1",fitprofile,false,false,false));
+      }
+      catch(const ObjCrystException &)
+      {// Keep one score per candidate
+         vScore.push_back(SPGScore("P1",-1,-1,0));
+         continue;
+      }
+      if(verbose)
+         cout<<"Candidate #"<<i<<": a="<<uc[0]<<" b="<<uc[1]<<" c="<<uc[2]<<" alpha="<<uc[3]*RAD2DEG
+             <<" beta="<<uc[4]*RAD2DEG<<" gamma="<<uc[5]*RAD2DEG<<" V="<<uc[6]
+             <<" => Rwp="<<vScore.back().rw<<"% GoF="<<vScore.back().gof<<endl;
+      if((vScore[best].gof<0)||(vScore.back().gof<vScore[best].gof)) best=i;
+   }
+   // Keep the best candidate
+   lsq.GetCompiledRefinedObj().RestoreParamSet(initial_par);
+   uc=vCell[best].DirectUnitCell();
+   pCrystal->Init(uc[0],uc[1],uc[2],uc[3],uc[4],uc[5],"P1",name);
+   pDiff->SetExtractionMode(true,true);
+   pDiff->ExtractLeBail(5);
+   return pDiff;
+}
+
 }//namespace ObjCryst
@@ -35,6 +35,7 @@
 namespace ObjCryst
 {
 class PeakList;
+class RecUnitCell;
 class PowderPattern;
 class PowderPatternDiffraction;
 
@@ -234,6 +235,11 @@ class PowderPatternBackground : public PowderPatternComponent
       /// Import background points from a file (with two columns 2theta (or tof), intensity)
       void ImportUserBackground(const string &filename);
       void SetInterpPoints(const CrystVector_REAL tth, const CrystVector_REAL backgd);
+      /** Set nbPointSpline interpolation points, evenly spaced over the parent powder pattern,
+      * using the minimum observed intensity around each point. This is the starting point
+      * of the automatic bayesian background (see OptimizeBayesianBackground()).
+      */
+      void InitInterpPointsFromObs(const long nbPointSpline=20);
       const std::pair<const CrystVector_REAL*,const CrystVector_REAL*> GetInterpPoints()const;
       virtual void XMLOutput(ostream &os,int indent=0)const;
       virtual void XMLInput(istream &is,const XMLCrystTag &tag);
@@ -816,6 +822,14 @@ class PowderPattern : public RefinableObj
          * for example by calling DiffractionDataPowder::InitPowderPatternPar().
          */
          void SetPowderPatternObs(const CrystVector_REAL& obs);
+         /** \brief Set the x coordinates, observed intensities, uncertainties and weights
+         * of the powder pattern.
+         *
+         * Contrary to SetPowderPatternObs(obs), sigma and weights are not re-computed.
+         * This is used to restore a previously saved state (see XMLConfig).
+         */
+         void SetPowderPatternObs(const CrystVector_REAL &x,const CrystVector_REAL &obs,
+                                  const CrystVector_REAL &sigma,const CrystVector_REAL &weight);
 
          ///Save powder pattern to one file, text format, 3 columns theta Iobs Icalc.
          ///If Iobs is missing, the column is omitted.
@@ -1289,6 +1303,87 @@ private:
    /// Map extinction fingerprint
    std::map<std::vector<bool>,SPGScore> mvSPGExtinctionFingerprint;
 };
+
+/** Add a bayesian-optimised background to a powder pattern (see
+* PowderPatternBackground::InitInterpPointsFromObs() and OptimizeBayesianBackground()),
+* first with a linear and then with a spline interpolation, as done from the graphical interface.
+*
+* \return the new background component, with all its parameters fixed.
+*/
+PowderPatternBackground* AddBayesianBackground(PowderPattern &pattern,const long nbPointSpline=20);
+
+/** Result of the automatic processing of one powder pattern, see AutoIndexPowderPatterns().
+*
+*/
+struct AutoIndexingResult
+{
+   AutoIndexingResult();
+   /// Write the result as a compact JSON object, on a single line
+   void WriteJSON(std::ostream &os)const;
+   /// Name of the powder pattern
+   std::string name;
+   /// Error message if the processing could not be completed, empty otherwise
+   std::string error;
+   /// Number of peaks found
+   unsigned int nbPeak;
+   /// Number of indexing solutions (after removing duplicates)
+   unsigned int nbSolution;
+   /// Score of the best indexing solution (0 if none was found)
+   float score;
+   /// Best indexing solution: direct unit cell a,b,c (Angstroems), alpha,beta,gamma (radians) and volume
+   std::vector<float> cell;
+   /// Crystal system of the best solution (e.g. "CUBIC")
+   std::string crystalSystem;
+   /// Lattice centering of the best solution (P,I,A,B,C or F)
+   char centering;
+   /// Number of spurious lines for the best solution
+   unsigned int nbSpurious;
+   /// Rwp (in %) and goodness-of-fit after Le Bail extraction and profile fitting
+   /// in the P1 spacegroup, or -1 if this was not done
+   float rwLeBail,gofLeBail;
+   /// Scores of all spacegroups compatible with the cell, best first
+   std::vector<SPGScore> vSPG;
+};
+
+/** Automatic processing of a list of powder patterns: peak search, indexing,
+* Le Bail validation and spacegroup ranking.
+*
+* Patterns are processed one after the other. The Le Bail fit and spacegroup exploration
+* add a background (if there is none), a Crystal and a PowderPatternDiffraction to each pattern.
+*
+* \param vResult: the results, one for each pattern
+* \param leBail: if true, perform the Le Bail validation (profile fitting in P1)
+* \param spacegroup: if true (and leBail is true), rank all compatible spacegroups
+* \param nbThread: number of threads used by the DicVol search (0: OpenMP default)
+*/
+void AutoIndexPowderPatterns(const std::vector<PowderPattern*> &vpPattern,
+                             std::vector<AutoIndexingResult> &vResult,
+                             const bool leBail=true,const bool spacegroup=true,
+                             const unsigned int nbThread=0);
+
+/** Validate a list of indexing candidates (e.g. the best solutions from a CellExplorer)
+* by Le Bail extraction and profile fitting in P1, as done for each cell from the
+* graphical interface.
+*
+* The background (a bayesian-optimised one is added if there is none) and the profile
+* are set up only once, and all candidates start from the same parameters. The candidates
+* are evaluated one after the other, since the fits work on the same PowderPattern.
+*
+* \param pattern: the powder pattern, which should not already include a PowderPatternDiffraction
+* \param vCell: the candidate unit cells
+* \param vScore: the scores (Rwp and goodness-of-fit in the P1 spacegroup), one for each candidate
+* \param fitprofile: if true, fit the profile and unit cell after the Le Bail extraction.
+*  Much slower, but more reliable.
+* \param verbose: print the results for each candidate
+* \return the PowderPatternDiffraction added to the pattern, with a Crystal in P1
+* using the best candidate cell (lowest goodness-of-fit). It can be used to
+* explore spacegroups with a SpaceGroupExplorer. 0 if there are no candidates.
+*/
+PowderPatternDiffraction* ValidateIndexingCandidates(PowderPattern &pattern,
+                                                     const std::vector<RecUnitCell> &vCell,
+                                                     std::vector<SPGScore> &vScore,
+                                                     const bool fitprofile=true,
+                                                     const bool verbose=false);
    
 
 }//namespace ObjCryst
@@ -508,6 +508,10 @@ mMaxSinThetaOvLambda(old.mMaxSinThetaOvLambda)
 ScatteringData::~ScatteringData()
 {
    VFN_DEBUG_MESSAGE("ScatteringData::~ScatteringData()",10)
+   // The Crystal may have been destroyed first
+   if(  (mpCrystal!=0)&&(gCrystalRegistry.Find(mpCrystal)>=0)
+      &&(mpCrystal->HasGeomStructFactorStore()))
+      mpCrystal->GetGeomStructFactorStore().RemoveClient(this);
 }
 
 void ScatteringData::SetHKL(const CrystVector_REAL &h,
@@ -654,7 +658,12 @@ RadiationType ScatteringData::GetRadiationType()const {return this->GetRadiation
 void ScatteringData::SetCrystal(Crystal &crystal)
 {
    VFN_DEBUG_MESSAGE("ScatteringData::SetCrystal()",5)
-   if(mpCrystal!=0) mpCrystal->DeRegisterClient(*this);
+   if(mpCrystal!=0)
+   {
+      mpCrystal->DeRegisterClient(*this);
+      if(mpCrystal->HasGeomStructFactorStore())
+         mpCrystal->GetGeomStructFactorStore().RemoveClient(this);
+   }
    mpCrystal=&crystal;
    this->AddSubRefObj(crystal);
    crystal.RegisterClient(*this);
@@ -662,6 +671,7 @@ void ScatteringData::SetCrystal(Crystal &crystal)
    mClockMaster.AddChild(mpCrystal->GetSpaceGroup().GetClockSpaceGroup());
    mClockGeomStructFact.Reset();
    mClockStructFactor.Reset();
+   mClockGeomStructFactorStoreIndex.Reset();
 }
 const Crystal& ScatteringData::GetCrystal()const {return *mpCrystal;}
 
@@ -1646,69 +1656,45 @@ void ScatteringData::CalcStructFactor_FullDeriv(std::set<RefinablePar *> &vPar)
    #endif
 }
 
-void ScatteringData::CalcGeomStructFactor() const
-{
-   // This also updates the ScattCompList if necessary.
-   const ScatteringComponentList *pScattCompList
-      =&(this->GetCrystal().GetScatteringComponentList());
-   if(  (mClockGeomStructFact>mpCrystal->GetClockScattCompList())
-      &&(mClockGeomStructFact>mClockHKL)
-      &&(mClockGeomStructFact>mClockNbReflUsed)
-      &&(mClockGeomStructFact>mpCrystal->GetSpaceGroup().GetClockSpaceGroup())
-      &&(mClockGeomStructFact>mpCrystal->GetMasterClockScatteringPower())) return;
-   TAU_PROFILE("ScatteringData::GeomStructFactor()","void (Vx,Vy,Vz,data,M,M,bool)",TAU_DEFAULT);
-   VFN_DEBUG_ENTRY("ScatteringData::GeomStructFactor(Vx,Vy,Vz,...)",3)
-   VFN_DEBUG_MESSAGE("-->Using fast functions:"<<mUseFastLessPreciseFunc,2)
-   VFN_DEBUG_MESSAGE("-->Number of translation vectors:"
-      <<this->GetCrystal().GetSpaceGroup().GetNbTranslationVectors()-1,2)
-   VFN_DEBUG_MESSAGE("-->Has an inversion Center:"
-      <<this->GetCrystal().GetSpaceGroup().HasInversionCenter(),2)
-   VFN_DEBUG_MESSAGE("-->Number of symetry operations (w/o transl&inv cent.):"\
-                     <<this->GetCrystal().GetSpaceGroup().GetNbSymmetrics(true,true),2)
-   VFN_DEBUG_MESSAGE("-->Number of Scattering Components :"
-      <<this->GetCrystal().GetScatteringComponentList().GetNbComponent(),2)
-   VFN_DEBUG_MESSAGE("-->Number of reflections:"
-      <<this->GetNbRefl()<<" (actually used:"<<mNbReflUsed<<")",2)
-   #ifdef __DEBUG__
-   static long counter=0;
-   VFN_DEBUG_MESSAGE("-->Number of GeomStructFactor calculations so far:"<<counter++,3)
-   #endif
-
-   //:TODO: implement for geometrical structure factor calculation
-   //bool useGeomStructFactor=mUseGeomStructFactor;
-
-   //if((mfpRealGeomStructFactor==0)||(mfpImagGeomStructFactor==0)) useGeomStructFactor=false ;
-
-   //if(useGeomStructFactor==true)
-   //{
-   //   (*mfpRealGeomStructFactor)(x,y,z,data.H2Pi(),data.K2Pi(),data.L2Pi(),rsf);
-   //   if(this->IsCentrosymmetric())return;
-   //   (*mfpImagGeomStructFactor)(x,y,z,data.H2Pi(),data.K2Pi(),data.L2Pi(),isf);
-   //   return;
-   //}
-   //else
+/** Compute the geometrical structure factors of all the ScatteringPower of a Crystal,
+* for a list of reflections. This is used by ScatteringData::CalcGeomStructFactor()
+* for its own reflections, and by GeomStructFactorStore for the reflections
+* shared by all the ScatteringData using the same Crystal.
+*/
+static void CalcGeomStructFactorList(const Crystal &crystal,const long nbReflUsed,
+                                     const CrystVector_REAL &h2pi,
+                                     const CrystVector_REAL &k2pi,
+                                     const CrystVector_REAL &l2pi,
+                                     const CrystVector_long &vIntH,
+                                     const CrystVector_long &vIntK,
+                                     const CrystVector_long &vIntL,
+                                     const bool useFastLessPreciseFunc,
+                                     map<const ScatteringPower*,CrystVector_REAL> &vRealGeomSF,
+                                     map<const ScatteringPower*,CrystVector_REAL> &vImagGeomSF)
+{
+   const ScatteringComponentList *pScattCompList=&(crystal.GetScatteringComponentList());
    {
-      const SpaceGroup *pSpg=&(this->GetCrystal().GetSpaceGroup());
+      const SpaceGroup *pSpg=&(crystal.GetSpaceGroup());
 
       const int nbSymmetrics=pSpg->GetNbSymmetrics(true,true);
       const int nbTranslationVectors=pSpg->GetNbTranslationVectors();
       const long nbComp=pScattCompList->GetNbComponent();
       const std::vector<SpaceGroup::TRx> *pTransVect=&(pSpg->GetTranslationVectors());
       CrystMatrix_REAL allCoords(nbSymmetrics,3);
-      CrystVector_REAL tmpVect(mNbReflUsed);
+      CrystVector_REAL tmpVect(nbReflUsed);
       #ifndef HAVE_SSE_MATHFUN
-      const int nbRefl=this->GetNbRefl();
-      CrystVector_long intVect(nbRefl);//not used if mUseFastLessPreciseFunc==false
+      const int nbRefl=nbReflUsed;
+      CrystVector_long intVect(nbRefl);//not used if useFastLessPreciseFunc==false
       #endif
       // which scattering powers are actually used ?
       map<const ScatteringPower*,bool> vUsed;
       // Add existing previously used scattering power to the test;
-      for(map<const ScatteringPower*,CrystVector_REAL>::const_iterator pos=mvRealGeomSF.begin();pos!=mvRealGeomSF.end();++pos)
+      for(map<const ScatteringPower*,CrystVector_REAL>::const_iterator pos=vRealGeomSF.begin();pos!=vRealGeomSF.end();++pos)
          vUsed[pos->first]=false;// this will be changed to true later if they are actually used
 
-      for(int i=mpCrystal->GetScatteringPowerRegistry().GetNb()-1;i>=0;i--)
+      for(int i=crystal.GetScatteringPowerRegistry().GetNb()-1;i>=0;i--)
       {// Here we make sure scattering power that only contribute ghost atoms are taken into account
-         const ScatteringPower*pow=&(mpCrystal->GetScatteringPowerRegistry().GetObj(i));
+         const ScatteringPower*pow=&(crystal.GetScatteringPowerRegistry().GetObj(i));
          if(pow->GetMaximumLikelihoodNbGhostAtom()>0) vUsed[pow]=true;
          else vUsed[pow]=false;
       }
@@ -1719,19 +1705,19 @@ void ScatteringData::CalcGeomStructFactor() const
       {
          if(pos->second)
          {// this will create the entry if it does not already exist
-            mvRealGeomSF[pos->first].resize(mNbReflUsed);
-            mvImagGeomSF[pos->first].resize(mNbReflUsed);
-            mvRealGeomSF[pos->first]=0;
-            mvImagGeomSF[pos->first]=0;
+            vRealGeomSF[pos->first].resize(nbReflUsed);
+            vImagGeomSF[pos->first].resize(nbReflUsed);
+            vRealGeomSF[pos->first]=0;
+            vImagGeomSF[pos->first]=0;
          }
          else
          {// erase entries that are not useful any more (e.g. ScatteringPower that were
           // used but are not any more).
             map<const ScatteringPower*,CrystVector_REAL>::iterator
-               poubelle=mvRealGeomSF.find(pos->first);
-            if(poubelle!=mvRealGeomSF.end()) mvRealGeomSF.erase(poubelle);
-            poubelle=mvImagGeomSF.find(pos->first);
-            if(poubelle!=mvImagGeomSF.end()) mvImagGeomSF.erase(poubelle);
+               poubelle=vRealGeomSF.find(pos->first);
+            if(poubelle!=vRealGeomSF.end()) vRealGeomSF.erase(poubelle);
+            poubelle=vImagGeomSF.find(pos->first);
+            if(poubelle!=vImagGeomSF.end()) vImagGeomSF.erase(poubelle);
          }
       }
 
@@ -1766,18 +1752,18 @@ void ScatteringData::CalcGeomStructFactor() const
             VFN_DEBUG_MESSAGE("ScatteringData::GeomStructFactor(),comp #"<<i<<", sym #"<<j,3)
 
             #ifndef HAVE_SSE_MATHFUN
-            if(mUseFastLessPreciseFunc==true)
+            if(useFastLessPreciseFunc==true)
             {
-               REAL * RESTRICT rrsf=mvRealGeomSF[pScattPow].data();
-               REAL * RESTRICT iisf=mvImagGeomSF[pScattPow].data();
+               REAL * RESTRICT rrsf=vRealGeomSF[pScattPow].data();
+               REAL * RESTRICT iisf=vImagGeomSF[pScattPow].data();
 
                const long intX=(long)(allCoords(j,0)*sLibCrystNbTabulSine);
                const long intY=(long)(allCoords(j,1)*sLibCrystNbTabulSine);
                const long intZ=(long)(allCoords(j,2)*sLibCrystNbTabulSine);
 
-               const long * RESTRICT intH=mIntH.data();
-               const long * RESTRICT intK=mIntK.data();
-               const long * RESTRICT intL=mIntL.data();
+               const long * RESTRICT intH=vIntH.data();
+               const long * RESTRICT intK=vIntK.data();
+               const long * RESTRICT intL=vIntL.data();
 
                long * RESTRICT tmpInt=intVect.data();
                // :KLUDGE: using a AND to bring back within [0;sLibCrystNbTabulSine[ may
@@ -1786,14 +1772,14 @@ void ScatteringData::CalcGeomStructFactor() const
                //
                // This work if we are using "2's complement" to represent negative numbers,
                // but not with a "sign magnitude" approach
-               for(int jj=mNbReflUsed;jj>0;jj--)
+               for(int jj=nbReflUsed;jj>0;jj--)
                 *tmpInt++ = (*intH++ * intX + *intK++ * intY + *intL++ *intZ)
                               &sLibCrystNbTabulSineMASK;
                if(false==pSpg->HasInversionCenter())
                {
 
                   tmpInt=intVect.data();
-                  for(int jj=mNbReflUsed;jj>0;jj--)
+                  for(int jj=nbReflUsed;jj>0;jj--)
                   {
                      const REAL *pTmp=&spLibCrystTabulCosineSine[*tmpInt++ <<1];
                      *rrsf++ += popu * *pTmp++;
@@ -1804,7 +1790,7 @@ void ScatteringData::CalcGeomStructFactor() const
                else
                {
                   tmpInt=intVect.data();
-                  for(int jj=mNbReflUsed;jj>0;jj--)
+                  for(int jj=nbReflUsed;jj>0;jj--)
                      *rrsf++ += popu * spLibCrystTabulCosine[*tmpInt++];
                }
             }
@@ -1814,15 +1800,15 @@ void ScatteringData::CalcGeomStructFactor() const
                const REAL x=allCoords(j,0);
                const REAL y=allCoords(j,1);
                const REAL z=allCoords(j,2);
-               const REAL *hh=mH2Pi.data();
-               const REAL *kk=mK2Pi.data();
-               const REAL *ll=mL2Pi.data();
+               const REAL *hh=h2pi.data();
+               const REAL *kk=k2pi.data();
+               const REAL *ll=l2pi.data();
 
                #ifdef HAVE_SSE_MATHFUN
                #if 0
                // This not much faster and is incorrect (does not take into account sign of h k l)
 
-               //cout<<__FILE__<<":"<<__LINE__<<":"<<mMaxHKL<<","<<mMaxH<<","<<mMaxK<<","<<mMaxL<<":"<<mNbReflUsed<<endl;
+               //cout<<__FILE__<<":"<<__LINE__<<":"<<mMaxHKL<<","<<mMaxH<<","<<mMaxK<<","<<mMaxL<<":"<<nbReflUsed<<endl;
                // cos&sin for 2pix 2piy 2piz
                static const float twopi=6.283185307179586f;
                sincos_ps(_mm_mul_ps(_mm_load1_ps(&twopi),_mm_set_ps(x,y,z,0)),cnxyz0,snxyz0);
@@ -1842,16 +1828,16 @@ void ScatteringData::CalcGeomStructFactor() const
                // Actual structure factor calculations
                if(false==pSpg->HasInversionCenter())
                {// Slow ?
-                  REAL *rsf=mvRealGeomSF[pScattPow].data();
-                  REAL *isf=mvImagGeomSF[pScattPow].data();
-                  const long *h=mIntH.data();
-                  const long *k=mIntK.data();
-                  const long *l=mIntL.data();
+                  REAL *rsf=vRealGeomSF[pScattPow].data();
+                  REAL *isf=vImagGeomSF[pScattPow].data();
+                  const long *h=vIntH.data();
+                  const long *k=vIntK.data();
+                  const long *l=vIntL.data();
                   int jj;
                   const v4sf v4popu=_mm_set1_ps(popu);
-                  for(jj=mNbReflUsed;jj>3;jj-=4)
+                  for(jj=nbReflUsed;jj>3;jj-=4)
                   {
-                     //cout<<__FILE__<<":"<<__LINE__<<":"<<mNbReflUsed<<","<<jj<<"("<<*h<<','<<*k<<","<<*l<<")"<<endl;
+                     //cout<<__FILE__<<":"<<__LINE__<<":"<<nbReflUsed<<","<<jj<<"("<<*h<<','<<*k<<","<<*l<<")"<<endl;
                      const v4sf ck=_mm_set_ps(pcnxyz0[(*(k))*4+1],pcnxyz0[(*(k+1))*4+1],pcnxyz0[(*(k+2))*4+1],pcnxyz0[(*(k+3))*4+1]);//cos 2pi kx =ck
                      const v4sf cl=_mm_set_ps(pcnxyz0[(*(l))*4+1],pcnxyz0[(*(l+1))*4+1],pcnxyz0[(*(l+2))*4+1],pcnxyz0[(*(l+3))*4+1]);//cos 2pi lz =cl
                      const v4sf sk=_mm_set_ps(psnxyz0[(*(k))*4+1],psnxyz0[(*(k+1))*4+1],psnxyz0[(*(k+2))*4+1],psnxyz0[(*(k+3))*4+1]);//sin 2pi kx =sk
@@ -1878,15 +1864,15 @@ void ScatteringData::CalcGeomStructFactor() const
                }
                else
                {
-                  REAL *rsf=mvRealGeomSF[pScattPow].data();
-                  const long *h=mIntH.data();
-                  const long *k=mIntK.data();
-                  const long *l=mIntL.data();
+                  REAL *rsf=vRealGeomSF[pScattPow].data();
+                  const long *h=vIntH.data();
+                  const long *k=vIntK.data();
+                  const long *l=vIntL.data();
                   int jj;
                   const v4sf v4popu=_mm_set1_ps(popu);
-                  for(jj=mNbReflUsed;jj>3;jj-=4)
+                  for(jj=nbReflUsed;jj>3;jj-=4)
                   {
-                     //cout<<__FILE__<<":"<<__LINE__<<":"<<mNbReflUsed<<","<<jj<<"("<<*h<<','<<*k<<","<<*l<<")"<<endl;
+                     //cout<<__FILE__<<":"<<__LINE__<<":"<<nbReflUsed<<","<<jj<<"("<<*h<<','<<*k<<","<<*l<<")"<<endl;
                      const v4sf ck=_mm_set_ps(pcnxyz0[(*(k))*4+1],pcnxyz0[(*(k+1))*4+1],pcnxyz0[(*(k+2))*4+1],pcnxyz0[(*(k+3))*4+1]);//cos 2pi kx =ck
                      const v4sf cl=_mm_set_ps(pcnxyz0[(*(l))*4+1],pcnxyz0[(*(l+1))*4+1],pcnxyz0[(*(l+2))*4+1],pcnxyz0[(*(l+3))*4+1]);//cos 2pi lz =cl
                      const v4sf sk=_mm_set_ps(psnxyz0[(*(k))*4+1],psnxyz0[(*(k+1))*4+1],psnxyz0[(*(k+2))*4+1],psnxyz0[(*(k+3))*4+1]);//sin 2pi kx =sk
@@ -1917,9 +1903,9 @@ void ScatteringData::CalcGeomStructFactor() const
                const v4sf v4popu=_mm_load1_ps(&popu);// Can't multiply directly a vector by a scalar ?
                if(false==pSpg->HasInversionCenter())
                {
-                  REAL *rsf=mvRealGeomSF[pScattPow].data();
-                  REAL *isf=mvImagGeomSF[pScattPow].data();
-                  int jj=mNbReflUsed;
+                  REAL *rsf=vRealGeomSF[pScattPow].data();
+                  REAL *isf=vImagGeomSF[pScattPow].data();
+                  int jj=nbReflUsed;
                   for(;jj>3;jj-=4)
                   {
                       v4sf v4sin,v4cos;
@@ -1946,8 +1932,8 @@ void ScatteringData::CalcGeomStructFactor() const
                }
                else
                {
-                  REAL *rsf=mvRealGeomSF[pScattPow].data();
-                  int jj=mNbReflUsed;
+                  REAL *rsf=vRealGeomSF[pScattPow].data();
+                  int jj=nbReflUsed;
                   for(;jj>3;jj-=4)
                   {
 //                      const v4sf v4cos=cos_ps(_mm_setr_ps(*(hh  )*x+ *(kk  )*y + *(ll  )*z,
@@ -1970,18 +1956,18 @@ void ScatteringData::CalcGeomStructFactor() const
                #endif
                #else
                REAL *tmp=tmpVect.data();
-               for(int jj=0;jj<mNbReflUsed;jj++) *tmp++ = *hh++ * x + *kk++ * y + *ll++ *z;
+               for(int jj=0;jj<nbReflUsed;jj++) *tmp++ = *hh++ * x + *kk++ * y + *ll++ *z;
 
-               REAL *sf=mvRealGeomSF[pScattPow].data();
+               REAL *sf=vRealGeomSF[pScattPow].data();
                tmp=tmpVect.data();
 
-               for(int jj=0;jj<mNbReflUsed;jj++) *sf++ += popu * cos(*tmp++);
+               for(int jj=0;jj<nbReflUsed;jj++) *sf++ += popu * cos(*tmp++);
 
                if(false==pSpg->HasInversionCenter())
                {
-                  sf=mvImagGeomSF[pScattPow].data();
+                  sf=vImagGeomSF[pScattPow].data();
                   tmp=tmpVect.data();
-                  for(int jj=0;jj<mNbReflUsed;jj++) *sf++ += popu * sin(*tmp++);
+                  for(int jj=0;jj<nbReflUsed;jj++) *sf++ += popu * sin(*tmp++);
                }
                #endif
             }
@@ -1993,10 +1979,10 @@ void ScatteringData::CalcGeomStructFactor() const
          if( (pSpg->GetSpaceGroupNumber()>= 143) && (pSpg->GetSpaceGroupNumber()<= 167))
          {//Special case for trigonal groups R3,...
             REAL * RESTRICT p1=tmpVect.data();
-            const REAL * RESTRICT hh=mH2Pi.data();
-            const REAL * RESTRICT kk=mK2Pi.data();
-            const REAL * RESTRICT ll=mL2Pi.data();
-            for(long j=mNbReflUsed;j>0;j--) *p1++ += 2*cos((*hh++ - *kk++ - *ll++)/3.);
+            const REAL * RESTRICT hh=h2pi.data();
+            const REAL * RESTRICT kk=k2pi.data();
+            const REAL * RESTRICT ll=l2pi.data();
+            for(long j=nbReflUsed;j>0;j--) *p1++ += 2*cos((*hh++ - *kk++ - *ll++)/3.);
          }
          else
          {
@@ -2006,19 +1992,19 @@ void ScatteringData::CalcGeomStructFactor() const
                const REAL y=(*pTransVect)[j].tr[1];
                const REAL z=(*pTransVect)[j].tr[2];
                REAL *p1=tmpVect.data();
-               const REAL *hh=mH2Pi.data();
-               const REAL *kk=mK2Pi.data();
-               const REAL *ll=mL2Pi.data();
-               for(long j=mNbReflUsed;j>0;j--) *p1++ += cos(*hh++ *x + *kk++ *y + *ll++ *z );
+               const REAL *hh=h2pi.data();
+               const REAL *kk=k2pi.data();
+               const REAL *ll=l2pi.data();
+               for(long j=nbReflUsed;j>0;j--) *p1++ += cos(*hh++ *x + *kk++ *y + *ll++ *z );
             }
          }
          for(map<const ScatteringPower*,CrystVector_REAL>::iterator
-               pos=mvRealGeomSF.begin();pos!=mvRealGeomSF.end();++pos)
+               pos=vRealGeomSF.begin();pos!=vRealGeomSF.end();++pos)
                   pos->second *= tmpVect;
 
          if(false==pSpg->HasInversionCenter())
             for(map<const ScatteringPower*,CrystVector_REAL>::iterator
-                  pos=mvImagGeomSF.begin();pos!=mvImagGeomSF.end();++pos)
+                  pos=vImagGeomSF.begin();pos!=vImagGeomSF.end();++pos)
                      pos->second *= tmpVect;
       }
       if(true==pSpg->HasInversionCenter())
@@ -2039,14 +2025,14 @@ void ScatteringData::CalcGeomStructFactor() const
                const REAL yc=((REAL)pSpg->GetCCTbxSpg().inv_t()[1])/STBF;
                const REAL zc=((REAL)pSpg->GetCCTbxSpg().inv_t()[2])/STBF;
                #ifdef __LIBCRYST_VECTOR_USE_BLITZ__
-               tmpVect = mH2Pi() * xc + mK2PI() * yc + mL2PI() * zc;
+               tmpVect = h2pi() * xc + k2pi() * yc + l2pi() * zc;
                #else
                {
-                  const REAL * RESTRICT hh=mH2Pi.data();
-                  const REAL * RESTRICT kk=mK2Pi.data();
-                  const REAL * RESTRICT ll=mL2Pi.data();
+                  const REAL * RESTRICT hh=h2pi.data();
+                  const REAL * RESTRICT kk=k2pi.data();
+                  const REAL * RESTRICT ll=l2pi.data();
                   REAL * RESTRICT ttmpVect=tmpVect.data();
-                  for(long ii=mNbReflUsed;ii>0;ii--)
+                  for(long ii=nbReflUsed;ii>0;ii--)
                      *ttmpVect++ = *hh++ * xc + *kk++ * yc + *ll++ * zc;
                }
                #endif
@@ -2056,9 +2042,9 @@ void ScatteringData::CalcGeomStructFactor() const
             cosTmpVect=cos(tmpVect);
             sinTmpVect=sin(tmpVect);
 
-            map<const ScatteringPower*,CrystVector_REAL>::iterator posi=mvImagGeomSF.begin();
-            map<const ScatteringPower*,CrystVector_REAL>::iterator posr=mvRealGeomSF.begin();
-            for(;posi!=mvImagGeomSF.end();)
+            map<const ScatteringPower*,CrystVector_REAL>::iterator posi=vImagGeomSF.begin();
+            map<const ScatteringPower*,CrystVector_REAL>::iterator posr=vRealGeomSF.begin();
+            for(;posi!=vImagGeomSF.end();)
             {
                posi->second = posr->second;
                posi->second *= sinTmpVect;
@@ -2068,6 +2054,82 @@ void ScatteringData::CalcGeomStructFactor() const
          }
       }
    }
+}
+
+void ScatteringData::CalcGeomStructFactor() const
+{
+   // This also updates the ScattCompList if necessary.
+   this->GetCrystal().GetScatteringComponentList();
+   if(  (mClockGeomStructFact>mpCrystal->GetClockScattCompList())
+      &&(mClockGeomStructFact>mClockHKL)
+      &&(mClockGeomStructFact>mClockNbReflUsed)
+      &&(mClockGeomStructFact>mpCrystal->GetSpaceGroup().GetClockSpaceGroup())
+      &&(mClockGeomStructFact>mpCrystal->GetMasterClockScatteringPower())) return;
+   TAU_PROFILE("ScatteringData::GeomStructFactor()","void (Vx,Vy,Vz,data,M,M,bool)",TAU_DEFAULT);
+   VFN_DEBUG_ENTRY("ScatteringData::GeomStructFactor(Vx,Vy,Vz,...)",3)
+   VFN_DEBUG_MESSAGE("-->Using fast functions:"<<mUseFastLessPreciseFunc,2)
+   VFN_DEBUG_MESSAGE("-->Number of translation vectors:"
+      <<this->GetCrystal().GetSpaceGroup().GetNbTranslationVectors()-1,2)
+   VFN_DEBUG_MESSAGE("-->Has an inversion Center:"
+      <<this->GetCrystal().GetSpaceGroup().HasInversionCenter(),2)
+   VFN_DEBUG_MESSAGE("-->Number of symetry operations (w/o transl&inv cent.):"\
+                     <<this->GetCrystal().GetSpaceGroup().GetNbSymmetrics(true,true),2)
+   VFN_DEBUG_MESSAGE("-->Number of Scattering Components :"
+      <<this->GetCrystal().GetScatteringComponentList().GetNbComponent(),2)
+   VFN_DEBUG_MESSAGE("-->Number of reflections:"
+      <<this->GetNbRefl()<<" (actually used:"<<mNbReflUsed<<")",2)
+   #ifdef __DEBUG__
+   static long counter=0;
+   VFN_DEBUG_MESSAGE("-->Number of GeomStructFactor calculations so far:"<<counter++,3)
+   #endif
+
+   //:TODO: implement for geometrical structure factor calculation
+   //bool useGeomStructFactor=mUseGeomStructFactor;
+
+   //if((mfpRealGeomStructFactor==0)||(mfpImagGeomStructFactor==0)) useGeomStructFactor=false ;
+
+   //if(useGeomStructFactor==true)
+   //{
+   //   (*mfpRealGeomStructFactor)(x,y,z,data.H2Pi(),data.K2Pi(),data.L2Pi(),rsf);
+   //   if(this->IsCentrosymmetric())return;
+   //   (*mfpImagGeomStructFactor)(x,y,z,data.H2Pi(),data.K2Pi(),data.L2Pi(),isf);
+   //   return;
+   //}
+   //else
+   // Share the computation with the other ScatteringData using the same Crystal ?
+   bool useStore=false;
+   #ifndef HAVE_SSE_MATHFUN
+   if(mUseFastLessPreciseFunc==false)
+   #endif
+   {
+      const ObjRegistry<RefinableObj> *pClients=&(mpCrystal->GetClientRegistry());
+      long nbScattData=0;
+      for(long i=0;i<pClients->GetNb();i++)
+         if(dynamic_cast<const ScatteringData*>(&(pClients->GetObj(i)))!=0) nbScattData++;
+      useStore=nbScattData>1;
+   }
+   if(useStore)
+   {
+      VFN_DEBUG_MESSAGE("-->Using the Crystal's GeomStructFactorStore",2)
+      // The store is shared, and datasets may be computed concurrently
+      #ifdef _OPENMP
+      #pragma omp critical(GeomStructFactorStore)
+      #endif
+      {
+         GeomStructFactorStore *pStore=&(mpCrystal->GetGeomStructFactorStore());
+         if(  (mClockGeomStructFactorStoreIndex<mClockHKL)
+            ||(mClockGeomStructFactorStoreIndex<mClockNbReflUsed)
+            ||(mClockGeomStructFactorStoreIndex<pStore->GetClockReset()))
+         {
+            pStore->GetIndex(this,mIntH,mIntK,mIntL,mNbReflUsed,mvGeomStructFactorStoreIndex);
+            mClockGeomStructFactorStoreIndex.Click();
+         }
+         pStore->GetGeomStructFactor(mvGeomStructFactorStoreIndex,mvRealGeomSF,mvImagGeomSF);
+      }
+   }
+   else
+      CalcGeomStructFactorList(*mpCrystal,mNbReflUsed,mH2Pi,mK2Pi,mL2Pi,mIntH,mIntK,mIntL,
+                               mUseFastLessPreciseFunc,mvRealGeomSF,mvImagGeomSF);
    //cout << FormatVertVector<REAL>(*mvRealGeomSF,*mvImagGeomSF)<<endl;
    mClockGeomStructFact.Click();
    VFN_DEBUG_EXIT("ScatteringData::GeomStructFactor(Vx,Vy,Vz,...)",3)
@@ -2547,4 +2609,128 @@ void ScatteringData::CalcStructFactVariance()const
    VFN_DEBUG_EXIT("ScatteringData::CalcStructFactVariance()",3)
 }
 
+////////////////////////////////////////////////////////////////////////
+//
+//    GeomStructFactorStore
+//
+////////////////////////////////////////////////////////////////////////
+GeomStructFactorStore::GeomStructFactorStore(const Crystal &cryst):
+mpCrystal(&cryst),mNbRefl(0)
+{}
+
+void GeomStructFactorStore::GetIndex(const ScatteringData *pData,
+                                     const CrystVector_long &h,const CrystVector_long &k,
+                                     const CrystVector_long &l,const long nbRefl,
+                                     std::vector<long> &index)
+{
+   VFN_DEBUG_ENTRY("GeomStructFactorStore::GetIndex()",3)
+   mvClientNbRefl[pData]=nbRefl;
+   long nbClientRefl=0;
+   for(std::map<const ScatteringData*,long>::const_iterator pos=mvClientNbRefl.begin();
+       pos!=mvClientNbRefl.end();++pos) nbClientRefl+=pos->second;
+   const long nbRefl0=mNbRefl;
+   index.resize(nbRefl);
+   for(;;)
+   {
+      for(long i=0;i<nbRefl;i++)
+      {
+         const std::pair<long,std::pair<long,long> > hkl(h(i),std::make_pair(k(i),l(i)));
+         std::map<std::pair<long,std::pair<long,long> >,long>::const_iterator pos=mvIndex.find(hkl);
+         if(pos==mvIndex.end())
+         {
+            index[i]=mNbRefl;
+            mvIndex.insert(std::make_pair(hkl,mNbRefl++));
+         }
+         else index[i]=pos->second;
+      }
+      if((mNbRefl<=2*nbClientRefl)||(mvClientNbRefl.size()==1)) break;
+      // Too many reflections are not used any more (e.g. after a change of
+      // the list of reflections of one dataset): start again from this client.
+      VFN_DEBUG_MESSAGE("GeomStructFactorStore::GetIndex(): reset",3)
+      mvIndex.clear();
+      mvClientNbRefl.clear();
+      mvClientNbRefl[pData]=nbRefl;
+      nbClientRefl=nbRefl;
+      mNbRefl=0;
+      mClockReset.Click();
+   }
+   if((mNbRefl!=nbRefl0)||(mClockReset>mClockHKL))
+   {
+      mIntH.resize(mNbRefl);
+      mIntK.resize(mNbRefl);
+      mIntL.resize(mNbRefl);
+      for(std::map<std::pair<long,std::pair<long,long> >,long>::const_iterator pos=mvIndex.begin();
+          pos!=mvIndex.end();++pos)
+      {
+         mIntH(pos->second)=pos->first.first;
+         mIntK(pos->second)=pos->first.second.first;
+         mIntL(pos->second)=pos->first.second.second;
+      }
+      mH2Pi.resize(mNbRefl);
+      mK2Pi.resize(mNbRefl);
+      mL2Pi.resize(mNbRefl);
+      for(long i=0;i<mNbRefl;i++)
+      {
+         mH2Pi(i)=mIntH(i);
+         mK2Pi(i)=mIntK(i);
+         mL2Pi(i)=mIntL(i);
+      }
+      mH2Pi*=(2*M_PI);
+      mK2Pi*=(2*M_PI);
+      mL2Pi*=(2*M_PI);
+      mClockHKL.Click();
+   }
+   VFN_DEBUG_EXIT("GeomStructFactorStore::GetIndex():"<<mNbRefl<<" reflections in store",3)
+}
+
+void GeomStructFactorStore::RemoveClient(const ScatteringData *pData)
+{
+   mvClientNbRefl.erase(pData);
+}
+
+void GeomStructFactorStore::GetGeomStructFactor(const std::vector<long> &index,
+                                 map<const ScatteringPower*,CrystVector_REAL> &vRealGeomSF,
+                                 map<const ScatteringPower*,CrystVector_REAL> &vImagGeomSF)
+{
+   // This also updates the ScattCompList if necessary.
+   mpCrystal->GetScatteringComponentList();
+   if(  (mClockGeomStructFact<mpCrystal->GetClockScattCompList())
+      ||(mClockGeomStructFact<mClockHKL)
+      ||(mClockGeomStructFact<mpCrystal->GetSpaceGroup().GetClockSpaceGroup())
+      ||(mClockGeomStructFact<mpCrystal->GetMasterClockScatteringPower()))
+   {
+      VFN_DEBUG_MESSAGE("GeomStructFactorStore::GetGeomStructFactor(): computing for "<<mNbRefl<<" reflections",3)
+      CalcGeomStructFactorList(*mpCrystal,mNbRefl,mH2Pi,mK2Pi,mL2Pi,mIntH,mIntK,mIntL,false,
+                               mvRealGeomSF,mvImagGeomSF);
+      mClockGeomStructFact.Click();
+   }
+   // Remove entries for ScatteringPower which are not used any more
+   for(map<const ScatteringPower*,CrystVector_REAL>::iterator pos=vRealGeomSF.begin();pos!=vRealGeomSF.end();)
+      if(mvRealGeomSF.find(pos->first)==mvRealGeomSF.end()) vRealGeomSF.erase(pos++);
+      else ++pos;
+   for(map<const ScatteringPower*,CrystVector_REAL>::iterator pos=vImagGeomSF.begin();pos!=vImagGeomSF.end();)
+      if(mvImagGeomSF.find(pos->first)==mvImagGeomSF.end()) vImagGeomSF.erase(pos++);
+      else ++pos;
+   // Copy the values for the requested reflections
+   const long nb=index.size();
+   for(map<const ScatteringPower*,CrystVector_REAL>::const_iterator pos=mvRealGeomSF.begin();pos!=mvRealGeomSF.end();++pos)
+   {
+      CrystVector_REAL *pSF=&(vRealGeomSF[pos->first]);
+      pSF->resize(nb);
+      const REAL *p0=pos->second.data();
+      REAL *p1=pSF->data();
+      for(long i=0;i<nb;i++) *p1++ = p0[index[i]];
+   }
+   for(map<const ScatteringPower*,CrystVector_REAL>::const_iterator pos=mvImagGeomSF.begin();pos!=mvImagGeomSF.end();++pos)
+   {
+      CrystVector_REAL *pSF=&(vImagGeomSF[pos->first]);
+      pSF->resize(nb);
+      const REAL *p0=pos->second.data();
+      REAL *p1=pSF->data();
+      for(long i=0;i<nb;i++) *p1++ = p0[index[i]];
+   }
+}
+
+const RefinableObjClock& GeomStructFactorStore::GetClockReset()const {return mClockReset;}
+
 }//namespace ObjCryst
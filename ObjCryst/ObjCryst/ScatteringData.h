@@ -286,6 +286,73 @@ class Radiation: public RefinableObj
    #endif
 };
 
+class ScatteringData;
+//######################################################################
+/** \brief Geometrical structure factors shared by all ScatteringData objects
+* using the same Crystal.
+*
+* When a Crystal is used by several datasets (e.g. several powder patterns,
+* or X-ray and neutron data), the geometrical structure factors only depend on
+* the crystal structure and on the Miller indices. They are then computed once
+* for the union of the reflections of all datasets, and each ScatteringData
+* copies the values for its own reflections.
+*
+* This object belongs to the Crystal (see Crystal::GetGeomStructFactorStore()),
+* and is only meant to be used from ScatteringData::CalcGeomStructFactor().
+* It is not thread-safe: calls must be serialized by the caller.
+*/
+//######################################################################
+class GeomStructFactorStore
+{
+   public:
+      GeomStructFactorStore(const Crystal &cryst);
+      /** Get the index of reflections in the store, adding them if necessary.
+      *
+      * \param pData: the ScatteringData the reflections belong to. This is
+      * used to reset the store when it becomes much larger than the
+      * reflection lists of its clients (e.g. after a change of resolution).
+      * \param nbRefl: only the first nbRefl reflections are used.
+      * \param index: on return, the index of each reflection in the store.
+      */
+      void GetIndex(const ScatteringData *pData,
+                    const CrystVector_long &h,const CrystVector_long &k,
+                    const CrystVector_long &l,const long nbRefl,
+                    std::vector<long> &index);
+      /** Remove a client (ScatteringData) of the store, e.g. when it is destroyed
+      * or uses another Crystal. Its reflections are removed at the next reset of the store.
+      */
+      void RemoveClient(const ScatteringData *pData);
+      /** Update (if necessary) the geometrical structure factors of all the
+      * reflections in the store, and copy the values for the reflections
+      * given by their index.
+      */
+      void GetGeomStructFactor(const std::vector<long> &index,
+                               map<const ScatteringPower*,CrystVector_REAL> &vRealGeomSF,
+                               map<const ScatteringPower*,CrystVector_REAL> &vImagGeomSF);
+      /// Last time the store was reset. Indices obtained before are invalid.
+      const RefinableObjClock& GetClockReset()const;
+   private:
+      /// The Crystal
+      const Crystal *mpCrystal;
+      /// Index of each reflection in the store
+      std::map<std::pair<long,std::pair<long,long> >,long> mvIndex;
+      /// Number of reflections used by each client
+      std::map<const ScatteringData*,long> mvClientNbRefl;
+      /// Number of reflections in the store
+      long mNbRefl;
+      /// H,K,L integer coordinates
+      CrystVector_long mIntH,mIntK,mIntL;
+      /// H,K,L coordinates, multiplied by 2PI
+      CrystVector_REAL mH2Pi,mK2Pi,mL2Pi;
+      /// Geometrical Structure factor for each ScatteringPower, for all reflections in the store
+      map<const ScatteringPower*,CrystVector_REAL> mvRealGeomSF,mvImagGeomSF;
+      /// Last time reflections were added to the store
+      RefinableObjClock mClockHKL;
+      /// Last time the store was reset
+      RefinableObjClock mClockReset;
+      /// Last time the geometrical structure factors were computed
+      RefinableObjClock mClockGeomStructFact;
+};
 //######################################################################
 /** \brief Class to compute structure factors for a set of reflections and a Crystal.
 *
@@ -577,6 +644,9 @@ class ScatteringData: virtual public RefinableObj
       /** \brief Compute the 'Geometrical Structure Factor' for each ScatteringPower
       * of the Crystal
       *
+      * If the Crystal is used by several ScatteringData objects, the computation
+      * is shared between them using the Crystal's GeomStructFactorStore (except
+      * when using the fast, less precise functions without SSE).
       */
       void CalcGeomStructFactor() const;
       void CalcGeomStructFactor_FullDeriv(std::set<RefinablePar*> &vPar);
@@ -665,6 +735,10 @@ class ScatteringData: virtual public RefinableObj
          /// Geometrical Structure factor for each ScatteringPower, as vectors with NbRefl elements
          mutable map<const ScatteringPower*,CrystVector_REAL> mvRealGeomSF,mvImagGeomSF;
          mutable map<RefinablePar*,map<const ScatteringPower*,CrystVector_REAL> > mvRealGeomSF_FullDeriv,mvImagGeomSF_FullDeriv;
+         /// Index of the reflections in the Crystal's GeomStructFactorStore, if it is used
+         mutable std::vector<long> mvGeomStructFactorStoreIndex;
+         /// Last time the index in the Crystal's GeomStructFactorStore was computed
+         mutable RefinableObjClock mClockGeomStructFactorStoreIndex;
 
       //Public Clocks
          /// Clock for the list of hkl
@@ -17,14 +17,54 @@
  */
 
 #include <cstdlib>
+#include <cstring>
 #include <boost/date_time.hpp>
 #include <sstream>
 #include "ObjCryst/ObjCryst/Undo.h"
+#include "ObjCryst/ObjCryst/IO.h"
 
 namespace ObjCryst
 {
 XMLConfigHistory gConfigHistory;
 
+/// XML description of a PowderPattern, without its observed data
+static std::string PowderPatternXML(const PowderPattern &p)
+{
+   stringstream ss;
+   XMLCrystSetSkipArrays(ss,true);
+   p.XMLOutput(ss,0);
+   return ss.str();
+}
+
+static bool SameVector(const CrystVector_REAL &a,const CrystVector_REAL &b)
+{
+   if(a.numElements()!=b.numElements()) return false;
+   if(a.numElements()==0) return true;
+   return memcmp(a.data(),b.data(),a.numElements()*sizeof(REAL))==0;
+}
+
+/// Does the PowderPattern have this observed data ?
+static bool SamePowderPatternData(const PowderPattern &p,const XMLConfigPowderPatternData &d)
+{
+   return SameVector(p.GetPowderPatternX(),d.mX)
+        &&SameVector(p.GetPowderPatternObs(),d.mObs)
+        &&SameVector(p.GetPowderPatternObsSigma(),d.mSigma)
+        &&SameVector(p.GetPowderPatternWeight(),d.mWeight);
+}
+
+/// Observed data of a PowderPattern, re-using the previous copy if the data has not changed
+static boost::shared_ptr<XMLConfigPowderPatternData> GetPowderPatternData(const PowderPattern &p,
+                                 const boost::shared_ptr<XMLConfigPowderPatternData> &previous)
+{
+   if((previous!=NULL)&&SamePowderPatternData(p,*previous)) return previous;
+   boost::shared_ptr<XMLConfigPowderPatternData> d(new XMLConfigPowderPatternData);
+   d->mX=p.GetPowderPatternX();
+   d->mObs=p.GetPowderPatternObs();
+   d->mSigma=p.GetPowderPatternObsSigma();
+   d->mWeight=p.GetPowderPatternWeight();
+   return d;
+}
+
 ////////////////////////////////////////////////////////////////////////
 //
 //    XMLConfig
@@ -54,9 +94,8 @@ XMLConfig::XMLConfig()
    for(std::vector<PowderPattern*>::const_iterator pos=gPowderPatternRegistry.begin();pos!=gPowderPatternRegistry.end();++pos)
    {
       VFN_DEBUG_MESSAGE("XMLConfig::XMLConfig(): storing "<< (*pos)->GetClassName() << ":" << (*pos)->GetName(), 10)
-      stringstream ss;
-      (*pos)->XMLOutput(ss,0);
-      mvpPowderPatternXML[*pos] = boost::shared_ptr<std::string>(new std::string(ss.str()));
+      mvpPowderPatternXML[*pos] = boost::shared_ptr<std::string>(new std::string(PowderPatternXML(**pos)));
+      mvpPowderPatternData[*pos] = GetPowderPatternData(**pos,boost::shared_ptr<XMLConfigPowderPatternData>());
    }
    
    for(std::vector<OptimizationObj*>::const_iterator pos=gOptimizationObjRegistry.begin();pos!=gOptimizationObjRegistry.end();++pos)
@@ -131,23 +170,26 @@ XMLConfig::XMLConfig(const XMLConfig &old)
       std::map<PowderPattern*, boost::shared_ptr<std::string> >::const_iterator pos2 = old.mvpPowderPatternXML.find(*pos);
       if(pos2 != old.mvpPowderPatternXML.end())
       {
+         const boost::shared_ptr<XMLConfigPowderPatternData> oldData=old.mvpPowderPatternData.find(*pos)->second;
          if((*pos)->GetClockMaster() <= old.GetClock())
+         {
             mvpPowderPatternXML[*pos] = boost::shared_ptr<std::string>(pos2->second);
+            mvpPowderPatternData[*pos] = oldData;
+         }
          else
          {
-            stringstream ss;
-            (*pos)->XMLOutput(ss,0);
-            if(ss.str() == *(pos2->second))
+            const std::string xml=PowderPatternXML(**pos);
+            if(xml == *(pos2->second))
                mvpPowderPatternXML[*pos] = boost::shared_ptr<std::string>(pos2->second);
             else
-               mvpPowderPatternXML[*pos] = boost::shared_ptr<std::string>(new std::string(ss.str()));
+               mvpPowderPatternXML[*pos] = boost::shared_ptr<std::string>(new std::string(xml));
+            mvpPowderPatternData[*pos] = GetPowderPatternData(**pos,oldData);
          }
       }
       else
       {
-         stringstream ss;
-         (*pos)->XMLOutput(ss,0);
-         mvpPowderPatternXML[*pos] = boost::shared_ptr<std::string>(new std::string(ss.str()));
+         mvpPowderPatternXML[*pos] = boost::shared_ptr<std::string>(new std::string(PowderPatternXML(**pos)));
+         mvpPowderPatternData[*pos] = GetPowderPatternData(**pos,boost::shared_ptr<XMLConfigPowderPatternData>());
       }
    }
 
@@ -221,7 +263,7 @@ void XMLConfig::Restore()
       else
          p = new DiffractionDataSingleCrystal;
       stringstream ss;
-      ss << pos->second;
+      ss << *(pos->second);
       XMLCrystTag tag(ss);
       VFN_DEBUG_ENTRY("XMLConfig::Restore()"<<p->GetClassName()<<":"<<p->GetName(), 10)
       p->XMLInput(ss,tag);
@@ -233,20 +275,27 @@ void XMLConfig::Restore()
    {
       VFN_DEBUG_MESSAGE("XMLConfig::Restore(): found "<< pos->first->GetClassName() << ":" << pos->first->GetName(), 10)
       PowderPattern *p;
+      const XMLConfigPowderPatternData *pData=mvpPowderPatternData[pos->first].get();
+      bool sameXML=false,sameData=false;
       if(gPowderPatternRegistry.Find(pos->first) >= 0)
       {
          p = pos->first;
-         stringstream ss;
-         p->XMLOutput(ss,0);
-         if(ss.str()== *(pos->second)) continue;
+         sameXML = PowderPatternXML(*p) == *(pos->second);
+         sameData = SamePowderPatternData(*p,*pData);
+         if(sameXML && sameData) continue;
       }
       else
          p = new PowderPattern;
-      stringstream ss;
-      ss << pos->second;
-      XMLCrystTag tag(ss);
       VFN_DEBUG_ENTRY("XMLConfig::Restore()"<<p->GetClassName()<<":"<<p->GetName(), 10)
-      p->XMLInput(ss,tag);
+      if(!sameXML)
+      {
+         stringstream ss;
+         ss << *(pos->second);
+         XMLCrystTag tag(ss);
+         p->XMLInput(ss,tag);
+      }
+      // The observed data is restored directly, without going through XML
+      if(!sameData) p->SetPowderPatternObs(pData->mX,pData->mObs,pData->mSigma,pData->mWeight);
       VFN_DEBUG_EXIT("XMLConfig::Restore()"<<p->GetClassName()<<":"<<p->GetName(), 10)
       vpRefObjUpdated.push_back(p);
    }
@@ -265,7 +314,7 @@ void XMLConfig::Restore()
       else
          p = new MonteCarloObj;
       stringstream ss;
-      ss << pos->second;
+      ss << *(pos->second);
       XMLCrystTag tag(ss);
       VFN_DEBUG_ENTRY("XMLConfig::Restore()"<<p->GetClassName()<<":"<<p->GetName(), 10)
       p->XMLInput(ss,tag);
@@ -331,6 +380,13 @@ bool XMLConfig::operator==(const ObjCryst::XMLConfig &rhs) const
       std::map<PowderPattern*, boost::shared_ptr<std::string> >::const_iterator pos2 = rhs.mvpPowderPatternXML.find(pos->first);
       if(pos2==rhs.mvpPowderPatternXML.end()) return false;
       if(*(pos->second) != *(pos2->second)) return false;
+      const XMLConfigPowderPatternData *pd1=mvpPowderPatternData.find(pos->first)->second.get();
+      const XMLConfigPowderPatternData *pd2=rhs.mvpPowderPatternData.find(pos->first)->second.get();
+      if(pd1!=pd2)
+      {
+         if(  !SameVector(pd1->mX,pd2->mX) || !SameVector(pd1->mObs,pd2->mObs)
+            ||!SameVector(pd1->mSigma,pd2->mSigma) || !SameVector(pd1->mWeight,pd2->mWeight)) return false;
+      }
    }
 
    for(std::map<OptimizationObj*, boost::shared_ptr<std::string> >::const_iterator pos = mvpOptimizationObjXML.begin(); pos!=mvpOptimizationObjXML.end(); pos++)
@@ -33,9 +33,21 @@
 
 namespace ObjCryst
 {
+/** Observed data of a PowderPattern, stored by XMLConfig separately from the
+ * XML description so that it can be shared between configurations.
+ */
+struct XMLConfigPowderPatternData
+{
+   CrystVector_REAL mX,mObs,mSigma,mWeight;
+};
+
 /** Class to store & restore all top-level ObjCryst++ objects as their XML description.
  * Storage uses a shared_ptr to avoid useless copies.
  *
+ * The observed data of PowderPattern objects is not included in their XML description,
+ * but stored as arrays which are shared between all configurations as long as the
+ * data does not change. This avoids formatting, parsing and storing large patterns
+ * for each configuration.
  */
 class XMLConfig
 {
@@ -55,6 +67,8 @@ class XMLConfig
    protected:
       std::map<Crystal*, boost::shared_ptr<std::string> > mvpCrystalXML;
       std::map<PowderPattern*, boost::shared_ptr<std::string> > mvpPowderPatternXML;
+      /// Observed data for each PowderPattern, which is not included in mvpPowderPatternXML
+      std::map<PowderPattern*, boost::shared_ptr<XMLConfigPowderPatternData> > mvpPowderPatternData;
       std::map<DiffractionDataSingleCrystal*, boost::shared_ptr<std::string> > mvpDiffractionDataSingleCrystalXML;
       std::map<OptimizationObj*, boost::shared_ptr<std::string> > mvpOptimizationObjXML;
       boost::posix_time::ptime mTime;
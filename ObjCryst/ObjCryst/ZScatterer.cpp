@@ -36,6 +36,10 @@
 
 #include "ObjCryst/Quirks/VFNDebug.h"
 
+#ifdef HAVE_SSE_MATHFUN
+#include "ObjCryst/Quirks/sse_mathfun.h"
+#endif
+
 #include <fstream>
 #include <iomanip>
 
@@ -1825,6 +1829,82 @@ void ZScatterer::GlobalOptRandomMove(const REAL mutationAmplitude,
    VFN_DEBUG_EXIT("ZScatterer::GlobalOptRandomMove():End",3)
 }
 
+/** Position of an atom from its bond length, angle and dihedral angle, relative to
+* atoms na, nb and nc, by successive rotations of the reference frame. This is only used
+* by ZScatterer::UpdateCoordinates() when the three reference atoms are (almost) aligned,
+* as the frame used for the dihedral angle is then arbitrary.
+*/
+static void ZAtomPositionFromRotations(const REAL *pX,const REAL *pY,const REAL *pZ,
+                                       const long na,const long nb,const long nc,const REAL dist,
+                                       const REAL cosa,const REAL sina,const REAL cosd,const REAL sind,
+                                       REAL &x,REAL &y,REAL &z)
+{
+   REAL xa,ya,za,xb,yb,zb,xd,yd,zd,cosph,sinph,costh,sinth,coskh,sinkh;
+   REAL xpd,ypd,zpd,xqd,yqd,zqd;
+   REAL rbc,xyb,yza,tmp,xpa,ypa,zqa;
+   bool flag;
+   xb = pX[nb] - pX[na];
+   yb = pY[nb] - pY[na];
+   zb = pZ[nb] - pZ[na];
+   rbc= 1./sqrt(xb*xb + yb*yb + zb*zb);
+
+   xa = pX[nc] - pX[na];
+   ya = pY[nc] - pY[na];
+   za = pZ[nc] - pZ[na];
+   xd = dist*cosa;
+   yd = dist*sina*cosd;
+   zd = -dist*sina*sind;
+
+   xyb = sqrt(xb*xb + yb*yb);
+   if( xyb < 0.1 )
+   {   // Rotate about y-axis
+       tmp = za; za = -xa; xa = tmp;
+       tmp = zb; zb = -xb; xb = tmp;
+       xyb = sqrt(xb*xb + yb*yb);
+       flag = true;
+   }
+   else flag = false;
+
+   costh = xb/xyb;
+   sinth = yb/xyb;
+   xpa = costh*xa + sinth*ya;
+   ypa = costh*ya - sinth*xa;
+   sinph = zb*rbc;
+   cosph = sqrt(1.0 - sinph*sinph);
+   zqa = cosph*za  - sinph*xpa;
+   yza = sqrt(ypa*ypa + zqa*zqa);
+
+   if( yza > 1e-5 )
+   {
+      coskh = ypa/yza;
+      sinkh = zqa/yza;
+      ypd = coskh*yd - sinkh*zd;
+      zpd = coskh*zd + sinkh*yd;
+   }
+   else
+   {
+      ypd = yd;
+      zpd = zd;
+   }
+
+   xpd = cosph*xd  - sinph*zpd;
+   zqd = cosph*zpd + sinph*xd;
+   xqd = costh*xpd - sinth*ypd;
+   yqd = costh*ypd + sinth*xpd;
+
+   if( true==flag )
+   {   // Rotate about y-axis ?
+      x=pX[na] - zqd;
+      y=pY[na] + yqd;
+      z=pZ[na] + xqd;
+   } else
+   {
+      x=pX[na] + xqd;
+      y=pY[na] + yqd;
+      z=pZ[na] + zqd;
+   }
+}
+
 void ZScatterer::UpdateCoordinates() const
 {
    if(mClockCoord>mClockScatterer) return;
@@ -1834,6 +1914,12 @@ void ZScatterer::UpdateCoordinates() const
    //if(0==mNbAtom) throw ObjCrystException("ZScatterer::Update() No Atoms in Scatterer !");
    if(0==mNbAtom) return;
 
+   // Only the atoms whose internal coordinates changed since the last update, or which
+   // are built from atoms which moved, are re-computed. Everything is re-computed if
+   // the orientation or the number of atoms changed.
+   const bool rebuild=  (mvZCacheIdx.size()!=(unsigned long)(3*mNbAtom))
+                      ||(mPhi!=mZCachePhi)||(mChi!=mZCacheChi)||(mPsi!=mZCachePsi);
+   if(rebuild)
    {
       CrystMatrix_REAL phiMatrix(3,3),chiMatrix(3,3),psiMatrix(3,3);
       phiMatrix= cos(mPhi)   , -sin(mPhi)   , 0,
@@ -1850,162 +1936,207 @@ void ZScatterer::UpdateCoordinates() const
 
       mPhiChiPsiMatrix=product(chiMatrix,product(phiMatrix,psiMatrix));
       //cout << phiMatrix <<endl<< chiMatrix <<endl<< psiMatrix <<endl<<mPhiChiPsiMatrix<<endl;
+      mZCachePhi=mPhi;
+      mZCacheChi=mChi;
+      mZCachePsi=mPsi;
+      mvZCacheIdx.assign(3*mNbAtom,-1);
+      mvZCacheValue.resize(3*mNbAtom);
+      mvZCacheTrig.resize(4*mNbAtom);
+      mXCoordLocal.resize(mNbAtom);
+      mYCoordLocal.resize(mNbAtom);
+      mZCoordLocal.resize(mNbAtom);
    }
 
-   mXCoord.resize(mNbAtom);
-   mYCoord.resize(mNbAtom);
-   mZCoord.resize(mNbAtom);
-
-   // Atom 0
-   mXCoord(0)=0.;
-   mYCoord(0)=0.;
-   mZCoord(0)=0.;
-   VFN_DEBUG_MESSAGE("->Atom #0:"<<mXCoord(0)<<" : "<<mYCoord(0)<<" : "<<mZCoord(0),1)
-
-   if(mNbAtom>1)
-   {// Atom 1
-      mXCoord(1)=GetZBondLength(1);
-      mYCoord(1)=0.;
-      mZCoord(1)=0.;
-      VFN_DEBUG_MESSAGE("->Atom #1:"<<mXCoord(1)<<" : "<<mYCoord(1)<<" : "<<mZCoord(1),1)
+   // Find the changed internal coordinates, and the atoms to re-compute
+   mvZDirty.assign(mNbAtom,rebuild);
+   mvZTrigIdx.clear();
+   for(long i=0;i<mNbAtom;i++)
+   {
+      const ZAtom *pAtom=&(mZAtomRegistry.GetObj(i));
+      long *pIdx=&mvZCacheIdx[3*i];
+      REAL *pVal=&mvZCacheValue[3*i];
+      if(  (pIdx[0]!=pAtom->GetZBondAtom())||(pIdx[1]!=pAtom->GetZAngleAtom())
+         ||(pIdx[2]!=pAtom->GetZDihedralAngleAtom())||(pVal[0]!=pAtom->GetZBondLength()))
+      {
+         pIdx[0]=pAtom->GetZBondAtom();
+         pIdx[1]=pAtom->GetZAngleAtom();
+         pIdx[2]=pAtom->GetZDihedralAngleAtom();
+         pVal[0]=pAtom->GetZBondLength();
+         mvZDirty[i]=true;
+      }
+      if(rebuild||(pVal[1]!=pAtom->GetZAngle())||(pVal[2]!=pAtom->GetZDihedralAngle()))
+      {
+         pVal[1]=pAtom->GetZAngle();
+         pVal[2]=pAtom->GetZDihedralAngle();
+         mvZTrigIdx.push_back(i);
+         mvZDirty[i]=true;
+      }
+      if(i<3) continue;
+      if(mvZDirty[pIdx[0]]||mvZDirty[pIdx[1]]||mvZDirty[pIdx[2]]) mvZDirty[i]=true;
    }
-   if(mNbAtom>2)
-   {// Atom 2
-      if(0==GetZBondAtom(2)) //Linked with Atom 1
-         mXCoord(2)=GetZBondLength(2)*cos(GetZAngle(2));
-      else //Linked with Atom 1
-         mXCoord(2)=mXCoord(1)-GetZBondLength(2)*cos(GetZAngle(2));
-      mYCoord(2)=GetZBondLength(2)*sin(GetZAngle(2));
-      mZCoord(2)=0.;
-      VFN_DEBUG_MESSAGE("->Atom #2:"<<mXCoord(2)<<" : "<<mYCoord(2)<<" : "<<mZCoord(2),1)
+   // The first three atoms are built together
+   if(mvZDirty[0]||((mNbAtom>1)&&mvZDirty[1])||((mNbAtom>2)&&mvZDirty[2]))
+      for(long i=0;(i<3)&&(i<mNbAtom);i++) mvZDirty[i]=true;
+
+   // cos & sin of all changed angles & dihedral angles, in one batch
+   {
+      const unsigned long nbTrig=mvZTrigIdx.size();
+      mvZTrigIn.resize(2*nbTrig);
+      mvZTrigCos.resize(2*nbTrig);
+      mvZTrigSin.resize(2*nbTrig);
+      for(unsigned long k=0;k<nbTrig;k++)
+      {
+         mvZTrigIn[k]       =mvZCacheValue[3*mvZTrigIdx[k]+1];
+         mvZTrigIn[k+nbTrig]=mvZCacheValue[3*mvZTrigIdx[k]+2];
+      }
+      unsigned long k=0;
+      #ifdef HAVE_SSE_MATHFUN
+      for(;(k+4)<=2*nbTrig;k+=4)
+      {
+         v4sf s,c;
+         sincos_ps(_mm_loadu_ps(&mvZTrigIn[k]),&s,&c);
+         _mm_storeu_ps(&mvZTrigSin[k],s);
+         _mm_storeu_ps(&mvZTrigCos[k],c);
+      }
+      #endif
+      for(;k<2*nbTrig;k++)
+      {
+         mvZTrigCos[k]=cos(mvZTrigIn[k]);
+         mvZTrigSin[k]=sin(mvZTrigIn[k]);
+      }
+      for(k=0;k<nbTrig;k++)
+      {
+         REAL *pTrig=&mvZCacheTrig[4*mvZTrigIdx[k]];
+         pTrig[0]=mvZTrigCos[k];
+         pTrig[1]=mvZTrigSin[k];
+         pTrig[2]=mvZTrigCos[k+nbTrig];
+         pTrig[3]=mvZTrigSin[k+nbTrig];
+      }
    }
-   for(int i=1;i<3;i++)// Global rotation of scatterer
+
+   REAL *pX=mXCoordLocal.data();
+   REAL *pY=mYCoordLocal.data();
+   REAL *pZ=mZCoordLocal.data();
+   if(mvZDirty[0])
    {
-      if(mNbAtom==i)break;
-      const REAL x=mXCoord(i);
-      const REAL y=mYCoord(i);
-      const REAL z=mZCoord(i);
-      mXCoord(i)=mPhiChiPsiMatrix(0,0)*x+mPhiChiPsiMatrix(0,1)*y+mPhiChiPsiMatrix(0,2)*z;
-      mYCoord(i)=mPhiChiPsiMatrix(1,0)*x+mPhiChiPsiMatrix(1,1)*y+mPhiChiPsiMatrix(1,2)*z;
-      mZCoord(i)=mPhiChiPsiMatrix(2,0)*x+mPhiChiPsiMatrix(2,1)*y+mPhiChiPsiMatrix(2,2)*z;
+      // Atom 0
+      pX[0]=0.;
+      pY[0]=0.;
+      pZ[0]=0.;
+      VFN_DEBUG_MESSAGE("->Atom #0:"<<pX[0]<<" : "<<pY[0]<<" : "<<pZ[0],1)
+
+      if(mNbAtom>1)
+      {// Atom 1
+         pX[1]=GetZBondLength(1);
+         pY[1]=0.;
+         pZ[1]=0.;
+         VFN_DEBUG_MESSAGE("->Atom #1:"<<pX[1]<<" : "<<pY[1]<<" : "<<pZ[1],1)
+      }
+      if(mNbAtom>2)
+      {// Atom 2
+         if(0==GetZBondAtom(2)) //Linked with Atom 1
+            pX[2]=GetZBondLength(2)*mvZCacheTrig[4*2];
+         else //Linked with Atom 1
+            pX[2]=pX[1]-GetZBondLength(2)*mvZCacheTrig[4*2];
+         pY[2]=GetZBondLength(2)*mvZCacheTrig[4*2+1];
+         pZ[2]=0.;
+         VFN_DEBUG_MESSAGE("->Atom #2:"<<pX[2]<<" : "<<pY[2]<<" : "<<pZ[2],1)
+      }
+      for(int i=1;i<3;i++)// Global rotation of scatterer
+      {
+         if(mNbAtom==i)break;
+         const REAL x=pX[i];
+         const REAL y=pY[i];
+         const REAL z=pZ[i];
+         pX[i]=mPhiChiPsiMatrix(0,0)*x+mPhiChiPsiMatrix(0,1)*y+mPhiChiPsiMatrix(0,2)*z;
+         pY[i]=mPhiChiPsiMatrix(1,0)*x+mPhiChiPsiMatrix(1,1)*y+mPhiChiPsiMatrix(1,2)*z;
+         pZ[i]=mPhiChiPsiMatrix(2,0)*x+mPhiChiPsiMatrix(2,1)*y+mPhiChiPsiMatrix(2,2)*z;
+      }
    }
-   if(mNbAtom>3)
+   // Other atoms, using the Natural Extension Reference Frame (NeRF) method: the atom
+   // is placed in the frame defined by the bond (na-nb) and the plane (na,nb,nc).
+   for(long i=3;i<mNbAtom;i++)
    {
-      REAL xa,ya,za,xb,yb,zb,xd,yd,zd,cosph,sinph,costh,sinth,coskh,sinkh,cosa,sina;
-      REAL xpd,ypd,zpd,xqd,yqd,zqd;
-      REAL rbc,xyb,yza,tmp,xpa,ypa,zqa;
-      int na,nb,nc;
-      bool flag;
-      REAL dist,angle,dihed;
-      for(int i=3;i<mNbAtom;i++)
+      if(!mvZDirty[i]) continue;
+      const long *pIdx=&mvZCacheIdx[3*i];
+      const long na=pIdx[0],nb=pIdx[1],nc=pIdx[2];
+      const REAL dist=mvZCacheValue[3*i];
+      const REAL *pTrig=&mvZCacheTrig[4*i];
+      const REAL cosa=pTrig[0],sina=pTrig[1];
+
+      // Unit vector from nb to na
+      REAL xb = pX[na] - pX[nb];
+      REAL yb = pY[na] - pY[nb];
+      REAL zb = pZ[na] - pZ[nb];
+      REAL rbc= sqrt(xb*xb + yb*yb + zb*zb);
+      if(rbc<1e-5)
       {
-         na=GetZBondAtom(i);
-         nb=GetZAngleAtom(i);
-         nc=GetZDihedralAngleAtom(i);
-         dist=GetZBondLength(i);
-         angle=GetZAngle(i);
-         dihed=GetZDihedralAngle(i);
-
-         xb = mXCoord(nb) - mXCoord(na);
-         yb = mYCoord(nb) - mYCoord(na);
-         zb = mZCoord(nb) - mZCoord(na);
-
-         rbc= sqrt(xb*xb + yb*yb + zb*zb);
-         if(rbc<1e-5)
-         {
-            throw ObjCrystException("ZScatterer::UpdateCoordinates(): two atoms ("
-                                    +mZAtomRegistry.GetObj(na).GetName()
-                                    +" and "+ mZAtomRegistry.GetObj(nb).GetName()
-                                    +") have the same coordinates (d<1e-5): aborting.");
-         }
-         rbc=1./rbc;
-
-         cosa = cos(angle);
-         sina = sin(angle);
-
-         if( fabs(cosa) >= 0.999999 )
-         {   // Colinear
-            mXCoord(i)=mXCoord(na)+cosa*dist*rbc*xb;
-            mYCoord(i)=mYCoord(na)+cosa*dist*rbc*yb;
-            mZCoord(i)=mZCoord(na)+cosa*dist*rbc*zb;
-            VFN_DEBUG_MESSAGE("->Atom #"<<i<<":"<<mXCoord(i)<<" : "<<mYCoord(i)<<" : " <<mZCoord(i)<<"(colinear)",1)
-         }
-         else
-         {
-            xa = mXCoord(nc) - mXCoord(na);
-            ya = mYCoord(nc) - mYCoord(na);
-            za = mZCoord(nc) - mZCoord(na);
-            xd = dist*cosa;
-            yd = dist*sina*cos(dihed);
-            zd = -dist*sina*sin(dihed);
-
-            xyb = sqrt(xb*xb + yb*yb);
-            if( xyb < 0.1 )
-            {   // Rotate about y-axis
-                tmp = za; za = -xa; xa = tmp;
-                tmp = zb; zb = -xb; xb = tmp;
-                xyb = sqrt(xb*xb + yb*yb);
-                flag = true;
-            }
-            else flag = false;
-
-            costh = xb/xyb;
-            sinth = yb/xyb;
-            xpa = costh*xa + sinth*ya;
-            ypa = costh*ya - sinth*xa;
-            sinph = zb*rbc;
-            cosph = sqrt(1.0 - sinph*sinph);
-            zqa = cosph*za  - sinph*xpa;
-            yza = sqrt(ypa*ypa + zqa*zqa);
-
-            //cout <<endl<<ypa<<" "<<zqa<<" "<<yza<<" "<<endl;
-            if( yza > 1e-5 )
-            {
-               coskh = ypa/yza;
-               sinkh = zqa/yza;
-               ypd = coskh*yd - sinkh*zd;
-               zpd = coskh*zd + sinkh*yd;
-            }
-            else
-            {
-               ypd = yd;
-               zpd = zd;
-            }
-
-            xpd = cosph*xd  - sinph*zpd;
-            zqd = cosph*zpd + sinph*xd;
-            xqd = costh*xpd - sinth*ypd;
-            yqd = costh*ypd + sinth*xpd;
-
-            if( true==flag )
-            {   // Rotate about y-axis ?
-               mXCoord(i)=mXCoord(na) - zqd;
-               mYCoord(i)=mYCoord(na) + yqd;
-               mZCoord(i)=mZCoord(na) + xqd;
-            } else
-            {
-               mXCoord(i)=mXCoord(na) + xqd;
-               mYCoord(i)=mYCoord(na) + yqd;
-               mZCoord(i)=mZCoord(na) + zqd;
-            }
-            VFN_DEBUG_MESSAGE("->Atom #"<<i<<":"<<mXCoord(i)<<" : "<<mYCoord(i)<<" : " <<mZCoord(i),1)
-         }
+         mvZCacheIdx.clear();// Force a full re-computation next time
+         throw ObjCrystException("ZScatterer::UpdateCoordinates(): two atoms ("
+                                 +mZAtomRegistry.GetObj(na).GetName()
+                                 +" and "+ mZAtomRegistry.GetObj(nb).GetName()
+                                 +") have the same coordinates (d<1e-5): aborting.");
+      }
+      rbc=1./rbc;
+      xb*=rbc;
+      yb*=rbc;
+      zb*=rbc;
+
+      if( fabs(cosa) >= 0.999999 )
+      {   // Colinear
+         pX[i]=pX[na]-cosa*dist*xb;
+         pY[i]=pY[na]-cosa*dist*yb;
+         pZ[i]=pZ[na]-cosa*dist*zb;
+         VFN_DEBUG_MESSAGE("->Atom #"<<i<<":"<<pX[i]<<" : "<<pY[i]<<" : " <<pZ[i]<<"(colinear)",1)
+         continue;
+      }
+      // Normal to the (na,nb,nc) plane
+      const REAL xa = pX[nb] - pX[nc];
+      const REAL ya = pY[nb] - pY[nc];
+      const REAL za = pZ[nb] - pZ[nc];
+      REAL xn = ya*zb - za*yb;
+      REAL yn = za*xb - xa*zb;
+      REAL zn = xa*yb - ya*xb;
+      const REAL rn = sqrt(xn*xn + yn*yn + zn*zn);
+      if( rn <= 1e-5 )
+      {// na, nb and nc are aligned
+         ZAtomPositionFromRotations(pX,pY,pZ,na,nb,nc,dist,cosa,sina,pTrig[2],pTrig[3],pX[i],pY[i],pZ[i]);
+         VFN_DEBUG_MESSAGE("->Atom #"<<i<<":"<<pX[i]<<" : "<<pY[i]<<" : " <<pZ[i]<<"(aligned)",1)
+         continue;
       }
+      xn/=rn;
+      yn/=rn;
+      zn/=rn;
+      // n x b
+      const REAL xm = yn*zb - zn*yb;
+      const REAL ym = zn*xb - xn*zb;
+      const REAL zm = xn*yb - yn*xb;
+
+      const REAL d0 = -dist*cosa;
+      const REAL d1 =  dist*sina*pTrig[2];
+      const REAL d2 =  dist*sina*pTrig[3];
+      pX[i]=pX[na] + d0*xb + d1*xm + d2*xn;
+      pY[i]=pY[na] + d0*yb + d1*ym + d2*yn;
+      pZ[i]=pZ[na] + d0*zb + d1*zm + d2*zn;
+      VFN_DEBUG_MESSAGE("->Atom #"<<i<<":"<<pX[i]<<" : "<<pY[i]<<" : " <<pZ[i],1)
    }
    //shift atom around Central atom
+   mXCoord.resize(mNbAtom);
+   mYCoord.resize(mNbAtom);
+   mZCoord.resize(mNbAtom);
    REAL x,y,z;
    x=this->GetX();
    y=this->GetY();
    z=this->GetZ();
    mpCryst->FractionalToOrthonormalCoords(x,y,z);
-   const REAL x0=x-mXCoord(mCenterAtomIndex);
-   const REAL y0=y-mYCoord(mCenterAtomIndex);
-   const REAL z0=z-mZCoord(mCenterAtomIndex);
+   const REAL x0=x-pX[mCenterAtomIndex];
+   const REAL y0=y-pY[mCenterAtomIndex];
+   const REAL z0=z-pZ[mCenterAtomIndex];
    for(int i=0;i<mNbAtom;i++)
    {
-      mXCoord(i) += x0;
-      mYCoord(i) += y0;
-      mZCoord(i) += z0;
+      mXCoord(i) = pX[i] + x0;
+      mYCoord(i) = pY[i] + y0;
+      mZCoord(i) = pZ[i] + z0;
    }
    mClockCoord.Click();
    VFN_DEBUG_EXIT("ZScatterer::UpdateCoordinates()"<<this->GetName(),3)
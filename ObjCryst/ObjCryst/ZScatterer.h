@@ -459,6 +459,23 @@ class ZScatterer: public Scatterer
       mutable CrystVector_REAL mXCoord,mYCoord,mZCoord;
       /// Last time the cartesian coordinates were computed
       mutable RefinableObjClock mClockCoord;
+      /// Cartesian coordinates before the translation to the position of the
+      /// scatterer. This includes Dummy atoms.
+      mutable CrystVector_REAL mXCoordLocal,mYCoordLocal,mZCoordLocal;
+      /// Bond, angle and dihedral angle atoms (3 per atom) for the last computed coordinates
+      mutable std::vector<long> mvZCacheIdx;
+      /// Bond length, angle and dihedral angle (3 per atom) for the last computed coordinates
+      mutable std::vector<REAL> mvZCacheValue;
+      /// cos and sin of the angle and of the dihedral angle (4 per atom)
+      mutable std::vector<REAL> mvZCacheTrig;
+      /// Orientation angles for the last computed coordinates
+      mutable REAL mZCachePhi,mZCacheChi,mZCachePsi;
+      /// Atoms which must be re-computed in UpdateCoordinates()
+      mutable std::vector<bool> mvZDirty;
+      /// Atoms for which the cos and sin of angles must be re-computed in UpdateCoordinates()
+      mutable std::vector<long> mvZTrigIdx;
+      /// Work arrays for the batch computation of cos and sin
+      mutable std::vector<REAL> mvZTrigIn,mvZTrigCos,mvZTrigSin;
       ZMoveMinimizer *mpZMoveMinimizer;
    #ifdef __WX__CRYST__
    public:
@@ -24,6 +24,8 @@
 
 #include "ObjCryst/RefinableObj/GlobalOptimObj.h"
 #include "ObjCryst/ObjCryst/Crystal.h"
+#include "ObjCryst/ObjCryst/PowderPattern.h"
+#include "ObjCryst/ObjCryst/DiffractionDataSingleCrystal.h"
 #include "ObjCryst/Quirks/VFNStreamFormat.h"
 #include "ObjCryst/Quirks/VFNDebug.h"
 #include "ObjCryst/Quirks/Chronometer.h"
@@ -247,9 +249,45 @@ REAL OptimizationObj::GetLogLikelihood() const
 {
    TAU_PROFILE("OptimizationObj::GetLogLikelihood()","void ()",TAU_DEFAULT);
    REAL cost =0.;
-   for(int i=0;i<mRecursiveRefinedObjList.GetNb();i++)
+   const long nbObj=mRecursiveRefinedObjList.GetNb();
+   vector<REAL> vllk(nbObj);
+   #ifdef _OPENMP
+   // Datasets only depend on the shared Crystal objects: update the crystals first,
+   // then compute the datasets concurrently
+   vector<long> vDataset;
+   for(long i=0;i<nbObj;i++)
+   {
+      const RefinableObj *pObj=&(mRecursiveRefinedObjList.GetObj(i));
+      // Only top-level datasets: a PowderPatternDiffraction (also a ScatteringData)
+      // is computed by its parent PowderPattern
+      if(  (dynamic_cast<const PowderPattern*>(pObj)!=0)
+         ||(dynamic_cast<const DiffractionDataSingleCrystal*>(pObj)!=0)) vDataset.push_back(i);
+      else if(const Crystal *pCrystal=dynamic_cast<const Crystal*>(pObj))
+      {
+         pCrystal->GetBMatrix();
+         pCrystal->GetScatteringComponentList();
+      }
+   }
+   const long nbDataset=vDataset.size();
+   if(nbDataset>1)
+   {
+      #pragma omp parallel for schedule(dynamic,1)
+      for(long j=0;j<nbDataset;j++)
+         vllk[vDataset[j]]=mRecursiveRefinedObjList.GetObj(vDataset[j]).GetLogLikelihood();
+   }
+   else vDataset.clear();
+   vector<long>::const_iterator posDataset=vDataset.begin();
+   #endif
+   for(long i=0;i<nbObj;i++)
+   {
+      #ifdef _OPENMP
+      if((posDataset!=vDataset.end())&&(*posDataset==i)) {++posDataset;continue;}
+      #endif
+      vllk[i]=mRecursiveRefinedObjList.GetObj(i).GetLogLikelihood();
+   }
+   for(long i=0;i<nbObj;i++)
    {
-      const REAL tmp=mRecursiveRefinedObjList.GetObj(i).GetLogLikelihood();
+      const REAL tmp=vllk[i];
       if(tmp!=0.)
       {
          LogLikelihoodStats* st=&((mvContextObjStats[mContext])
@@ -732,6 +770,8 @@ void MonteCarloObj::Optimize(long &nbStep,const bool silent,const REAL finalcost
       }//case GLOBAL_OPTIM_PARTICLE_SWARM_OPTIMIZATION
    }
    mIsOptimizing=false;
+   // Make sure all autosaved files have been written
+   XMLCrystFileSaveGlobalAsyncWait();
    #ifdef __WX__CRYST__
    mMutexStopAfterCycle.Lock();
    #endif
@@ -862,7 +902,7 @@ void MonteCarloObj::MultiRunOptimize(long &nbCycle,long &nbStep,const bool silen
          char costAsChar[30];
          sprintf(costAsChar,"-Run#%ld-Cost-%f",abs(nbCycle),this->GetLogLikelihood());
          saveFileName=saveFileName+(string)strDate+(string)costAsChar+(string)".xml";
-         XMLCrystFileSaveGlobal(saveFileName);
+         XMLCrystFileSaveGlobalAsync(saveFileName,false);
       }
       if(mSaveTrackedData.GetChoice()==1)
       {
@@ -892,6 +932,8 @@ void MonteCarloObj::MultiRunOptimize(long &nbCycle,long &nbStep,const bool silen
       mRun++;
    }
    mIsOptimizing=false;
+   // Make sure all autosaved files have been written
+   XMLCrystFileSaveGlobalAsyncWait();
 
    mRefParList.RestoreParamSet(mBestParSavedSetIndex);
 
@@ -1112,7 +1154,7 @@ void MonteCarloObj::RunSimulatedAnnealing(long &nbStep,const bool silent,
          if(accept!=2) mRefParList.RestoreParamSet(mBestParSavedSetIndex);
          sprintf(costAsChar,"-Cost-%f",this->GetLogLikelihood());
          saveFileName=saveFileName+(string)strDate+(string)costAsChar+(string)".xml";
-         XMLCrystFileSaveGlobal(saveFileName);
+         XMLCrystFileSaveGlobalAsync(saveFileName);
          if(accept!=2) mRefParList.RestoreParamSet(lastParSavedSetIndex);
       }
       if((mNbTrial%300==0)&&needUpdateDisplay)
@@ -1312,7 +1354,7 @@ void MonteCarloObj::RunRandomLSQMethod(long &nbCycle)
         char costAsChar[30];
         sprintf(costAsChar,"#Run%ld-Cost-%f",nbCycle, mCurrentCost);
         saveFileName=saveFileName+(string)strDate+(string)costAsChar+(string)".xml";
-        XMLCrystFileSaveGlobal(saveFileName);
+        XMLCrystFileSaveGlobalAsync(saveFileName,false);
 
          #ifdef __WX__CRYST__
           mMutexStopAfterCycle.Lock();
@@ -1617,7 +1659,7 @@ if(S==26){
             mRefParList.RestoreParamSet(mBestParSavedSetIndex);
             sprintf(costAsChar, "-Cost-%f", this->GetLogLikelihood());
             saveFileName = saveFileName + (string)strDate + (string)costAsChar + (string) ".xml";
-            XMLCrystFileSaveGlobal(saveFileName);
+            XMLCrystFileSaveGlobalAsync(saveFileName);
        }
 
         // Update numbers of trials and steps
@@ -2233,7 +2275,7 @@ void MonteCarloObj::RunParallelTempering(long &nbStep,const bool silent,
                if(accept!=2) mRefParList.RestoreParamSet(mBestParSavedSetIndex);
                sprintf(costAsChar,"-Cost-%f",this->GetLogLikelihood());
                saveFileName=saveFileName+(string)strDate+(string)costAsChar+(string)".xml";
-               XMLCrystFileSaveGlobal(saveFileName);
+               XMLCrystFileSaveGlobalAsync(saveFileName);
                //if(accept!=2) mRefParList.RestoreParamSet(lastParSavedSetIndex);
             }
             //if(accept==0) mRefParList.RestoreParamSet(lastParSavedSetIndex);
@@ -163,6 +163,11 @@ class OptimizationObj
       *
       * This function is the weighted sum of the chosen Cost Functions for
       * the refined objects.
+      *
+      * When compiled with OpenMP and if there are several datasets (PowderPattern
+      * or DiffractionDataSingleCrystal), their log-likelihoods are computed
+      * concurrently, after updating the Crystal objects. The sum is always made
+      * in the same order, so the result does not depend on the number of threads.
       */
       virtual REAL GetLogLikelihood()const;
 
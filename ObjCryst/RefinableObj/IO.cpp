@@ -23,6 +23,7 @@
 
 
 #include <sstream>
+#include <cctype>
 #include "ObjCryst/RefinableObj/RefinableObj.h"
 #include "ObjCryst/RefinableObj/IO.h"
 
@@ -118,62 +119,72 @@ ostream& operator<< (ostream& os, const XMLCrystTag&tag)
 }
 istream& operator>> (istream& is, XMLCrystTag &tag)
 {
-   ios::fmtflags f=is.flags();
-   is.unsetf(ios::skipws);//skip whitespaces
+   // The tag is parsed directly from the stream buffer, which avoids the
+   // overhead of a formatted input (sentry, flags) for each character.
+   streambuf *pbuf=is.rdbuf();
    tag.mIsEmptyTag=false;
    tag.mIsEndTag=false;
-   char tmp;
-   is>>tmp;
-   while ((tmp!='<') && !(is.eof()) && !(is.fail()) )is>>tmp;
-   if(is.eof()) return is;
-   if(is.fail()) {cout<<"throw:"<<__FILE__<<":"<<__LINE__<<":"<<tag<<endl;throw ObjCrystException("XMLCrystTag::>>   failed input");}
-   while ((tmp==' ')||(tmp=='<'))is>>tmp;
+   tag.mvAttribute.clear();
+   int c=pbuf->sbumpc();
+   while((c!='<')&&(c!=EOF)) c=pbuf->sbumpc();
+   if(c==EOF)
+   {
+      is.setstate(ios::eofbit|ios::failbit);
+      return is;
+   }
+   c=pbuf->sbumpc();
+   while((c==' ')||(c=='<')) c=pbuf->sbumpc();
 
-   if('/'==tmp)
+   if('/'==c)
    {
       tag.mIsEndTag=true;
-      while ((tmp==' ')||(tmp=='/'))is>>tmp;
+      while ((c==' ')||(c=='/')) c=pbuf->sbumpc();
    }
 
    string str="";
-   do
+   while((c!=' ')&&(c!='>')&&(c!='/')&&(0==isspace(c)))
    {
-     str+=tmp;
-     is>>tmp;
-     VFN_DEBUG_MESSAGE(str,1);
-      if(is.fail()) {cout<<"throw:"<<__FILE__<<":"<<__LINE__<<":"<<tag<<endl;throw ObjCrystException("XMLCrystTag::>>   failed input");}
-   } while ((tmp!=' ')&&(tmp!='>')&&(tmp!='/'));
+      if(c==EOF)
+      {
+         is.setstate(ios::eofbit|ios::failbit);
+         cout<<"throw:"<<__FILE__<<":"<<__LINE__<<":"<<tag<<endl;
+         throw ObjCrystException("XMLCrystTag::>>   failed input");
+      }
+      str+=(char)c;
+      c=pbuf->sbumpc();
+   }
    tag.mName=str;
+   VFN_DEBUG_MESSAGE(str,1);
 
    string str2;
    while(true)
    {
-      while(tmp==' ')is>>tmp;
-      if(tmp=='>')
+      while(0!=isspace(c)) c=pbuf->sbumpc();
+      if(c=='>') return is;
+      if(c=='/')
       {
-         is.setf(f);
-         return is;
-      }
-      if(tmp=='/')
-      {
-         is>>tmp;
-         //if(tmp!='>') ; :TODO:
+         pbuf->sbumpc();
+         //if(c!='>') ; :TODO:
          tag.mIsEmptyTag=true;
-         is.setf(f);
          return is;
       }
       str="";
-      do {str+=tmp;is>>tmp;VFN_DEBUG_MESSAGE(str,1)} while ((tmp!=' ')&&(tmp!='='));
-      while(tmp!='"')is>>tmp;
+      while((c!=EOF)&&(c!='=')&&(0==isspace(c))) {str+=(char)c;c=pbuf->sbumpc();}
+      while((c!='"')&&(c!=EOF)) c=pbuf->sbumpc();
       str2="";
-      is>>tmp;
-      if(tmp!='"') do {str2+=tmp;is>>tmp;VFN_DEBUG_MESSAGE(str2,1)} while (tmp!='"');
-      is>>tmp;
+      if(c!=EOF) c=pbuf->sbumpc();
+      while((c!='"')&&(c!=EOF)) {str2+=(char)c;c=pbuf->sbumpc();}
+      if(c==EOF)
+      {
+         is.setstate(ios::eofbit|ios::failbit);
+         cout<<"throw:"<<__FILE__<<":"<<__LINE__<<":"<<tag<<endl;
+         throw ObjCrystException("XMLCrystTag::>>   failed input");
+      }
+      VFN_DEBUG_MESSAGE(str<<"="<<str2,1)
+      c=pbuf->sbumpc();
 
       tag.AddAttribute(str,str2);
    }
-
-   is.setf(f);
    return is;
 }
 ////////////////////////////////////////////////////////////////////////
@@ -252,20 +263,12 @@ void RefinablePar::XMLInput(istream &is,const XMLCrystTag &tag)
       }
       if("Min"==tag.GetAttributeName(i))
       {
-         REAL f;
-         stringstream ss(tag.GetAttributeValue(i));
-         ss.imbue(std::locale::classic());
-         ss >>f;
-         this->SetHumanMin(f);
+         this->SetHumanMin(string2REALC(tag.GetAttributeValue(i)));
          continue;
       }
       if("Max"==tag.GetAttributeName(i))
       {
-         REAL f;
-         stringstream ss(tag.GetAttributeValue(i));
-         ss.imbue(std::locale::classic());
-         ss >>f;
-         this->SetHumanMax(f);
+         this->SetHumanMax(string2REALC(tag.GetAttributeValue(i)));
          continue;
       }
       if("Periodic"==tag.GetAttributeName(i))
@@ -40,11 +40,13 @@ namespace ObjCryst
 *
 * \param endchar: the character ending the input. On return, the stream will be placed
 * at this character (i.e. it will be the next to be read). Note that the input will
-* stop when encoutering a space character, even if the endchar has not been found.
+* stop when encoutering a whitespace character, even if the endchar has not been found.
+* The value is always read using '.' as decimal separator, whatever the locale,
+* and is converted with the full precision of REAL.
 * \return: the value - NaN will be returned as NaN, but probably only if the value
 * was written on the same platform
 */
-float InputFloat(istream &is, const char endchar=' ');
+REAL InputFloat(istream &is, const char endchar=' ');
 
 /// Test if the value is a NaN
 bool ISNAN_OR_INF(REAL r);
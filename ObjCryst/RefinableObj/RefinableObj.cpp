@@ -83,13 +83,11 @@ long NiftyStaticGlobalObjectsInitializer_RefinableObj::mCount=0;
 //
 //######################################################################
 
-unsigned long RefinableObjClock::msTick0=0;
-unsigned long RefinableObjClock::msTick1=0;
+unsigned long long RefinableObjClock::msTick=0;
 RefinableObjClock::RefinableObjClock()
 {
    //this->Click();
-   mTick0=0;
-   mTick1=0;
+   mTick=0;
 }
 RefinableObjClock::~RefinableObjClock()
 {
@@ -106,53 +104,53 @@ RefinableObjClock::~RefinableObjClock()
 
 bool RefinableObjClock::operator< (const RefinableObjClock &rhs)const
 {
-   if(mTick1<rhs.mTick1) return true;
-   if(mTick1==rhs.mTick1) {if(mTick0<rhs.mTick0) return true;}
-   return false;
+   return mTick<rhs.mTick;
 }
 bool RefinableObjClock::operator<=(const RefinableObjClock &rhs)const
 {
-   if(mTick1<rhs.mTick1) return true;
-   if(mTick1==rhs.mTick1) if(mTick0<=rhs.mTick0) return true;
-   return false;
+   return mTick<=rhs.mTick;
 }
 bool RefinableObjClock::operator> (const RefinableObjClock &rhs)const
 {
-   if(mTick1>rhs.mTick1) return true;
-   if(mTick1==rhs.mTick1) if(mTick0>rhs.mTick0) return true;
-   return false;
+   return mTick>rhs.mTick;
 }
 bool RefinableObjClock::operator>=(const RefinableObjClock &rhs)const
 {
-   if(mTick1>rhs.mTick1) return true;
-   if(mTick1==rhs.mTick1) if(mTick0>=rhs.mTick0) return true;
-   return false;
+   return mTick>=rhs.mTick;
 }
 void RefinableObjClock::Click()
 {
    //return;
-   if(++msTick0==0) ++msTick1;//Update ObjCryst++ static event counter
-   mTick0=msTick0;
-   mTick1=msTick1;
+   // The event counter is shared, e.g. by datasets computed concurrently in OptimizationObj:
+   // it is incremented atomically, without a lock. Each clock (and each parent clock) then
+   // stores the value it obtained.
+   unsigned long long tick;
+   #ifdef _OPENMP
+   #pragma omp atomic capture
+   #endif
+   tick=++msTick;
+   #ifdef _OPENMP
+   #pragma omp atomic write
+   #endif
+   mTick=tick;
    for(std::set<RefinableObjClock*>::iterator pos=mvParent.begin();
        pos!=mvParent.end();++pos) (*pos)->Click();
-   VFN_DEBUG_MESSAGE("RefinableObjClock::Click():"<<mTick1<<":"<<mTick0<<"(at "<<this<<")",0)
+   VFN_DEBUG_MESSAGE("RefinableObjClock::Click():"<<mTick<<"(at "<<this<<")",0)
    //this->Print();
 }
 void RefinableObjClock::Reset()
 {
-   mTick0=0;
-   mTick1=0;
+   mTick=0;
 }
 void RefinableObjClock::Print()const
 {
-   cout <<"Clock():"<<mTick1<<":"<<mTick0;
+   cout <<"Clock():"<<mTick;
    VFN_DEBUG_MESSAGE_SHORT(" (at "<<this<<")",4)
    cout <<endl;
 }
 void RefinableObjClock::PrintStatic()const
 {
-   cout <<"RefinableObj class Clock():"<<msTick1<<":"<<msTick0<<endl;
+   cout <<"RefinableObj class Clock():"<<msTick<<endl;
 }
 void RefinableObjClock::AddChild(const RefinableObjClock &clock)
 {mvChild.insert(&clock);clock.AddParent(*this);this->Click();}
@@ -181,8 +179,7 @@ void RefinableObjClock::RemoveParent(RefinableObjClock &clock)const
 
 void RefinableObjClock::operator=(const RefinableObjClock &rhs)
 {
-   mTick0=rhs.mTick0;
-   mTick1=rhs.mTick1;
+   mTick=rhs.mTick;
    for(std::set<RefinableObjClock*>::iterator pos=mvParent.begin();
        pos!=mvParent.end();++pos) if( (*this) > (**pos) ) **pos = *this;
 }
@@ -355,6 +352,11 @@ const REAL* RefinablePar::GetPointer()const
    return mpValue;
 }
 
+void RefinablePar::SetPointer(REAL *p)
+{
+   mpValue=p;
+}
+
 void RefinablePar::SetValue(const REAL value)
 {
    if(*mpValue == value) return;
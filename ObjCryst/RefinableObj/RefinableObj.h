@@ -170,8 +170,11 @@ class RefinableObjClock
       void operator=(const RefinableObjClock &rhs);
    private:
       bool HasParent(const RefinableObjClock &) const;
-      unsigned long mTick0, mTick1;
-      static unsigned long msTick0,msTick1;
+      /// Value of the event counter when this clock was last clicked
+      unsigned long long mTick;
+      /// Event counter, shared by all clocks. Clicks are lock-free (atomic increment),
+      /// but the clock tree (children and parents) must not be modified concurrently.
+      static unsigned long long msTick;
       /// List of 'child' clocks, which will click this clock whenever they are clicked.
       std::set<const RefinableObjClock*> mvChild;
       /// List of parent clocks, which will be clicked whenever this one is. This
@@ -321,6 +324,13 @@ class RefinablePar:public Restraint
          */
          const REAL* GetPointer()const;
 
+         /** Change the pointer to the refined value.
+         *
+         * This is only useful when the refined value has been moved in memory,
+         * e.g. when the array holding it has been re-allocated.
+         */
+         void SetPointer(REAL *p);
+
          /** of the parameter. Use the The Mutate() and MutateTo() function
          *  to change this value.
          */
@@ -127,6 +127,15 @@ SSE_FLAGS = -DHAVE_SSE_MATHFUN -DUSE_SSE2 -march=native
 endif
 endif
 
+#Using OpenMP (e.g. for multi-start Molecule conformation optimization)
+ifeq ($(openmp),1)
+OPENMP_FLAGS = -fopenmp
+OPENMP_LIB = -fopenmp
+else
+OPENMP_FLAGS :=
+OPENMP_LIB :=
+endif
+
 ifneq ($(shared-newmat),1)
 LDNEWMAT := $(DIR_STATIC_LIBS)/lib/libnewmat.a
 else
@@ -142,7 +151,7 @@ endif
 
 ifeq ($(shared_libcryst),1)
  CPPFLAGS = -O3 -w -fPIC -g -ffast-math -fstrict-aliasing -pipe -funroll-loops ${SSE_FLAGS}
- DEPENDFLAGS = ${SEARCHDIRS} ${GL_FLAGS} ${WXCRYSTFLAGS} ${FFTW_FLAGS} ${REAL_FLAG}
+ DEPENDFLAGS = ${SEARCHDIRS} ${GL_FLAGS} ${WXCRYSTFLAGS} ${FFTW_FLAGS} ${OPENMP_FLAGS} ${REAL_FLAG}
 else
  ifeq ($(debug),1)
  #Set DEBUG options
@@ -152,8 +161,8 @@ else
    else
       CPPFLAGS = -g -Wall -D__DEBUG__ ${SSE_FLAGS} ${COD_FLAGS}
    endif
-   DEPENDFLAGS = ${SEARCHDIRS} ${GL_FLAGS} ${WXCRYSTFLAGS} ${FFTW_FLAGS} ${REAL_FLAG}
-   LOADLIBES = -lm -lcryst -lCrystVector -lQuirks -lRefinableObj -lcctbx ${LDNEWMAT} ${PROFILELIB} ${GL_LIB} ${WX_LDFLAGS} ${FFTW_LIB}
+   DEPENDFLAGS = ${SEARCHDIRS} ${GL_FLAGS} ${WXCRYSTFLAGS} ${FFTW_FLAGS} ${OPENMP_FLAGS} ${REAL_FLAG}
+   LOADLIBES = -lm -lcryst -lCrystVector -lQuirks -lRefinableObj -lcctbx ${LDNEWMAT} ${PROFILELIB} ${GL_LIB} ${WX_LDFLAGS} ${FFTW_LIB} ${OPENMP_LIB} -lpthread
  else
    ifdef RPM_OPT_FLAGS
       # we are building a RPM !
@@ -162,8 +171,8 @@ else
       #default flags - use "sse=1" to enable SSE optimizations
       CPPFLAGS = -O3 -w -ffast-math -fstrict-aliasing -pipe -fomit-frame-pointer -funroll-loops -ftree-vectorize ${SSE_FLAGS} ${COD_FLAGS}
    endif
-   DEPENDFLAGS = ${SEARCHDIRS} ${GL_FLAGS} ${WXCRYSTFLAGS} ${FFTW_FLAGS} ${REAL_FLAG}
-   LOADLIBES = -lm -lcryst -lCrystVector -lQuirks -lRefinableObj -lcctbx ${LDNEWMAT} ${PROFILELIB} ${GL_LIB} ${WX_LDFLAGS} ${FFTW_LIB}
+   DEPENDFLAGS = ${SEARCHDIRS} ${GL_FLAGS} ${WXCRYSTFLAGS} ${FFTW_FLAGS} ${OPENMP_FLAGS} ${REAL_FLAG}
+   LOADLIBES = -lm -lcryst -lCrystVector -lQuirks -lRefinableObj -lcctbx ${LDNEWMAT} ${PROFILELIB} ${GL_LIB} ${WX_LDFLAGS} ${FFTW_LIB} ${OPENMP_LIB} -lpthread
  endif
 endif
 # Add to statically link: -nodefaultlibs -lgcc /usr/lib/libstdc++.a
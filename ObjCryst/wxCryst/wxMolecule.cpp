@@ -40,6 +40,25 @@
 
 namespace ObjCryst
 {
+/// Field for the ideal value, delta or sigma of a restraint (bond length, bond angle
+/// or dihedral angle), which are edited directly. The Molecule's restraint value clock
+/// is clicked after each change.
+class WXFieldRestraintPar:public WXFieldPar<REAL>
+{
+   public:
+      WXFieldRestraintPar(wxWindow *parent,const string& label, const int field_id,
+                          REAL *par,Molecule &mol):
+      WXFieldPar<REAL>(parent,label,field_id,par),mpMol(&mol){}
+   protected:
+      virtual void ReadNewValue()
+      {
+         WXFieldPar<REAL>::ReadNewValue();
+         mpMol->GetRestraintValueClock().Click();
+      }
+   private:
+      Molecule *mpMol;
+};
+
 
 //:TODO: Move this to wxCryst.h
 template<class T> T const* WXDialogChooseFromVector(const vector<T*> &reg,wxWindow*parent,
@@ -285,17 +304,17 @@ WXCrystObjBasic(parent),mpMolBond(obj),mpButtonFree(0)
    mList.Add(value);
 
    WXFieldPar<REAL> *length=
-      new WXFieldPar<REAL>(this,",Restraint=",-1,&(mpMolBond->Length0()));
+      new WXFieldRestraintPar(this,",Restraint=",-1,&(mpMolBond->Length0()),mpMolBond->GetMolecule());
    mpSizer->Add(length,0,wxALIGN_CENTER);
    mList.Add(length);
 
    WXFieldPar<REAL> *delta=
-      new WXFieldPar<REAL>(this,",delta=",-1,&(mpMolBond->LengthDelta()));
+      new WXFieldRestraintPar(this,",delta=",-1,&(mpMolBond->LengthDelta()),mpMolBond->GetMolecule());
    mpSizer->Add(delta,0,wxALIGN_CENTER);
    mList.Add(delta);
 
    WXFieldPar<REAL> *sigma=
-      new WXFieldPar<REAL>(this,",sigma=",-1,&(mpMolBond->LengthSigma()));
+      new WXFieldRestraintPar(this,",sigma=",-1,&(mpMolBond->LengthSigma()),mpMolBond->GetMolecule());
    mpSizer->Add(sigma,0,wxALIGN_CENTER);
    mList.Add(sigma);
 
@@ -416,19 +435,19 @@ WXCrystObjBasic(parent),mpMolBondAngle(obj)
    mList.Add(value);
 
    WXFieldPar<REAL> *angle=
-      new WXFieldPar<REAL>(this,",Restraint=",WXCRYST_ID(),&(mpMolBondAngle->Angle0()));
+      new WXFieldRestraintPar(this,",Restraint=",WXCRYST_ID(),&(mpMolBondAngle->Angle0()),mpMolBondAngle->GetMolecule());
    angle->SetHumanValueScale(RAD2DEG);
    mpSizer->Add(angle,0,wxALIGN_CENTER);
    mList.Add(angle);
 
    WXFieldPar<REAL> *delta=
-      new WXFieldPar<REAL>(this,",delta=",WXCRYST_ID(),&(mpMolBondAngle->AngleDelta()));
+      new WXFieldRestraintPar(this,",delta=",WXCRYST_ID(),&(mpMolBondAngle->AngleDelta()),mpMolBondAngle->GetMolecule());
    delta->SetHumanValueScale(RAD2DEG);
    mpSizer->Add(delta,0,wxALIGN_CENTER);
    mList.Add(delta);
 
    WXFieldPar<REAL> *sigma=
-      new WXFieldPar<REAL>(this,",sigma=",WXCRYST_ID(),&(mpMolBondAngle->AngleSigma()));
+      new WXFieldRestraintPar(this,",sigma=",WXCRYST_ID(),&(mpMolBondAngle->AngleSigma()),mpMolBondAngle->GetMolecule());
    sigma->SetHumanValueScale(RAD2DEG);
    mpSizer->Add(sigma,0,wxALIGN_CENTER);
    mList.Add(sigma);
@@ -562,19 +581,19 @@ WXCrystObjBasic(parent),mpMolDihedralAngle(obj)
    mList.Add(value);
 
    WXFieldPar<REAL> *angle=
-      new WXFieldPar<REAL>(this,"Restraint:",-1,&(mpMolDihedralAngle->Angle0()));
+      new WXFieldRestraintPar(this,"Restraint:",-1,&(mpMolDihedralAngle->Angle0()),mpMolDihedralAngle->GetMolecule());
    angle->SetHumanValueScale(RAD2DEG);
    mpSizer->Add(angle,0,wxALIGN_CENTER);
    mList.Add(angle);
 
    WXFieldPar<REAL> *delta=
-      new WXFieldPar<REAL>(this,",delta=",-1,&(mpMolDihedralAngle->AngleDelta()));
+      new WXFieldRestraintPar(this,",delta=",-1,&(mpMolDihedralAngle->AngleDelta()),mpMolDihedralAngle->GetMolecule());
    delta->SetHumanValueScale(RAD2DEG);
    mpSizer->Add(delta,0,wxALIGN_CENTER);
    mList.Add(delta);
 
    WXFieldPar<REAL> *sigma=
-      new WXFieldPar<REAL>(this,",sigma=",-1,&(mpMolDihedralAngle->AngleSigma()));
+      new WXFieldRestraintPar(this,",sigma=",-1,&(mpMolDihedralAngle->AngleSigma()),mpMolDihedralAngle->GetMolecule());
    sigma->SetHumanValueScale(RAD2DEG);
    mpSizer->Add(sigma,0,wxALIGN_CENTER);
    mList.Add(sigma);
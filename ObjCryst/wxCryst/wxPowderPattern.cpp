@@ -663,27 +663,7 @@ void WXPowderPattern::OnMenuAddCompBackgdBayesian(wxCommandEvent & WXUNUSED(even
    VFN_DEBUG_MESSAGE("WXPowderPattern::OnMenuAddCompBackgdBayesian()",6)
    mpPowderPattern->AddPowderPatternComponent(*pBckgd);
    VFN_DEBUG_MESSAGE("WXPowderPattern::OnMenuAddCompBackgdBayesian()",6)
-   {
-      CrystVector_REAL x(nbPointSpline),backgd(nbPointSpline);
-      const CrystVector_REAL *pObs=&(pBckgd->GetParentPowderPattern().GetPowderPatternObs());
-      const unsigned long nbPoint=pBckgd->GetParentPowderPattern().GetNbPoint();
-      const float xmin=pBckgd->GetParentPowderPattern().GetPowderPatternX()(0),
-                  xmax=pBckgd->GetParentPowderPattern().GetPowderPatternX()(nbPoint-1);
-      for(int i=0;i<nbPointSpline;i++)
-      {// xmax is not necessarily > xmin, but in the right order (TOF)
-         x(i)=xmin+(xmax-xmin)/(REAL)(nbPointSpline-1)*REAL(i);
-         REAL x1=xmin+(xmax-xmin)/(REAL)(nbPointSpline-1)*REAL(i-.2);
-         REAL x2=xmin+(xmax-xmin)/(REAL)(nbPointSpline-1)*REAL(i+.2);
-         long n1=(long)(pBckgd->GetParentPowderPattern().X2Pixel(x1));
-         long n2=(long)(pBckgd->GetParentPowderPattern().X2Pixel(x2));
-         if(n1<0) n1=0;
-         if(n2>(long)nbPoint)n2=nbPoint;
-         backgd(i)=(*pObs)(n1);
-         for(long j=n1;j<n2;j++)
-            if((*pObs)(j)<backgd(i))backgd(i)=(*pObs)(j);
-      }
-      pBckgd->SetInterpPoints(x,backgd);
-   }
+   pBckgd->InitInterpPointsFromObs(nbPointSpline);
    if(mpGraph!=0) mpPowderPattern->Prepare();//else this will be done when opening the graph
 
    pBckgd->UnFixAllPar();
@@ -2330,6 +2310,48 @@ WXCellExplorer::~WXCellExplorer()
    }
 }
 
+/// Report the progress of CellExplorer::DicVolAllSystems() in the indexing log and a progress dialog
+class WXDicVolMonitor:public DicVolMonitor
+{
+   public:
+      WXDicVolMonitor(wxTextCtrl *pLog,wxProgressDialog *pProgress):
+      mpLog(pLog),mpProgress(pProgress),mNbSpurious(0),mT0(0)
+      {}
+      virtual bool BeginSystem(const CellExplorer &cx,const CrystalSystem system,
+                               const CrystalCentering centering,const unsigned int nbSpurious,
+                               const float minv,const float maxv,const float lengthmax)
+      {
+         if(nbSpurious!=mNbSpurious)
+         {
+            mNbSpurious=nbSpurious;
+            mpLog->AppendText(wxString::Format(_T("\n Trying now with %2u spurious peaks\n"),nbSpurious));
+         }
+         const char *vsystem[7]={"TRICLINIC","MONOCLINIC","ORTHOROMBIC","HEXAGONAL","RHOMBOEDRAL","TETRAGONAL","CUBIC"};
+         const char vcent[6]={'P','I','A','B','C','F'};
+         wxString name=wxString::FromAscii(vsystem[system]);
+         if((system!=RHOMBOEDRAL)&&(system!=HEXAGONAL)) name+=wxString::Format(_T(" %c"),vcent[centering]);
+         mpLog->AppendText(wxString::Format(_T("%-13s: V= %6.0f -> %6.0f A^3, max length=%6.2fA"),
+                                            name.c_str(),minv,maxv,lengthmax));
+         mT0=mChrono.seconds();
+         // Progress from cubic (0) to monoclinic (5)
+         return mpProgress->Update(CUBIC-system,wxString::Format(_T("%s (%u spurious), V=%6.0f-%6.0f, l<%6.2fA\n")
+                                                                 _T("Best Score=%6.1f"),name.c_str(),
+                                                                 nbSpurious,minv,maxv,lengthmax,cx.GetBestScore()));
+      }
+      virtual void EndSystem(const CellExplorer &cx)
+      {
+         mpLog->AppendText(wxString::Format(_T(" -> %3u sols in %6.2fs, best score=%6.1f\n"),
+                           (unsigned int)(cx.GetSolutions().size()),mChrono.seconds()-mT0,cx.GetBestScore()));
+         mpLog->Update();
+      }
+   private:
+      wxTextCtrl *mpLog;
+      wxProgressDialog *mpProgress;
+      unsigned int mNbSpurious;
+      Chronometer mChrono;
+      float mT0;
+};
+
 void WXCellExplorer::OnIndex(wxCommandEvent &event)
 {
 
@@ -2358,187 +2380,14 @@ void WXCellExplorer::OnIndex(wxCommandEvent &event)
       mpCellExplorer->SetAngleMinMax(90*DEG2RAD,140*DEG2RAD);
       mpCellExplorer->SetD2Error(0);
 
-      float weak_f=1.0;
-      if(mpWeakDiffraction->GetValue()) weak_f=0.5;
-      const bool continueOnSolution=mpContinueOnSolution->GetValue();
-
-      const bool noCentered=!(mpTryCenteredLattice->GetValue());
-
-      const float        stopOnScore=50, reportOnScore=10;
-      const unsigned int stopOnDepth=6+int(continueOnSolution),   reportOnDepth=4;
-
-      unsigned int nbSpurious=0;
       wxProgressDialog dlgProgress(_T("Indexing..."),_T("Starting Indexing in Quick Mode"),
                                    7,this,wxPD_AUTO_HIDE|wxPD_ELAPSED_TIME|wxPD_CAN_ABORT|wxPD_APP_MODAL);
-
       unsigned int maxNbSpurious=0;
       if(mpTrySpurious->GetValue()) maxNbSpurious=2;
-      while(nbSpurious<=maxNbSpurious)
-      {
-         float t0,minv,maxv,lengthmax;
-         mpCellExplorer->SetNbSpurious(nbSpurious);
-         CrystalCentering cent;
-         char centc;
-         for(int lat=0;lat<=2;++lat)
-         {
-            switch(lat)
-            {//LATTICE_P,LATTICE_I,LATTICE_A,LATTICE_B,LATTICE_C,LATTICE_F
-               case 0:cent=LATTICE_P;centc='P';break;
-               case 1:cent=LATTICE_I;centc='I';break;
-               case 2:cent=LATTICE_F;centc='F';break;
-            }
-            minv=EstimateCellVolume(dmin,dmax,nb,CUBIC      ,cent,1.5);
-            maxv=EstimateCellVolume(dmin,dmax,nb,CUBIC      ,cent,0.4*weak_f);
-            mpCellExplorer->SetVolumeMinMax(minv,maxv);
-            lengthmax=pow(maxv,(float)(1/3.0))*3;
-            if(lengthmax<25)lengthmax=25;
-            mpCellExplorer->SetLengthMinMax(3,lengthmax);
-            mpCellExplorer->SetCrystalSystem(CUBIC);
-            mpCellExplorer->SetCrystalCentering(cent);
-            mpLog->AppendText(wxString::Format(_T("CUBIC %c      : V= %6.0f -> %6.0f A^3, max length=%6.2fA"),centc,minv,maxv,lengthmax));
-            t0=chrono.seconds();
-            if(dlgProgress.Update(0,wxString::Format(_T("CUBIC %c (%u spurious), V=%6.0f-%6.0f, l<%6.2fA\n")
-                                                   _T("Best Score=%6.1f"),centc,
-                                                   nbSpurious,minv,maxv,lengthmax,mpCellExplorer->GetBestScore()))==false) break;
-            mpCellExplorer->DicVol(reportOnScore,reportOnDepth,stopOnScore,stopOnDepth);
-            mpLog->AppendText(wxString::Format(_T(" -> %3u sols in %6.2fs, best score=%6.1f\n"),
-                     (unsigned int)(mpCellExplorer->GetSolutions().size()),chrono.seconds()-t0,mpCellExplorer->GetBestScore()));
-            mpLog->Update();
-            if(noCentered) break;
-         }
-         for(int lat=0;lat<=1;++lat)
-         if((mpCellExplorer->GetBestScore()<=stopOnScore)||continueOnSolution)
-         {
-            switch(lat)
-            {//LATTICE_P,LATTICE_I,LATTICE_A,LATTICE_B,LATTICE_C,LATTICE_F
-               case 0:cent=LATTICE_P;centc='P';break;
-               case 1:cent=LATTICE_I;centc='I';break;
-            }
-            minv=EstimateCellVolume(dmin,dmax,nb,TETRAGONAL,cent,1.5);
-            maxv=EstimateCellVolume(dmin,dmax,nb,TETRAGONAL,cent,0.4*weak_f);
-            mpCellExplorer->SetVolumeMinMax(minv,maxv);
-            float lengthmax=pow(maxv,(float)(1/3.0))*3;
-            if(lengthmax<25)lengthmax=25;
-            mpCellExplorer->SetLengthMinMax(3,lengthmax);
-            mpCellExplorer->SetCrystalSystem(TETRAGONAL);
-            mpCellExplorer->SetCrystalCentering(cent);
-            mpLog->AppendText(wxString::Format(_T("TETRAGONAL %c : V= %6.0f -> %6.0f A^3, max length=%6.2fA"),centc,minv,maxv,lengthmax));
-            t0=chrono.seconds();
-            if(dlgProgress.Update(1,wxString::Format(_T("TETRAGONAL %c (%u spurious), V=%6.0f-%6.0f, l<%6.2fA\n")
-                                                   _T("Best Score=%6.1f"),centc,
-                                                   nbSpurious,minv,maxv,lengthmax,mpCellExplorer->GetBestScore()))==false) break;
-            mpCellExplorer->DicVol(reportOnScore,reportOnDepth,stopOnScore,stopOnDepth);
-            mpLog->AppendText(wxString::Format(_T(" -> %3u sols in %6.2fs, best score=%6.1f\n"),
-                     (unsigned int)(mpCellExplorer->GetSolutions().size()),chrono.seconds()-t0,mpCellExplorer->GetBestScore()));
-            mpLog->Update();
-            if(noCentered) break;
-         }
-         if((mpCellExplorer->GetBestScore()<=stopOnScore)||continueOnSolution)
-         {
-            minv=EstimateCellVolume(dmin,dmax,nb,RHOMBOEDRAL,LATTICE_P,1.5);
-            maxv=EstimateCellVolume(dmin,dmax,nb,RHOMBOEDRAL,LATTICE_P,0.4*weak_f);
-            mpCellExplorer->SetVolumeMinMax(minv,maxv);
-            lengthmax=pow(maxv,(float)(1/3.0))*3;
-            if(lengthmax<25)lengthmax=25;
-            mpCellExplorer->SetLengthMinMax(3,lengthmax);
-            mpCellExplorer->SetCrystalSystem(RHOMBOEDRAL);
-            mpCellExplorer->SetCrystalCentering(LATTICE_P);
-            mpLog->AppendText(wxString::Format(_T("RHOMBOEDRAL  : V= %6.0f -> %6.0f A^3, max length=%6.2fA"),minv,maxv,lengthmax));
-            t0=chrono.seconds();
-            if(dlgProgress.Update(2,wxString::Format(_T("RHOMBOEDRAL (%u spurious), V=%6.0f-%6.0f, l<%6.2fA\n")
-                                                   _T("Best Score=%6.1f"),
-                                                   nbSpurious,minv,maxv,lengthmax,mpCellExplorer->GetBestScore()))==false) break;
-            mpCellExplorer->DicVol(reportOnScore,reportOnDepth,stopOnScore,stopOnDepth);
-            mpLog->AppendText(wxString::Format(_T(" -> %3u sols in %6.2fs, best score=%6.1f\n"),
-                     (unsigned int)(mpCellExplorer->GetSolutions().size()),chrono.seconds()-t0,mpCellExplorer->GetBestScore()));
-            mpLog->Update();
-         }
-         if((mpCellExplorer->GetBestScore()<=stopOnScore)||continueOnSolution)
-         {
-            minv=EstimateCellVolume(dmin,dmax,nb,HEXAGONAL,LATTICE_P,1.5);
-            maxv=EstimateCellVolume(dmin,dmax,nb,HEXAGONAL,LATTICE_P,0.4*weak_f);
-            mpCellExplorer->SetVolumeMinMax(minv,maxv);
-            lengthmax=pow(maxv,(float)(1/3.0))*3;
-            if(lengthmax<25)lengthmax=25;
-            mpCellExplorer->SetLengthMinMax(3,lengthmax);
-            mpCellExplorer->SetCrystalSystem(HEXAGONAL);
-            mpCellExplorer->SetCrystalCentering(LATTICE_P);
-            mpLog->AppendText(wxString::Format(_T("HEXAGONAL    : V= %6.0f -> %6.0f A^3, max length=%6.2fA"),minv,maxv,lengthmax));
-            t0=chrono.seconds();
-            if(dlgProgress.Update(3,wxString::Format(_T("HEXAGONAL (%u spurious), V=%6.0f-%6.0f, l<%6.2fA\n")
-                                                   _T("Best Score=%6.1f"),
-                                                   nbSpurious,minv,maxv,lengthmax,mpCellExplorer->GetBestScore()))==false) break;
-            mpCellExplorer->DicVol(reportOnScore,reportOnDepth,stopOnScore,stopOnDepth);
-            mpLog->AppendText(wxString::Format(_T(" -> %3u sols in %6.2fs, best score=%6.1f\n"),
-                     (unsigned int)(mpCellExplorer->GetSolutions().size()),chrono.seconds()-t0,mpCellExplorer->GetBestScore()));
-            mpLog->Update();
-         }
-         for(int lat=0;lat<=5;++lat)
-         if((mpCellExplorer->GetBestScore()<=stopOnScore)||continueOnSolution)
-         {
-            switch(lat)
-            {//LATTICE_P,LATTICE_I,LATTICE_A,LATTICE_B,LATTICE_C,LATTICE_F
-               case 0:cent=LATTICE_P;centc='P';break;
-               case 1:cent=LATTICE_I;centc='I';break;
-               case 2:cent=LATTICE_A;centc='A';break;
-               case 3:cent=LATTICE_B;centc='B';break;
-               case 4:cent=LATTICE_C;centc='C';break;
-               case 5:cent=LATTICE_F;centc='F';break;
-            }
-            minv=EstimateCellVolume(dmin,dmax,nb,ORTHOROMBIC,cent,1.5);
-            maxv=EstimateCellVolume(dmin,dmax,nb,ORTHOROMBIC,cent,0.4*weak_f);
-            mpCellExplorer->SetVolumeMinMax(minv,maxv);
-            lengthmax=pow(maxv,(float)(1/3.0))*3;
-            if(lengthmax<25)lengthmax=25;
-            mpCellExplorer->SetLengthMinMax(3,lengthmax);
-            mpCellExplorer->SetCrystalSystem(ORTHOROMBIC);
-            mpCellExplorer->SetCrystalCentering(cent);
-            mpLog->AppendText(wxString::Format(_T("ORTHOROMBIC %c: V= %6.0f -> %6.0f A^3, max length=%6.2fA"),centc,minv,maxv,lengthmax));
-            t0=chrono.seconds();
-            if(dlgProgress.Update(4,wxString::Format(_T("ORTHOROMBIC %c (%u spurious), V=%6.0f-%6.0f, l<%6.2fA\n")
-                                                   _T("Best Score=%6.1f"),centc,
-                                                   nbSpurious,minv,maxv,lengthmax,mpCellExplorer->GetBestScore()))==false) break;
-            mpCellExplorer->DicVol(reportOnScore,reportOnDepth,stopOnScore,stopOnDepth);
-            mpLog->AppendText(wxString::Format(_T(" -> %3u sols in %6.2fs, best score=%6.1f\n"),
-                     (unsigned int)(mpCellExplorer->GetSolutions().size()),chrono.seconds()-t0,mpCellExplorer->GetBestScore()));
-            mpLog->Update();
-            if(noCentered) break;
-         }
-         for(int lat=0;lat<=3;++lat)
-         if((mpCellExplorer->GetBestScore()<=stopOnScore)||continueOnSolution)
-         {
-            switch(lat)
-            {//LATTICE_P,LATTICE_I,LATTICE_A,LATTICE_B,LATTICE_C,LATTICE_F
-               case 0:cent=LATTICE_P;centc='P';break;
-               case 1:cent=LATTICE_C;centc='C';break;
-               case 2:cent=LATTICE_I;centc='I';break;
-               case 3:cent=LATTICE_A;centc='A';break;
-            }
-            minv=EstimateCellVolume(dmin,dmax,nb,MONOCLINIC,cent,1.5);
-            maxv=EstimateCellVolume(dmin,dmax,nb,MONOCLINIC,cent,0.4*weak_f);
-            mpCellExplorer->SetVolumeMinMax(minv,maxv);
-            lengthmax=pow(maxv,(float)(1/3.0))*3;
-            if(lengthmax<25)lengthmax=25;
-            mpCellExplorer->SetLengthMinMax(3,lengthmax);
-            mpCellExplorer->SetCrystalSystem(MONOCLINIC);
-            mpCellExplorer->SetCrystalCentering(cent);
-            mpLog->AppendText(wxString::Format(_T("MONOCLINIC %c : V= %6.0f -> %6.0f A^3, max length=%6.2fA"),centc,minv,maxv,lengthmax));
-            t0=chrono.seconds();
-            if(dlgProgress.Update(5,wxString::Format(_T("MONOCLINIC %c (%u spurious), V=%6.0f-%6.0f, l<%6.2fA\n")
-                                                   _T("Best Score=%6.1f"),centc,
-                                                   nbSpurious,minv,maxv,lengthmax,mpCellExplorer->GetBestScore()))==false) break;
-            mpCellExplorer->DicVol(reportOnScore,reportOnDepth,stopOnScore,stopOnDepth);
-            mpLog->AppendText(wxString::Format(_T(" -> %3u sols in %6.2fs, best score=%6.1f\n"),
-                  (unsigned int)(mpCellExplorer->GetSolutions().size()),chrono.seconds()-t0,mpCellExplorer->GetBestScore()));
-            mpLog->Update();
-            if(noCentered) break;
-         }
-
-         nbSpurious+=1;
-         if((mpCellExplorer->GetBestScore()>=stopOnScore)||(nbSpurious>3)) break;
-         mpLog->AppendText(wxString::Format(_T("\n Trying now with %2u spurious peaks\n"),nbSpurious));
-         mpLog->Update();
-      }
+      WXDicVolMonitor monitor(mpLog,&dlgProgress);
+      mpCellExplorer->DicVolAllSystems(maxNbSpurious,mpTryCenteredLattice->GetValue(),
+                                       mpWeakDiffraction->GetValue(),mpContinueOnSolution->GetValue(),
+                                       &monitor);
    }
    else
    {
@@ -2600,7 +2449,7 @@ void WXCellExplorer::OnIndex(wxCommandEvent &event)
       char buf[200];
       wxArrayString sols;
       float bestvol=0;
-      for(list<pair<RecUnitCell,float> >::const_iterator pos=mpCellExplorer->GetSolutions().begin();
+      for(vector<pair<RecUnitCell,float> >::const_iterator pos=mpCellExplorer->GetSolutions().begin();
          pos!=mpCellExplorer->GetSolutions().end();++pos)
       {
          vector<float> uc=pos->first.DirectUnitCell();
@@ -2651,15 +2500,13 @@ void WXCellExplorer::OnSelectCell(wxCommandEvent &event)
       long nbspurious;
       s=mpNbSpurious->GetValue();s.ToLong(&nbspurious);
 
-      list<pair<RecUnitCell,float> >::const_iterator pos=mpCellExplorer->GetSolutions().begin();
-      for(int i=0;i<choice;++i)++pos;// We need a random access ?
+      vector<pair<RecUnitCell,float> >::const_iterator pos=mpCellExplorer->GetSolutions().begin()+choice;
       // This will update the hkl in the list and therefore on the graph
       Score(*mpPeakList,pos->first,nbspurious,true,true,true);
       if(mpCrystal!=NULL)
       {
          // Apply crystal structure
-         list<pair<RecUnitCell,float> >::const_iterator pos=mpCellExplorer->GetSolutions().begin();
-         for(int i=0;i<choice;++i)++pos;// We need a random access ?
+         vector<pair<RecUnitCell,float> >::const_iterator pos=mpCellExplorer->GetSolutions().begin()+choice;
          vector<float> uc=pos->first.DirectUnitCell();
          mpCrystal->GetPar("a").SetValue(uc[0]);
          mpCrystal->GetPar("b").SetValue(uc[1]);
@@ -2668,62 +2515,8 @@ void WXCellExplorer::OnSelectCell(wxCommandEvent &event)
          mpCrystal->GetPar("beta").SetValue(uc[4]);
          mpCrystal->GetPar("gamma").SetValue(uc[5]);
          // Choose the spcegroup with the highest possible symmetry given the centering used.
-         // We only try P, I, F, but also handle others, just in case
-         switch(pos->first.mCentering)
-         {
-            case LATTICE_P:
-            {
-               switch(pos->first.mlattice)
-               {
-                  case TRICLINIC:mpCrystal->ChangeSpaceGroup("P-1");break;
-                  case MONOCLINIC:mpCrystal->ChangeSpaceGroup("P2/m");break;
-                  case ORTHOROMBIC:mpCrystal->ChangeSpaceGroup("Pmmm");break;
-                  case HEXAGONAL:mpCrystal->ChangeSpaceGroup("P6/mmm");break;
-                  case RHOMBOEDRAL:mpCrystal->ChangeSpaceGroup("R-3m");break;
-                  case TETRAGONAL:mpCrystal->ChangeSpaceGroup("P4/mmm");break;
-                  case CUBIC:mpCrystal->ChangeSpaceGroup("Pm-3m");break;
-               }
-               break;
-            }
-            case LATTICE_I:
-            {
-               switch(pos->first.mlattice)
-               {
-                  case MONOCLINIC:mpCrystal->ChangeSpaceGroup("I2/m");break;
-                  case ORTHOROMBIC:mpCrystal->ChangeSpaceGroup("I222");break;
-                  case TETRAGONAL:mpCrystal->ChangeSpaceGroup("I4/mmm");break;
-                  case CUBIC:mpCrystal->ChangeSpaceGroup("Im-3m");break;
-               }
-               break;
-            }
-            case LATTICE_A:
-            {
-               switch(pos->first.mlattice)
-               {
-                  case MONOCLINIC:mpCrystal->ChangeSpaceGroup("A2/m");break;
-                  case ORTHOROMBIC:mpCrystal->ChangeSpaceGroup("Amm2");break;
-               }
-               break;
-            }
-            case LATTICE_C:
-            {
-               switch(pos->first.mlattice)
-               {
-                  case MONOCLINIC:mpCrystal->ChangeSpaceGroup("C2/m");break;
-                  case ORTHOROMBIC:mpCrystal->ChangeSpaceGroup("Cmmm");break;
-               }
-               break;
-            }
-            case LATTICE_F://,LATTICE_A,LATTICE_B,LATTICE_C};
-            {
-               switch(pos->first.mlattice)
-               {
-                  case ORTHOROMBIC:mpCrystal->ChangeSpaceGroup("Fmmm");break;
-                  case CUBIC:mpCrystal->ChangeSpaceGroup("Fm-3m");break;
-               }
-               break;
-            }
-         }
+         const string spg=GetHighestSymmetrySpaceGroup(pos->first.mlattice,pos->first.mCentering);
+         if(spg!="") mpCrystal->ChangeSpaceGroup(spg);
          mpCrystal->UpdateDisplay();
       }
       try{
@@ -2995,8 +2788,7 @@ void WXCellExplorer::OnApplyCell(wxCommandEvent &event)
    const int choice=mpCell->GetSelection();
    if((mpCrystal!=0)&&(choice!=wxNOT_FOUND))
    {
-      list<pair<RecUnitCell,float> >::const_iterator pos=mpCellExplorer->GetSolutions().begin();
-      for(int i=0;i<choice;++i)++pos;// We need a random access ?
+      vector<pair<RecUnitCell,float> >::const_iterator pos=mpCellExplorer->GetSolutions().begin()+choice;
       vector<float> uc=pos->first.DirectUnitCell();
       mpCrystal->GetPar("a").SetValue(uc[0]);
       mpCrystal->GetPar("b").SetValue(uc[1]);
@@ -3197,7 +2989,7 @@ void WXCellExplorer::OnExportIndexingResults(wxCommandEvent &event)
    wxArrayString sols;
    float bestvol=0;
    out <<"Score, Volume, Volume/V_best, a, b, c, alpha, beta, gamma, Lattice, Centering, NbSpurious"<<endl;
-   for(list<pair<RecUnitCell,float> >::const_iterator pos=mpCellExplorer->GetSolutions().begin();
+   for(vector<pair<RecUnitCell,float> >::const_iterator pos=mpCellExplorer->GetSolutions().begin();
        pos!=mpCellExplorer->GetSolutions().end();++pos)
    {
       vector<float> uc=pos->first.DirectUnitCell();
@@ -3678,29 +3470,7 @@ void WXPowderPatternBackground::OnMenuAutomaticBayesianBackground(wxCommandEvent
    wxProgressDialog dlgProgress(_T("Automatic Bayesian Background"),_T("Automatic Background, Initializing..."),
                                       4,this,wxPD_AUTO_HIDE|wxPD_ELAPSED_TIME|wxPD_CAN_ABORT|wxPD_APP_MODAL);
    if(nbPointSpline<2) nbPointSpline=2;
-   {
-      CrystVector_REAL x(nbPointSpline),backgd(nbPointSpline);
-      const CrystVector_REAL *pObs=&(mpPowderPatternBackground->GetParentPowderPattern().GetPowderPatternObs());
-      const unsigned long nbPoint=mpPowderPatternBackground->GetParentPowderPattern().GetNbPoint();
-      const float xmin=mpPowderPatternBackground->GetParentPowderPattern()
-                       .GetPowderPatternX()(0),
-                  xmax=mpPowderPatternBackground->GetParentPowderPattern()
-                       .GetPowderPatternX()(nbPoint-1);
-      for(int i=0;i<nbPointSpline;i++)
-      {// xmax is not necessarily > xmin, but in the right order (TOF)
-         x(i)=xmin+(xmax-xmin)/(REAL)(nbPointSpline-1)*REAL(i);
-         REAL x1=xmin+(xmax-xmin)/(REAL)(nbPointSpline-1)*REAL(i-.2);
-         REAL x2=xmin+(xmax-xmin)/(REAL)(nbPointSpline-1)*REAL(i+.2);
-         long n1=(long)(mpPowderPatternBackground->GetParentPowderPattern().X2Pixel(x1));
-         long n2=(long)(mpPowderPatternBackground->GetParentPowderPattern().X2Pixel(x2));
-         if(n1<0) n1=0;
-         if(n2>(long)nbPoint)n2=nbPoint;
-         backgd(i)=(*pObs)(n1);
-         for(long j=n1;j<n2;j++)
-            if((*pObs)(j)<backgd(i))backgd(i)=(*pObs)(j);
-      }
-      mpPowderPatternBackground->SetInterpPoints(x,backgd);
-   }
+   mpPowderPatternBackground->InitInterpPointsFromObs(nbPointSpline);
    //mpPowderPatternBackground->GetParentPowderPattern().Prepare();
    mpPowderPatternBackground->UnFixAllPar();
    mpPowderPatternBackground->GetOption(0).SetChoice(0);//linear